@@ -0,0 +1,348 @@
+/* lz4bench.c */
+
+#include "lz4block.h"
+#include <stdio.h>      // For printf, fprintf, fopen, fread
+#include <stdlib.h>     // For malloc, realloc, free, exit
+#include <string.h>     // For memcpy, memcmp, memset
+#include <time.h>       // For clock_gettime
+
+/*
+ * CPU/bandwidth trade-off of the chat LZ4 compression, measured the way the server uses it:
+ *
+ *   source  The files named on the command line (`make bench` passes the tree's own C sources),
+ *           cut into independent 64 KiB file pieces like filecache_zpieces: pieces whose sampled
+ *           entropy is too high, or that would save less than 1/8, are sent raw.
+ *   chat    Synthetic chat lines (fixed seed) compressed as one stream of "[ZTEXT <raw> <zlen>]"
+ *           frames like ztext_build_locked, twice: one line per frame (an idle connection, where
+ *           each line goes out as soon as it is queued) and frames of up to LZ4_BLOCK_MAX bytes
+ *           (a connection whose socket is backed up). A frame that would not be smaller goes out
+ *           raw.
+ *   random  Incompressible bytes: what the entropy check costs to decide to send them raw.
+ *
+ * For each it prints the wire ratio (frames included), compression and decompression
+ * throughput on one core, and the link speed below which compressing is a net win: sending n
+ * bytes compressed takes n / compress + n * ratio / link, against n / link raw, so compression
+ * pays on links slower than compress * (1 - ratio).
+ */
+
+// Size of a file piece (OUTBOX_SLICE_SIZE on the server)
+#define PIECE_SIZE      (64 * 1024)
+
+// Lines in each chat corpus
+#define CHAT_LINES      50000
+
+// Size of the random corpus
+#define RANDOM_SIZE     (4 * 1024 * 1024)
+
+// Each measurement repeats until it has run this long, in seconds
+#define MIN_SECONDS     0.3
+
+/**
+ * corpus_t
+ *   Bytes to compress, and for the chat corpus the offsets where its frames end.
+ */
+typedef struct {
+    const char *name;
+    char       *data;
+    size_t      len;
+    size_t     *ends;
+    size_t      nends;
+} corpus_t;
+
+/**
+ * result_t
+ *   One measurement: wire bytes and seconds per pass.
+ */
+typedef struct {
+    size_t wire;
+    double compress_s;
+    double decompress_s;
+} result_t;
+
+/* ----------------------------------------------------------------------------
+ * Internal helpers
+ * ----------------------------------------------------------------------------
+ */
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// xorshift64: fixed seed, so every run measures the same corpora
+#define RNG_SEED 0x9e3779b97f4a7c15ull
+static uint64_t rng_state = RNG_SEED;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/**
+ * append
+ *   Add 'n' bytes to the corpus, growing it as needed. Exits if memory runs out.
+ */
+static void append(corpus_t *c, const char *data, size_t n) {
+    char *grown = realloc(c->data, c->len + n);
+    if (!grown) {
+        perror("realloc");
+        exit(1);
+    }
+    c->data = grown;
+    memcpy(c->data + c->len, data, n);
+    c->len += n;
+}
+
+/**
+ * load_files
+ *   The source corpus: the concatenated contents of 'paths'.
+ */
+static corpus_t load_files(char **paths, int count) {
+    corpus_t c = { .name = "source" };
+    char buf[PIECE_SIZE];
+    for (int i = 0; i < count; ++i) {
+        FILE *fp = fopen(paths[i], "rb");
+        if (!fp) {
+            perror(paths[i]);
+            exit(1);
+        }
+        size_t n;
+        while ((n = fread(buf, 1, sizeof buf, fp)) > 0) {
+            append(&c, buf, n);
+        }
+        fclose(fp);
+    }
+    return c;
+}
+
+/**
+ * make_chat
+ *   A chat corpus: "[user] words...\n" lines from a small vocabulary, like relayed room
+ *   messages, cut into frames of whole lines of at most 'frame_max' bytes (each line its own
+ *   frame when a second one does not fit).
+ */
+static corpus_t make_chat(const char *name, size_t frame_max) {
+    static const char *users[] = { "alice", "bob", "carol", "dave", "erin", "frank", "grace",
+                                   "heidi" };
+    static const char *words[] = {
+        "the", "a", "is", "to", "and", "of", "in", "that", "it", "for", "on", "with", "you",
+        "we", "this", "file", "room", "server", "client", "build", "test", "deploy", "merge",
+        "review", "please", "thanks", "ok", "lol", "meeting", "tomorrow", "today", "branch",
+        "fixed", "broken", "works", "again", "later", "sure", "done", "check"
+    };
+    corpus_t c = { .name = name };
+    rng_state = RNG_SEED;   // Same lines for every framing
+    c.ends = malloc(CHAT_LINES * sizeof(*c.ends));
+    if (!c.ends) {
+        perror("malloc");
+        exit(1);
+    }
+
+    char line[256];
+    for (int i = 0; i < CHAT_LINES; ++i) {
+        int n = snprintf(line, sizeof line, "[%s]", users[rng_next() % 8]);
+        int nwords = 3 + (int)(rng_next() % 10);
+        for (int w = 0; w < nwords; ++w) {
+            n += snprintf(line + n, sizeof line - (size_t)n, " %s", words[rng_next() % 40]);
+        }
+        line[n++] = '\n';
+        size_t start = c.nends ? c.ends[c.nends - 1] : 0;
+        if (c.len > start && c.len - start + (size_t)n > frame_max) {
+            c.ends[c.nends++] = c.len;
+        }
+        append(&c, line, (size_t)n);
+    }
+    c.ends[c.nends++] = c.len;
+    return c;
+}
+
+/**
+ * make_random
+ *   The random corpus.
+ */
+static corpus_t make_random(void) {
+    corpus_t c = { .name = "random", .len = RANDOM_SIZE };
+    c.data = malloc(RANDOM_SIZE);
+    if (!c.data) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < RANDOM_SIZE; i += 8) {
+        uint64_t v = rng_next();
+        memcpy(c.data + i, &v, 8);
+    }
+    return c;
+}
+
+/**
+ * run_pieces
+ *   One pass over a corpus as file pieces (see filecache_zpieces): compress every piece that
+ *   passes the entropy check and saves at least 1/8, then decode them all again and compare.
+ */
+static result_t run_pieces(const corpus_t *c, char *zbuf, size_t *zlens, char *out) {
+    result_t r = { 0 };
+    uint32_t table[LZ4_TABLE_SIZE];
+    size_t pieces = (c->len + PIECE_SIZE - 1) / PIECE_SIZE;
+
+    double t0 = now_s();
+    for (size_t k = 0; k < pieces; ++k) {
+        const char *piece = c->data + k * PIECE_SIZE;
+        size_t n = c->len - k * PIECE_SIZE < PIECE_SIZE ? c->len - k * PIECE_SIZE : PIECE_SIZE;
+        zlens[k] = 0;
+        if (lz4_entropy_q8(piece, n) >= LZ4_INCOMPRESSIBLE_Q8) {
+            continue;
+        }
+        memset(table, 0, sizeof table);
+        zlens[k] = lz4_compress(piece, 0, n, zbuf + k * LZ4_BOUND(PIECE_SIZE), n - n / 8, table);
+    }
+    double t1 = now_s();
+    for (size_t k = 0; k < pieces; ++k) {
+        size_t n = c->len - k * PIECE_SIZE < PIECE_SIZE ? c->len - k * PIECE_SIZE : PIECE_SIZE;
+        if (zlens[k] == 0) {
+            memcpy(out + k * PIECE_SIZE, c->data + k * PIECE_SIZE, n);
+            r.wire += n;
+        } else {
+            lz4_decompress(zbuf + k * LZ4_BOUND(PIECE_SIZE), zlens[k], out, k * PIECE_SIZE, n);
+            r.wire += zlens[k];
+        }
+    }
+    double t2 = now_s();
+
+    r.compress_s   = t1 - t0;
+    r.decompress_s = t2 - t1;
+    return r;
+}
+
+/**
+ * run_stream
+ *   One pass over the chat corpus as "[ZTEXT]" frames of one LZ4 stream (see
+ *   ztext_build_locked), then through a decoding stream like the client's, comparing as it goes.
+ */
+static result_t run_stream(const corpus_t *c, char *zbuf, size_t *zlens, char *out) {
+    result_t r = { 0 };
+    lz4_stream_t enc, dec;
+    if (lz4_stream_init(&enc, 1) < 0 || lz4_stream_init(&dec, 0) < 0) {
+        perror("lz4_stream_init");
+        exit(1);
+    }
+
+    double t0 = now_s();
+    size_t at = 0, zat = 0;
+    for (size_t f = 0; f < c->nends; ++f) {
+        size_t raw = c->ends[f] - at;
+        char hdr[48];
+        size_t hmax = (size_t)snprintf(hdr, sizeof hdr, "[ZTEXT %zu %zu]\n", raw, raw);
+        zlens[f] = 0;
+        if (raw > hmax + 1) {
+            memcpy(lz4_stream_reserve(&enc, raw), c->data + at, raw);
+            zlens[f] = lz4_stream_compress(&enc, raw, zbuf + zat, raw - hmax - 1);
+        }
+        if (zlens[f]) {
+            size_t hlen = (size_t)snprintf(hdr, sizeof hdr, "[ZTEXT %zu %zu]\n", raw, zlens[f]);
+            r.wire += hlen + zlens[f];
+            zat    += zlens[f];
+        } else {
+            r.wire += raw;
+        }
+        at = c->ends[f];
+    }
+    double t1 = now_s();
+    at = zat = 0;
+    for (size_t f = 0; f < c->nends; ++f) {
+        size_t raw = c->ends[f] - at;
+        if (zlens[f]) {
+            const char *text = lz4_stream_decompress(&dec, zbuf + zat, zlens[f], raw);
+            if (text) {
+                memcpy(out + at, text, raw);
+            }
+            zat += zlens[f];
+        } else {
+            memcpy(out + at, c->data + at, raw);
+        }
+        at = c->ends[f];
+    }
+    double t2 = now_s();
+
+    lz4_stream_free(&enc);
+    lz4_stream_free(&dec);
+    r.compress_s   = t1 - t0;
+    r.decompress_s = t2 - t1;
+    return r;
+}
+
+/**
+ * measure
+ *   Run a corpus until MIN_SECONDS have passed, check that it round-trips, and print one line.
+ */
+static void measure(const corpus_t *c) {
+    size_t slots = c->ends ? c->nends : (c->len + PIECE_SIZE - 1) / PIECE_SIZE;
+    char   *zbuf  = malloc(c->ends ? LZ4_BOUND(c->len) + slots * 16 : slots * LZ4_BOUND(PIECE_SIZE));
+    size_t *zlens = malloc(slots * sizeof(*zlens));
+    char   *out   = malloc(c->len);
+    if (!zbuf || !zlens || !out) {
+        perror("malloc");
+        exit(1);
+    }
+
+    result_t best = { 0 };
+    int passes = 0;
+    double total = 0;
+    while (total < MIN_SECONDS || passes < 3) {
+        result_t r = c->ends ? run_stream(c, zbuf, zlens, out) : run_pieces(c, zbuf, zlens, out);
+        if (passes == 0 || r.compress_s < best.compress_s) {
+            best.compress_s = r.compress_s;
+        }
+        if (passes == 0 || r.decompress_s < best.decompress_s) {
+            best.decompress_s = r.decompress_s;
+        }
+        best.wire = r.wire;
+        total += r.compress_s + r.decompress_s;
+        passes++;
+    }
+    int ok = memcmp(out, c->data, c->len) == 0;
+
+    double mb      = (double)c->len / 1e6;
+    double ratio   = (double)best.wire / (double)c->len;
+    double comp    = mb / best.compress_s;
+    double decomp  = mb / best.decompress_s;
+    double breakeven = ratio < 1 ? comp * (1 - ratio) * 8 : 0;
+    printf("%-8s %10zu %10zu %7.3f %10.0f %10.0f %14.0f  %s\n", c->name, c->len, best.wire,
+           ratio, comp, decomp, breakeven, ok ? "ok" : "MISMATCH");
+
+    free(zbuf);
+    free(zlens);
+    free(out);
+}
+
+/* ----------------------------------------------------------------------------
+ * Main
+ * ----------------------------------------------------------------------------
+ */
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file>...   (source corpus; see `make bench`)\n", argv[0]);
+        return 1;
+    }
+
+    corpus_t corpora[] = {
+        load_files(argv + 1, argc - 1),
+        make_chat("chat-1", 1),
+        make_chat("chat-64K", LZ4_BLOCK_MAX),
+        make_random(),
+    };
+
+    printf("%-8s %10s %10s %7s %10s %10s %14s\n", "corpus", "raw B", "wire B", "ratio",
+           "comp MB/s", "dec MB/s", "pays below Mb/s");
+    for (size_t i = 0; i < sizeof corpora / sizeof *corpora; ++i) {
+        if (corpora[i].len > 0) {
+            measure(&corpora[i]);
+        }
+        free(corpora[i].data);
+        free(corpora[i].ends);
+    }
+    return 0;
+}
@@ -10,11 +10,26 @@ extern const char *USAGE_TEXT;  // Declaration of the usage/help text shown to t
 extern int sockfd;              // Socket file descriptor for the TCP connection to the server
 
 /**
- * Thread function that continuously receives data from the server.
- * - If a file transfer is in progress, it writes incoming bytes to a local file.
- * - Otherwise, it treats incoming bytes as text messages and displays them.
+ * Handles what has arrived from the server (called by the event loop when the socket is
+ * readable). Returns -1 once the server has closed the connection.
+ * - "[FILE ...]" headers open a local partial file (or reopen it at the resume offset), up
+ *   to four at a time; the raw bytes after each "[FILE-DATA ...]" line (or the LZ4 block
+ *   after a "[FILE-ZDATA ...]" line, decoded) go to the file with that transfer id, and a
+ *   complete file is moved to a free name and confirmed with /fileack.
+ * - "[ZTEXT ...]" blocks (with compression negotiated) are decoded and their lines handled
+ *   like any others.
+ * - "[FILE-RESUME ...]" offers are answered with /fileack and the size of the partial file.
+ * - "[XFER ...]" answers start the upload of the file /sendfile announced.
+ * - Every other line is a text message; the lines of one read are displayed together.
  */
-void *recv_thread(void *arg);
+static int server_read(void);
+
+/**
+ * The client's single-threaded loop: poll()s the keyboard and the (non-blocking) socket, reads
+ * keystrokes in bulk, handles server data as it arrives and sends queued output, upload chunks
+ * included, as fast as the socket takes it. Returns when standard input ends.
+ */
+static void event_loop(void);
 
 /**
  * Signal handler that is invoked when an exit-related signal (SIGINT, SIGTERM)
@@ -34,7 +49,8 @@ static void on_exit_signal(int signo);
  *   - /leave: leave the current room
  *   - /broadcast <message>: send a message to everyone in the room
  *   - /whisper <user> <msg>: send a private message to a specific user
- *   - /sendfile <file> <user>: send a file to a specific user
+ *   - /sendfile <to> <file>: send a file to a user, users (a,b) or a #room, uploaded in /chunk
+ *     commands while the user keeps chatting
  *   - /exit: disconnect cleanly from the server
  *   - otherwise: print a warning about invalid command
  */
@@ -13,6 +13,11 @@
 // Maximum length of the input buffer (including terminating '\0')
 #define TI_MAXLINE 1024
 
+// Output is collected into frames of up to TI_FRAME_SIZE bytes, written at most once per
+// TI_REFRESH_MS milliseconds (see ti_refresh)
+#define TI_FRAME_SIZE  (64 * 1024)
+#define TI_REFRESH_MS  16
+
 // Message types used when drawing messages from server or input
 #define SERVER_MESSAGE 0
 #define INPUT_MESSAGE  1
@@ -129,6 +134,29 @@ void ti_draw_buffer(const TI_InputHandler *ih);
  */
 void ti_draw_newline(void);
 
+/* --- Frames --- */
+
+/*
+ * The drawing functions do not write to the terminal themselves: their output is collected
+ * into a frame, and a message leaves the redraw of the prompt and the user's line to whatever
+ * is drawn next, so consecutive messages redraw it only once. The caller writes the frame with
+ * ti_flush, or lets ti_refresh pace the writes.
+ */
+
+/**
+ * ti_flush
+ *   Write the frame to STDOUT now (one write()). Async-signal-safe.
+ */
+void ti_flush(void);
+
+/**
+ * ti_refresh
+ *   Write the frame if there is one and the last frame was written at least TI_REFRESH_MS ago.
+ *   Returns the milliseconds after which to call again (a frame is waiting), or -1 (nothing
+ *   to write).
+ */
+int ti_refresh(void);
+
 /* --- Character processing --- */
 
 /**
@@ -159,6 +187,8 @@ void ti_process_backspace(TI_InputHandler *ih);
  *   - Writes the color code, then the message string (`msg`), then resets color.
  *   - If messageType != EXIT_MESSAGE, redraws the prompt.
  *   - If messageType == SERVER_MESSAGE, also redraws whatever is in the input buffer so the user sees what they had typed.
+ *   The redraw waits until something else is drawn or the frame is written: a burst of messages
+ *   redraws the line once.
  *
  *   @param ih            Pointer to TI_InputHandler for prompt + buffer data.
  *   @param msg           Null-terminated string to display as a message.
@@ -1,13 +1,24 @@
+#define _GNU_SOURCE                  // For fallocate() and FALLOC_FL_KEEP_SIZE
 #include "chatclient.h"
+#include "command.h"         // Command table shared with the server
+#include "textscan.h"        // For ts_find_newline
+#include "filehash.h"        // For the digest offered with /sendfile
+#include "crc32c.h"          // For the checksums of uploaded and received file pieces
+#include "lz4block.h"        // For compressed chunks, pieces and text
 #include <stdio.h>
+#include <stdint.h>        // For uint32_t
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>     // For sockaddr_in, inet_pton, htons
-#include <pthread.h>       // For pthread_create, pthread_t
-#include <fcntl.h>         // For open() when sending files
+#include <poll.h>          // For poll() in the event loop
+#include <fcntl.h>         // For open() and fallocate() when sending and receiving files
+#include <errno.h>         // For EAGAIN, EEXIST
+#include <time.h>          // For clock_gettime when waiting for [XFER] and showing progress
 #include <sys/stat.h>      // For stat() to determine file size and existence
+#include <sys/mman.h>      // For mmap() when hashing and checksumming a file being sent
+#include <sys/sendfile.h>  // For sendfile() when uploading file chunks
 #include <libgen.h>        // For basename() to extract filename from path
 #include <sys/ioctl.h>
 #include <fcntl.h>
@@ -27,208 +38,813 @@ const char *USAGE_TEXT =
   "  /leave                   Leave the current room\n"
   "  /broadcast <message>     Send message to everyone in the room\n"
   "  /whisper <user> <msg>    Send private message\n"
-  "  /sendfile <file> <user>  Send file to user\n"
+  "  /sendfile <to> <file>    Send file to a user, users (a,b) or a #room\n"
   "  /exit                    Disconnect from server\n"
   "  /usage                   Show this help message\n";
 
+// Files that can be arriving at the same time
+#define MAX_INCOMING 4
+
+// Bytes of a received file collected before they are written out
+#define INCOMING_BUF_SIZE (256 * 1024)
+
+// Numbered names ("<name>_<n>.<ext>") tried for a received file whose name is taken
+#define SAVE_NAME_TRIES 1000
+
+// Largest payload of one /chunk command (must not exceed the server's TRANSFER_CHUNK_SIZE)
+#define CHUNK_SIZE (64 * 1024)
+
+// Seconds /sendfile waits for the server's [XFER] answer before giving up
+#define XFER_REPLY_TIMEOUT 10
+
+// Milliseconds between two progress lines of an upload
+#define UPLOAD_PROGRESS_MS 1000
+
+// Files /sendfile may queue for upload
+#define UPLOAD_QUEUE_LEN 8
+
+// Bytes taken from the socket per recv(), and from the keyboard per read()
+#define RECV_BUF_SIZE  (64 * 1024)
+#define INPUT_BUF_SIZE 4096
+
+// 1 once the server agreed at the handshake to LZ4 compression: it then sends [ZTEXT] and
+// [FILE-ZDATA] frames and takes /zchunk
+static int compress_ok = 0;
+
+// Decoder of the server's compressed text stream ([ZTEXT] frames), set up before the handshake
+static lz4_stream_t ztext_stream;
+
 /**
- * Thread function responsible for receiving data from the server.
- * It handles both normal text messages and file transfers.
- *
- * @param arg Pointer to an integer (socket descriptor to use for receiving).
- * @return NULL.
+ * out
+ *   Bytes queued for the server, sent by the event loop as the socket takes them. The payload
+ *   of an upload chunk can instead be a range of the file, sent with sendfile(2) once the
+ *   'range_at' bytes queued before it are out; bytes queued after it follow it.
  */
-void *recv_thread(void *arg) {
-    int recv_sockfd = *(int*)arg;  // Extract the socket descriptor passed into the thread
-    free(arg);                     // Free the allocated memory (caller used malloc)
+static struct {
+    char   *buf;
+    size_t  cap;
+    size_t  len;                // Bytes queued
+    size_t  sent;               // Bytes of them already sent
+    int     range_fd;           // File of the pending range, -1 for none
+    size_t  range_at;           // Bytes of 'buf' that go before the range
+    off_t   range_off;
+    size_t  range_len;
+} out = { NULL, 0, 0, 0, -1, 0, 0, 0 };
 
-    char buf[BUF_SIZE];
-    ssize_t n;                     // Number of bytes received
-
-    // Variables to manage file-receive state
-    static int    receiving_file = 0;   // 0 = not currently receiving a file; 1 = receiving
-    static size_t file_remain   = 0;    // Number of bytes still expected for the incoming file
-    static FILE  *fp            = NULL; // FILE pointer to the local file being written
-
-    char incoming_fname[MAX_FILENAME];  // Stores the unique filename we're saving to
-    char incoming_sender[USERNAME_LEN]; // The username of the sender of the file
-
-    // Continuously read from the socket until an error or disconnection
-    while ((n = recv(recv_sockfd, buf, sizeof(buf), 0)) > 0) {
-        // If currently in the middle of a file transfer, write raw bytes to disk
-        if (receiving_file) {
-            // Determine how many bytes to write (no more than file_remain)
-            size_t to_write = (n < (ssize_t)file_remain ? (size_t)n : file_remain);
-            fwrite(buf, 1, to_write, fp);      // Write data to the open file
-            file_remain -= to_write;           // Decrement bytes remaining
-
-            // If we have received the entire file, close it and notify the user
-            if (file_remain == 0) {
-                fclose(fp);
-                receiving_file = 0;
-
-                // Print an informational message that file reception is complete
-                char msg_done[BUF_SIZE];
-                snprintf(msg_done, sizeof(msg_done),
-                         "[INFO] Received file '%s' from %s (saved).\n",
-                         incoming_fname, incoming_sender);
-                ti_draw_message(&ih, msg_done, SERVER_MESSAGE, COLOR_MAGENTA);
-            }
-            continue;  // Continue reading next chunk without treating this as text
+/**
+ * out_append
+ *   Queue 'len' bytes at 'data' for the server. Returns 0 on success, -1 if memory runs out.
+ */
+static int out_append(const void *data, size_t len) {
+    if (out.len + len > out.cap && out.sent > 0) {
+        memmove(out.buf, out.buf + out.sent, out.len - out.sent);
+        out.len -= out.sent;
+        if (out.range_fd >= 0) {
+            out.range_at -= out.sent;
+        }
+        out.sent = 0;
+    }
+    if (out.len + len > out.cap) {
+        size_t cap = out.cap ? out.cap : BUF_SIZE;
+        while (cap < out.len + len) {
+            cap *= 2;
+        }
+        char *buf = realloc(out.buf, cap);
+        if (!buf) {
+            return -1;
         }
+        out.buf = buf;
+        out.cap = cap;
+    }
+    memcpy(out.buf + out.len, data, len);
+    out.len += len;
+    return 0;
+}
 
-        // Not currently receiving a file, so interpret incoming data as text message
-        buf[n] = '\0';  // Null-terminate the received bytes to treat as C-string
+/**
+ * out_range
+ *   Queue 'len' bytes of the open file 'fd' from 'offset' (at most one range at a time).
+ */
+static void out_range(int fd, size_t offset, size_t len) {
+    out.range_fd  = fd;
+    out.range_at  = out.len;
+    out.range_off = (off_t)offset;
+    out.range_len = len;
+}
 
-        // Check if this is the header for an incoming file transfer:
-        // The protocol: server sends "[FILE <orig_filename> <size> <sender>]" before file bytes.
-        if (strncmp(buf, "[FILE ", 6) == 0) {
-            // Parse header fields: raw filename, size, sender
-            char *p = buf + 6;  // Skip over "[FILE "
-            char *size_str;
-            char *endptr;
+/**
+ * out_idle
+ *   1 if everything queued has been sent.
+ */
+static int out_idle(void) {
+    return out.sent == out.len && out.range_fd < 0;
+}
 
-            char raw_fname[MAX_FILENAME];
-            char sender[USERNAME_LEN];
+/**
+ * out_flush
+ *   Send what the socket takes of the queued bytes: the bytes before a pending range with
+ *   MSG_MORE (so a chunk's command line and payload share packets), the range straight from
+ *   the page cache with sendfile(2), then the rest. Returns 0 (when all is sent or the socket
+ *   is full), or -1 if the connection failed.
+ */
+static int out_flush(void) {
+    for (;;) {
+        size_t stop = out.range_fd >= 0 ? out.range_at : out.len;
+        ssize_t n;
+        if (out.sent < stop) {
+            n = send(sockfd, out.buf + out.sent, stop - out.sent,
+                     MSG_NOSIGNAL | (out.range_fd >= 0 ? MSG_MORE : 0));
+        } else if (out.range_fd >= 0) {
+            n = sendfile(sockfd, out.range_fd, &out.range_off, out.range_len);
+        } else {
+            out.len  = 0;
+            out.sent = 0;
+            return 0;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        if (out.sent < stop) {
+            out.sent += (size_t)n;
+        } else if ((out.range_len -= (size_t)n) == 0) {
+            out.range_fd = -1;
+        }
+    }
+}
 
-            // First token is the raw filename (may include path)
-            size_str = strchr(p, ' ');
-            if (!size_str) {
-                // Malformed header: just display as a normal server message
-                ti_draw_message(&ih, buf, SERVER_MESSAGE, COLOR_GREEN);
-                continue;
-            }
-            *size_str = '\0';  // Null-terminate the filename
-            strncpy(raw_fname, p, MAX_FILENAME - 1);
-            raw_fname[MAX_FILENAME - 1] = '\0';
-
-            // Move past the null we inserted to get the size string
-            size_str++;
-            endptr = strchr(size_str, ' ');
-            if (!endptr) {
-                ti_draw_message(&ih, buf, SERVER_MESSAGE, COLOR_GREEN);
-                continue;
-            }
-            *endptr = '\0';
-            size_t fsize = strtoul(size_str, NULL, 10);  // Convert size to numeric
-            endptr++;  // Move pointer to just after the size token
-
-            // Next field up to ']' is the sender username
-            char *closing_bracket = strchr(endptr, ']');
-            if (!closing_bracket) {
-                ti_draw_message(&ih, buf, SERVER_MESSAGE, COLOR_GREEN);
-                continue;
-            }
-            *closing_bracket = '\0';
-            strncpy(sender, endptr, USERNAME_LEN - 1);
-            sender[USERNAME_LEN - 1] = '\0';
-
-            // Extract just the basename of the file (strip directories)
-            char *base = basename(raw_fname);
-            strncpy(incoming_fname, base, MAX_FILENAME - 1);
-            incoming_fname[MAX_FILENAME - 1] = '\0';
-
-            // Now we need to ensure uniqueness: if a file with this name exists,
-            // append "_1", "_2", etc., until we find a free name.
-            char name_only[MAX_FILENAME], ext_only[MAX_FILENAME];
-            char temp_fname[MAX_FILENAME];
-            struct stat st;
-
-            strncpy(temp_fname, incoming_fname, MAX_FILENAME);
-            temp_fname[MAX_FILENAME - 1] = '\0';
-
-            // Split original filename into base name and extension
-            char *dot = strrchr(temp_fname, '.');
-            if (dot) {
-                size_t base_len = dot - temp_fname;
-                strncpy(name_only, temp_fname, base_len);
-                name_only[base_len] = '\0';
-                strncpy(ext_only, dot, MAX_FILENAME - base_len);
-                ext_only[MAX_FILENAME - base_len - 1] = '\0';
-            } else {
-                // No extension present
-                strncpy(name_only, temp_fname, MAX_FILENAME);
-                name_only[MAX_FILENAME - 1] = '\0';
-                ext_only[0] = '\0';
-            }
+/**
+ * incoming_t
+ *   A file being received. Its bytes arrive in "[FILE-DATA <xfer> <len>]" pieces tagged with
+ *   the transfer id of its "[FILE ...]" header, interleaved with chat lines (and with the
+ *   pieces of other files), and go to a partial file that gets its final name once complete.
+ *   They are collected in 'buf' and written INCOMING_BUF_SIZE bytes at a time into space
+ *   reserved for the whole file when it was opened. The partial file's size stays the number
+ *   of bytes written: that is where a resumed transfer continues. Each piece's frame carries
+ *   the CRC32C of the file up to its end, checked against 'crc' as the piece arrives.
+ */
+typedef struct {
+    uint32_t      xfer;                    // Transfer id, 0 for a free slot
+    int           fd;                      // The partial file being written
+    size_t        size;                    // Size of the whole file
+    size_t        remain;                  // Bytes still expected
+    size_t        written;                 // Bytes of the partial file on disk
+    char         *buf;                     // Bytes received after those (page-aligned)
+    size_t        buffered;
+    uint32_t      crc;                     // CRC32C of the bytes received so far (from byte 0)
+    size_t        verified;                // Bytes from byte 0 on confirmed by a piece's checksum
+    unsigned long opened;                  // When it was opened, to give up the oldest first
+    char          name[MAX_FILENAME];      // The file's name as sent (basename only)
+    char          fname[MAX_FILENAME];     // The partial file we're writing to
+    char          sender[USERNAME_LEN];    // The username of the sender of the file
+} incoming_t;
+
+static incoming_t    incoming[MAX_INCOMING];
+static unsigned long incoming_opened = 0;
+
+/**
+ * frame
+ *   The frame whose body is arriving: the raw bytes of a "[FILE-DATA ...]" piece, added to its
+ *   file as they come, or the LZ4 block of a "[FILE-ZDATA ...]" piece or a "[ZTEXT ...]" batch
+ *   of lines, collected in 'zbuf' and decoded once complete.
+ */
+enum { FRAME_DATA, FRAME_ZDATA, FRAME_ZTEXT };
+
+static struct {
+    int         kind;                 // FRAME_DATA, FRAME_ZDATA or FRAME_ZTEXT
+    size_t      remain;               // Bytes of the body still to come (0 between frames)
+    incoming_t *file;                 // The open file a piece belongs to, NULL to skip it
+    uint32_t    crc;                  // CRC32C of the file up to the end of a piece
+    int         checked;              // 1 if the piece's frame carried 'crc'
+    size_t      raw;                  // Decoded length of a compressed body
+    size_t      zlen;                 // Bytes of the compressed body in 'zbuf'
+    char        zbuf[LZ4_BOUND(LZ4_BLOCK_MAX)];
+} frame;
+
+// Chat lines of one recv() batch, drawn with a single ti_draw_message call
+static char   text_batch[BUF_SIZE + 1];
+static size_t text_len = 0;
+
+/**
+ * flush_text
+ *   Draw the batched chat lines, if any.
+ */
+static void flush_text(void) {
+    if (text_len == 0) {
+        return;
+    }
+    text_batch[text_len] = '\0';
+    ti_draw_message(&ih, text_batch, SERVER_MESSAGE, COLOR_GREEN);
+    text_len = 0;
+}
+
+/**
+ * add_text
+ *   Append 'len' bytes of chat text to the batch, drawing the batch first if they do not fit.
+ */
+static void add_text(const char *s, size_t len) {
+    if (text_len + len > BUF_SIZE) {
+        flush_text();
+    }
+    if (len > BUF_SIZE) {
+        len = BUF_SIZE;
+    }
+    memcpy(text_batch + text_len, s, len);
+    text_len += len;
+}
+
+/**
+ * save_file
+ *   Move the complete partial file 'part' to the first free name among 'name',
+ *   "<name>_1.<ext>", "<name>_2.<ext>", ... Each name is claimed with link(), which fails if
+ *   it is taken, so one call settles each candidate and a file that appears meanwhile is never
+ *   overwritten. Stores the name in 'out' and returns 0, or -1 if the file stays as 'part'.
+ */
+static int save_file(const char *part, const char *name, char out[MAX_FILENAME]) {
+    const char *dot = strrchr(name, '.');
+    int stem = dot && dot != name ? (int)(dot - name) : (int)strlen(name);
+
+    for (unsigned i = 0; i <= SAVE_NAME_TRIES; ++i) {
+        if (i == 0) {
+            snprintf(out, MAX_FILENAME, "%s", name);
+        } else {
+            snprintf(out, MAX_FILENAME, "%.*s_%u%s", stem > 200 ? 200 : stem, name, i, name + stem);
+        }
+        if (link(part, out) == 0) {
+            unlink(part);
+            return 0;
+        }
+        if (errno != EEXIST) {
+            break;
+        }
+    }
+    return -1;
+}
+
+/**
+ * part_filename
+ *   Name under which transfer 'xfer' of 'raw' is received until it is complete: the basename
+ *   followed by ".<xfer>.part". A partial file left by a broken connection is found again
+ *   under this name when the server offers the transfer for resuming.
+ */
+static void part_filename(char *raw, uint32_t xfer, char out[MAX_FILENAME]) {
+    snprintf(out, MAX_FILENAME, "%.200s.%u.part", basename(raw), xfer);
+}
+
+/**
+ * file_crc32c
+ *   CRC32C of the first 'len' bytes of the open file 'fd', read with pread. Returns 0 on
+ *   success, -1 if the file is shorter or cannot be read.
+ */
+static int file_crc32c(int fd, size_t len, uint32_t *crc) {
+    char block[16 * 1024];
+    uint32_t c = 0;
+    size_t at = 0;
+    while (at < len) {
+        size_t want = len - at < sizeof(block) ? len - at : sizeof(block);
+        ssize_t r = pread(fd, block, want, (off_t)at);
+        if (r <= 0) {
+            return -1;
+        }
+        c   = crc32c_update(c, block, (size_t)r);
+        at += (size_t)r;
+    }
+    *crc = c;
+    return 0;
+}
+
+/**
+ * send_fileack
+ *   Tell the server how many bytes of transfer 'xfer' this client holds (/fileack).
+ */
+static void send_fileack(uint32_t xfer, size_t offset) {
+    char line[64];
+    int len = snprintf(line, sizeof(line), "/fileack %u %zu\n", xfer, offset);
+    out_append(line, (size_t)len);
+}
+
+/**
+ * incoming_find
+ *   The open incoming file of transfer 'xfer', or NULL.
+ */
+static incoming_t *incoming_find(uint32_t xfer) {
+    for (size_t i = 0; i < MAX_INCOMING; ++i) {
+        if (xfer != 0 && incoming[i].xfer == xfer) {
+            return &incoming[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * incoming_flush
+ *   Write the buffered bytes of 'f' to its partial file. Returns 0 on success, -1 on a write
+ *   error. Async-signal-safe.
+ */
+static int incoming_flush(incoming_t *f) {
+    const char *p = f->buf;
+    while (f->buffered > 0) {
+        ssize_t n = pwrite(f->fd, p, f->buffered, (off_t)f->written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p           += n;
+        f->written  += (size_t)n;
+        f->buffered -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * incoming_close
+ *   Cut the partial file of 'f' to 'keep' bytes (releasing the space reserved beyond them),
+ *   close it and free the slot; buffered bytes are dropped. Returns -1 if the file could not be
+ *   cut, 0 otherwise.
+ */
+static int incoming_close(incoming_t *f, size_t keep) {
+    int rc = ftruncate(f->fd, (off_t)keep);
+    close(f->fd);
+    free(f->buf);
+    f->buf      = NULL;
+    f->buffered = 0;
+    f->xfer     = 0;
+    return rc < 0 ? -1 : 0;
+}
 
-            // Construct an initial candidate filename
-            char candidate[MAX_FILENAME];
-            snprintf(candidate, sizeof(candidate), "%s%s", name_only, ext_only);
-
-            // Loop: as long as a file by 'candidate' exists, append "_1" to base name
-            while (stat(candidate, &st) == 0) {
-                // Create a new base name by appending "_1"
-                char new_base[MAX_FILENAME];
-                int max_copy = sizeof(new_base) - 3;  // Reserve space for "_1\0"
-                snprintf(new_base,
-                         sizeof(new_base),
-                         "%.*s_1",        // Write the first (up to max_copy) chars of name_only
-                         max_copy,
-                         name_only);
-                strncpy(name_only, new_base, MAX_FILENAME - 1);
-                name_only[MAX_FILENAME - 1] = '\0';
-
-                // Reconstruct candidate using updated name_only
-                snprintf(candidate, sizeof(candidate), "%s%s", name_only, ext_only);
+/**
+ * incoming_abandon
+ *   Close 'f' with everything received written out: the server resends the rest when it
+ *   offers the transfer again.
+ */
+static void incoming_abandon(incoming_t *f) {
+    incoming_flush(f);
+    incoming_close(f, f->written);
+}
+
+/**
+ * incoming_save_all
+ *   Write out and close every partial file, so the next connection resumes each from all that
+ *   arrived. Only async-signal-safe calls: run from on_exit_signal.
+ */
+static void incoming_save_all(void) {
+    for (size_t i = 0; i < MAX_INCOMING; ++i) {
+        incoming_t *f = &incoming[i];
+        if (f->xfer != 0) {
+            incoming_flush(f);
+            if (ftruncate(f->fd, (off_t)f->written) < 0) {
+                // The reserved space stays; the file's size is still right
             }
+            close(f->fd);
+            f->xfer = 0;
+        }
+    }
+}
 
-            // 'candidate' now is a unique filename that does not exist
-            strncpy(incoming_fname, candidate, MAX_FILENAME - 1);
-            incoming_fname[MAX_FILENAME - 1] = '\0';
-
-            // Mark state to start receiving file bytes
-            receiving_file = 1;
-            file_remain   = fsize;
-            strncpy(incoming_sender, sender, USERNAME_LEN - 1);
-            incoming_sender[USERNAME_LEN - 1] = '\0';
-
-            // Open a local file for writing in binary mode
-            fp = fopen(incoming_fname, "wb");
-            if (!fp) {
-                char errmsg[BUF_SIZE];
-                snprintf(errmsg, sizeof(errmsg),
-                         "[ERROR] Could not create file '%s' for writing.\n",
-                         incoming_fname);
-                ti_draw_message(&ih, errmsg, SERVER_MESSAGE, COLOR_RED);
-                receiving_file = 0;  // Abort file reception
-                continue;
+/**
+ * incoming_failed
+ *   Writing the partial file of 'f' failed: keep what is on disk and tell the user.
+ */
+static void incoming_failed(incoming_t *f) {
+    char errmsg[BUF_SIZE];
+    snprintf(errmsg, sizeof(errmsg), "[ERROR] Could not write file '%s': %s.\n",
+             f->fname, strerror(errno));
+    incoming_close(f, f->written);
+    flush_text();
+    ti_draw_message(&ih, errmsg, SERVER_MESSAGE, COLOR_RED);
+}
+
+/**
+ * finish_file
+ *   Write out the rest of the incoming file 'f', move it to a free final name, confirm it to
+ *   the server and tell the user it is saved.
+ */
+static void finish_file(incoming_t *f) {
+    if (incoming_flush(f) < 0) {
+        incoming_failed(f);
+        return;
+    }
+
+    char msg_done[BUF_SIZE];
+    char final_name[MAX_FILENAME];
+    if (save_file(f->fname, f->name, final_name) == 0) {
+        snprintf(msg_done, sizeof(msg_done),
+                 "[INFO] Received file '%s' from %s (saved).\n",
+                 final_name, f->sender);
+    } else {
+        snprintf(msg_done, sizeof(msg_done),
+                 "[INFO] Received file '%s' from %s (saved as '%s').\n",
+                 f->name, f->sender, f->fname);
+    }
+    send_fileack(f->xfer, f->size);
+    incoming_close(f, f->size);
+
+    flush_text();
+    ti_draw_message(&ih, msg_done, SERVER_MESSAGE, COLOR_MAGENTA);
+}
+
+/**
+ * begin_file
+ *   Handle a "[FILE <xfer> <filename> <size> <sender> <offset>]" header line (NUL-terminated,
+ *   without its newline): open the partial file, fresh for offset 0 or continued at <offset>
+ *   for a resumed transfer, and reserve disk space for the rest of it. Returns 0 on success, -1
+ *   if the line is malformed (the caller then shows it as text).
+ */
+static int begin_file(const char *line) {
+    unsigned xfer;
+    size_t fsize, offset;
+    char raw_fname[MAX_FILENAME];
+    char sender[USERNAME_LEN];
+
+    if (sscanf(line, "[FILE %u %255s %zu %15s %zu]", &xfer, raw_fname, &fsize, sender, &offset) != 5 ||
+        xfer == 0 || offset > fsize) {
+        return -1;
+    }
+
+    // A new header for a transfer that is open means it was cut short and is being sent again;
+    // otherwise take a free slot, giving up the oldest open file if there is none (its partial
+    // file stays for a later resume)
+    incoming_t *f = incoming_find(xfer);
+    if (!f) {
+        f = &incoming[0];
+        for (size_t i = 0; i < MAX_INCOMING && f->xfer != 0; ++i) {
+            if (incoming[i].xfer == 0 || incoming[i].opened < f->opened) {
+                f = &incoming[i];
             }
+        }
+    }
+    if (f->xfer != 0) {
+        incoming_abandon(f);
+    }
+
+    snprintf(f->name, sizeof(f->name), "%s", basename(raw_fname));
+    part_filename(raw_fname, xfer, f->fname);
+    strncpy(f->sender, sender, USERNAME_LEN - 1);
+    f->sender[USERNAME_LEN - 1] = '\0';
+
+    // Open the partial file: truncated for a new transfer, kept up to the resume offset
+    // otherwise (after checksumming what it already has). The space for the rest is reserved
+    // without changing the file's size, which must keep telling how much has arrived.
+    f->crc      = 0;
+    f->verified = 0;  // A resumed file's old part is only trusted once a piece confirms it
+    f->fd       = open(f->fname, offset > 0 ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (f->fd >= 0 && offset > 0 &&
+        (file_crc32c(f->fd, offset, &f->crc) < 0 || ftruncate(f->fd, (off_t)offset) < 0)) {
+        close(f->fd);
+        f->fd = -1;
+    }
+    if (f->fd >= 0 && posix_memalign((void **)&f->buf, 4096, INCOMING_BUF_SIZE) != 0) {
+        close(f->fd);
+        f->fd = -1;
+    }
+    if (f->fd < 0) {
+        char errmsg[BUF_SIZE];
+        snprintf(errmsg, sizeof(errmsg),
+                 "[ERROR] Could not %s file '%s' for writing.\n",
+                 offset > 0 ? "resume" : "create", f->fname);
+        flush_text();
+        ti_draw_message(&ih, errmsg, SERVER_MESSAGE, COLOR_RED);
+        return 0;
+    }
+    if (fsize > offset) {
+        // Best effort: not every file system can reserve space
+        fallocate(f->fd, FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)(fsize - offset));
+    }
+    f->xfer     = xfer;
+    f->size     = fsize;
+    f->remain   = fsize - offset;
+    f->written  = offset;
+    f->buffered = 0;
+    f->opened   = ++incoming_opened;
+    if (offset > 0) {
+        char info[BUF_SIZE];
+        snprintf(info, sizeof(info), "[INFO] Resuming file '%s' from %s at byte %zu of %zu.\n",
+                 f->name, f->sender, offset, fsize);
+        add_text(info, strlen(info));
+    }
+    if (f->remain == 0) {
+        finish_file(f);
+    }
+    return 0;
+}
+
+/**
+ * reject_file
+ *   The piece of the incoming file 'f' that ended at 'end' failed its checksum. Cut the partial
+ *   file back to its verified part and close it without confirming: the server offers the
+ *   file again on the next connection and resumes it from there.
+ */
+static void reject_file(incoming_t *f, size_t end) {
+    incoming_flush(f);
+    size_t start = f->verified < f->written ? f->verified : f->written;
+    if (incoming_close(f, start) < 0) {
+        start = 0;
+    }
+
+    char errmsg[BUF_SIZE];
+    snprintf(errmsg, sizeof(errmsg),
+             "[ERROR] File '%s' from %s is corrupted (checksum mismatch before byte %zu); "
+             "it is fetched again from byte %zu on the next connection.\n",
+             f->name, f->sender, end, start);
+    flush_text();
+    ti_draw_message(&ih, errmsg, SERVER_MESSAGE, COLOR_RED);
+}
+
+/**
+ * offer_file
+ *   Handle a "[FILE-RESUME <xfer> <filename> <size> <sender>]" line: the server still has a
+ *   file for us from an earlier connection. Answer with the size of its partial file (0 if
+ *   there is none), and the server sends the rest.
+ */
+static int offer_file(const char *line) {
+    unsigned xfer;
+    size_t fsize;
+    char raw_fname[MAX_FILENAME];
+    char sender[USERNAME_LEN];
+
+    if (sscanf(line, "[FILE-RESUME %u %255s %zu %15[^]]]", &xfer, raw_fname, &fsize, sender) != 4 ||
+        xfer == 0) {
+        return -1;
+    }
+
+    char part[MAX_FILENAME];
+    struct stat st;
+    part_filename(raw_fname, xfer, part);
+    size_t have = stat(part, &st) == 0 ? (size_t)st.st_size : 0;
+    if (have > fsize) {
+        have = 0;   // Not ours after all: start over
+    } else if (have == fsize) {
+        // Complete, but the connection broke before it was moved into place and confirmed
+        char final_name[MAX_FILENAME];
+        save_file(part, basename(raw_fname), final_name);
+    }
+    send_fileack(xfer, have);
+    return 0;
+}
+
+/**
+ * piece_bytes
+ *   Add 'n' bytes of the piece in 'frame' to its file, if it is being received.
+ */
+static void piece_bytes(const char *data, size_t n) {
+    incoming_t *f = frame.file;
+    if (!f) {
+        return;
+    }
+    if (n > f->remain) {
+        n = f->remain;
+    }
+    f->crc     = crc32c_update(f->crc, data, n);
+    f->remain -= n;
+    while (n > 0) {
+        if (f->buffered == INCOMING_BUF_SIZE && incoming_flush(f) < 0) {
+            incoming_failed(f);
+            frame.file = NULL;
+            return;
+        }
+        size_t take = INCOMING_BUF_SIZE - f->buffered < n ? INCOMING_BUF_SIZE - f->buffered : n;
+        memcpy(f->buf + f->buffered, data, take);
+        f->buffered += take;
+        data        += take;
+        n           -= take;
+    }
+}
+
+/**
+ * piece_end
+ *   The piece in 'frame' is complete: check it against its frame's checksum, and finish the
+ *   file if this was its last piece.
+ */
+static void piece_end(void) {
+    incoming_t *f = frame.file;
+    if (!f) {
+        return;
+    }
+    size_t at = f->size - f->remain;
+    if (frame.checked && f->crc != frame.crc) {
+        reject_file(f, at);
+        return;
+    }
+    if (frame.checked) {
+        f->verified = at;
+    }
+    if (f->remain == 0) {
+        finish_file(f);
+    }
+}
+
+static void handle_line(char *line, size_t nl);
+static void upload_answer(uint32_t xfer, size_t offset);
+static void upload_error(const char *line);
+
+/**
+ * ztext_end
+ *   A "[ZTEXT ...]" block is complete: decode it with the text stream and handle its lines as
+ *   if they had arrived uncompressed.
+ */
+static void ztext_end(void) {
+    static char text[LZ4_BLOCK_MAX];
+
+    const char *raw = lz4_stream_decompress(&ztext_stream, frame.zbuf, frame.zlen, frame.raw);
+    if (!raw) {
+        flush_text();
+        ti_draw_message(&ih, "[ERROR] Could not decompress a message from the server.\n",
+                        SERVER_MESSAGE, COLOR_RED);
+        return;
+    }
+    // The stream keeps the decoded bytes as history for the next block: work on a copy
+    memcpy(text, raw, frame.raw);
+    size_t pos = 0;
+    while (pos < frame.raw) {
+        size_t nl = ts_find_newline(text + pos, frame.raw - pos);
+        if (nl == frame.raw - pos) {
+            add_text(text + pos, nl);
+            break;
+        }
+        handle_line(text + pos, nl);
+        pos += nl + 1;
+    }
+}
+
+/**
+ * zdata_end
+ *   A "[FILE-ZDATA ...]" block is complete: decode it straight into its file's buffer and take
+ *   it as the piece it stands for. A block that does not decode (or decodes past the end of
+ *   the file) is treated like a piece that fails its checksum.
+ */
+static void zdata_end(void) {
+    incoming_t *f = frame.file;
+    if (!f) {
+        return;
+    }
+    if (f->buffered + frame.raw > INCOMING_BUF_SIZE && incoming_flush(f) < 0) {
+        incoming_failed(f);
+        return;
+    }
+    size_t at = f->size - f->remain;
+    if (frame.raw > f->remain ||
+        lz4_decompress(frame.zbuf, frame.zlen, f->buf, f->buffered, frame.raw) < 0) {
+        reject_file(f, at + frame.raw);
+        return;
+    }
+    f->crc       = crc32c_update(f->crc, f->buf + f->buffered, frame.raw);
+    f->buffered += frame.raw;
+    f->remain   -= frame.raw;
+    piece_end();
+}
+
+/**
+ * handle_line
+ *   Handle one line from the server ('nl' bytes at 'line', followed by its '\n'): a frame
+ *   header starts reading its body, file headers, offers and [XFER] answers are acted upon, and
+ *   anything else is added to the text batch.
+ */
+static void handle_line(char *line, size_t nl) {
+    if (strncmp(line, "[FILE-DATA ", 11) == 0) {
+        unsigned xfer;
+        size_t len;
+        line[nl] = '\0';
+        int fields = sscanf(line, "[FILE-DATA %u %zu %x]", &xfer, &len, &frame.crc);
+        if (fields >= 2 && len > 0) {
+            frame.kind    = FRAME_DATA;
+            frame.remain  = len;
+            frame.file    = incoming_find(xfer);
+            frame.checked = fields == 3;
+            return;
+        }
+        line[nl] = '\n';
+    } else if (strncmp(line, "[FILE-ZDATA ", 12) == 0) {
+        unsigned xfer;
+        size_t len, zlen;
+        line[nl] = '\0';
+        if (sscanf(line, "[FILE-ZDATA %u %zu %x %zu]", &xfer, &len, &frame.crc, &zlen) == 4 &&
+            len > 0 && len <= LZ4_BLOCK_MAX && zlen > 0 && zlen <= sizeof(frame.zbuf)) {
+            frame.kind    = FRAME_ZDATA;
+            frame.remain  = zlen;
+            frame.file    = incoming_find(xfer);
+            frame.checked = 1;
+            frame.raw     = len;
+            frame.zlen    = 0;
+            return;
+        }
+        line[nl] = '\n';
+    } else if (strncmp(line, "[ZTEXT ", 7) == 0) {
+        size_t len, zlen;
+        line[nl] = '\0';
+        if (compress_ok && sscanf(line, "[ZTEXT %zu %zu]", &len, &zlen) == 2 &&
+            len > 0 && len <= LZ4_BLOCK_MAX && zlen > 0 && zlen <= sizeof(frame.zbuf)) {
+            frame.kind   = FRAME_ZTEXT;
+            frame.remain = zlen;
+            frame.raw    = len;
+            frame.zlen   = 0;
+            return;
+        }
+        line[nl] = '\n';
+    } else if (strncmp(line, "[FILE ", 6) == 0) {
+        line[nl] = '\0';
+        if (begin_file(line) == 0) {
+            return;
+        }
+        line[nl] = '\n';
+    } else if (strncmp(line, "[FILE-RESUME ", 13) == 0) {
+        line[nl] = '\0';
+        if (offer_file(line) == 0) {
+            return;
+        }
+        line[nl] = '\n';
+    } else if (strncmp(line, "[XFER ", 6) == 0) {
+        // Where to send the next upload chunk from: for the upload, not the user
+        unsigned xfer;
+        size_t offset;
+        if (sscanf(line, "[XFER %u %zu]", &xfer, &offset) == 2) {
+            upload_answer(xfer, offset);
+            return;
+        }
+    } else if (strncmp(line, "[ERROR]", 7) == 0) {
+        // Shown as usual; an answer to the upload also ends its /sendfile or stops its chunks
+        upload_error(line);
+    }
+    // Anything else is a normal chat message
+    add_text(line, nl + 1);
+}
+
+/**
+ * server_read
+ *   Take what has arrived from the server (called by the event loop when the socket is
+ *   readable). The stream is a sequence of newline-terminated lines, except that a frame line
+ *   is followed by a body of raw bytes (see handle_line):
+ *   - "[FILE-DATA <xfer> <len> <crc>]": <len> bytes of the file announced under that transfer
+ *     id; <crc> is checked once the piece is complete
+ *   - "[FILE-ZDATA <xfer> <len> <crc> <zlen>]": the same piece as a <zlen>-byte LZ4 block
+ *   - "[ZTEXT <len> <zlen>]": a <zlen>-byte block of the compressed text stream that decodes to
+ *     <len> bytes of lines
+ *   "[XFER ...]" answers and "[FILE-RESUME ...]" offers are handled here without being shown.
+ *   Chat lines received together are drawn together; a partial line waits for the next read.
+ *   Returns 0, or -1 once the server has closed the connection.
+ */
+static int server_read(void) {
+    static char buf[RECV_BUF_SIZE];
+    static size_t have = 0;        // Bytes in buf not yet handled
+
+    ssize_t n = recv(sockfd, buf + have, sizeof(buf) - have, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    have += (size_t)n;
+    size_t pos = 0;
 
-            // It is possible that the server sent both the header and some file bytes
-            // in the same packet. We need to detect and write those bytes too.
-            // Find where the header ends: after "] "
-            char *after_header = closing_bracket + 2;
-            size_t header_len = (size_t)(after_header - buf);
-            size_t data_len   = (size_t)n - header_len;
-            if (data_len > 0) {
-                size_t to_write = (data_len < fsize ? data_len : fsize);
-                fwrite(after_header, 1, to_write, fp);
-                file_remain -= to_write;
-                if (file_remain == 0) {
-                    // Entire file arrived in the same packet as header
-                    fclose(fp);
-                    receiving_file = 0;
-                    char msg_done2[BUF_SIZE];
-                    snprintf(msg_done2, sizeof(msg_done2),
-                             "[INFO] Received file '%s' from %s (saved).\n",
-                             incoming_fname, incoming_sender);
-                    ti_draw_message(&ih, msg_done2, SERVER_MESSAGE, COLOR_MAGENTA);
+    while (pos < have) {
+        // Inside a frame: file bytes go to the open file, compressed blocks are collected
+        if (frame.remain > 0) {
+            size_t take = have - pos < frame.remain ? have - pos : frame.remain;
+            if (frame.kind == FRAME_DATA) {
+                piece_bytes(buf + pos, take);
+            } else {
+                memcpy(frame.zbuf + frame.zlen, buf + pos, take);
+                frame.zlen += take;
+            }
+            pos          += take;
+            frame.remain -= take;
+            if (frame.remain == 0) {
+                if (frame.kind == FRAME_DATA) {
+                    piece_end();
+                } else if (frame.kind == FRAME_ZDATA) {
+                    zdata_end();
+                } else {
+                    ztext_end();
                 }
             }
-            continue;  // Continue to next recv() call
+            continue;
         }
 
-        // If not in file-receive state and not a [FILE] header, treat it as a normal chat message
-        ti_draw_message(&ih, buf, SERVER_MESSAGE, COLOR_GREEN);
+        char  *line = buf + pos;
+        size_t nl   = ts_find_newline(line, have - pos);
+        if (nl == have - pos) {
+            // Incomplete line: wait for the rest, unless it already fills the buffer
+            if (pos == 0 && have == sizeof(buf)) {
+                add_text(line, have);
+                pos = have;
+            }
+            break;
+        }
+        pos += nl + 1;
+        handle_line(line, nl);
     }
+    flush_text();
 
-    // If recv() returns <= 0, it usually means the server closed the connection.
-    // Display a disconnection message, shut down writing on the socket, and exit.
-    ti_draw_message(&ih, "Server disconnected.\n", EXIT_MESSAGE, COLOR_GREEN);
-    shutdown(sockfd, SHUT_WR);
-    raise(SIGTERM);  // Trigger the exit signal handler to clean up
-    return NULL;
+    memmove(buf, buf + pos, have - pos);
+    have -= pos;
+    return 0;
 }
 
 /**
@@ -238,8 +854,11 @@ void *recv_thread(void *arg) {
  * @param signo The signal number that was caught.
  */
 static void on_exit_signal(int signo) {
-    // 1) Restore terminal from raw mode and move to a new line
+    // 1) Restore terminal from raw mode and move to a new line, and keep what arrived of the
+    //    files being received
+    incoming_save_all();
     ti_draw_newline();
+    ti_flush();
     ti_disable_raw_mode();
 
     // 2) Clean up resources held by the terminal input handler
@@ -256,152 +875,571 @@ static void on_exit_signal(int signo) {
     _exit(128 + signo);
 }
 
+/* --- Command handlers (client side of the table in command.h) --- */
+
+/**
+ * Prints the help text explaining all commands.
+ */
+static void handle_usage(const cmd_line_t *line) {
+    (void)line;
+    ti_draw_message(&ih, USAGE_TEXT, INPUT_MESSAGE, COLOR_RESET);
+}
+
+/**
+ * Joins or creates a chat room.
+ */
+static void handle_join(const cmd_line_t *line) {
+    char buf[BUF_SIZE];
+    // Erase current prompt line, reprint prompt, then send the command to server
+    ti_draw_newline();
+    ti_draw_prompt(&ih);
+    snprintf(buf, sizeof(buf), "/join %s\n", line->argv[0]);
+    out_append(buf, strlen(buf));
+}
+
+/**
+ * Leaves the current chat room.
+ */
+static void handle_leave(const cmd_line_t *line) {
+    (void)line;
+    ti_draw_newline();
+    ti_draw_prompt(&ih);
+    out_append("/leave\n", 7);
+}
+
+/**
+ * Broadcasts a message to everyone in the current room.
+ */
+static void handle_broadcast(const cmd_line_t *line) {
+    char buf[BUF_SIZE];
+    ti_draw_newline();
+    ti_draw_prompt(&ih);
+    snprintf(buf, sizeof(buf), "/broadcast %s\n", line->text);
+    out_append(buf, strlen(buf));
+}
+
+/**
+ * Sends a private message to a specific user.
+ */
+static void handle_whisper(const cmd_line_t *line) {
+    char buf[BUF_SIZE];
+    const char *user = line->argv[0];  // The target username
+    const char *msg  = line->text;     // The message text (rest of line)
+    printf("\n%s - %s", user, client_username);  // Debug print (could be removed)
+    if (strcmp(user, client_username) == 0) {
+        // Prevent user from whispering to themselves
+        ti_draw_message(&ih, "[ERROR] Cannot whisper to yourself.\n", INPUT_MESSAGE, COLOR_RED);
+        return;
+    }
+    ti_draw_newline();
+    ti_draw_prompt(&ih);
+    snprintf(buf, sizeof(buf), "/whisper %s %s\n", user, msg);
+    out_append(buf, strlen(buf));
+}
+
+/**
+ * upload_job_t
+ *   A file to upload, checked, opened and mapped by handle_sendfile.
+ */
+typedef struct {
+    int         fd;
+    size_t      size;
+    const char *map;                  // The whole file, mapped for the digest and checksums
+    char        filename[CMD_BUF_SIZE];
+    char        target[CMD_BUF_SIZE];
+} upload_job_t;
+
+/**
+ * upload
+ *   The files given with /sendfile, uploaded one at a time in the order they were given. The
+ *   first is announced; once the server answers with [XFER], its chunks are queued one at a
+ *   time as the socket drains, so whatever the user types meanwhile goes out between two
+ *   chunks and the prompt never waits for an upload.
+ */
+enum { UPLOAD_IDLE, UPLOAD_WAITING, UPLOAD_SENDING };
+
+static struct {
+    int             state;            // UPLOAD_IDLE, or the state of jobs[head]
+    upload_job_t    jobs[UPLOAD_QUEUE_LEN];
+    size_t          head;
+    size_t          count;            // Queued files, the current one included
+    uint32_t        xfer;             // Transfer id the server gave the current file
+    size_t          offset;           // Bytes of the current file queued so far
+    uint32_t        crc;              // CRC32C of those bytes
+    int             failed;           // Set by an error line while sending: stop
+    struct timespec deadline;         // When to give up waiting for [XFER]
+    struct timespec progress;         // When progress was last shown
+} upload = { .state = UPLOAD_IDLE };
+
+static void upload_next(void);
+
+/**
+ * ms_since
+ *   Milliseconds from 't' to now (negative if 't' is in the future).
+ */
+static long ms_since(const struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/**
+ * upload_release
+ *   Done with the current file: release it and announce the next one, if any.
+ */
+static void upload_release(void) {
+    upload_job_t *job = &upload.jobs[upload.head];
+    munmap((void *)job->map, job->size);
+    close(job->fd);
+    upload.head  = (upload.head + 1) % UPLOAD_QUEUE_LEN;
+    upload.count--;
+    upload.state = UPLOAD_IDLE;
+    upload_next();
+}
+
+/**
+ * upload_next
+ *   Announce the next queued file, if no upload is in progress:
+ *   "/sendfile <filename> <user> <size> <digest>\n", answered by "[XFER <transfer> <offset>]"
+ *   (see upload_answer) or an error (see upload_error).
+ */
+static void upload_next(void) {
+    if (upload.state != UPLOAD_IDLE || upload.count == 0) {
+        return;
+    }
+    upload_job_t *job = &upload.jobs[upload.head];
+
+    file_digest_t digest;
+    char digest_hex[FH_DIGEST_HEX_LEN + 1];
+    digest.fast = fh_fast64(job->map, job->size);
+    fh_sha256(job->map, job->size, digest.sha256);
+    fh_digest_format(&digest, digest_hex);
+
+    char buf[BUF_SIZE];
+    int len = snprintf(buf, sizeof(buf), "/sendfile %s %s %zu %s\n",
+                       job->filename, job->target, job->size, digest_hex);
+    out_append(buf, (size_t)len);
+    upload.state = UPLOAD_WAITING;
+    clock_gettime(CLOCK_MONOTONIC, &upload.deadline);
+    upload.deadline.tv_sec += XFER_REPLY_TIMEOUT;
+}
+
+/**
+ * upload_answer
+ *   The server answered the announcement with "[XFER <xfer> <offset>]": upload from <offset>
+ *   (non-zero when an earlier, interrupted upload of the same file is resumed, the full size
+ *   when the server already has the content).
+ */
+static void upload_answer(uint32_t xfer, size_t offset) {
+    if (upload.state != UPLOAD_WAITING) {
+        return;
+    }
+    upload_job_t *job = &upload.jobs[upload.head];
+    if (offset > job->size) {
+        upload_release();
+        return;
+    }
+    char buf[BUF_SIZE];
+    if (offset == job->size) {
+        snprintf(buf, sizeof(buf), "[INFO] '%s' is already on the server; upload skipped.\n",
+                 job->filename);
+        ti_draw_message(&ih, buf, SERVER_MESSAGE, COLOR_MAGENTA);
+        upload_release();
+        return;
+    }
+    if (offset > 0) {
+        snprintf(buf, sizeof(buf), "[INFO] Resuming upload of '%s' at byte %zu of %zu.\n",
+                 job->filename, offset, job->size);
+        ti_draw_message(&ih, buf, SERVER_MESSAGE, COLOR_MAGENTA);
+    }
+    upload.state  = UPLOAD_SENDING;
+    upload.xfer   = xfer;
+    upload.offset = offset;
+    upload.crc    = crc32c_update(0, job->map, offset);
+    upload.failed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &upload.progress);
+}
+
+/**
+ * sendfile_errors / chunk_errors
+ *   Beginnings of the server's error replies to "/sendfile" and to "/chunk" / "/zchunk". Other
+ *   errors (a mistyped command, a whisper to an unknown user) may arrive during an upload too;
+ *   they are only shown.
+ */
+static const char *const sendfile_errors[] = {
+    "[ERROR] Usage: /sendfile ",
+    "[ERROR] Too many recipients ",
+    "[ERROR] Room '",
+    "[ERROR] Invalid recipient ",
+    "[ERROR] Cannot send a file to yourself.",
+    "[ERROR] No one to send the file to.",
+    "[ERROR] File size must be ",
+    "[ERROR] Recipient list is too long.",
+    "[ERROR] Malformed file digest.",
+    "[ERROR] Server out of memory.",
+    "[ERROR] Too many unfinished uploads.",
+};
+
+static const char *const chunk_errors[] = {
+    "[ERROR] Invalid or unknown file chunk.",
+    "[ERROR] File chunk failed its checksum.",
+    "[ERROR] Failed to receive full file data.",
+};
+
+/**
+ * error_matches
+ *   1 if 'line' begins with one of the 'count' prefixes in 'errors'.
+ */
+static int error_matches(const char *line, const char *const *errors, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (strncmp(line, errors[i], strlen(errors[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * upload_error
+ *   The server sent an error line: if it refuses the announced file, the file is dropped; if a
+ *   chunk failed (e.g. its checksum), the upload stops. Any other error leaves the upload alone.
+ */
+static void upload_error(const char *line) {
+    if (upload.state == UPLOAD_WAITING &&
+        error_matches(line, sendfile_errors, sizeof(sendfile_errors) / sizeof(*sendfile_errors))) {
+        upload_release();
+    } else if (upload.state == UPLOAD_SENDING &&
+               error_matches(line, chunk_errors, sizeof(chunk_errors) / sizeof(*chunk_errors))) {
+        upload.failed = 1;
+    }
+}
+
+/**
+ * upload_expire
+ *   Give up on an announcement the server has not answered within XFER_REPLY_TIMEOUT seconds.
+ *   Returns the milliseconds the event loop may wait before calling again, -1 for no limit.
+ */
+static int upload_expire(void) {
+    if (upload.state != UPLOAD_WAITING) {
+        return -1;
+    }
+    long late = ms_since(&upload.deadline);
+    if (late >= 0) {
+        upload_release();
+        return upload_expire();
+    }
+    return (int)-late;
+}
+
+/**
+ * upload_progress
+ *   Show how far the upload has got, at most once per UPLOAD_PROGRESS_MS (a file that goes out
+ *   quicker than that shows no progress at all).
+ */
+static void upload_progress(const upload_job_t *job) {
+    if (ms_since(&upload.progress) < UPLOAD_PROGRESS_MS || upload.offset == job->size) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &upload.progress);
+
+    char msg[BUF_SIZE];
+    snprintf(msg, sizeof(msg), "[INFO] Uploading '%s': %zu%% (%zu of %zu bytes).\n",
+             job->filename, upload.offset * 100 / job->size, upload.offset, job->size);
+    ti_draw_message(&ih, msg, SERVER_MESSAGE, COLOR_MAGENTA);
+}
+
+/**
+ * upload_pump
+ *   Called when everything queued for the server has been sent: queue the next chunk of the
+ *   file being uploaded, or release the file once all its chunks are out (or it failed).
+ *   Returns 1 if more output was queued.
+ *
+ * A chunk is "/chunk <transfer> <offset> <len> <crc>\n" followed by <len> bytes, <crc> being
+ * the CRC32C of the file up to the end of the chunk. The bytes go out with sendfile(2); the
+ * checksum is taken from the mapping, so the file is never copied into the client. With
+ * compression negotiated, a chunk that shrinks by at least 1/16 goes as
+ * "/zchunk <transfer> <offset> <len> <crc> <zlen>\n" followed by its <zlen>-byte LZ4 block;
+ * chunks of already compressed data (JPEG, PNG, most of a PDF) are recognised by their entropy
+ * and sent as they are. The server answers the last one with [OK], or with an error.
+ */
+static int upload_pump(void) {
+    static char zchunk[LZ4_BOUND(CHUNK_SIZE)];
+    static uint32_t ztable[LZ4_TABLE_SIZE];
+
+    if (upload.state != UPLOAD_SENDING) {
+        return 0;
+    }
+    upload_job_t *job = &upload.jobs[upload.head];
+    if (upload.failed || upload.offset == job->size) {
+        upload_release();
+        return !out_idle();     // The next file's announcement
+    }
+
+    size_t offset = upload.offset;
+    size_t n = job->size - offset < CHUNK_SIZE ? job->size - offset : CHUNK_SIZE;
+    const char *chunk = job->map + offset;
+    upload.crc = crc32c_update(upload.crc, chunk, n);
+    size_t zlen = 0;
+    if (compress_ok && lz4_entropy_q8(chunk, n) < LZ4_INCOMPRESSIBLE_Q8) {
+        memset(ztable, 0, sizeof(ztable));
+        zlen = lz4_compress(chunk, 0, n, zchunk, n - n / 16, ztable);
+    }
+    char buf[BUF_SIZE];
+    int len;
+    if (zlen > 0) {
+        len = snprintf(buf, sizeof(buf), "/zchunk %u %zu %zu %08x %zu\n",
+                       upload.xfer, offset, n, (unsigned)upload.crc, zlen);
+        out_append(buf, (size_t)len);
+        out_append(zchunk, zlen);
+    } else {
+        len = snprintf(buf, sizeof(buf), "/chunk %u %zu %zu %08x\n",
+                       upload.xfer, offset, n, (unsigned)upload.crc);
+        out_append(buf, (size_t)len);
+        out_range(job->fd, offset, n);
+    }
+    upload.offset += n;
+    upload_progress(job);
+    return 1;
+}
+
+/**
+ * Sends a file to a user, a comma-separated list of users or the members of a "#room" (the
+ * server resolves the list and stores the file once for all of them): checks it locally, then
+ * queues it for upload in /chunk commands, which the event loop sends while the user keeps
+ * chatting.
+ */
+static void handle_sendfile(const cmd_line_t *line) {
+    const char *user     = line->argv[0];
+    const char *filename = line->argv[1];
+    if (strcmp(user, client_username) == 0) {
+        // Prevent sending a file to oneself
+        ti_draw_message(&ih, "[ERROR] Cannot sendfile to yourself.\n", INPUT_MESSAGE, COLOR_RED);
+        return;
+    }
+
+    // 1) Check if file exists and get its size
+    struct stat st;
+    if (stat(filename, &st) < 0) {
+        ti_draw_message(&ih, "[ERROR] File not found.\n", INPUT_MESSAGE, COLOR_RED);
+        return;
+    }
+    size_t filesize = (size_t)st.st_size;
+    // Empty files cannot be mapped; the upper limit is the server's (max_file_size), which
+    // refuses a larger file with "[ERROR] File size must be ..." (see upload_error)
+    if (filesize == 0) {
+        ti_draw_message(&ih, "[ERROR] File is empty.\n", INPUT_MESSAGE, COLOR_RED);
+        return;
+    }
+
+    // 2) Check file extension: only allow .txt, .pdf, .jpg, .png
+    const char *ext = strrchr(filename, '.');
+    if (!ext ||
+        (strcmp(ext, ".txt") != 0 &&
+         strcmp(ext, ".pdf") != 0 &&
+         strcmp(ext, ".jpg") != 0 &&
+         strcmp(ext, ".png") != 0)) {
+        ti_draw_message(&ih, "[ERROR] Only .txt, .pdf, .jpg, .png allowed.\n", INPUT_MESSAGE, COLOR_RED);
+        return;
+    }
+
+    // 3) Map the file and queue it: it is announced once the uploads before it are done
+    if (upload.count == UPLOAD_QUEUE_LEN) {
+        ti_draw_message(&ih, "[ERROR] Too many files waiting to be uploaded.\n", INPUT_MESSAGE, COLOR_RED);
+        return;
+    }
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        ti_draw_message(&ih, "[ERROR] Cannot open file for reading.\n", INPUT_MESSAGE, COLOR_RED);
+        return;
+    }
+    void *map = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        ti_draw_message(&ih, "[ERROR] Cannot read file.\n", INPUT_MESSAGE, COLOR_RED);
+        close(fd);
+        return;
+    }
+
+    upload_job_t *job = &upload.jobs[(upload.head + upload.count) % UPLOAD_QUEUE_LEN];
+    job->fd   = fd;
+    job->size = filesize;
+    job->map  = map;
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    snprintf(job->target, sizeof(job->target), "%s", user);
+    upload.count++;
+    upload_next();
+
+    ti_draw_newline();
+    ti_draw_prompt(&ih);
+}
+
+/**
+ * Gracefully disconnects from the server.
+ */
+static void handle_exit(const cmd_line_t *line) {
+    (void)line;
+    ti_draw_newline();
+    out_append("/exit\n", strlen("/exit\n"));
+}
+
+/**
+ * Client-side handler of each command in the shared table, with the usage line shown when the
+ * typed arguments do not match the command's input spec.
+ */
+static const struct {
+    void       (*run)(const cmd_line_t *line);
+    const char  *usage;
+} command_handlers[CMD_COUNT] = {
+    [CMD_USAGE]     = { handle_usage,     NULL },
+    [CMD_JOIN]      = { handle_join,      "[WARN] Usage: /join <room_name>\n" },
+    [CMD_LEAVE]     = { handle_leave,     NULL },
+    [CMD_BROADCAST] = { handle_broadcast, "[WARN] Usage: /broadcast <message>\n" },
+    [CMD_WHISPER]   = { handle_whisper,   "[WARN] Usage: /whisper <user> <message>\n" },
+    [CMD_SENDFILE]  = { handle_sendfile,  "[WARN] Usage: /sendfile <user|user,user|#room> <file>\n" },
+    [CMD_EXIT]      = { handle_exit,      NULL },
+};
+
 /**
  * Processes a command line entered by the user. Commands start with '/'.
- * Strips off the command token and its arguments, then performs the appropriate action.
+ * Looks the command up in the shared table, checks its arguments against the command's
+ * input spec and runs its handler.
  *
  * @param line A null-terminated string that the user typed (not including the initial prompt).
  */
 static void process_command(const char *line) {
-    char buf[BUF_SIZE];
-    // Duplicate 'line' into a modifiable buffer so we can use strtok on it
-    char *tok = strtok((char*)line, " \n");
-    if (!tok) return;  // No tokens: empty line, do nothing
-
-    if (strcmp(tok, "/usage") == 0) {
-        // Print the help text explaining all commands
-        ti_draw_message(&ih, USAGE_TEXT, INPUT_MESSAGE, COLOR_RESET);
-
-    } else if (strcmp(tok, "/join") == 0) {
-        // Join or create a chat room
-        char *room = strtok(NULL, " \n");
-        char *extra = strtok(NULL, " \n");
-        if (!room || extra) {
-            // Missing argument: show usage for /join
-            ti_draw_message(&ih, "[WARN] Usage: /join <room_name>\n", INPUT_MESSAGE, COLOR_MAGENTA);
-        } else {
-            // Erase current prompt line, reprint prompt, then send the command to server
-            ti_draw_newline();
-            ti_draw_prompt(&ih);
-            snprintf(buf, sizeof(buf), "/join %s\n", room);
-            send(sockfd, buf, strlen(buf), 0);
-        }
+    cmd_line_t parsed;
+    // The line is the input handler's own buffer; parsing splits it up in place
+    int args_ok = command_parse((char *)line, strlen(line), 0, &parsed) == 0;
+    if (!parsed.token) return;  // No tokens: empty line, do nothing
 
-    } else if (strcmp(tok, "/leave") == 0) {
-        // Leave the current chat room
-        ti_draw_newline();
-        ti_draw_prompt(&ih);
-        send(sockfd, "/leave\n", 7, 0);
+    if (!parsed.cmd || !command_handlers[parsed.cmd->id].run) {
+        // Unrecognized command, or one only the client itself sends: instruct user to type /usage
+        ti_draw_message(&ih, "[WARN] Invalid command. Use /usage\n", INPUT_MESSAGE, COLOR_MAGENTA);
+    } else if (!args_ok) {
+        // Missing or extra arguments: show the command's usage
+        ti_draw_message(&ih, command_handlers[parsed.cmd->id].usage, INPUT_MESSAGE, COLOR_MAGENTA);
+    } else {
+        command_handlers[parsed.cmd->id].run(&parsed);
+    }
+}
 
-    } else if (strcmp(tok, "/broadcast") == 0) {
-        // Broadcast a message to everyone in the current room
-        char *msg = strtok(NULL, "\n");  // Everything after "/broadcast "
-        if (!msg) {
-            ti_draw_message(&ih, "[WARN] Usage: /broadcast <message>\n", INPUT_MESSAGE, COLOR_MAGENTA);
-        } else {
+/**
+ * handle_key
+ *   Handle one byte typed by the user: ENTER runs the line, backspace/DEL edits it, anything
+ *   else goes to the input handler.
+ */
+static void handle_key(char c) {
+    if (c == '\r' || c == '\n') {
+        // User pressed ENTER: terminate the input buffer and process the command
+        ih.buffer[ih.length] = '\0';
+
+        if (ih.length == 0) {
+            // Empty line: just redraw the prompt
             ti_draw_newline();
             ti_draw_prompt(&ih);
-            snprintf(buf, sizeof(buf), "/broadcast %s\n", msg);
-            send(sockfd, buf, strlen(buf), 0);
-        }
-
-    } else if (strcmp(tok, "/whisper") == 0) {
-        // Send a private message to a specific user
-        char *user = strtok(NULL, " \n");  // The target username
-        char *msg  = strtok(NULL, "\n");   // The message text (rest of line)
-        printf("\n%s - %s", user, client_username);  // Debug print (could be removed)
-        if (user && strcmp(user, client_username) == 0) {
-            // Prevent user from whispering to themselves
-            ti_draw_message(&ih, "[ERROR] Cannot whisper to yourself.\n", INPUT_MESSAGE, COLOR_RED);
         } else {
-            if (!user || !msg) {
-                // Missing either username or message
-                ti_draw_message(&ih, "[WARN] Usage: /whisper <user> <message>\n", INPUT_MESSAGE, COLOR_MAGENTA);
-            } else {
-                ti_draw_newline();
-                ti_draw_prompt(&ih);
-                snprintf(buf, sizeof(buf), "/whisper %s %s\n", user, msg);
-                send(sockfd, buf, strlen(buf), 0);
-            }
+            process_command(ih.buffer);
         }
+        // Reset input buffer
+        ih.length = 0;
+        ih.buffer[0] = '\0';
 
-    } else if (strcmp(tok, "/sendfile") == 0) {
-        // Send a file to a specific user
-        char *user     = strtok(NULL, " \n");
-        if (user && strcmp(user, client_username) == 0) {
-            // Prevent sending a file to oneself
-            ti_draw_message(&ih, "[ERROR] Cannot sendfile to yourself.\n", INPUT_MESSAGE, COLOR_RED);
-        } else {
-            char *filename = strtok(NULL, " \n");
-            if (!filename || !user) {
-                // Missing either file name or target username
-                ti_draw_message(&ih, "[WARN] Usage: /sendfile <file> <user>\n", INPUT_MESSAGE, COLOR_MAGENTA);
-                return;
-            }
+    } else if (c == 127 || c == 8) {
+        // Backspace or DEL: remove last character from buffer
+        ti_process_backspace(&ih);
 
-            // 1) Check if file exists and get its size
-            struct stat st;
-            if (stat(filename, &st) < 0) {
-                ti_draw_message(&ih, "[ERROR] File not found.\n", INPUT_MESSAGE, COLOR_RED);
-                return;
-            }
-            size_t filesize = (size_t)st.st_size;
-            // Enforce file size constraints: non-zero and <= 3 MB
-            if (filesize == 0 || filesize > (3 * 1024 * 1024)) {
-                ti_draw_message(&ih, "[ERROR] File size must be between 1 byte and 3MB.\n", INPUT_MESSAGE, COLOR_RED);
-                return;
-            }
+    } else {
+        // Regular character: add to buffer and update display
+        ti_process_char(&ih, c);
+    }
+}
+
+/**
+ * server_write
+ *   Send queued output, queueing upload chunks whenever all of it is out, until the socket
+ *   is full or nothing is left. Returns 0, or -1 if the connection failed.
+ */
+static int server_write(void) {
+    do {
+        if (out_flush() < 0) {
+            return -1;
+        }
+    } while (out_idle() && upload_pump());
+    return 0;
+}
+
+/**
+ * server_disconnected
+ *   The connection is gone: say so and exit through the signal handler's cleanup.
+ */
+static void server_disconnected(void) {
+    ti_draw_message(&ih, "Server disconnected.\n", EXIT_MESSAGE, COLOR_GREEN);
+    shutdown(sockfd, SHUT_WR);
+    raise(SIGTERM);
+}
 
-            // 2) Check file extension: only allow .txt, .pdf, .jpg, .png
-            const char *ext = strrchr(filename, '.');
-            if (!ext ||
-                (strcmp(ext, ".txt") != 0 &&
-                 strcmp(ext, ".pdf") != 0 &&
-                 strcmp(ext, ".jpg") != 0 &&
-                 strcmp(ext, ".png") != 0)) {
-                ti_draw_message(&ih, "[ERROR] Only .txt, .pdf, .jpg, .png allowed.\n", INPUT_MESSAGE, COLOR_RED);
-                return;
+/**
+ * event_loop
+ *   The client's only loop, on a non-blocking socket: wait with poll() until the keyboard or
+ *   the server has data, or the socket can take queued output, and handle whatever is ready.
+ *   Keystrokes are read in bulk; server data is handled as it arrives; output (commands,
+ *   acknowledgements, upload chunks) is sent as far as the socket takes it, the rest when it
+ *   drains. Everything drawn meanwhile goes out as one frame per turn, or per TI_REFRESH_MS
+ *   while messages keep coming. Returns when standard input ends.
+ */
+static void event_loop(void) {
+    char keys[INPUT_BUF_SIZE];
+
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = sockfd,       .events = POLLIN | (out_idle() ? 0 : POLLOUT) },
+        };
+        // Wake up for whichever comes first: the next frame or the upload's reply timeout
+        int timeout = ti_refresh();
+        int expire  = upload_expire();
+        if (timeout < 0 || (expire >= 0 && expire < timeout)) {
+            timeout = expire;
+        }
+        if (poll(fds, 2, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            break;
+        }
 
-            // 3) Send header line to server: "/sendfile <filename> <user> <size>\n"
-            ti_draw_newline();
-            ti_draw_prompt(&ih);
-            snprintf(buf, sizeof(buf), "/sendfile %s %s %zu\n", filename, user, filesize);
-            send(sockfd, buf, strlen(buf), 0);
-
-            // 4) Open the file and transmit its raw bytes to the server
-            int fd = open(filename, O_RDONLY);
-            if (fd < 0) {
-                ti_draw_message(&ih, "[ERROR] Cannot open file for reading.\n", INPUT_MESSAGE, COLOR_RED);
-                return;
+        if ((fds[1].revents & (POLLIN | POLLHUP | POLLERR)) && server_read() < 0) {
+            server_disconnected();
+            return;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+            if (n <= 0) {
+                return;  // Error or EOF
             }
-            size_t total = 0;
-            while (total < filesize) {
-                ssize_t r = read(fd, buf, sizeof(buf));
-                if (r <= 0) break;
-                send(sockfd, buf, (size_t)r, 0);  // Send chunk
-                total += (size_t)r;
+            for (ssize_t i = 0; i < n; ++i) {
+                handle_key(keys[i]);
             }
-            close(fd);
-            // After sending all bytes, the server should reply with an ACK or an error
         }
-    } else if (strcmp(tok, "/exit") == 0) {
-        // Gracefully disconnect from server
-        ti_draw_newline();
-        send(sockfd, "/exit\n", strlen("/exit\n"), 0);
-
-    } else {
-        // Unrecognized command: instruct user to type /usage
-        ti_draw_message(&ih, "[WARN] Invalid command. Use /usage\n", INPUT_MESSAGE, COLOR_MAGENTA);
+        if (server_write() < 0) {
+            server_disconnected();
+            return;
+        }
     }
 }
 
 int main(int argc, char *argv[]) {
-    // Program expects exactly two arguments: server IP and port number
-    if (argc != 3) {
-        fprintf(stderr, "[ERROR] Usage: %s <server-ip> <port>\n", argv[0]);
+    // Program expects two arguments, server IP and port number, optionally followed by
+    // --no-compress (do not ask the server for compressed data)
+    int want_compress = 1;
+    if (argc == 4 && strcmp(argv[3], "--no-compress") == 0) {
+        want_compress = 0;
+    } else if (argc != 3) {
+        fprintf(stderr, "[ERROR] Usage: %s <server-ip> <port> [--no-compress]\n", argv[0]);
         return 1;
     }
+    if (want_compress && lz4_stream_init(&ztext_stream, 0) < 0) {
+        want_compress = 0;
+    }
 
     const char *server_ip = argv[1];  // e.g. "127.0.0.1"
     int port = atoi(argv[2]);         // Convert port string to integer
@@ -444,17 +1482,24 @@ int main(int argc, char *argv[]) {
             return 0;
         }
 
-        // Send the username to the server (including newline)
-        send(sockfd, client_username, strlen(client_username), 0);
-
         // Remove trailing newline from client_username
         size_t len = strlen(client_username);
         if (len > 0 && client_username[len-1] == '\n') {
             client_username[len-1] = '\0';
         }
 
-        // Wait for server response (e.g., "[OK]" or an error message)
-        n = recv(sockfd, buf, sizeof(buf)-1, 0);
+        // Send the username to the server (with a newline), asking for LZ4 compression
+        int hello = snprintf(buf, sizeof(buf), "%s%s\n", client_username,
+                             want_compress ? " lz4" : "");
+        send(sockfd, buf, (size_t)hello, 0);
+
+        // Wait for server response (e.g., "[OK]" or an error message). Only its first line is
+        // taken: what follows (such as [FILE-RESUME] offers) is for the event loop.
+        n = recv(sockfd, buf, sizeof(buf)-1, MSG_PEEK);
+        if (n > 0) {
+            size_t nl = ts_find_newline(buf, (size_t)n);
+            n = recv(sockfd, buf, nl < (size_t)n ? nl + 1 : (size_t)n, 0);
+        }
         if (n <= 0) {
             printf("[ERROR] Handshake failed.\n");
             close(sockfd);
@@ -464,59 +1509,27 @@ int main(int argc, char *argv[]) {
         printf("%s", buf);    // Print server response
         if (strncmp(buf, "[OK]", 4) == 0) {
             ok = 1;  // Username accepted
+            compress_ok = want_compress && strstr(buf, "Compression: lz4") != NULL;
         }
     }
 
-    // 5) Register signal handlers so we can clean up on SIGINT or SIGTERM
+    // 5) Register signal handlers so we can clean up on SIGINT or SIGTERM. A write to a
+    //    closed connection (sendfile() has no MSG_NOSIGNAL) fails with EPIPE instead of killing
+    //    the client; the event loop reports the disconnection.
     signal(SIGINT, on_exit_signal);
     signal(SIGTERM, on_exit_signal);
+    signal(SIGPIPE, SIG_IGN);
 
     // 6) Enable raw mode for terminal input and initialize input handler
     ti_enable_raw_mode();
     ti_input_init(&ih, "> ");  // Prompt character is "> "
 
-    // 7) Launch a separate thread to handle incoming messages from server
-    pthread_t rt;
-    int *arg = malloc(sizeof *arg);
-    if (!arg) {
-        perror("malloc");
-        ti_draw_message(&ih, "[ERROR] Malloc error", INPUT_MESSAGE, COLOR_RED);
-        exit(1);
-    }
-    *arg = sockfd;  // Pass the socket descriptor to the thread
-    pthread_create(&rt, NULL, recv_thread, arg);
-    pthread_detach(rt);  // Detach the thread so its resources are freed on exit
-
-    // 8) Enter the main loop to read user keystrokes, build lines, and process commands
+    // 7) From here on the socket never blocks: the event loop reads keystrokes and server data
+    //    and sends queued output as each is ready
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
     ti_draw_prompt(&ih);
-    while (1) {
-        char c;
-        if (read(STDIN_FILENO, &c, 1) <= 0) break;  // Error or EOF
-
-        if (c == '\r' || c == '\n') {
-            // User pressed ENTER: terminate the input buffer and process the command
-            ih.buffer[ih.length] = '\0';
-
-            if (ih.length == 0) {
-                // Empty line: just redraw the prompt
-                ti_draw_newline();
-                ti_draw_prompt(&ih);
-            } else {
-                process_command(ih.buffer);
-            }
-            // Reset input buffer
-            ih.length = 0;
-            ih.buffer[0] = '\0';
-
-        } else if (c == 127 || c == 8) {
-            // Backspace or DEL: remove last character from buffer
-            ti_process_backspace(&ih);
-
-        } else {
-            // Regular character: add to buffer and update display
-            ti_process_char(&ih, c);
-        }
-    }
+    event_loop();
+    ti_flush();
 
     return 0;
 }
@@ -5,7 +5,8 @@
 #include <errno.h>   // For errno
 #include <stdlib.h>  // For malloc, free
 #include <unistd.h>  // For write, read, STDIN_FILENO
-#include <string.h>  // For strlen, memset
+#include <string.h>  // For strlen, memset, memcpy
+#include <time.h>    // For clock_gettime, to pace ti_refresh
 
 /*
  * --------------------------------------------------------------------------
@@ -20,6 +21,77 @@
  */
 static struct termios ti_orig_termios;
 
+// What of the edit line ti_settle still has to draw (see ti_frame)
+#define TI_REDRAW_NONE    0
+#define TI_REDRAW_PROMPT  1     // The prompt
+#define TI_REDRAW_BUFFER  2     // The prompt and what the user has typed
+
+/**
+ * ti_frame
+ *   Terminal output not yet written. Every drawing function appends to 'buf', and ti_flush
+ *   writes it with a single write(), which ti_refresh does at most once per TI_REFRESH_MS.
+ *   A message does not redraw the prompt and the user's line itself: it leaves that to
+ *   ti_settle ('redraw', for 'ih'), which runs once before anything else is drawn or the frame
+ *   is written. A burst of messages thus costs one prompt redraw and one write.
+ */
+static struct {
+    char                   buf[TI_FRAME_SIZE];
+    size_t                 len;
+    int                    redraw;      // TI_REDRAW_*
+    const TI_InputHandler *ih;
+    struct timespec        last;        // When the last frame was written
+} ti_frame;
+
+/**
+ * ti_write_all
+ *   Write 'len' bytes at 'data' to STDOUT, resuming after short writes.
+ */
+static void ti_write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len  -= (size_t)n;
+    }
+}
+
+/**
+ * ti_emit
+ *   Append 'len' bytes to the frame, writing the frame out first if they do not fit.
+ */
+static void ti_emit(const char *data, size_t len) {
+    if (ti_frame.len + len > TI_FRAME_SIZE) {
+        ti_write_all(ti_frame.buf, ti_frame.len);
+        ti_frame.len = 0;
+        if (len > TI_FRAME_SIZE) {
+            ti_write_all(data, len);
+            return;
+        }
+    }
+    memcpy(ti_frame.buf + ti_frame.len, data, len);
+    ti_frame.len += len;
+}
+
+/**
+ * ti_settle
+ *   Draw the prompt (and the user's line) that the last message left to redraw, if any.
+ */
+static void ti_settle(void) {
+    int redraw = ti_frame.redraw;
+    ti_frame.redraw = TI_REDRAW_NONE;
+    if (redraw != TI_REDRAW_NONE) {
+        ti_emit(ti_frame.ih->prompt, strlen(ti_frame.ih->prompt));
+    }
+    if (redraw == TI_REDRAW_BUFFER) {
+        ti_emit(ti_frame.ih->buffer, ti_frame.ih->length);
+    }
+}
+
 /* --------------------------------------------------------------------------
  * Raw mode management
  * --------------------------------------------------------------------------
@@ -119,7 +191,8 @@ void ti_input_cleanup(TI_InputHandler *ih) {
  * @param ih  Pointer to TI_InputHandler containing the prompt text.
  */
 void ti_draw_prompt(const TI_InputHandler *ih) {
-    write(STDOUT_FILENO, ih->prompt, strlen(ih->prompt));
+    ti_settle();
+    ti_emit(ih->prompt, strlen(ih->prompt));
 }
 
 /**
@@ -132,7 +205,8 @@ void ti_draw_prompt(const TI_InputHandler *ih) {
  * @param ih  Pointer to TI_InputHandler whose buffer will be written.
  */
 void ti_draw_buffer(const TI_InputHandler *ih) {
-    write(STDOUT_FILENO, ih->buffer, ih->length);
+    ti_settle();
+    ti_emit(ih->buffer, ih->length);
 }
 
 /**
@@ -142,7 +216,42 @@ void ti_draw_buffer(const TI_InputHandler *ih) {
  * one line before printing something else.
  */
 void ti_draw_newline(void) {
-    write(STDOUT_FILENO, "\n", 1);
+    ti_settle();
+    ti_emit("\n", 1);
+}
+
+/**
+ * ti_flush
+ *
+ * Finish the frame (ti_settle) and write it. Only async-signal-safe calls, so the exit signal
+ * handler can use it.
+ */
+void ti_flush(void) {
+    ti_settle();
+    ti_write_all(ti_frame.buf, ti_frame.len);
+    ti_frame.len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ti_frame.last);
+}
+
+/**
+ * ti_refresh
+ *
+ * Flush the frame if there is one and the last was written at least TI_REFRESH_MS ago: the
+ * first output after a quiet spell shows at once, a flood is drawn TI_REFRESH_MS at a time.
+ */
+int ti_refresh(void) {
+    if (ti_frame.len == 0 && ti_frame.redraw == TI_REDRAW_NONE) {
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (now.tv_sec - ti_frame.last.tv_sec) * 1000 +
+              (now.tv_nsec - ti_frame.last.tv_nsec) / 1000000;
+    if (ms < TI_REFRESH_MS) {
+        return (int)(TI_REFRESH_MS - ms);
+    }
+    ti_flush();
+    return -1;
 }
 
 /* --------------------------------------------------------------------------
@@ -158,7 +267,8 @@ void ti_draw_newline(void) {
  *       * Decrement ih->length.
  *       * Null-terminate ih->buffer at the new length.
  *       * Write "\b \b" to STDOUT, which moves the cursor back one, prints a space
- *         (erasing the character), and moves back again.
+ *         (erasing the character), and moves back again. If the line is still to be redrawn
+ *         after a message, the redraw shows the shorter line instead.
  *
  * @param ih  Pointer to TI_InputHandler whose buffer/state is updated.
  */
@@ -166,8 +276,13 @@ void ti_process_backspace(TI_InputHandler *ih) {
     if (ih->length > 0) {
         ih->length--;
         ih->buffer[ih->length] = '\0';
+        if (ti_frame.redraw == TI_REDRAW_BUFFER) {
+            ti_settle();
+            return;
+        }
         // Move cursor back, overwrite with space, move back again
-        write(STDOUT_FILENO, "\b \b", 3);
+        ti_settle();
+        ti_emit("\b \b", 3);
     }
 }
 
@@ -185,7 +300,8 @@ void ti_process_backspace(TI_InputHandler *ih) {
  *                     echo or store these three bytes in the input buffer.
  *
  *   - If we are not in the middle of an ESC sequence (esc_state == 0) and c is not the start of one,
- *     we append c to the input buffer (if there's space), null-terminate, and write c to STDOUT to echo.
+ *     we append c to the input buffer (if there's space), null-terminate, and write c to STDOUT to echo
+ *     (or let the pending redraw of the line after a message show it).
  *
  *   @param ih  Pointer to TI_InputHandler whose buffer/state is updated.
  *   @param c   Single character read from STDIN.
@@ -218,7 +334,12 @@ void ti_process_char(TI_InputHandler *ih, char c) {
     if (ih->length + 1 < TI_MAXLINE) {
         ih->buffer[ih->length++] = c;
         ih->buffer[ih->length] = '\0';
-        write(STDOUT_FILENO, &c, 1);
+        if (ti_frame.redraw == TI_REDRAW_BUFFER) {
+            ti_settle();
+            return;
+        }
+        ti_settle();
+        ti_emit(&c, 1);
     }
 }
 
@@ -239,16 +360,13 @@ void ti_process_char(TI_InputHandler *ih, char c) {
  *   2. If messageType == INPUT_MESSAGE, first call ti_draw_newline() to ensure we are on a fresh line.
  *   3. Write "\r\033[K" to STDOUT to move the cursor to the beginning of the line (carriage return)
  *      and then send the ANSI code "\033[K" to clear from cursor to end of line.
- *   4. Choose a color based on messageType:
- *        – SERVER_MESSAGE: green
- *        – EXIT_MESSAGE:   red
- *        – INPUT_MESSAGE:  default (no color)
- *   5. Write the chosen color code.
- *   6. Write the actual message text (`msg`) to STDOUT.
- *   7. Write COLOR_RESET to restore normal color.
- *   8. If messageType != EXIT_MESSAGE, redraw the prompt by calling ti_draw_prompt(ih).
- *   9. If messageType == SERVER_MESSAGE, also reprint whatever the user had typed so far (ti_draw_buffer(ih)).
- *  10. Unlock ih->mutex.
+ *   4. Write the color code, the message text (`msg`) and COLOR_RESET.
+ *   5. If messageType != EXIT_MESSAGE, leave the prompt to be redrawn by ti_settle; for a
+ *      SERVER_MESSAGE, whatever the user had typed so far too. A message that follows before
+ *      anything else is drawn replaces that redraw, so a burst of messages redraws the line once.
+ *   6. Unlock ih->mutex.
+ *
+ * All of it goes into the frame (see ti_frame); nothing reaches the terminal before ti_flush.
  *
  * @param ih            Pointer to TI_InputHandler used for locking, prompt, and buffer.
  * @param msg           Null-terminated message to display (newline may be included if desired).
@@ -266,24 +384,18 @@ void ti_draw_message(TI_InputHandler *ih, const char *msg, int messageType, char
     }
 
     // Move cursor to start of line and clear to end of line
-    write(STDOUT_FILENO, "\r\033[K", sizeof("\r\033[K") - 1);
-
-    // Choose color based on message type
+    ti_emit("\r\033[K", sizeof("\r\033[K") - 1);
 
     // Print the color code, the message, then reset
-    write(STDOUT_FILENO, color_code, strlen(color_code)+1);
-    write(STDOUT_FILENO, msg, strlen(msg));
-    write(STDOUT_FILENO, COLOR_RESET, strlen(COLOR_RESET)+1);
+    ti_emit(color_code, strlen(color_code));
+    ti_emit(msg, strlen(msg));
+    ti_emit(COLOR_RESET, strlen(COLOR_RESET));
 
-    if (messageType != EXIT_MESSAGE) {
-        // Redraw the prompt since we haven't exited
-        ti_draw_prompt(ih);
-    }
-
-    if (messageType == SERVER_MESSAGE) {
-        // If this is a server message, reprint whatever the user typed so far
-        ti_draw_buffer(ih);
-    }
+    // Redraw the prompt (and for a server message, whatever the user typed so far) once the
+    // messages of this frame are out, unless we have exited
+    ti_frame.ih     = ih;
+    ti_frame.redraw = messageType == EXIT_MESSAGE   ? TI_REDRAW_NONE :
+                      messageType == SERVER_MESSAGE ? TI_REDRAW_BUFFER : TI_REDRAW_PROMPT;
 
     pthread_mutex_unlock(&ih->mutex);
 }
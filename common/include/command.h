@@ -0,0 +1,125 @@
+/* command.h */
+
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>     // For size_t
+
+// Most whitespace-separated arguments any command takes (including an optional one)
+#define CMD_MAX_WORDS   5
+
+// Slots in the command hash table (a power of two)
+#define CMD_TABLE_SIZE  32
+
+/**
+ * CMD_HASH
+ *   Perfect hash of a command name: its second character plus its length. Every command in
+ *   the table lands in its own slot; command.c is built with -Woverride-init (part of
+ *   -Wextra), so a new command that collides with an existing one is a compile-time warning.
+ */
+#define CMD_HASH(c1, len)  (((unsigned)(unsigned char)(c1) + (unsigned)(len)) & (CMD_TABLE_SIZE - 1))
+
+/**
+ * cmd_id_t
+ *   Every command either side understands. Server and client each keep an array of handler
+ *   functions indexed by this id.
+ */
+typedef enum {
+    CMD_EXIT,
+    CMD_WHISPER,
+    CMD_JOIN,
+    CMD_LEAVE,
+    CMD_BROADCAST,
+    CMD_SENDFILE,
+    CMD_CHUNK,
+    CMD_ZCHUNK,
+    CMD_FILEACK,
+    CMD_USAGE,
+    CMD_COUNT
+} cmd_id_t;
+
+/**
+ * cmd_rest_t
+ *   What may follow a command's words on its line.
+ *   - CMD_REST_IGNORE:  Anything; it is ignored
+ *   - CMD_REST_NONE:    Nothing; extra words are a usage error
+ *   - CMD_REST_TEXT:    Free text up to the newline, required (e.g. a chat message)
+ *   - CMD_REST_WORD:    One more, optional word (stored in argv and counted in argc); anything
+ *                       after it is ignored
+ */
+typedef enum {
+    CMD_REST_IGNORE,
+    CMD_REST_NONE,
+    CMD_REST_TEXT,
+    CMD_REST_WORD
+} cmd_rest_t;
+
+/**
+ * cmd_args_t
+ *   Argument spec of a command.
+ *   - words:  Number of required whitespace-separated arguments
+ *   - rest:   What may follow them (see cmd_rest_t)
+ */
+typedef struct {
+    unsigned char words;
+    cmd_rest_t    rest;
+} cmd_args_t;
+
+/**
+ * command_t
+ *   One entry of the command table.
+ *   - name:   The command as typed, including the leading '/'
+ *   - len:    strlen(name)
+ *   - id:     Index into the handler arrays
+ *   - wire:   Arguments as sent to the server
+ *   - input:  Arguments as typed into the client (differs from 'wire' where the client adds
+ *             fields, e.g. the file size of /sendfile)
+ *   - local:  1 if the client handles the command itself and never sends it
+ */
+typedef struct {
+    const char    *name;
+    unsigned char  len;
+    cmd_id_t       id;
+    cmd_args_t     wire;
+    cmd_args_t     input;
+    int            local;
+} command_t;
+
+/**
+ * cmd_line_t
+ *   A parsed command line. All pointers point into the (modified) line.
+ *   - cmd:    The command, or NULL if the first token is not one
+ *   - token:  The first token as typed, or NULL for an empty line
+ *   - argv:   The first 'argc' words after the command
+ *   - argc:   Number of words found (at most the spec's count, plus one for CMD_REST_WORD)
+ *   - text:   The free text of a CMD_REST_TEXT command, or NULL if there is none
+ */
+typedef struct {
+    const command_t *cmd;
+    char            *token;
+    char            *argv[CMD_MAX_WORDS];
+    int              argc;
+    char            *text;
+} cmd_line_t;
+
+/**
+ * command_lookup
+ *   Find the command named by the 'len' bytes at 'name' with one hash and one compare.
+ *   Returns NULL if there is no such command.
+ */
+const command_t *command_lookup(const char *name, size_t len);
+
+/**
+ * command_parse
+ *   Split the first line of the 'len' bytes at 'line' (up to '\n' or the end) in place: the
+ *   command token and the words after it are NUL-terminated where they end, the text of a
+ *   CMD_REST_TEXT command runs to the end of the line. line[len] must be writable (normally
+ *   the string's NUL) for a line without '\n'. 'wire' selects which spec of the command is
+ *   applied. Unlike strtok this keeps no hidden state, so any number of threads may parse at
+ *   once.
+ *   Returns 0 if the line is a known command whose arguments match the spec, -1 otherwise
+ *   (out->cmd is NULL for an unknown command; the words found so far are filled in either way).
+ */
+int command_parse(char *line, size_t len, int wire, cmd_line_t *out);
+
+#endif /* COMMAND_H */
@@ -0,0 +1,31 @@
+/* crc32c.h */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>     // For size_t
+#include <stdint.h>     // For uint32_t
+
+/*
+ * CRC32C (Castagnoli) checksums of file transfers, computed the same way by client and server.
+ *
+ * On x86-64 the SSE4.2 crc32 instruction is used when the CPU has it (checked once at
+ * start-up), on AArch64 builds with the CRC extension the ARMv8 crc32c instructions; other
+ * targets, and builds made with `make SIMD=0`, use a slicing-by-8 table. All variants give the
+ * same results.
+ */
+
+/**
+ * crc32c_update
+ *   Extend 'crc', the CRC32C of some bytes (0 for none), by the 'n' bytes at 'data'.
+ *   crc32c_update(crc32c_update(0, a, n), b, m) is the CRC32C of a followed by b.
+ */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t n);
+
+/**
+ * crc32c_impl_name
+ *   "sse4.2", "armv8" or "table": the implementation in use, for the start-up log.
+ */
+const char *crc32c_impl_name(void);
+
+#endif /* CRC32C_H */
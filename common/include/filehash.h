@@ -0,0 +1,74 @@
+/* filehash.h */
+
+#ifndef FILEHASH_H
+#define FILEHASH_H
+
+#include <stddef.h>     // For size_t
+#include <stdint.h>     // For uint8_t, uint32_t, uint64_t
+
+/*
+ * Content hashes of transferred files, computed the same way by client and server.
+ *
+ * fh_fast64 (XXH64) runs at memory speed and is what the server's file cache is indexed by;
+ * SHA-256 is only computed to confirm that two files with the same fast hash really are the
+ * same. A client offers both as one "<xxh64>:<sha256>" hex token.
+ */
+
+// Length of a formatted digest: 16 hex digits, ':', 64 hex digits (without the NUL)
+#define FH_DIGEST_HEX_LEN (16 + 1 + 64)
+
+/**
+ * file_digest_t
+ *   Both hashes of one file.
+ *   - fast:    XXH64 (seed 0) of the content
+ *   - sha256:  SHA-256 of the content
+ */
+typedef struct {
+    uint64_t fast;
+    uint8_t  sha256[32];
+} file_digest_t;
+
+/**
+ * sha256_ctx_t
+ *   Running state of a SHA-256 computation.
+ */
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;        // Bytes hashed so far
+    uint8_t  block[64];     // Pending bytes of the current block
+    size_t   used;          // How many of them are filled
+} sha256_ctx_t;
+
+/**
+ * fh_fast64
+ *   XXH64 of the 'n' bytes at 'data' (seed 0).
+ */
+uint64_t fh_fast64(const void *data, size_t n);
+
+/**
+ * sha256_init / sha256_update / sha256_final
+ *   Hash a message given in any number of pieces; sha256_final stores the 32-byte digest.
+ */
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t n);
+void sha256_final(sha256_ctx_t *ctx, uint8_t out[32]);
+
+/**
+ * fh_sha256
+ *   SHA-256 of the 'n' bytes at 'data' in one call.
+ */
+void fh_sha256(const void *data, size_t n, uint8_t out[32]);
+
+/**
+ * fh_digest_format
+ *   Write 'd' as "<xxh64>:<sha256>" in lowercase hex, NUL-terminated, into 'out'.
+ */
+void fh_digest_format(const file_digest_t *d, char out[FH_DIGEST_HEX_LEN + 1]);
+
+/**
+ * fh_digest_parse
+ *   Read a "<xxh64>:<sha256>" token into *d. Returns 0 on success, -1 if it is malformed.
+ */
+int fh_digest_parse(const char *s, file_digest_t *d);
+
+#endif /* FILEHASH_H */
@@ -0,0 +1,108 @@
+/* lz4block.h */
+
+#ifndef LZ4BLOCK_H
+#define LZ4BLOCK_H
+
+#include <stddef.h>     // For size_t
+#include <stdint.h>     // For uint32_t
+
+/*
+ * LZ4 block-format compression of file pieces and chat output, used the same way by client
+ * and server (a small self-contained codec: no liblz4 needed).
+ *
+ * A block is a sequence of LZ4 sequences (literals plus a back-reference of at most
+ * LZ4_WINDOW bytes), decodable by any LZ4 block decoder. File pieces are independent blocks.
+ * Chat output is a stream (lz4_stream_t): every block may refer back into the text of the
+ * blocks before it, which is what makes short, repetitive chat lines compress.
+ */
+
+// Farthest a back-reference reaches
+#define LZ4_WINDOW      65535
+
+// Largest block the stream functions take (raw bytes)
+#define LZ4_BLOCK_MAX   (64 * 1024)
+
+// Worst-case compressed size of 'n' raw bytes
+#define LZ4_BOUND(n)    ((n) + (n) / 255 + 16)
+
+// Entries of the match-finder hash table (see lz4_compress)
+#define LZ4_TABLE_SIZE  4096
+
+// Sampled entropy (bits per byte, times 256) from which data is not worth compressing: typical
+// of JPEG, PNG, PDF streams and anything else that is already compressed or encrypted
+#define LZ4_INCOMPRESSIBLE_Q8 (7 * 256 + 128)
+
+/**
+ * lz4_stream_t
+ *
+ * One direction of a compressed stream: the raw text of the recent blocks, which later blocks
+ * refer back to. The encoder and the decoder of a stream hold the same bytes.
+ * - buf:    Window plus room for one block (LZ4_WINDOW + 1 + LZ4_BLOCK_MAX bytes)
+ * - len:    Bytes of history in 'buf'
+ * - table:  Match finder (encoder only, NULL for a decoder)
+ */
+typedef struct {
+    char     *buf;
+    size_t    len;
+    uint32_t *table;
+} lz4_stream_t;
+
+/**
+ * lz4_compress
+ *   Compress base[start, end) into 'dst' ('cap' bytes). Back-references may reach into
+ *   base[0, start) (at most LZ4_WINDOW back). 'table' holds LZ4_TABLE_SIZE positions in
+ *   'base' (plus one; 0 is empty): zero it for an independent block, keep it for a stream.
+ *   Returns the compressed size, or 0 if it does not fit in 'cap'.
+ */
+size_t lz4_compress(const char *base, size_t start, size_t end, char *dst, size_t cap,
+                    uint32_t *table);
+
+/**
+ * lz4_decompress
+ *   Decode the 'n' bytes at 'src' into exactly 'len' bytes at base + start. Back-references
+ *   may reach into base[0, start), never before 'base'. Returns 0, or -1 if the block is
+ *   malformed or does not decode to exactly 'len' bytes (nothing outside base[0, start + len)
+ *   is written or read either way).
+ */
+int lz4_decompress(const char *src, size_t n, char *base, size_t start, size_t len);
+
+/**
+ * lz4_stream_init / lz4_stream_free
+ *   Set up an empty stream, with a match finder if 'encoder' (returns 0, or -1 if memory runs
+ *   out), or free one. Freeing a zeroed stream is harmless.
+ */
+int  lz4_stream_init(lz4_stream_t *s, int encoder);
+void lz4_stream_free(lz4_stream_t *s);
+
+/**
+ * lz4_stream_reserve
+ *   Make room for 'n' (at most LZ4_BLOCK_MAX) raw bytes at the end of the history, sliding
+ *   old history out as needed. Returns where the encoder copies them before
+ *   lz4_stream_compress.
+ */
+char *lz4_stream_reserve(lz4_stream_t *s, size_t n);
+
+/**
+ * lz4_stream_compress
+ *   Compress the 'n' bytes just copied to lz4_stream_reserve's pointer into 'dst' ('cap'
+ *   bytes) and add them to the history. Returns the compressed size, or 0 if it does not fit
+ *   'cap'; the bytes are then left out of the history, and the caller sends them raw.
+ */
+size_t lz4_stream_compress(lz4_stream_t *s, size_t n, char *dst, size_t cap);
+
+/**
+ * lz4_stream_decompress
+ *   Decode the 'n' bytes at 'src', a block of 'len' (at most LZ4_BLOCK_MAX) raw bytes, and add
+ *   them to the history. Returns the decoded bytes (inside the history: valid until the next
+ *   call, not to be modified), or NULL if the block is malformed.
+ */
+const char *lz4_stream_decompress(lz4_stream_t *s, const char *src, size_t n, size_t len);
+
+/**
+ * lz4_entropy_q8
+ *   Estimated entropy of the 'n' bytes at 'data' in bits per byte, times 256, from a sample of
+ *   at most 4 KiB spread over them. Compare with LZ4_INCOMPRESSIBLE_Q8.
+ */
+unsigned lz4_entropy_q8(const void *data, size_t n);
+
+#endif /* LZ4BLOCK_H */
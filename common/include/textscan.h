@@ -0,0 +1,49 @@
+/* textscan.h */
+
+#ifndef TEXTSCAN_H
+#define TEXTSCAN_H
+
+#include <stddef.h>     // For size_t
+
+/*
+ * Byte-scanning kernels used by the command parser and the name/message validators.
+ *
+ * On x86-64 each kernel looks at 32 bytes per step with AVX2 when the CPU has it (checked
+ * once at start-up) and at 16 bytes with SSE2 otherwise; other targets, and builds made with
+ * `make SIMD=0` (which defines CHAT_NO_SIMD), use the scalar loops. All variants give the
+ * same results, and none reads past s + n.
+ */
+
+/**
+ * ts_span_alnum
+ *   Length of the run of ASCII letters and digits [A-Za-z0-9] at the start of the 'n' bytes
+ *   at 's' (n if they all are).
+ */
+size_t ts_span_alnum(const char *s, size_t n);
+
+/**
+ * ts_find_newline
+ *   Index of the first '\n' in the 'n' bytes at 's', or n if there is none.
+ */
+size_t ts_find_newline(const char *s, size_t n);
+
+/**
+ * ts_find_delim
+ *   Index of the first word delimiter (' ', '\r' or '\n') in the 'n' bytes at 's', or n.
+ */
+size_t ts_find_delim(const char *s, size_t n);
+
+/**
+ * ts_utf8_valid
+ *   1 if the 'n' bytes at 's' are well-formed UTF-8 (no overlong forms, surrogates or code
+ *   points above U+10FFFF), 0 otherwise. Runs of ASCII are skipped a vector at a time.
+ */
+int ts_utf8_valid(const char *s, size_t n);
+
+/**
+ * ts_simd_name
+ *   "avx2", "sse2" or "scalar": the kernels in use, for the start-up log.
+ */
+const char *ts_simd_name(void);
+
+#endif /* TEXTSCAN_H */
@@ -0,0 +1,135 @@
+/* command.c */
+
+#include "command.h"
+#include "textscan.h"   // For ts_find_newline, ts_find_delim
+#include <string.h>     // For memcmp, memset
+
+/**
+ * COMMAND
+ *   Table entry for 'name', placed in its hash slot. 'c1' is name[1], spelled out because a
+ *   character of a string literal is not a constant expression in C.
+ */
+#define COMMAND(c1, name, id, wire_words, wire_rest, input_words, input_rest, local) \
+    [CMD_HASH(c1, sizeof(name) - 1)] = { name, sizeof(name) - 1, id,                  \
+                                         { wire_words, wire_rest },                   \
+                                         { input_words, input_rest }, local }
+
+/**
+ * command_table
+ *   All commands, indexed by CMD_HASH. Empty slots have name == NULL.
+ */
+static const command_t command_table[CMD_TABLE_SIZE] = {
+    COMMAND('e', "/exit",      CMD_EXIT,      0, CMD_REST_IGNORE, 0, CMD_REST_IGNORE, 0),
+    COMMAND('w', "/whisper",   CMD_WHISPER,   1, CMD_REST_TEXT,   1, CMD_REST_TEXT,   0),
+    COMMAND('j', "/join",      CMD_JOIN,      1, CMD_REST_NONE,   1, CMD_REST_NONE,   0),
+    COMMAND('l', "/leave",     CMD_LEAVE,     0, CMD_REST_IGNORE, 0, CMD_REST_IGNORE, 0),
+    COMMAND('b', "/broadcast", CMD_BROADCAST, 0, CMD_REST_TEXT,   0, CMD_REST_TEXT,   0),
+    COMMAND('s', "/sendfile",  CMD_SENDFILE,  3, CMD_REST_WORD,   2, CMD_REST_IGNORE, 0),
+    COMMAND('c', "/chunk",     CMD_CHUNK,     3, CMD_REST_WORD,   3, CMD_REST_IGNORE, 0),
+    COMMAND('z', "/zchunk",    CMD_ZCHUNK,    5, CMD_REST_IGNORE, 5, CMD_REST_IGNORE, 0),
+    COMMAND('f', "/fileack",   CMD_FILEACK,   2, CMD_REST_NONE,   2, CMD_REST_NONE,   0),
+    COMMAND('u', "/usage",     CMD_USAGE,     0, CMD_REST_IGNORE, 0, CMD_REST_IGNORE, 1),
+};
+
+/* ----------------------------------------------------------------------------
+ * Internal helpers
+ * ----------------------------------------------------------------------------
+ */
+
+// Word separators; the line itself ends at '\n' (or the end of the string)
+static int is_space(char c) {
+    return c == ' ' || c == '\r';
+}
+
+/**
+ * next_word
+ *   Skip separators at *p, NUL-terminate the word that follows and advance *p past it (and
+ *   past the one separator that ended it). Returns the word, or NULL if the line is used up.
+ */
+static char *next_word(char **p, char *end) {
+    char *s = *p;
+    while (s < end && is_space(*s)) {
+        s++;
+    }
+    if (s == end) {
+        *p = s;
+        return NULL;
+    }
+    char *word = s;
+    s += ts_find_delim(s, (size_t)(end - s));
+    if (s < end) {
+        *s++ = '\0';
+    }
+    *p = s;
+    return word;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public functions
+ * ----------------------------------------------------------------------------
+ */
+
+const command_t *command_lookup(const char *name, size_t len) {
+    if (len < 2) {
+        return NULL;
+    }
+    const command_t *c = &command_table[CMD_HASH(name[1], len)];
+    if (c->name && c->len == len && memcmp(c->name, name, len) == 0) {
+        return c;
+    }
+    return NULL;
+}
+
+/**
+ * command_parse
+ *
+ * Mirrors what the strtok-based parsers did: words are separated by runs of blanks, and the
+ * text of a CMD_REST_TEXT command starts right after the separator that ended the last word.
+ */
+int command_parse(char *line, size_t len, int wire, cmd_line_t *out) {
+    memset(out, 0, sizeof(*out));
+
+    char *end = line + ts_find_newline(line, len);
+    *end = '\0';
+
+    char *p = line;
+    out->token = next_word(&p, end);
+    if (!out->token) {
+        return -1;
+    }
+    out->cmd = command_lookup(out->token, strlen(out->token));
+    if (!out->cmd) {
+        return -1;
+    }
+
+    const cmd_args_t *spec = wire ? &out->cmd->wire : &out->cmd->input;
+    while (out->argc < spec->words) {
+        char *word = next_word(&p, end);
+        if (!word) {
+            return -1;
+        }
+        out->argv[out->argc++] = word;
+    }
+
+    switch (spec->rest) {
+    case CMD_REST_TEXT:
+        if (p == end) {
+            return -1;
+        }
+        out->text = p;
+        break;
+    case CMD_REST_NONE:
+        if (next_word(&p, end)) {
+            return -1;
+        }
+        break;
+    case CMD_REST_WORD:
+        if ((out->argv[out->argc] = next_word(&p, end)) != NULL) {
+            out->argc++;
+        }
+        break;
+    case CMD_REST_IGNORE:
+        break;
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+/* crc32c.c */
+
+#include "crc32c.h"
+#include <string.h>     // For memcpy
+
+#if defined(__x86_64__) && !defined(CHAT_NO_SIMD)
+#define CRC_X86 1
+#include <nmmintrin.h>  // For the SSE4.2 crc32 intrinsics
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32) && !defined(CHAT_NO_SIMD)
+#define CRC_ARM 1
+#include <arm_acle.h>   // For the ARMv8 crc32c intrinsics
+#endif
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78u
+
+/* ----------------------------------------------------------------------------
+ * Table kernel (slicing-by-8; the fallback everywhere)
+ * ----------------------------------------------------------------------------
+ */
+
+// crc_table[k][b]: CRC of byte b followed by k zero bytes; filled in before main() runs
+static uint32_t crc_table[8][256];
+
+__attribute__((constructor))
+static void crc_table_init(void) {
+    for (uint32_t b = 0; b < 256; ++b) {
+        uint32_t c = b;
+        for (int i = 0; i < 8; ++i) {
+            c = (c >> 1) ^ (CRC32C_POLY & (0u - (c & 1)));
+        }
+        crc_table[0][b] = c;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+        for (int k = 1; k < 8; ++k) {
+            uint32_t c = crc_table[k - 1][b];
+            crc_table[k][b] = (c >> 8) ^ crc_table[0][c & 0xFF];
+        }
+    }
+}
+
+static uint32_t crc_table_run(uint32_t c, const uint8_t *p, size_t n) {
+    while (n >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+            crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+            crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+            crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    while (n--) {
+        c = (c >> 8) ^ crc_table[0][(c ^ *p++) & 0xFF];
+    }
+    return c;
+}
+
+/* ----------------------------------------------------------------------------
+ * Hardware kernels (8 bytes per instruction)
+ * ----------------------------------------------------------------------------
+ */
+
+#if defined(CRC_X86)
+
+static __attribute__((target("sse4.2"))) uint32_t crc_hw_run(uint32_t c, const uint8_t *p, size_t n) {
+    uint64_t c64 = c;
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+        p += 8;
+        n -= 8;
+    }
+    c = (uint32_t)c64;
+    while (n--) {
+        c = _mm_crc32_u8(c, *p++);
+    }
+    return c;
+}
+
+// Set once before main() runs
+static int use_hw;
+
+__attribute__((constructor))
+static void crc_detect(void) {
+    __builtin_cpu_init();
+    use_hw = __builtin_cpu_supports("sse4.2");
+}
+
+#define CRC_RUN(c, p, n)  (use_hw ? crc_hw_run(c, p, n) : crc_table_run(c, p, n))
+#define CRC_HW_NAME       (use_hw ? "sse4.2" : "table")
+
+#elif defined(CRC_ARM)
+
+static uint32_t crc_hw_run(uint32_t c, const uint8_t *p, size_t n) {
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __crc32cd(c, v);
+        p += 8;
+        n -= 8;
+    }
+    while (n--) {
+        c = __crc32cb(c, *p++);
+    }
+    return c;
+}
+
+#define CRC_RUN(c, p, n)  crc_hw_run(c, p, n)
+#define CRC_HW_NAME       "armv8"
+
+#else
+
+#define CRC_RUN(c, p, n)  crc_table_run(c, p, n)
+#define CRC_HW_NAME       "table"
+
+#endif
+
+/* ----------------------------------------------------------------------------
+ * Public functions
+ * ----------------------------------------------------------------------------
+ */
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t n) {
+    return ~CRC_RUN(~crc, (const uint8_t *)data, n);
+}
+
+const char *crc32c_impl_name(void) {
+    return CRC_HW_NAME;
+}
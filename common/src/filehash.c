@@ -0,0 +1,273 @@
+/* filehash.c */
+
+#include "filehash.h"
+#include <string.h>     // For memcpy, strlen
+
+/* ----------------------------------------------------------------------------
+ * XXH64
+ * ----------------------------------------------------------------------------
+ */
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Little-endian loads; memcpy keeps them legal at any alignment
+static uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc  = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t fh_fast64(const void *data, size_t n) {
+    const uint8_t *p   = data;
+    const uint8_t *end = p + n;
+    uint64_t h;
+
+    // Four independent lanes over 32-byte stripes
+    if (n >= 32) {
+        uint64_t v1 = XXH_P1 + XXH_P2;
+        uint64_t v2 = XXH_P2;
+        uint64_t v3 = 0;
+        uint64_t v4 = 0 - XXH_P1;
+        const uint8_t *limit = end - 32;
+        do {
+            v1 = xxh_round(v1, load64(p));
+            v2 = xxh_round(v2, load64(p + 8));
+            v3 = xxh_round(v3, load64(p + 16));
+            v4 = xxh_round(v4, load64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = XXH_P5;
+    }
+    h += (uint64_t)n;
+
+    // The tail: 8, then 4, then 1 byte at a time
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, load64(p));
+        h  = rotl64(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)load32(p) * XXH_P1;
+        h  = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (uint64_t)(*p) * XXH_P5;
+        h  = rotl64(h, 11) * XXH_P1;
+        p++;
+    }
+
+    // Avalanche
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* ----------------------------------------------------------------------------
+ * SHA-256 (FIPS 180-4)
+ * ----------------------------------------------------------------------------
+ */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+/**
+ * sha256_block
+ *   Mix one 64-byte block into the state.
+ */
+static void sha256_block(uint32_t state[8], const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | (uint32_t)block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t s1  = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+        uint32_t ch  = (e & f) ^ (~e & g);
+        uint32_t t1  = h + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0  = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2  = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256_init(sha256_ctx_t *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, iv, sizeof iv);
+    ctx->length = 0;
+    ctx->used   = 0;
+}
+
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t n) {
+    const uint8_t *p = data;
+    ctx->length += n;
+
+    // Top up a partial block first
+    if (ctx->used > 0) {
+        size_t take = 64 - ctx->used < n ? 64 - ctx->used : n;
+        memcpy(ctx->block + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        n -= take;
+        if (ctx->used < 64) {
+            return;
+        }
+        sha256_block(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    // Whole blocks straight from the input
+    while (n >= 64) {
+        sha256_block(ctx->state, p);
+        p += 64;
+        n -= 64;
+    }
+    memcpy(ctx->block, p, n);
+    ctx->used = n;
+}
+
+void sha256_final(sha256_ctx_t *ctx, uint8_t out[32]) {
+    uint64_t bits = ctx->length * 8;
+
+    // Padding: 0x80, zeros up to 56 mod 64, then the message length in bits (big-endian)
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        sha256_block(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (int i = 0; i < 8; ++i) {
+        ctx->block[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    sha256_block(ctx->state, ctx->block);
+
+    for (int i = 0; i < 8; ++i) {
+        out[4 * i]     = (uint8_t)(ctx->state[i] >> 24);
+        out[4 * i + 1] = (uint8_t)(ctx->state[i] >> 16);
+        out[4 * i + 2] = (uint8_t)(ctx->state[i] >> 8);
+        out[4 * i + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+void fh_sha256(const void *data, size_t n, uint8_t out[32]) {
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, n);
+    sha256_final(&ctx, out);
+}
+
+/* ----------------------------------------------------------------------------
+ * Wire format
+ * ----------------------------------------------------------------------------
+ */
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void fh_digest_format(const file_digest_t *d, char out[FH_DIGEST_HEX_LEN + 1]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 16; ++i) {
+        out[i] = digits[(d->fast >> (60 - 4 * i)) & 0xf];
+    }
+    out[16] = ':';
+    for (int i = 0; i < 32; ++i) {
+        out[17 + 2 * i]     = digits[d->sha256[i] >> 4];
+        out[17 + 2 * i + 1] = digits[d->sha256[i] & 0xf];
+    }
+    out[FH_DIGEST_HEX_LEN] = '\0';
+}
+
+int fh_digest_parse(const char *s, file_digest_t *d) {
+    if (strlen(s) != FH_DIGEST_HEX_LEN || s[16] != ':') {
+        return -1;
+    }
+    uint64_t fast = 0;
+    for (int i = 0; i < 16; ++i) {
+        int v = hex_value(s[i]);
+        if (v < 0) {
+            return -1;
+        }
+        fast = fast << 4 | (uint64_t)v;
+    }
+    for (int i = 0; i < 32; ++i) {
+        int hi = hex_value(s[17 + 2 * i]);
+        int lo = hex_value(s[17 + 2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return -1;
+        }
+        d->sha256[i] = (uint8_t)(hi << 4 | lo);
+    }
+    d->fast = fast;
+    return 0;
+}
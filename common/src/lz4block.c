@@ -0,0 +1,318 @@
+/* lz4block.c */
+
+#include "lz4block.h"
+#include <stdlib.h>     // For malloc, calloc, free
+#include <string.h>     // For memcpy, memmove
+
+// Shortest match, and the block-end rules every LZ4 decoder relies on: the last match starts
+// at least MFLIMIT bytes before the end, and the last LASTLITERALS bytes are literals
+#define MINMATCH      4
+#define MFLIMIT       12
+#define LASTLITERALS  5
+
+// Bytes of a stream's buffer: the window plus one block
+#define STREAM_CAP    (LZ4_WINDOW + 1 + LZ4_BLOCK_MAX)
+
+// Entropy sample: SAMPLE_RUNS runs of SAMPLE_RUN bytes spread over the data
+#define SAMPLE_RUNS   16
+#define SAMPLE_RUN    256
+
+/* ----------------------------------------------------------------------------
+ * Internal helpers
+ * ----------------------------------------------------------------------------
+ */
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+// Multiplicative hash of four bytes into the table
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - 12);
+}
+
+/**
+ * put_len
+ *   Write the extension bytes of a literal or match length that did not fit its token nibble.
+ */
+static char *put_len(char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = (char)255;
+        len  -= 255;
+    }
+    *op++ = (char)len;
+    return op;
+}
+
+/**
+ * get_len
+ *   Add the extension bytes of a length whose nibble was 15 to *len. Returns -1 if the input
+ *   ends first.
+ */
+static int get_len(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+    unsigned s;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        s     = *(*ip)++;
+        *len += s;
+    } while (s == 255);
+    return 0;
+}
+
+/**
+ * emit
+ *   Append one sequence: 'lit' literals from 'src', then (if 'mlen' is non-zero) a match of
+ *   'mlen' bytes at distance 'off'. Returns the new output position, or NULL if it would pass
+ *   'oend'.
+ */
+static char *emit(char *op, char *oend, const char *src, size_t lit, size_t off, size_t mlen) {
+    size_t worst = 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+    if ((size_t)(oend - op) < worst) {
+        return NULL;
+    }
+    unsigned char *token = (unsigned char *)op++;
+    if (lit >= 15) {
+        *token = 15 << 4;
+        op = put_len(op, lit - 15);
+    } else {
+        *token = (unsigned char)(lit << 4);
+    }
+    memcpy(op, src, lit);
+    op += lit;
+    if (mlen == 0) {
+        return op;
+    }
+    *op++ = (char)(off & 0xFF);
+    *op++ = (char)(off >> 8);
+    size_t ml = mlen - MINMATCH;
+    if (ml >= 15) {
+        *token |= 15;
+        op = put_len(op, ml - 15);
+    } else {
+        *token |= (unsigned char)ml;
+    }
+    return op;
+}
+
+/**
+ * stream_slide
+ *   Make room for 'n' more bytes in a stream's buffer by dropping all but the last LZ4_WINDOW
+ *   bytes of history, and move the match finder's positions along.
+ */
+static void stream_slide(lz4_stream_t *s, size_t n) {
+    if (s->len + n <= STREAM_CAP) {
+        return;
+    }
+    size_t keep  = s->len < LZ4_WINDOW ? s->len : LZ4_WINDOW;
+    size_t shift = s->len - keep;
+    memmove(s->buf, s->buf + shift, keep);
+    s->len = keep;
+    if (s->table) {
+        for (size_t i = 0; i < LZ4_TABLE_SIZE; ++i) {
+            s->table[i] = s->table[i] > shift ? s->table[i] - (uint32_t)shift : 0;
+        }
+    }
+}
+
+/**
+ * log2_q8
+ *   log2(x) times 256 for x >= 1, with the mantissa interpolated linearly (off by at most
+ *   0.09 bits, plenty for a compressibility estimate).
+ */
+static uint32_t log2_q8(uint32_t x) {
+    unsigned e = 31u - (unsigned)__builtin_clz(x);
+    uint32_t frac = e >= 8 ? (x >> (e - 8)) & 0xFF : (x << (8 - e)) & 0xFF;
+    return (e << 8) + frac;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public functions
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * lz4_compress
+ *
+ * Greedy parsing with one candidate per hash slot, like the reference "fast" level. Runs
+ * without matches are skipped faster the longer they get, so incompressible input costs
+ * little more than a copy.
+ */
+size_t lz4_compress(const char *base, size_t start, size_t end, char *dst, size_t cap,
+                    uint32_t *table) {
+    char *op = dst, *oend = dst + cap;
+    size_t ip = start, anchor = start;
+
+    if (end - start > MFLIMIT) {
+        size_t limit     = end - MFLIMIT;
+        size_t match_end = end - LASTLITERALS;
+        while (ip < limit) {
+            uint32_t seq = read32(base + ip);
+            uint32_t h   = hash4(seq);
+            size_t ref   = table[h];
+            table[h] = (uint32_t)(ip + 1);
+            if (ref == 0 || ref - 1 >= ip || ip - (ref - 1) > LZ4_WINDOW ||
+                read32(base + ref - 1) != seq) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            ref -= 1;
+
+            // Extend the match backwards over pending literals, then forwards
+            while (ip > anchor && ref > 0 && base[ip - 1] == base[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            size_t len = MINMATCH;
+            while (ip + len < match_end && base[ip + len] == base[ref + len]) {
+                len++;
+            }
+
+            op = emit(op, oend, base + anchor, ip - anchor, ip - ref, len);
+            if (!op) {
+                return 0;
+            }
+            ip    += len;
+            anchor = ip;
+        }
+    }
+
+    op = emit(op, oend, base + anchor, end - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+int lz4_decompress(const char *src, size_t n, char *base, size_t start, size_t len) {
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + n;
+    size_t op = start, oend = start + len;
+
+    for (;;) {
+        if (ip >= iend) {
+            return -1;
+        }
+        unsigned token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15 && get_len(&ip, iend, &lit) < 0) {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < lit || oend - op < lit) {
+            return -1;
+        }
+        memcpy(base + op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) {
+            break;                  // The last sequence has no match
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_len(&ip, iend, &mlen) < 0) {
+            return -1;
+        }
+        mlen += MINMATCH;
+        if (off == 0 || off > op || oend - op < mlen) {
+            return -1;
+        }
+        char *d = base + op;
+        const char *m = d - off;
+        if (off >= mlen) {
+            memcpy(d, m, mlen);
+        } else {
+            for (size_t i = 0; i < mlen; ++i) {
+                d[i] = m[i];        // Overlapping: repeats the last 'off' bytes
+            }
+        }
+        op += mlen;
+    }
+    return op == oend ? 0 : -1;
+}
+
+int lz4_stream_init(lz4_stream_t *s, int encoder) {
+    s->len   = 0;
+    s->buf   = malloc(STREAM_CAP);
+    s->table = encoder ? calloc(LZ4_TABLE_SIZE, sizeof(*s->table)) : NULL;
+    if (!s->buf || (encoder && !s->table)) {
+        lz4_stream_free(s);
+        return -1;
+    }
+    return 0;
+}
+
+void lz4_stream_free(lz4_stream_t *s) {
+    free(s->buf);
+    free(s->table);
+    s->buf   = NULL;
+    s->table = NULL;
+    s->len   = 0;
+}
+
+char *lz4_stream_reserve(lz4_stream_t *s, size_t n) {
+    stream_slide(s, n);
+    return s->buf + s->len;
+}
+
+size_t lz4_stream_compress(lz4_stream_t *s, size_t n, char *dst, size_t cap) {
+    size_t z = lz4_compress(s->buf, s->len, s->len + n, dst, cap, s->table);
+    if (z) {
+        s->len += n;
+    }
+    return z;
+}
+
+const char *lz4_stream_decompress(lz4_stream_t *s, const char *src, size_t n, size_t len) {
+    if (len == 0 || len > LZ4_BLOCK_MAX) {
+        return NULL;
+    }
+    stream_slide(s, len);
+    if (lz4_decompress(src, n, s->buf, s->len, len) < 0) {
+        return NULL;
+    }
+    const char *out = s->buf + s->len;
+    s->len += len;
+    return out;
+}
+
+/**
+ * lz4_entropy_q8
+ *
+ * H = log2(N) - (1/N) * sum(c * log2(c)) over the byte counts c of an N-byte sample.
+ */
+unsigned lz4_entropy_q8(const void *data, size_t n) {
+    const unsigned char *p = data;
+    uint32_t count[256] = { 0 };
+    size_t sample = 0;
+
+    if (n <= SAMPLE_RUNS * SAMPLE_RUN) {
+        for (size_t i = 0; i < n; ++i) {
+            count[p[i]]++;
+        }
+        sample = n;
+    } else {
+        for (size_t r = 0; r < SAMPLE_RUNS; ++r) {
+            const unsigned char *run = p + r * (n - SAMPLE_RUN) / (SAMPLE_RUNS - 1);
+            for (size_t i = 0; i < SAMPLE_RUN; ++i) {
+                count[run[i]]++;
+            }
+        }
+        sample = SAMPLE_RUNS * SAMPLE_RUN;
+    }
+    if (sample == 0) {
+        return 0;
+    }
+
+    uint64_t acc = 0;
+    for (size_t b = 0; b < 256; ++b) {
+        if (count[b]) {
+            acc += (uint64_t)count[b] * log2_q8(count[b]);
+        }
+    }
+    return (unsigned)(log2_q8((uint32_t)sample) - acc / sample);
+}
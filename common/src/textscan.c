@@ -0,0 +1,282 @@
+/* textscan.c */
+
+#include "textscan.h"
+
+#if defined(__x86_64__) && !defined(CHAT_NO_SIMD)
+#define TS_X86 1
+#include <immintrin.h>  // For the SSE2 and AVX2 intrinsics
+#endif
+
+/* ----------------------------------------------------------------------------
+ * Scalar kernels (tails of the vector loops, and the whole job without SIMD)
+ * ----------------------------------------------------------------------------
+ */
+
+static int is_alnum_byte(unsigned char c) {
+    return (unsigned)(c - '0') < 10 || (unsigned)((c | 0x20) - 'a') < 26;
+}
+
+static int is_delim_byte(unsigned char c) {
+    return c == ' ' || c == '\r' || c == '\n';
+}
+
+static size_t span_alnum_scalar(const char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && is_alnum_byte((unsigned char)s[i])) {
+        i++;
+    }
+    return i;
+}
+
+static size_t find_newline_scalar(const char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && s[i] != '\n') {
+        i++;
+    }
+    return i;
+}
+
+static size_t find_delim_scalar(const char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && !is_delim_byte((unsigned char)s[i])) {
+        i++;
+    }
+    return i;
+}
+
+static size_t span_ascii_scalar(const char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && !((unsigned char)s[i] & 0x80)) {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * utf8_seq_len
+ *   Length of the well-formed multi-byte UTF-8 sequence at 's' (at most 'n' bytes available),
+ *   or 0 if it is malformed, overlong, a surrogate or beyond U+10FFFF.
+ */
+static size_t utf8_seq_len(const unsigned char *s, size_t n) {
+    unsigned char c = s[0];
+    size_t len;
+    unsigned char lo = 0x80, hi = 0xBF;     // Allowed range of the second byte
+
+    if (c >= 0xC2 && c <= 0xDF) {
+        len = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3;
+        if (c == 0xE0) lo = 0xA0;           // Overlong
+        if (c == 0xED) hi = 0x9F;           // Surrogates
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4;
+        if (c == 0xF0) lo = 0x90;           // Overlong
+        if (c == 0xF4) hi = 0x8F;           // Above U+10FFFF
+    } else {
+        return 0;
+    }
+
+    if (n < len || s[1] < lo || s[1] > hi) {
+        return 0;
+    }
+    for (size_t i = 2; i < len; ++i) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    return len;
+}
+
+#ifdef TS_X86
+
+/* ----------------------------------------------------------------------------
+ * SSE2 kernels (16 bytes per step; always available on x86-64)
+ * ----------------------------------------------------------------------------
+ */
+
+// Bit i set if byte i of 'v' is an ASCII letter or digit. Bytes >= 0x80 compare as negative
+// and so fall outside every range.
+static inline unsigned alnum_mask_sse2(__m128i v) {
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i low   = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(low, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(low, _mm_set1_epi8('z' + 1)));
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(digit, alpha));
+}
+
+static size_t span_alnum_sse2(const char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        unsigned m = alnum_mask_sse2(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (m != 0xFFFF) {
+            return i + (size_t)__builtin_ctz(~m);
+        }
+    }
+    return i + span_alnum_scalar(s + i, n - i);
+}
+
+static size_t find_newline_sse2(const char *s, size_t n) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (m) {
+            return i + (size_t)__builtin_ctz(m);
+        }
+    }
+    return i + find_newline_scalar(s + i, n - i);
+}
+
+static size_t find_delim_sse2(const char *s, size_t n) {
+    const __m128i sp = _mm_set1_epi8(' '), cr = _mm_set1_epi8('\r'), nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, cr)),
+                                   _mm_cmpeq_epi8(v, nl));
+        unsigned m = (unsigned)_mm_movemask_epi8(hit);
+        if (m) {
+            return i + (size_t)__builtin_ctz(m);
+        }
+    }
+    return i + find_delim_scalar(s + i, n - i);
+}
+
+static size_t span_ascii_sse2(const char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (m) {
+            return i + (size_t)__builtin_ctz(m);
+        }
+    }
+    return i + span_ascii_scalar(s + i, n - i);
+}
+
+/* ----------------------------------------------------------------------------
+ * AVX2 kernels (32 bytes per step; used when the CPU supports AVX2)
+ * ----------------------------------------------------------------------------
+ */
+
+#define TS_AVX2 __attribute__((target("avx2")))
+
+static inline TS_AVX2 unsigned alnum_mask_avx2(__m256i v) {
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    __m256i low   = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(low, _mm256_set1_epi8('a' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), low));
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(digit, alpha));
+}
+
+static TS_AVX2 size_t span_alnum_avx2(const char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        unsigned m = alnum_mask_avx2(_mm256_loadu_si256((const __m256i *)(s + i)));
+        if (m != 0xFFFFFFFFu) {
+            return i + (size_t)__builtin_ctz(~m);
+        }
+    }
+    return i + span_alnum_sse2(s + i, n - i);
+}
+
+static TS_AVX2 size_t find_newline_avx2(const char *s, size_t n) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (m) {
+            return i + (size_t)__builtin_ctz(m);
+        }
+    }
+    return i + find_newline_sse2(s + i, n - i);
+}
+
+static TS_AVX2 size_t find_delim_avx2(const char *s, size_t n) {
+    const __m256i sp = _mm256_set1_epi8(' '), cr = _mm256_set1_epi8('\r'), nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+                                                      _mm256_cmpeq_epi8(v, cr)),
+                                      _mm256_cmpeq_epi8(v, nl));
+        unsigned m = (unsigned)_mm256_movemask_epi8(hit);
+        if (m) {
+            return i + (size_t)__builtin_ctz(m);
+        }
+    }
+    return i + find_delim_sse2(s + i, n - i);
+}
+
+static TS_AVX2 size_t span_ascii_avx2(const char *s, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)));
+        if (m) {
+            return i + (size_t)__builtin_ctz(m);
+        }
+    }
+    return i + span_ascii_sse2(s + i, n - i);
+}
+
+// Set once before main() runs
+static int use_avx2;
+
+__attribute__((constructor))
+static void ts_detect(void) {
+    __builtin_cpu_init();
+    use_avx2 = __builtin_cpu_supports("avx2");
+}
+
+#define TS_DISPATCH(kernel, ...) \
+    (use_avx2 ? kernel##_avx2(__VA_ARGS__) : kernel##_sse2(__VA_ARGS__))
+
+#else
+
+#define TS_DISPATCH(kernel, ...) kernel##_scalar(__VA_ARGS__)
+
+#endif /* TS_X86 */
+
+/* ----------------------------------------------------------------------------
+ * Public functions
+ * ----------------------------------------------------------------------------
+ */
+
+size_t ts_span_alnum(const char *s, size_t n) {
+    return TS_DISPATCH(span_alnum, s, n);
+}
+
+size_t ts_find_newline(const char *s, size_t n) {
+    return TS_DISPATCH(find_newline, s, n);
+}
+
+size_t ts_find_delim(const char *s, size_t n) {
+    return TS_DISPATCH(find_delim, s, n);
+}
+
+int ts_utf8_valid(const char *s, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        i += TS_DISPATCH(span_ascii, s + i, n - i);
+        if (i == n) {
+            break;
+        }
+        size_t len = utf8_seq_len((const unsigned char *)s + i, n - i);
+        if (len == 0) {
+            return 0;
+        }
+        i += len;
+    }
+    return 1;
+}
+
+const char *ts_simd_name(void) {
+#ifdef TS_X86
+    return use_avx2 ? "avx2" : "sse2";
+#else
+    return "scalar";
+#endif
+}
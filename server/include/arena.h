@@ -0,0 +1,90 @@
+/* arena.h */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>     // For size_t
+#include <stdarg.h>     // For va_list
+
+/**
+ * arena_t
+ *
+ * A bump allocator over one fixed block. Allocation only moves 'used' forward and
+ * everything is released at once by arena_reset, so short-lived strings (replies and log
+ * lines for one command) cost neither malloc nor stack space. An arena is used by one
+ * thread at a time.
+ * - base:  The block, NULL until arena_init succeeded
+ * - size:  Size of the block
+ * - used:  Bytes handed out since the last reset
+ */
+typedef struct {
+    char   *base;
+    size_t  size;
+    size_t  used;
+} arena_t;
+
+/**
+ * strbuf_t
+ *
+ * String builder writing into the free tail of an arena. While a builder is open, nothing
+ * else may be allocated from that arena; sb_end commits the string. Output that does not
+ * fit is truncated (like snprintf), and the result is always NUL-terminated.
+ * - arena:  The arena the string is built in
+ * - data:   Start of the string
+ * - len:    Current length, excluding the terminating NUL
+ * - cap:    Bytes available at 'data', including room for the terminating NUL
+ */
+typedef struct {
+    arena_t *arena;
+    char    *data;
+    size_t   len;
+    size_t   cap;
+} strbuf_t;
+
+/**
+ * arena_init
+ *   Allocate an arena block of 'size' bytes (returns 0, or -1 if memory runs out). An existing
+ *   block that is already at least 'size' bytes is kept, so an arena embedded in a pooled
+ *   object allocates only the first time it is used.
+ */
+int arena_init(arena_t *a, size_t size);
+
+/**
+ * arena_reset
+ *   Release everything allocated from the arena.
+ */
+void arena_reset(arena_t *a);
+
+/**
+ * arena_alloc
+ *   Return 'n' bytes (8-byte aligned) from the arena, or NULL if it is exhausted.
+ */
+void *arena_alloc(arena_t *a, size_t n);
+
+/**
+ * sb_start / sb_end
+ *   Open a builder over the arena's free space, and close it: the string is NUL-terminated,
+ *   its bytes are committed to the arena and it is returned (valid until the next reset).
+ */
+void        sb_start(strbuf_t *sb, arena_t *a);
+const char *sb_end(strbuf_t *sb);
+
+/**
+ * sb_put / sb_puts / sb_putc / sb_printf / sb_vprintf
+ *   Append 'n' bytes, a C string, one character, or printf-style formatted text.
+ */
+void sb_put(strbuf_t *sb, const char *s, size_t n);
+void sb_puts(strbuf_t *sb, const char *s);
+void sb_putc(strbuf_t *sb, char c);
+void sb_printf(strbuf_t *sb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void sb_vprintf(strbuf_t *sb, const char *fmt, va_list ap);
+
+/**
+ * sb_cat / sb_vcat
+ *   Append a NULL-terminated list of C strings. Nothing is parsed, so this is the cheap way to
+ *   join precomputed prefixes and arguments.
+ */
+void sb_cat(strbuf_t *sb, ...) __attribute__((sentinel));
+void sb_vcat(strbuf_t *sb, va_list ap);
+
+#endif /* ARENA_H */
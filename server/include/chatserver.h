@@ -2,30 +2,67 @@
 #define SERVER_H
 
 #include <pthread.h>    // For pthread_t, pthread_mutex_t, pthread_cond_t
+#include <stdatomic.h>  // For the connection and snapshot reference counts
+#include "config.h"     // For server_config (runtime limits)
+#include "trace.h"      // For trace_stamp_t (delivery latency tracing)
+#include "outbox.h"     // For outbox_t (bounded per-connection outbound queue)
+#include "io_engine.h"  // For conn_io_t (select or io_uring socket I/O)
+#include "arena.h"      // For arena_t (per-connection scratch memory)
+#include "pool.h"       // For pool_id_t (connection ids)
 
-// Maximum number of simultaneous client connections the server can track
-#define MAX_CONN        256
+// Default maximum number of simultaneous client connections (see server_config.max_conn)
+#define DEFAULT_MAX_CONN          256
 
 // Maximum length of a username (including terminating null byte)
 #define USERNAME_LEN    16
 
-// Size of internal I/O buffers (for both control messages and file transfers)
+// Size of the stack buffers used to format log lines and short replies
 #define BUF_SIZE        4096
 
+// Size of a connection's interned log prefix: "[THREAD-INFO (TID: <tid>)] User '<username>'"
+#define LOG_PREFIX_LEN  64
+
+// Size of a connection's interned chat prefix: "[<username>] "
+#define CHAT_PREFIX_LEN (USERNAME_LEN + 3)
+
+// Default size of each client handler's receive/relay buffer (see server_config.buf_size)
+#define DEFAULT_BUF_SIZE          4096
+
 // Default port number if none is supplied to the server program
 #define PORT            8080
 
 // Maximum length of a chat room name (including terminating null byte)
 #define ROOM_NAME_LEN   32
 
-// Maximum number of distinct chat rooms the server can manage
-#define MAX_ROOMS       256
+// Default maximum number of distinct chat rooms (see server_config.max_rooms)
+#define DEFAULT_MAX_ROOMS         256
 
 // Directory where log files (timestamps, events, errors) will be written
 #define LOG_DIRECTORY   "logs"
 
-// Maximum number of members allowed in any single chat room
-#define ROOM_CAPACITY   15
+// Default maximum number of members in a single chat room (see server_config.room_capacity)
+#define DEFAULT_ROOM_CAPACITY     15
+
+// Default number of file upload worker threads (see server_config.upload_workers)
+#define DEFAULT_UPLOAD_WORKERS    5
+
+// Default capacity of the pending upload queue (see server_config.upload_queue_size)
+#define DEFAULT_UPLOAD_QUEUE_SIZE 5
+
+// Default largest file accepted by /sendfile, in bytes (see server_config.max_file_size)
+#define DEFAULT_MAX_FILE_SIZE     (3 * 1024 * 1024)
+
+// Default seconds an interrupted file transfer stays resumable (see server_config.resume_ttl)
+#define DEFAULT_RESUME_TTL        600
+
+// Default bytes of recent uploads kept for deduplication (see server_config.file_cache_size)
+#define DEFAULT_FILE_CACHE_SIZE   (64 * 1024 * 1024)
+
+// Default loopback port of the metrics endpoint; 0 keeps it disabled (see server_config.admin_port)
+#define DEFAULT_ADMIN_PORT        0
+
+// Default per-connection budget of queued outbound bytes (see server_config.outbox_limit)
+#define DEFAULT_OUTBOX_LIMIT      (1024 * 1024)
 
 /**
  * thread_info_t
@@ -46,23 +83,69 @@ typedef struct {
     pthread_cond_t     init_cond;       // Condition variable for initialization handshake
 } thread_info_t;
 
+/**
+ * conn_id_t
+ *   Stable id of one connection: the pool slot of its connection_t plus generation bits, so
+ *   an id stays unique after the slot is reused. Other threads keep ids instead of pointers
+ *   and resolve them with connection_acquire_id, without any registry lock.
+ */
+typedef pool_id_t conn_id_t;
+#define CONN_ID_NONE POOL_ID_NONE
+
+/**
+ * room_id_t
+ *   Stable id of one open room, built the same way from its room_pool slot. Room names are
+ *   mapped to ids only when a client joins (room_create); connections, member lists and
+ *   broadcasts use the id, which stops resolving once the room is retired.
+ */
+typedef pool_id_t room_id_t;
+#define ROOM_ID_NONE POOL_ID_NONE
+
 // Forward declaration of room_t so that connection_t can refer to it
 typedef struct room_t room_t;
 
+/**
+ * member_snapshot_t
+ *
+ * Immutable copy of a room's member list with the ids resolved to connections, published on
+ * every join/leave. Broadcasts iterate a
+ * snapshot without holding room->mutex; a snapshot (and the reference it holds on each member
+ * connection) stays alive until the last broadcaster using it lets go.
+ * - refs:     The room's reference on its current snapshot plus one per broadcaster using it
+ * - count:    Number of entries in 'members'
+ * - members:  The connections that were in the room when the snapshot was taken
+ */
+typedef struct {
+    _Atomic int          refs;
+    int                  count;
+    struct connection_t *members[];
+} member_snapshot_t;
+
 /**
  * room_t
  *
  * Represents a chat room, which has:
  * - name:              The human-readable identifier for this room (up to ROOM_NAME_LEN - 1 characters)
+ * - id:                This room's room_id_t while it is open, ROOM_ID_NONE once retired (its last
+ *                      member left); written under 'mutex'
+ * - name_next:         Next room in the same name index bucket (guarded by rooms_mutex)
  * - mutex:             Protects all modifications to the room’s member list and member_count
- * - members:           Array of pointers to connection_t structures that have joined this room
+ * - members:           Array of server_config.room_capacity conn_id_t of the connections that have
+ *                      joined this room, CONN_ID_NONE for a free entry (allocated together with the room)
  * - member_count:      The current number of active members in this room
+ * - snapshot:          Current published copy of 'members' used by room_broadcast
+ * - snapshot_mutex:    Guards only the load of 'snapshot' plus taking a reference on it, so a
+ *                      publisher cannot free the snapshot in between
  */
 struct room_t {
     char               name[ROOM_NAME_LEN];
+    _Atomic room_id_t  id;
+    struct room_t     *name_next;
     pthread_mutex_t    mutex;
-    struct connection_t *members[ROOM_CAPACITY];
+    conn_id_t         *members;
     int                member_count;
+    member_snapshot_t *snapshot;
+    pthread_mutex_t    snapshot_mutex;
 };
 
 /**
@@ -71,10 +154,21 @@ struct room_t {
  * Represents a single client connection. For each connected user, the server allocates one of these.
  * - username:         The alphanumeric username chosen by the client (up to USERNAME_LEN - 1 chars)
  * - sockfd:           The TCP socket file descriptor for communicating with this client
- * - notify_fd:        One end of a UNIX-domain socketpair for delivering asynchronous notifications to this client handler
- * - notify_writer:    The opposite end of the same socketpair; writes here wake up the client’s select() loop
+ * - notify_fd:        One end of a UNIX-domain socketpair; readable whenever the outbox has new data
+ * - notify_writer:    The opposite end of the same socketpair; the outbox writes a wake byte here
  * - thread_info:      Metadata about the thread servicing this client (used for logging and synchronization)
- * - room:             Pointer to the room this client is currently in (NULL if not in any room)
+ * - room:             Id of the room this client is currently in (ROOM_ID_NONE if not in any room)
+ * - outbox:           Bounded queue of data waiting to be sent to this client (see outbox.h)
+ * - io:               Socket I/O state of the handler thread (see io_engine.h); only that thread uses it
+ * - arena:            Scratch memory of the handler thread for replies and log lines, reset once per
+ *                     loop iteration (see arena.h); its block survives reuse of the pooled struct
+ * - log_prefix:       "[THREAD-INFO (TID: <tid>)] User '<username>'", built once by the handler thread;
+ *                     its first tid_prefix_len bytes are the TID part alone, user_prefix_len is all of it
+ * - chat_prefix:      "[<username>] ", put in front of every room or private message the user sends
+ * - id:               This connection's conn_id_t while it is registered, CONN_ID_NONE otherwise
+ * - name_next:        Next connection in the same registry bucket (guarded by the bucket's shard lock)
+ * - refs:             References held on this struct: the registry's, every room member
+ *                     snapshot listing it, and any upload worker delivering to it
  */
 typedef struct connection_t {
     char              username[USERNAME_LEN];
@@ -82,50 +176,90 @@ typedef struct connection_t {
     int               notify_fd;
     int               notify_writer;
     thread_info_t     thread_info;
-    room_t           *room;
+    room_id_t         room;
+    outbox_t          outbox;
+    conn_io_t        *io;
+    arena_t           arena;
+    char              log_prefix[LOG_PREFIX_LEN];
+    size_t            tid_prefix_len;
+    size_t            user_prefix_len;
+    char              chat_prefix[CHAT_PREFIX_LEN];
+    size_t            chat_prefix_len;
+    _Atomic conn_id_t id;
+    struct connection_t *name_next;
+    _Atomic int       refs;
 } connection_t;
 
-// Global array of all connected clients (indexed 0..MAX_CONN-1). NULL means slot is free.
-extern connection_t *connections[MAX_CONN];
-
-// Mutex to protect concurrent access to the global 'connections' array
-extern pthread_mutex_t conn_mutex;
+/**
+ * registry_status_t
+ *   Result of registry_add.
+ */
+typedef enum {
+    REGISTRY_OK,
+    REGISTRY_TAKEN,     // Another connection already uses the username
+    REGISTRY_FULL       // server_config.max_conn users are already registered
+} registry_status_t;
 
-// Global array of all existing chat rooms (indexed 0..MAX_ROOMS-1). NULL means no room in that slot.
-extern room_t *rooms[MAX_ROOMS];
+/**
+ * room_add_result_t
+ *   Result of room_add_member.
+ */
+typedef enum {
+    ROOM_ADD_OK,
+    ROOM_ADD_FULL,      // The room already has server_config.room_capacity members
+    ROOM_ADD_GONE       // The id is stale: the room was retired after it was looked up
+} room_add_result_t;
 
-// Mutex to protect concurrent access to the global 'rooms' array
+// Mutex to protect the room name index (see room_lookup / room_create)
 extern pthread_mutex_t rooms_mutex;
 
 /**
- * find_connection
- *   Look up an existing connection_t pointer by exact username match.
- *   Returns NULL if no such user is currently connected.
+ * registry_add
+ *   Register a freshly initialized connection (refs already 1, which becomes the registry's
+ *   reference) under its username and give it its conn_id_t. Connected users live in a hash
+ *   table split into shards by username hash, each with its own lock.
+ */
+registry_status_t registry_add(connection_t *c);
+
+/**
+ * connection_lookup_id
+ *   Map a username to the id of its connection (CONN_ID_NONE if not connected). Used where a
+ *   name arrives from a client and a reference to the user has to outlive the command.
  */
-connection_t *find_connection(const char *username);
+conn_id_t connection_lookup_id(const char *username);
 
 /**
- * find_free_slot
- *   Return the index of the first unused slot in the 'connections' array,
- *   or -1 if all MAX_CONN slots are occupied.
+ * connection_acquire / connection_acquire_id / connection_retain / connection_release
+ *   Look up a connection by username or by id and take a reference on it, so that it stays
+ *   valid after the lookup (e.g. while a file stream waits on its outbox), or take another
+ *   reference on a connection already held. The lookups return NULL if the user is not
+ *   connected. Every reference must be dropped with connection_release; the last one frees
+ *   the struct.
  */
-int find_free_slot(void);
+connection_t *connection_acquire(const char *username);
+connection_t *connection_acquire_id(conn_id_t id);
+void connection_retain(connection_t *c);
+void connection_release(connection_t *c);
 
 /**
  * broadcast_message_via_notify
- *   Send a private (whisper) message from 'from' to 'to' by writing into the target’s notify socket.
- *   The 'msg' should be exactly the textual content to deliver.
+ *   Send a private (whisper) message from 'from' to 'to' by queueing it in the target’s outbox.
+ *   The 'msg' should be exactly the textual content to deliver. The line is formatted in the
+ *   sender's arena, so only the sender's handler thread may call this.
+ *   'stamp' carries the sender's trace timestamps, or is NULL when the message is not traced.
+ *   Returns 1 if 'to' is connected (whether or not its outbox took the line), 0 otherwise.
  */
-void broadcast_message_via_notify(const char *from,
-                                  const char *to,
-                                  const char *msg);
+int broadcast_message_via_notify(connection_t *from,
+                                 const char *to,
+                                 const char *msg,
+                                 const trace_stamp_t *stamp);
 
 /**
  * remove_connection
- *   Remove a user (by username) from the global list of connections.
- *   Frees the connection_t struct and sets that slot to NULL.
+ *   Unregister a connection so that neither its username nor its id resolves any more, and
+ *   drop the registry's reference; the struct is freed by the last reference.
  */
-void remove_connection(const char *user);
+void remove_connection(connection_t *c);
 
 /**
  * client_handler
@@ -136,44 +270,54 @@ void remove_connection(const char *user);
 void *client_handler(void *arg);
 
 /**
- * room_find
- *   Search for an existing room by name. Returns NULL if not found.
- *   Must hold rooms_mutex if making multiple calls to room arrays or modifying content.
+ * room_lookup
+ *   Map a room name to the id of the open room with that name. Returns ROOM_ID_NONE if not found.
  */
-room_t *room_find(const char *name);
+room_id_t room_lookup(const char *name);
 
 /**
  * room_create
  *   Create a new room with the given name if it does not already exist.
  *   Associates the connection pointer at room creation time so that logs can print thread IDs.
- *   Returns a pointer to the newly created room, or if the room already existed, that existing pointer.
- *   Returns NULL if there is no free slot to create a new room (i.e., all MAX_ROOMS slots are full).
+ *   Returns the id of the newly created room, or if the room already existed, that room's id.
+ *   Returns ROOM_ID_NONE if there is no free slot to create a new room (i.e., all server_config.max_rooms slots are full).
  */
-room_t *room_create(const char *name, connection_t *connection);
+room_id_t room_create(const char *name, connection_t *connection);
 
 /**
  * room_add_member
- *   Add a connection_t * to a room’s membership list.
- *   If the room is already full (member_count >= ROOM_CAPACITY), this is a no-op except for logging and notifying.
- *   Otherwise, increments member_count and updates connection->room.
+ *   Add a connection's id to the membership list of room 'id'.
+ *   If the room is already full (member_count >= server_config.room_capacity) nothing changes and
+ *   ROOM_ADD_FULL is returned; if the id is stale, ROOM_ADD_GONE. Otherwise, increments
+ *   member_count and sets connection->room.
  */
-void room_add_member(room_t *r, connection_t *c);
+room_add_result_t room_add_member(room_id_t id, connection_t *c);
 
 /**
  * room_remove_member
- *   Remove the given connection_t * from the room’s membership list.
- *   If after removal the room becomes empty (member_count == 0), the room is destroyed (freed) and removed
- *   from the global rooms array.
+ *   Remove the given connection from the membership list of room 'id'.
+ *   If after removal the room becomes empty (member_count == 0), the room is retired (its id stops
+ *   resolving), removed from the name index and returned to the pool.
  */
-void room_remove_member(room_t *r, connection_t *c);
+void room_remove_member(room_id_t id, connection_t *c);
 
 /**
  * room_broadcast
- *   Send a text message “from: msg” to every member in the given room.
- *   This function writes into each member’s notify_writer so that their select() loop wakes up and
- *   relays the message back over the TCP socket.
+ *   Send a text message “from: msg” to every member of room 'id'.
+ *   The message is queued in each member’s outbox, which never blocks the sender; each member's
+ *   handler then sends it over the TCP socket. The member list is read from the room's published
+ *   snapshot, so room->mutex is not held during the fan-out. The line is formatted once, in the
+ *   sender's arena (sender's handler thread only).
+ *   'stamp' carries the sender's trace timestamps, or is NULL when the message is not traced.
+ */
+void room_broadcast(room_id_t id, connection_t *from, const char *msg, const trace_stamp_t *stamp);
+
+/**
+ * room_member_names
+ *   Store the usernames of up to 'max' current members of room 'id' in 'names'.
+ *   Returns how many were stored, or -1 if the room is gone.
  */
-void room_broadcast(room_t *r, const char *from, const char *msg);
+int room_member_names(room_id_t id, char (*names)[USERNAME_LEN], int max);
 
 /**
  * safe_print
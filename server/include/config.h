@@ -0,0 +1,135 @@
+/* config.h */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>     // For size_t
+
+/**
+ * slow_policy_t
+ *
+ * What happens when a chat message would push a connection's outbound buffer past
+ * outbox_limit. File streams are never dropped: they wait for the recipient to catch up
+ * (up to OUTBOX_PAUSE_TIMEOUT, after which the file is dropped, or under 'disconnect' the
+ * client is disconnected).
+ * - SLOW_POLICY_DROP:        Discard the oldest queued chat messages (or the new one)
+ * - SLOW_POLICY_DISCONNECT:  Disconnect the slow client
+ * - SLOW_POLICY_PAUSE:       Keep chat lossless and let file streams absorb the backpressure;
+ *                            chat may overshoot the budget up to twice outbox_limit, after
+ *                            which the client is disconnected
+ */
+typedef enum {
+    SLOW_POLICY_DROP,
+    SLOW_POLICY_DISCONNECT,
+    SLOW_POLICY_PAUSE
+} slow_policy_t;
+
+/**
+ * io_engine_t
+ *
+ * How client sockets are driven.
+ * - IO_ENGINE_SELECT:  accept() in the main loop; every handler waits in select() and uses
+ *                      recv()/sendmsg() directly
+ * - IO_ENGINE_URING:   io_uring: multishot accept, multishot receives into provided buffers and
+ *                      linked send chains, each loop iteration costing a single io_uring_enter.
+ *                      Falls back to IO_ENGINE_SELECT when the kernel does not support it.
+ */
+typedef enum {
+    IO_ENGINE_SELECT,
+    IO_ENGINE_URING
+} io_engine_t;
+
+/**
+ * server_config_t
+ *
+ * Runtime limits and tunables for the server. Every structure that used to be sized by a
+ * compile-time constant (connection table, room table, room member lists, I/O buffers, the
+ * upload worker pool and the upload queue) is now sized from these values at startup.
+ *
+ * Values are resolved in three layers, later layers overriding earlier ones:
+ *   1) Built-in defaults (the DEFAULT_* constants in chatserver.h)
+ *   2) An optional config file given with -c/--config
+ *   3) Individual command-line options
+ *
+ * - port:               TCP port the server listens on
+ * - max_conn:           Maximum number of simultaneous client connections
+ * - max_rooms:          Maximum number of chat rooms that can exist at once
+ * - room_capacity:      Maximum number of members in a single room
+ * - buf_size:           Size of each client handler's receive/relay buffer, in bytes
+ * - upload_workers:     Number of file_upload_worker threads
+ * - upload_queue_size:  Capacity of the bounded upload queue (pending files)
+ * - max_file_size:      Largest file accepted by /sendfile, in bytes (at most 1G)
+ * - resume_ttl:         Seconds an interrupted or unacknowledged file transfer is kept so
+ *                       that its sender or recipient can resume it (0 = not kept)
+ * - file_cache_size:    Bytes of recently uploaded files kept for deduplication (0 = off)
+ * - log_dir:            Directory in which timestamped log files are created
+ * - admin_port:         Loopback port of the metrics endpoint (0 disables it)
+ * - trace:              1 to record per-message delivery stage latencies, 0 to skip the stamps
+ * - compression:        1 to offer LZ4 compression to clients that ask for it at the handshake
+ * - outbox_limit:       Per-connection budget of queued outbound bytes
+ * - slow_policy:        What to do when a client falls behind its budget (slow_policy_t)
+ * - io_engine:          Socket I/O engine (io_engine_t)
+ */
+typedef struct {
+    int     port;
+    int     max_conn;
+    int     max_rooms;
+    int     room_capacity;
+    size_t  buf_size;
+    int     upload_workers;
+    int     upload_queue_size;
+    size_t  max_file_size;
+    int     resume_ttl;
+    size_t  file_cache_size;
+    char    log_dir[256];
+    int     admin_port;
+    int     trace;
+    int     compression;
+    size_t  outbox_limit;
+    int     slow_policy;
+    int     io_engine;
+} server_config_t;
+
+// The active server configuration. Filled in once by main() before any thread is started,
+// and treated as read-only afterwards.
+extern server_config_t server_config;
+
+/**
+ * config_set_defaults
+ *   Fill 'cfg' with the built-in default values.
+ */
+void config_set_defaults(server_config_t *cfg);
+
+/**
+ * config_load_file
+ *   Read "key = value" lines from the file at 'path' into 'cfg'. Blank lines and lines
+ *   starting with '#' are ignored. Size values accept an optional K, M or G suffix.
+ *   Returns 0 on success, -1 if the file cannot be opened or contains an invalid line
+ *   (an error message naming the file and line is printed to stderr).
+ */
+int config_load_file(server_config_t *cfg, const char *path);
+
+/**
+ * config_parse_args
+ *   Apply the command line to 'cfg': loads the file given with -c/--config (if any), then
+ *   applies every other option on top of it. A single positional argument is taken as the port.
+ *   Returns 0 on success, 1 if usage was printed on request (--help), -1 on error.
+ */
+int config_parse_args(server_config_t *cfg, int argc, char *argv[]);
+
+/**
+ * config_validate
+ *   Check that every limit in 'cfg' is within a sane range.
+ *   Returns 0 if the configuration is usable, -1 otherwise (with a message on stderr). A usable
+ *   value that a fixed limit cuts short (max_conn beyond the reserved message slots) is reported
+ *   on stderr as a warning.
+ */
+int config_validate(const server_config_t *cfg);
+
+/**
+ * config_usage
+ *   Print the command-line usage text to stderr.
+ */
+void config_usage(const char *prog);
+
+#endif /* CONFIG_H */
@@ -7,33 +7,31 @@
 #include <stdbool.h>    // For bool type
 #include <pthread.h>    // For pthread_mutex_t, pthread_cond_t
 
-/* We need USERNAME_LEN from chatserver.h in order to size the sender/target arrays. */
-#include "chatserver.h"
-
-#define MAX_FILENAME 256  /* Maximum length for a filename (including terminating '\0') */
+/* Items refer to the transfer (file bytes, names) they deliver. */
+#include "transfer.h"
 
 /**
  * file_item_t
  *
- * Represents a single file that needs to be delivered from one user to another.
- * - filename:   Name of the file (up to MAX_FILENAME-1 characters + '\0')
- * - size:       Size of the file data in bytes
- * - data:       Pointer to a heap-allocated buffer containing exactly 'size' bytes of file content
- * - sender:     The username of the sender (up to USERNAME_LEN-1 characters + '\0')
- * - target:     The username of the intended recipient (up to USERNAME_LEN-1 characters + '\0')
+ * Represents one delivery of an uploaded file to one of its recipients.
+ * - rcpt:       The recipient's entry in the fully uploaded transfer (rcpt->transfer holds the
+ *               file bytes, name and sender); the item holds a reference on the transfer and
+ *               the recipient is marked as being delivered to
+ * - offset:     First byte to deliver (non-zero when the recipient resumes a transfer)
+ * - target_id:  The recipient's connection id, resolved when the delivery was queued
+ *               (CONN_ID_NONE if the user was not connected); the worker delivers by id, so a
+ *               recipient that reconnected meanwhile under the same name is offered the
+ *               transfer again instead (see /fileack)
  * - is_sentinel:Is this a “poison pill” to tell worker threads to exit? 1 = yes, 0 = no
  *
- * Note: We perform a shallow copy of this structure when enqueuing. That means
- *       'data' is not deep-copied; the pointer itself is copied, and the worker
- *       thread will be responsible for freeing item.data once done.
+ * Note: We perform a shallow copy of this structure when enqueuing. The reference travels
+ *       with the copy, and the worker thread releases it once done.
  */
 typedef struct {
-    char     filename[MAX_FILENAME];
-    size_t   size;
-    char    *data;
-    char     sender[USERNAME_LEN];
-    char     target[USERNAME_LEN];
-    int      is_sentinel;
+    transfer_rcpt_t *rcpt;
+    size_t           offset;
+    conn_id_t        target_id;
+    int              is_sentinel;
 } file_item_t;
 
 /**
@@ -79,7 +77,7 @@ file_queue_t *file_queue_init(size_t capacity);
 /**
  * file_queue_destroy
  *   Free all resources associated with a file_queue_t.
- *   Also frees any file_item_t.data pointers still present in the buffer.
+ *   Also releases the transfers of any items still present in the buffer.
  *
  *   After calling this, the pointer should not be used again.
  */
@@ -113,7 +111,7 @@ void file_queue_enqueue(file_queue_t *q, const file_item_t *item);
  *   Blocking dequeue: If the queue is empty, this call will wait (block) until an item is enqueued.
  *   Returns a copy of the file_item_t that was stored at the head index. Updates head & count, and signals not_full.
  *
- *   Caller takes ownership of the returned file_item_t.data buffer and is responsible for calling free() on it when done.
+ *   Caller takes over the item's transfer reference and releases it when done.
  */
 file_item_t file_queue_dequeue(file_queue_t *q);
 
@@ -0,0 +1,83 @@
+/* filecache.h */
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <stddef.h>     // For size_t
+#include <stdint.h>     // For uint64_t
+#include <stdatomic.h>  // For the reference count
+#include "filehash.h"   // For file_digest_t
+#include "outbox.h"     // For outbox_zpiece_t
+
+/**
+ * fc_entry_t
+ *
+ * One file's bytes, shared by every transfer that carries that content. Entries are
+ * reference counted; while an entry is cached the cache holds one of the references.
+ * - fast:        XXH64 of the content (the cache is indexed by it)
+ * - sha256:      SHA-256 of the content, valid once 'sha_ready' is set
+ * - sha_ready:   1 once sha256 was computed (it is only needed to confirm a match)
+ * - size:        Size of the content in bytes
+ * - data:        The content (owned by the entry)
+ * - marks:       Its CRC32C checkpoints (see transfer_t; owned by the entry)
+ * - zpieces:     Its pieces compressed (see filecache_zpieces; owned by the entry), NULL until
+ *                a delivery first asks for them
+ * - refs:        The cache's reference (while cached) plus one per transfer
+ * - cached:      1 while the entry is in the cache
+ * - hnext:       Next entry in the same hash bucket
+ * - newer/older: Neighbours in the LRU list
+ *
+ * sha256, sha_ready, cached and the links are guarded by the cache lock; fast, size, data and
+ * marks never change; zpieces is set once.
+ */
+typedef struct fc_entry_t {
+    uint64_t           fast;
+    uint8_t            sha256[32];
+    int                sha_ready;
+    size_t             size;
+    char              *data;
+    uint32_t          *marks;
+    _Atomic(outbox_zpiece_t *) zpieces;
+    _Atomic int        refs;
+    int                cached;
+    struct fc_entry_t *hnext;
+    struct fc_entry_t *newer;
+    struct fc_entry_t *older;
+} fc_entry_t;
+
+/**
+ * filecache_adopt
+ *   Take ownership of the 'size' malloc'ed bytes at 'data', a completely uploaded file, and of
+ *   its malloc'ed CRC32C checkpoints 'marks'. If the cache already holds the same content,
+ *   both are freed and the cached entry is returned instead; otherwise they are wrapped in a
+ *   new entry, which is cached if it fits server_config.file_cache_size (evicting least
+ *   recently used entries as needed). Returns a referenced entry, or NULL if memory ran out
+ *   (then 'data' and 'marks' are still the caller's).
+ */
+fc_entry_t *filecache_adopt(char *data, uint32_t *marks, size_t size);
+
+/**
+ * filecache_lookup
+ *   Find cached content with digest 'd' and 'size' bytes. Returns a referenced entry (now the
+ *   most recently used), or NULL on a miss.
+ */
+fc_entry_t *filecache_lookup(const file_digest_t *d, size_t size);
+
+/**
+ * filecache_zpieces
+ *   The content of 'e' as independent LZ4 blocks, one per OUTBOX_SLICE_SIZE piece, for
+ *   deliveries to clients that negotiated compression. Compressed by the first delivery that
+ *   asks (outside any lock) and kept with the entry; not counted in the cache budget. Pieces
+ *   that look incompressible by their sampled entropy (JPEG, PNG, most PDF streams), or do not
+ *   shrink by at least an eighth, have len 0 and go out as they are. Returns NULL if memory
+ *   runs out or the entry is empty.
+ */
+const outbox_zpiece_t *filecache_zpieces(fc_entry_t *e);
+
+/**
+ * filecache_release
+ *   Drop a reference taken by filecache_adopt or filecache_lookup. Accepts NULL.
+ */
+void filecache_release(fc_entry_t *e);
+
+#endif /* FILECACHE_H */
@@ -0,0 +1,121 @@
+/* io_engine.h */
+
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <stddef.h>     // For size_t
+#include <sys/types.h>  // For ssize_t
+#include "outbox.h"     // For outbox_t
+
+// Submission queue size of each connection's ring
+#define CONN_IO_RING_ENTRIES  16
+
+// Provided receive buffers per connection (each server_config.buf_size bytes; power of two)
+#define CONN_IO_RECV_BUFS     8
+
+// Most sendmsg requests linked into one send chain; each carries up to OUTBOX_IOV_MAX messages
+#define CONN_IO_SEND_LINKS    4
+
+// How long the acceptor waits for a connection before re-checking the stop flag, in milliseconds
+#define ACCEPT_POLL_MS        500
+
+// How long a closing connection waits for its last queued output before it is cut off, in milliseconds
+#define CONN_IO_CLOSE_TIMEOUT_MS 1000
+
+/**
+ * conn_io_event_t
+ *   Outcome of conn_io_wait.
+ *   - CONN_IO_READABLE:  Input (or end of stream) is available to conn_io_recv
+ *   - CONN_IO_IDLE:      Woken for output only (outbox wake-up, socket writable, send finished)
+ *   - CONN_IO_ERROR:     Waiting failed (errno is set)
+ *   - CONN_IO_SHUTDOWN:  The notify socketpair was shut down (server shutdown)
+ */
+typedef enum {
+    CONN_IO_SHUTDOWN = -2,
+    CONN_IO_ERROR    = -1,
+    CONN_IO_IDLE     = 0,
+    CONN_IO_READABLE = 1
+} conn_io_event_t;
+
+// Per-connection I/O state, owned by the connection's handler thread (opaque)
+typedef struct conn_io conn_io_t;
+
+// Listening socket driver used by main()'s accept loop (opaque)
+typedef struct acceptor acceptor_t;
+
+/**
+ * io_engine_probe
+ *   Check that the kernel supports everything the io_uring engine uses (ring setup, provided
+ *   buffer rings, multishot receive, timed waits). Returns 0 if it does, or a negative errno
+ *   describing why not (e.g. -ENOSYS on old kernels, -EPERM when io_uring is disabled).
+ */
+int io_engine_probe(void);
+
+/**
+ * acceptor_open / acceptor_next / acceptor_close
+ *   Wrap the listening socket for the engine selected in server_config.io_engine.
+ *   With io_uring a single multishot accept stays armed and acceptor_next hands out the
+ *   connections it produced, waiting at most ACCEPT_POLL_MS at a time.
+ *   acceptor_next returns a connected fd, or -1 with errno set; EINTR means "nothing yet"
+ *   (signal or poll timeout) and the caller should re-check its stop flag and call again.
+ *   acceptor_open returns NULL only if memory runs out.
+ */
+acceptor_t *acceptor_open(int listen_fd);
+int  acceptor_next(acceptor_t *acc);
+void acceptor_close(acceptor_t *acc);
+
+/**
+ * conn_io_open
+ *   Set up I/O for one client: 'tcp_fd' is the client socket, 'notify_fd' the read end of the
+ *   connection's wake socketpair, 'ob' its outbox. Uses io_uring when configured and falls
+ *   back to the select engine (poll()) for this connection if the ring cannot be created.
+ *   Returns NULL if memory runs out.
+ */
+conn_io_t *conn_io_open(int tcp_fd, int notify_fd, outbox_t *ob);
+
+/**
+ * conn_io_engine
+ *   The engine actually in use for this connection (io_engine_t).
+ */
+int conn_io_engine(const conn_io_t *io);
+
+/**
+ * conn_io_flush
+ *   Move queued outbox data towards the socket. With the select engine this sends right away
+ *   (outbox_flush); with io_uring it retires the last finished send chain and prepares the next
+ *   one, which is submitted together with the following wait.
+ *   Returns the number of bytes that reached the socket since the previous call, or -1 if the
+ *   socket failed.
+ */
+ssize_t conn_io_flush(conn_io_t *io);
+
+/**
+ * conn_io_kick
+ *   Submit prepared sends immediately instead of with the next wait. Used before the handler
+ *   blocks on something other than its socket.
+ */
+void conn_io_kick(conn_io_t *io);
+
+/**
+ * conn_io_wait
+ *   Block until the client sent data, the outbox was woken, or queued output made progress,
+ *   or for at most 'timeout_ms' milliseconds (-1: no limit; CONN_IO_IDLE when it runs out).
+ *   Returns a conn_io_event_t.
+ */
+int conn_io_wait(conn_io_t *io, int timeout_ms);
+
+/**
+ * conn_io_recv
+ *   Read up to 'len' bytes from the client, waiting if nothing is buffered yet.
+ *   Same results as recv(): bytes read, 0 at end of stream, -1 on error (errno set).
+ */
+ssize_t conn_io_recv(conn_io_t *io, void *buf, size_t len);
+
+/**
+ * conn_io_close
+ *   Give the last queued output up to CONN_IO_CLOSE_TIMEOUT_MS to leave, cancel outstanding
+ *   requests and free the state. Does not close the sockets. Accepts NULL.
+ */
+void conn_io_close(conn_io_t *io);
+
+#endif /* IO_ENGINE_H */
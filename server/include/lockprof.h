@@ -0,0 +1,113 @@
+/* lockprof.h */
+
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>    // For pthread_mutex_t, pthread_cond_t
+#include <stdint.h>     // For uint64_t
+#include <stdatomic.h>  // For the atomic statistics fields
+
+/**
+ * Instrumented locking
+ *
+ * Build with `make LOCKPROF=1` (which defines CHAT_LOCK_PROFILE) to record, for every named
+ * lock, how often it was acquired, how often the acquire had to wait, the total/maximum wait
+ * time and the total/maximum hold time. In normal builds the LP_* macros expand to the plain
+ * pthread calls and LOCKPROF_SITE declarations disappear, so there is zero overhead.
+ *
+ * Usage:
+ *     LOCKPROF_SITE(rooms_lp, "rooms_mutex");      // once, at file scope
+ *     LP_LOCK(&rooms_mutex, &rooms_lp);
+ *     ...
+ *     LP_UNLOCK(&rooms_mutex, &rooms_lp);
+ *
+ * Locks that exist in many instances (e.g. one mutex per room, or per connection registry shard) share one site, so the report
+ * shows the aggregate behaviour of that lock class.
+ */
+
+/**
+ * lockprof_t
+ *
+ * Statistics for one named lock (or lock class).
+ * - name:          Label printed in the report
+ * - acquisitions:  Successful lock operations
+ * - contended:     Acquisitions that found the lock already held and had to wait
+ * - wait_ns:       Total time spent waiting to acquire
+ * - max_wait_ns:   Longest single wait
+ * - hold_ns:       Total time the lock was held
+ * - max_hold_ns:   Longest single hold
+ * - registered:    Set once the site has been linked into the report list
+ * - next:          Link in the report list
+ */
+typedef struct lockprof {
+    const char       *name;
+    _Atomic uint64_t  acquisitions;
+    _Atomic uint64_t  contended;
+    _Atomic uint64_t  wait_ns;
+    _Atomic uint64_t  max_wait_ns;
+    _Atomic uint64_t  hold_ns;
+    _Atomic uint64_t  max_hold_ns;
+    _Atomic int       registered;
+    struct lockprof  *next;
+} lockprof_t;
+
+#ifdef CHAT_LOCK_PROFILE
+
+#define LOCKPROF_SITE(var, label)   lockprof_t var = { .name = (label) }
+#define LOCKPROF_EXTERN(var)        extern lockprof_t var
+#define LP_LOCK(m, lp)              lockprof_lock((m), (lp))
+#define LP_UNLOCK(m, lp)            lockprof_unlock((m), (lp))
+#define LP_COND_WAIT(c, m, lp)      lockprof_cond_wait((c), (m), (lp))
+#define LP_COND_TIMEDWAIT(c, m, t, lp) lockprof_cond_timedwait((c), (m), (t), (lp))
+
+#else
+
+#define LOCKPROF_SITE(var, label)   typedef int var##_lockprof_unused
+#define LOCKPROF_EXTERN(var)        typedef int var##_lockprof_extern_unused
+#define LP_LOCK(m, lp)              pthread_mutex_lock(m)
+#define LP_UNLOCK(m, lp)            pthread_mutex_unlock(m)
+#define LP_COND_WAIT(c, m, lp)      pthread_cond_wait((c), (m))
+#define LP_COND_TIMEDWAIT(c, m, t, lp) pthread_cond_timedwait((c), (m), (t))
+
+#endif
+
+/**
+ * lockprof_lock / lockprof_unlock / lockprof_cond_wait / lockprof_cond_timedwait
+ *   Instrumented replacements for pthread_mutex_lock, pthread_mutex_unlock,
+ *   pthread_cond_wait and pthread_cond_timedwait. Use through the LP_* macros.
+ */
+int lockprof_lock(pthread_mutex_t *m, lockprof_t *lp);
+int lockprof_unlock(pthread_mutex_t *m, lockprof_t *lp);
+int lockprof_cond_wait(pthread_cond_t *c, pthread_mutex_t *m, lockprof_t *lp);
+int lockprof_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m,
+                            const struct timespec *abstime, lockprof_t *lp);
+
+/**
+ * lockprof_enabled
+ *   Returns 1 in CHAT_LOCK_PROFILE builds, 0 otherwise.
+ */
+int lockprof_enabled(void);
+
+/**
+ * lockprof_report
+ *   Format one line per lock that has been used (sorted by total wait time, worst first)
+ *   and pass each line to 'emit'. Does nothing in non-profiling builds.
+ */
+void lockprof_report(void (*emit)(const char *line));
+
+/**
+ * lockprof_start_reporter
+ *   In profiling builds, block SIGUSR1 in the calling thread (and therefore in every thread it
+ *   creates afterwards) and start a reporter thread that prints the report with 'emit' each time
+ *   SIGUSR1 is received. Call from main() before any other thread is created.
+ *   Does nothing in non-profiling builds.
+ */
+void lockprof_start_reporter(void (*emit)(const char *line));
+
+/**
+ * lockprof_stop_reporter
+ *   Stop the reporter thread started by lockprof_start_reporter (if any).
+ */
+void lockprof_stop_reporter(void);
+
+#endif /* LOCKPROF_H */
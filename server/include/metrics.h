@@ -0,0 +1,124 @@
+/* metrics.h */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>     // For size_t
+#include <stdint.h>     // For uint64_t, int64_t
+
+/**
+ * metric_counter_id_t
+ *
+ * Monotonic counters. Each thread increments its own private copy (no shared cache line,
+ * no lock); the copies are only summed when the admin endpoint is scraped.
+ */
+typedef enum {
+    M_CONNECTIONS_ACCEPTED,     // Handshakes that completed successfully
+    M_CONNECTIONS_REJECTED,     // Handshakes refused (server full, out of memory)
+    M_MESSAGES_IN,              // Commands received from clients
+    M_MESSAGES_OUT,             // Chat messages handed to a recipient (one per recipient)
+    M_BYTES_IN,                 // Bytes read from client sockets
+    M_BYTES_RELAYED,            // Bytes written to client sockets by client handlers
+    M_FILES_DELIVERED,          // Files fully handed to their recipient
+    M_FILES_DROPPED,            // Files dropped because the recipient vanished or failed
+    M_WORKER_BUSY_NS,           // Time upload workers spent processing items (nanoseconds)
+    M_OUTBOX_DROPPED,           // Chat messages discarded by the drop slow-consumer policy
+    M_SLOW_DISCONNECTS,         // Clients disconnected for exceeding their outbound budget
+    M_FILE_PAUSES,              // File streams that had to wait for a slow recipient
+    M_FILE_RESUMES,             // Uploads or deliveries resumed from a non-zero offset
+    M_SEND_CALLS,               // sendmsg() calls (or io_uring sendmsg requests) made to flush outboxes
+    M_URING_ENTERS,             // io_uring_enter() calls made by the io_uring engine
+    M_FILE_CACHE_HITS,          // File offers answered from the file cache (upload skipped)
+    M_FILE_CACHE_MISSES,        // File offers the cache did not have
+    M_FILE_CACHE_DEDUPS,        // Uploads whose content was already cached (one copy kept)
+    M_FILE_CACHE_SAVED_BYTES,   // Upload bytes clients did not have to send thanks to the cache
+    M_FILE_CHECKSUM_ERRORS,     // Upload chunks rejected because their CRC32C did not match
+    M_COMPRESS_OUT_RAW_BYTES,   // Bytes sent compressed ([ZTEXT], [FILE-ZDATA]), before compression
+    M_COMPRESS_OUT_WIRE_BYTES,  // The same bytes as sent, after compression (frames of text included)
+    M_COMPRESS_IN_RAW_BYTES,    // Bytes received compressed (/zchunk), after decompression
+    M_COMPRESS_IN_WIRE_BYTES,   // The same bytes as received, compressed
+    M_COUNTER_COUNT
+} metric_counter_id_t;
+
+/**
+ * metric_gauge_id_t
+ *
+ * Point-in-time values. Gauges are shared atomics updated with +/- deltas.
+ */
+typedef enum {
+    G_CONNECTIONS,              // Currently connected clients
+    G_ROOMS,                    // Currently existing rooms
+    G_UPLOAD_QUEUE_DEPTH,       // Items waiting in the upload queue
+    G_UPLOAD_WORKERS_BUSY,      // Upload workers currently processing an item
+    G_LOG_BACKLOG,              // Threads waiting for, or holding, the log file lock
+    G_OUTBOX_BYTES,             // Outbound bytes queued across all connections
+    G_FILE_CACHE_BYTES,         // File bytes held by the file cache
+    G_GAUGE_COUNT
+} metric_gauge_id_t;
+
+/**
+ * metric_hist_id_t
+ *
+ * Latency histograms with fixed exponential buckets from 1us to 10s. Like counters,
+ * histograms are recorded into per-thread storage and merged on scrape.
+ */
+typedef enum {
+    H_COMMAND_SECONDS,          // Time to handle one client command in client_handler
+    H_FILE_DELIVERY_SECONDS,    // Time for an upload worker to hand one file to its recipient
+    H_TRACE_PARSE_SECONDS,      // Traced message: recv() → command parsed
+    H_TRACE_LOCK_WAIT_SECONDS,  // Traced broadcast: parsed → room member snapshot acquired
+    H_TRACE_ENQUEUE_SECONDS,    // Traced message: parsed → queued in recipient's outbox
+    H_TRACE_DELIVERY_SECONDS,   // Traced message: outbox → recipient's TCP send()
+    H_TRACE_TOTAL_SECONDS,      // Traced message: parsed → recipient's TCP send()
+    H_HIST_COUNT
+} metric_hist_id_t;
+
+/**
+ * metrics_now_ns
+ *   Current CLOCK_MONOTONIC time in nanoseconds. Use for latency measurements.
+ */
+uint64_t metrics_now_ns(void);
+
+/**
+ * metrics_add / metrics_inc
+ *   Add 'v' (or 1) to a counter in the calling thread's private storage.
+ */
+void metrics_add(metric_counter_id_t id, uint64_t v);
+#define metrics_inc(id) metrics_add((id), 1)
+
+/**
+ * metrics_gauge_add / metrics_gauge_set
+ *   Adjust a gauge by a signed delta, or overwrite it.
+ */
+void metrics_gauge_add(metric_gauge_id_t id, int64_t delta);
+void metrics_gauge_set(metric_gauge_id_t id, int64_t value);
+
+/**
+ * metrics_observe_ns
+ *   Record one latency sample (in nanoseconds) into a histogram.
+ */
+void metrics_observe_ns(metric_hist_id_t id, uint64_t ns);
+
+/**
+ * metrics_render
+ *   Render every metric in Prometheus text exposition format (version 0.0.4) into a
+ *   freshly malloc'd, NUL-terminated buffer. Stores the length in *len (if non-NULL).
+ *   Returns NULL on allocation failure. The caller frees the buffer.
+ */
+char *metrics_render(size_t *len);
+
+/**
+ * metrics_admin_start
+ *   Start the admin HTTP endpoint on 127.0.0.1:'port' in a background thread.
+ *   Every request is answered with the current metrics_render() output.
+ *   Returns 0 on success, -1 if the socket could not be set up (errno is preserved).
+ */
+int metrics_admin_start(int port);
+
+/**
+ * metrics_admin_stop
+ *   Stop the admin endpoint (if running) and join its thread.
+ */
+void metrics_admin_stop(void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,395 @@
+/* outbox.h */
+
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stddef.h>     // For size_t
+#include <stdint.h>     // For uint64_t
+#include <pthread.h>    // For pthread_mutex_t
+#include <time.h>       // For struct timespec
+#include <sys/types.h>  // For ssize_t
+#include <sys/uio.h>    // For struct iovec
+#include "trace.h"      // For trace_stamp_t
+#include "lz4block.h"   // For lz4_stream_t
+#include "pool.h"       // For POOL_ID_INDEX_BITS
+
+// Most queued messages gathered into one sendmsg() call
+#define OUTBOX_IOV_MAX 64
+
+// Largest piece of a file sent in one go; chat and replies queued meanwhile go out between
+// two pieces, so a message never waits behind more than one of them
+#define OUTBOX_SLICE_SIZE (64 * 1024)
+
+// Room for the "[FILE-DATA <xfer> <len> <crc>]\n" frame in front of each piece (also for the
+// "[FILE-ZDATA ...]" and "[ZTEXT ...]" frames of compressed data)
+#define OUTBOX_FRAME_MAX  48
+
+// Size of a preallocated message slot (see outbox_pool_init); messages whose header and bytes
+// do not fit in one are malloc'd
+#define OUTBOX_MSG_SLOT   512
+
+// Message slots preallocated per connection (server_config.max_conn), and at most in all (a
+// pool indexes at most 2^POOL_ID_INDEX_BITS slots: 4096 connections' worth)
+#define OUTBOX_MSG_SLOTS_PER_CONN 64
+#define OUTBOX_MSG_SLOTS_MAX      (1u << POOL_ID_INDEX_BITS)
+
+// Longest time a file stream stays held back in a slow recipient's file lane, waiting for its
+// outbox to make room, before the file is dropped, in seconds.
+#define OUTBOX_PAUSE_TIMEOUT 30
+
+/**
+ * outbox_result_t
+ *   Outcome of queueing data for a connection.
+ *   - OUTBOX_OK:        Queued
+ *   - OUTBOX_DROPPED:   The message was discarded by the drop policy
+ *   - OUTBOX_OVERFLOW:  The budget was exceeded and the connection is now marked for disconnect
+ *   - OUTBOX_CLOSED:    The connection is going away; nothing was queued
+ */
+typedef enum {
+    OUTBOX_OK,
+    OUTBOX_DROPPED,
+    OUTBOX_OVERFLOW,
+    OUTBOX_CLOSED
+} outbox_result_t;
+
+/**
+ * outbox_kind_t
+ *   Chat messages may be discarded under the drop policy. Replies are the handler's own
+ *   answers to its client's commands and are neither dropped nor budgeted. (Files travel in
+ *   their own lane, see outbox_file_t; they are never dropped, only held back.)
+ */
+typedef enum {
+    OUTBOX_CHAT,
+    OUTBOX_REPLY
+} outbox_kind_t;
+
+/**
+ * outbox_msg_t
+ *
+ * One queued chat message or reply.
+ * - next:      Link in the FIFO
+ * - kind:      OUTBOX_CHAT or OUTBOX_REPLY
+ * - data/len:  Bytes to send ('inline_data')
+ * - off:       Bytes of 'data' already sent; a message with off > 0 is never dropped
+ * - parse_ns:  Sender's parse time for traced messages, 0 otherwise
+ * - enq_ns:    Time the message was queued (only set when traced)
+ */
+typedef struct outbox_msg {
+    struct outbox_msg *next;
+    outbox_kind_t      kind;
+    const char        *data;
+    size_t             len;
+    size_t             off;
+    uint64_t           parse_ns;
+    uint64_t           enq_ns;
+    char               inline_data[];
+} outbox_msg_t;
+
+/**
+ * outbox_zpiece_t
+ *   One OUTBOX_SLICE_SIZE piece of a file as an independent LZ4 block: 'len' bytes at 'data',
+ *   or len 0 if the piece did not compress and goes out as it is.
+ */
+typedef struct {
+    const char *data;
+    size_t      len;
+} outbox_zpiece_t;
+
+/**
+ * outbox_payload_t
+ *
+ * File bytes handed to the outbox without giving up ownership.
+ * - data/len:  The bytes to send
+ * - origin:    Offset of 'data' in the whole file (non-zero for a resumed delivery)
+ * - marks:     CRC32C checkpoints of the whole file, one per OUTBOX_SLICE_SIZE bytes (marks[k]
+ *              covers its first min((k + 1) * OUTBOX_SLICE_SIZE, file size) bytes), or NULL.
+ *              With marks, pieces end on those boundaries and every frame quotes the
+ *              checkpoint at its end, so the recipient can verify each piece and the whole
+ *              file without the outbox touching the bytes.
+ * - zpieces:   The file's pieces compressed (zpieces[k] is the piece at k * OUTBOX_SLICE_SIZE),
+ *              or NULL. Only used with 'marks', for the recipients that negotiated compression.
+ * - release:   Called once with 'arg' when the outbox is done with them; 'sent' is 1 if every
+ *              byte was handed to the socket, 0 if the stream was refused or discarded
+ * - arg:       Owner context for 'release'
+ */
+typedef struct {
+    const char      *data;
+    size_t           len;
+    size_t           origin;
+    const uint32_t  *marks;
+    const outbox_zpiece_t *zpieces;
+    void       (*release)(void *arg, int sent);
+    void        *arg;
+} outbox_payload_t;
+
+/**
+ * outbox_file_t
+ *
+ * One queued file stream. On the wire it becomes its header followed by pieces of at most
+ * OUTBOX_SLICE_SIZE bytes, each framed as "[FILE-DATA <xfer> <len>]\n" + <len> bytes, so the
+ * client can tell file bytes from the chat lines sent between them. With checkpoints (see
+ * outbox_payload_t) the frame is "[FILE-DATA <xfer> <len> <crc>]\n", <crc> being the CRC32C
+ * (hex) of the file from byte 0 to the end of the piece. A piece that goes out compressed is
+ * framed "[FILE-ZDATA <xfer> <len> <crc> <zlen>]\n" + <zlen> bytes, an LZ4 block that decodes
+ * to the <len> bytes of the piece.
+ * - next:        Link in the file lane
+ * - xfer:        Transfer id quoted in the header and every frame
+ * - payload:     The bytes and their owner, released when the stream ends
+ * - framed:      Payload bytes already cut into pieces
+ * - held:        1 while the stream waits for room in the budget (see outbox_push_file); a
+ *                held stream is neither sent nor counted in the outbox's bytes
+ * - deadline:    When a held stream is dropped (CLOCK_MONOTONIC, see outbox_hold_expire)
+ * - header_len:  Length of 'header' ("[FILE ...]\n", sent in front of the first piece)
+ */
+typedef struct outbox_file {
+    struct outbox_file *next;
+    uint32_t            xfer;
+    outbox_payload_t    payload;
+    size_t              framed;
+    int                 held;
+    struct timespec     deadline;
+    size_t              header_len;
+    char                header[];
+} outbox_file_t;
+
+/**
+ * outbox_slice_t
+ *
+ * The piece of the head file stream being sent: up to three segments sent back to back
+ * (the stream header for the first piece, the frame, the payload bytes).
+ * - file:       Stream the piece belongs to; NULL when no piece is cut
+ * - seg/nseg:   The segments
+ * - total:      Their combined length
+ * - sent:       Bytes already sent; once nonzero the piece goes out before anything else
+ * - raw:        File bytes the piece carries
+ * - packed:     1 if the payload segment is the piece compressed (its file bytes are accounted
+ *               once the whole piece is sent)
+ * - frame:      Storage of the frame segment
+ */
+typedef struct {
+    outbox_file_t *file;
+    struct iovec   seg[3];
+    int            nseg;
+    size_t         total;
+    size_t         sent;
+    size_t         raw;
+    int            packed;
+    char           frame[OUTBOX_FRAME_MAX];
+} outbox_slice_t;
+
+/**
+ * outbox_ztext_t
+ *
+ * The compressed frame being sent on a connection that negotiated compression: the first
+ * 'count' chat lane messages as "[ZTEXT <raw> <zlen>]\n" + <zlen> bytes, one block of the
+ * connection's LZ4 stream that decodes to their <raw> bytes.
+ * - buf:     Storage (OUTBOX_FRAME_MAX + LZ4_BOUND(LZ4_BLOCK_MAX) bytes); NULL when the
+ *            connection does not compress
+ * - data:    The frame, inside 'buf'
+ * - total:   Its length
+ * - sent:    Bytes already sent
+ * - raw:     Bytes of the messages it carries
+ * - count:   Number of those messages (0 when no frame is built); they stay queued, and are
+ *            never evicted, until the whole frame is sent
+ */
+typedef struct {
+    char       *buf;
+    const char *data;
+    size_t      total;
+    size_t      sent;
+    size_t      raw;
+    int         count;
+} outbox_ztext_t;
+
+/**
+ * outbox_t
+ *
+ * Per-connection queue of data waiting to be sent to the client, with a byte budget.
+ * Any thread may queue into it without blocking on the recipient's socket; only the
+ * connection's own handler sends from it, with non-blocking sends.
+ * Two lanes feed the socket: chat and replies first, then one piece of the head file stream
+ * (see outbox_file_t), so a large file in flight delays a chat line by one piece at most.
+ * - mutex:         Protects every field below
+ * - head/tail:     Chat lane: FIFO of outbox_msg_t
+ * - file_head/file_tail: File lane: FIFO of outbox_file_t
+ * - file_held:     First held stream of the file lane (every stream behind it is held too), or
+ *                  NULL
+ * - slice:         The piece of file_head being sent
+ * - z:             Compression stream of the chat lane (buf NULL when not compressing)
+ * - ztext:         Compressed frame of chat lane messages being sent (see outbox_ztext_t)
+ * - batch_chat:    Chat messages in the batch being sent (see outbox_prepare)
+ * - batch_ztext:   1 if the batch carries the compressed frame instead of chat messages
+ * - batch_slice:   Where the batch carries a piece: 0 none, 1 before the chat messages (a piece
+ *                  already partly sent), 2 after them
+ * - batch_out:     An asynchronous batch is outstanding
+ * - bytes:         Unsent payload bytes currently queued (file frames are not counted)
+ * - chat_bytes:    The part of 'bytes' that belongs to chat messages. Chat is checked against
+ *                  the budget on its own, so a large file in flight does not evict chat.
+ * - limit:         Byte budget (server_config.outbox_limit)
+ * - wake_fd:       Non-blocking notify_writer end of the connection's socketpair, -1 until set
+ * - wake_pending:  A wake byte has been written and not yet consumed by the handler
+ * - inflight:      Number of chat lane messages at the head that the batch being sent
+ *                  references; they are never evicted
+ * - closed:        The connection is going away; further pushes are refused
+ * - overflowed:    The disconnect policy fired; the handler must drop the connection
+ */
+typedef struct {
+    pthread_mutex_t  mutex;
+    outbox_msg_t    *head;
+    outbox_msg_t    *tail;
+    outbox_file_t   *file_head;
+    outbox_file_t   *file_tail;
+    outbox_file_t   *file_held;
+    outbox_slice_t   slice;
+    lz4_stream_t     z;
+    outbox_ztext_t   ztext;
+    int              batch_chat;
+    int              batch_ztext;
+    int              batch_slice;
+    int              batch_out;
+    size_t           bytes;
+    size_t           chat_bytes;
+    size_t           limit;
+    int              wake_fd;
+    int              wake_pending;
+    int              inflight;
+    int              closed;
+    int              overflowed;
+} outbox_t;
+
+/**
+ * outbox_pool_init
+ *   Reserve 'slots' message slots of OUTBOX_MSG_SLOT bytes (at most OUTBOX_MSG_SLOTS_MAX; see
+ *   config_validate), shared by every outbox, so that queueing a reply or chat line takes a
+ *   slot from the calling thread's pool cache instead of calling malloc. Slots only take memory
+ *   once used. Called once at startup; returns 0, or -1 if memory runs out. Without it (or once
+ *   every slot is in use) messages are malloc'd.
+ */
+int outbox_pool_init(uint32_t slots);
+
+/**
+ * outbox_init
+ *   Set up an empty outbox with the given byte budget.
+ */
+void outbox_init(outbox_t *ob, size_t limit);
+
+/**
+ * outbox_reset
+ *   Free everything still queued and start over empty and uncompressed with a new byte budget,
+ *   keeping the mutex and condition variable (outboxes embedded in pooled connections are
+ *   initialized once).
+ */
+void outbox_reset(outbox_t *ob, size_t limit);
+
+/**
+ * outbox_set_compression
+ *   Compress what is sent from now on: chat lane messages in "[ZTEXT ...]" frames whenever that
+ *   makes them smaller, and file pieces the payload has compressed (outbox_payload_t.zpieces).
+ *   Called at the handshake, before anything is queued. Returns 0, or -1 if memory ran out
+ *   (the outbox then sends everything uncompressed).
+ */
+int outbox_set_compression(outbox_t *ob);
+
+/**
+ * outbox_compressing
+ *   Returns 1 if outbox_set_compression is in effect.
+ */
+int outbox_compressing(outbox_t *ob);
+
+/**
+ * outbox_set_wake_fd
+ *   Attach the fd that is written to (one byte) whenever the handler has new work.
+ *   The fd is switched to non-blocking mode.
+ */
+void outbox_set_wake_fd(outbox_t *ob, int fd);
+
+/**
+ * outbox_push_chat
+ *   Copy 'len' bytes of a chat line into the outbox (into a preallocated slot if it fits one).
+ *   Never blocks. When the budget is
+ *   exceeded the configured slow-consumer policy decides the outcome (see config.h).
+ *   'stamp' carries the sender's trace timestamps, or is NULL when the message is not traced.
+ */
+outbox_result_t outbox_push_chat(outbox_t *ob, const char *data, size_t len,
+                                 const trace_stamp_t *stamp);
+
+/**
+ * outbox_push_reply
+ *   Queue a reply from the connection's own handler, copied like a chat line (replies are
+ *   formatted in the connection's arena, which is reset before they are sent). Never dropped
+ *   and never blocks; it is sent
+ *   with everything else on the handler's next outbox_flush, so replies and relayed messages
+ *   share one sendmsg() call.
+ */
+void outbox_push_reply(outbox_t *ob, const char *data, size_t len);
+
+/**
+ * outbox_push_file
+ *   Queue a file stream in the file lane: 'header' is copied, the payload is borrowed until its
+ *   release callback runs (also on failure). 'xfer' identifies the stream in its frames.
+ *   Never waits: a file that does not fit in the budget is queued held (the stream is paused)
+ *   and goes out once the queue has drained enough; see outbox_hold_expire for one that waits
+ *   too long. Sets *paused to 1 if the stream was queued held.
+ */
+outbox_result_t outbox_push_file(outbox_t *ob, uint32_t xfer, const char *header, size_t header_len,
+                                 const outbox_payload_t *payload, int *paused);
+
+/**
+ * outbox_flush
+ *   Called by the connection's handler: consume the pending wake-up and send as much queued
+ *   data to 'fd' as the socket accepts without blocking. Up to OUTBOX_IOV_MAX segments (chat
+ *   messages, then one file piece) are gathered into each sendmsg() call, with MSG_MORE set
+ *   while more data follows.
+ *   Returns the number of bytes sent, or -1 if the socket failed.
+ */
+ssize_t outbox_flush(outbox_t *ob, int fd);
+
+/**
+ * outbox_prepare / outbox_complete
+ *   The two halves of outbox_flush for asynchronous senders (the io_uring engine).
+ *   outbox_prepare consumes the pending wake-up and describes up to 'max' (at least 4) queued
+ *   segments in 'iov' without sending anything; the described data stays pinned (never
+ *   evicted) until outbox_complete reports how many of those bytes the socket took. At most
+ *   one prepared batch may be outstanding. Returns the number of iovecs filled (0 when nothing
+ *   is queued or a batch is already outstanding) and stores the total length in *len.
+ */
+int  outbox_prepare(outbox_t *ob, struct iovec *iov, int max, size_t *len);
+void outbox_complete(outbox_t *ob, size_t sent);
+
+/**
+ * outbox_wake_consumed
+ *   Record that the handler read the wake byte, so the next push (or an overflow) writes a new
+ *   one. outbox_flush and outbox_prepare do this implicitly; an asynchronous sender calls it
+ *   while a batch is still outstanding.
+ */
+void outbox_wake_consumed(outbox_t *ob);
+
+/**
+ * outbox_pending
+ *   Returns 1 if unsent data is queued (the handler should wait for 'fd' to become writable).
+ */
+int outbox_pending(outbox_t *ob);
+
+/**
+ * outbox_overflowed
+ *   Returns 1 if the disconnect policy has fired for this connection.
+ */
+int outbox_overflowed(outbox_t *ob);
+
+/**
+ * outbox_hold_expire
+ *   Drop the held file streams whose OUTBOX_PAUSE_TIMEOUT has run out (their payloads are
+ *   released as not sent); under the disconnect policy the connection is marked overflowed
+ *   instead. Called by the handler before it waits. Stores the number of dropped streams in
+ *   *dropped and returns the milliseconds until the next held stream runs out, -1 if none is
+ *   held.
+ */
+int outbox_hold_expire(outbox_t *ob, int *dropped);
+
+/**
+ * outbox_close
+ *   Refuse further pushes. Called by the handler before it closes the wake fd.
+ */
+void outbox_close(outbox_t *ob);
+
+#endif /* OUTBOX_H */
@@ -0,0 +1,126 @@
+/* pool.h */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>     // For size_t
+#include <stdint.h>     // For uint32_t
+#include <pthread.h>    // For pthread_mutex_t, pthread_key_t
+#include <stdatomic.h>  // For the per-slot generation counters
+
+// Free slots a thread keeps for itself before handing half of them back to the shared list
+#define POOL_CACHE_SIZE   8
+
+// Threads that can hold a cache at the same time; further threads use the shared list directly
+#define POOL_MAX_CACHES   64
+
+// Alignment of every object in the slab (one cache line)
+#define POOL_ALIGN        64
+
+// Bits of a pool_id_t holding the slot index (so at most 2^18 slots per pool); the remaining
+// high bits hold the low bits of the slot's generation
+#define POOL_ID_INDEX_BITS 18
+
+/**
+ * pool_id_t
+ *   Compact handle of one lifetime of a pooled object: slot index plus generation bits. Live
+ *   generations are odd, so a valid id is never 0 (POOL_ID_NONE).
+ */
+typedef uint32_t pool_id_t;
+#define POOL_ID_NONE ((pool_id_t)0)
+
+typedef struct pool pool_t;
+
+/**
+ * pool_cache_t
+ *
+ * Free slots reserved by one thread. The owner takes and returns slots under its own mutex,
+ * which is only ever contended when another thread finds the shared list empty and steals.
+ * - pool:    The pool this cache belongs to
+ * - mutex:   Protects 'count' and 'slots' (owner vs. stealing threads)
+ * - claimed: 1 while a thread owns this cache
+ * - count:   Number of valid entries in 'slots'
+ * - slots:   Indices of free slots
+ */
+typedef struct {
+    pool_t          *pool;
+    pthread_mutex_t  mutex;
+    int              claimed;
+    unsigned         count;
+    uint32_t         slots[POOL_CACHE_SIZE];
+} pool_cache_t;
+
+/**
+ * pool_t
+ *
+ * A fixed number of equally sized objects carved out of one cache-line aligned slab.
+ * Every slot carries a generation counter that is odd while the object is handed out and
+ * even while it is free, so a (pointer, generation) pair identifies one lifetime of an
+ * object and stale pointers or double frees can be detected.
+ * - name:        Label used in diagnostics
+ * - slab:        capacity * slot_size bytes of object storage
+ * - slot_size:   Object size rounded up to POOL_ALIGN
+ * - capacity:    Number of slots
+ * - gens:        Generation counter of each slot
+ * - free_slots:  Shared stack of free slot indices, 'free_count' entries long
+ * - mutex:       Protects free_slots/free_count and cache claiming
+ * - key:         Thread-specific pointer to the calling thread's pool_cache_t
+ * - caches:      POOL_MAX_CACHES per-thread caches, claimed on a thread's first use
+ *
+ * A pool lives as long as the process: handler threads may still be returning objects when
+ * the server exits, so it is never torn down.
+ */
+struct pool {
+    const char       *name;
+    char             *slab;
+    size_t            slot_size;
+    uint32_t          capacity;
+    _Atomic uint32_t *gens;
+    uint32_t         *free_slots;
+    uint32_t          free_count;
+    pthread_mutex_t   mutex;
+    pthread_key_t     key;
+    pool_cache_t      caches[POOL_MAX_CACHES];
+};
+
+/**
+ * pool_create
+ *   Allocate a pool of 'capacity' objects of 'obj_size' bytes. 'ctor' (may be NULL) runs once
+ *   on every (zeroed) slot right here, so mutexes and condition variables embedded in the
+ *   objects are initialized exactly once for the life of the pool. Returns NULL if memory runs
+ *   out or 'capacity' exceeds 2^POOL_ID_INDEX_BITS.
+ */
+pool_t *pool_create(const char *name, size_t obj_size, uint32_t capacity,
+                    void (*ctor)(void *obj));
+
+/**
+ * pool_alloc
+ *   Hand out a free object, preferably from the calling thread's cache. The object keeps
+ *   whatever its previous user left in it (apart from what 'ctor' set up); the caller
+ *   resets the fields it uses. Returns NULL when every slot is in use.
+ */
+void *pool_alloc(pool_t *pool);
+
+/**
+ * pool_free
+ *   Return an object to the pool. Returns 0, or -1 (leaving the pool untouched) if 'obj' is
+ *   not an object currently handed out by this pool (double free or foreign pointer).
+ */
+int pool_free(pool_t *pool, void *obj);
+
+/**
+ * pool_at
+ *   The object in slot 'index' (live or not), or NULL if 'index' is out of range.
+ */
+void *pool_at(pool_t *pool, uint32_t index);
+
+/**
+ * pool_id / pool_from_id
+ *   The id of a live object, and the object an id refers to if that slot is still in the same
+ *   lifetime (else NULL). pool_from_id does not pin the object: it can be freed right after the
+ *   check, so callers take their own reference and then confirm the id on the object itself.
+ */
+pool_id_t pool_id(pool_t *pool, const void *obj);
+void *pool_from_id(pool_t *pool, pool_id_t id);
+
+#endif /* POOL_H */
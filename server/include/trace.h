@@ -0,0 +1,45 @@
+/* trace.h */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>     // For uint64_t
+
+/**
+ * trace_stamp_t
+ *
+ * Monotonic timestamps taken by the sending client's handler while it processes a
+ * /broadcast or /whisper. Passed down to the delivery functions so each recipient's outbox
+ * entry can be tied back to the moment the message was parsed.
+ * - recv_ns:   recv() returned the command bytes
+ * - parse_ns:  the command was tokenized and recognized
+ */
+typedef struct {
+    uint64_t recv_ns;
+    uint64_t parse_ns;
+} trace_stamp_t;
+
+/**
+ * trace_now
+ *   Return the current monotonic time in nanoseconds if tracing is enabled, 0 otherwise.
+ *   A zero stamp means "not traced" everywhere in this module.
+ */
+uint64_t trace_now(void);
+
+/**
+ * trace_record_delivery
+ *   Called when the last byte of a traced message has been sent to its recipient.
+ *   'parse_ns' is the sender's parse time and 'enq_ns' the time the message was queued in
+ *   the recipient's outbox. Records the enqueue, delivery and total stage latencies.
+ */
+void trace_record_delivery(uint64_t parse_ns, uint64_t enq_ns);
+
+/**
+ * trace_record_parse / trace_record_lock_wait
+ *   Record the sender-side stages: recv → parse, and parse → room member snapshot acquired.
+ *   No-ops when the stamp is absent or tracing is disabled.
+ */
+void trace_record_parse(const trace_stamp_t *stamp);
+void trace_record_lock_wait(const trace_stamp_t *stamp, uint64_t locked_ns);
+
+#endif /* TRACE_H */
@@ -0,0 +1,246 @@
+/* transfer.h */
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stddef.h>     // For size_t
+#include <stdint.h>     // For uint32_t
+#include <time.h>       // For time_t
+#include <stdatomic.h>  // For the reference count
+#include "chatserver.h" // For USERNAME_LEN, conn_id_t
+#include "filecache.h"  // For fc_entry_t
+
+#define MAX_FILENAME 256  /* Maximum length for a filename (including terminating '\0') */
+
+// Largest payload of one /chunk command
+#define TRANSFER_CHUNK_SIZE (64 * 1024)
+
+// Spacing of a transfer's CRC32C checkpoints; deliveries are cut at the same boundaries
+#define TRANSFER_MARK_SPAN OUTBOX_SLICE_SIZE
+
+// Number of checkpoints of a file of 'size' bytes
+#define TRANSFER_MARKS(size) (((size) + TRANSFER_MARK_SPAN - 1) / TRANSFER_MARK_SPAN)
+
+// Size of the recipient list as given to /sendfile ("bob", "bob,carol", "#room", ...)
+#define TRANSFER_TARGET_LEN 256
+
+// Unfinished uploads one sender, and the whole server, may hold at once (including interrupted
+// ones kept for a resume)
+#define TRANSFER_UPLOADS_PER_SENDER 8
+#define TRANSFER_UPLOADS_MAX        256
+
+// First allocation of an upload's data; it doubles as the upload needs more, up to the size
+#define TRANSFER_ALLOC_MIN  (256 * 1024)
+
+// Seconds between two runs of the reaper thread (transfer_reaper_start)
+#define TRANSFER_REAP_INTERVAL 5
+
+/**
+ * transfer_id_t
+ *   Server-wide number of a file transfer, used on the wire by /chunk, /fileack and the
+ *   [XFER], [FILE], [FILE-DATA] and [FILE-RESUME] lines. Never 0. All recipients of a file
+ *   see the same id.
+ */
+typedef uint32_t transfer_id_t;
+
+struct transfer_t;
+
+/**
+ * transfer_rcpt_t
+ *
+ * One recipient of a transfer. Every recipient is delivered to independently, from the
+ * transfer's single copy of the file.
+ * - transfer:   The transfer this entry belongs to
+ * - name:       Username of the recipient
+ * - sending:    1 while a delivery is queued for, or inside, the recipient's outbox
+ * - confirmed:  1 once the recipient confirmed the whole file (/fileack)
+ *
+ * 'sending' and 'confirmed' are guarded by the table lock.
+ */
+typedef struct transfer_rcpt_t {
+    struct transfer_t *transfer;
+    char               name[USERNAME_LEN];
+    int                sending;
+    int                confirmed;
+} transfer_rcpt_t;
+
+/**
+ * transfer_t
+ *
+ * One file on its way from a sender to one or more recipients. The file is uploaded and held
+ * once, however many recipients it has. Transfers live in a table keyed by id from the first
+ * /sendfile until every recipient confirms the whole file (/fileack) or they sit unused for
+ * server_config.resume_ttl seconds, so that either side can pick up where it stopped after
+ * reconnecting.
+ * - id:         Transfer id
+ * - filename:   Name of the file as given by the sender
+ * - sender:     Username of the sender
+ * - target:     The recipient list as given by the sender (for messages and upload resumes)
+ * - size:       Size of the file in bytes
+ * - data:       The file; the first 'received' bytes are filled in. Allocated as the upload
+ *               proceeds ('allocated' bytes of it exist, 'size' once the upload is complete)
+ * - allocated:  Bytes allocated for 'data'
+ * - blob:       The file cache entry that owns 'data' once the upload is complete (NULL
+ *               before, and if the cache could not take it; 'data' is then the transfer's own)
+ * - marks:      CRC32C checkpoints: marks[k] is the CRC32C of the first
+ *               min((k + 1) * TRANSFER_MARK_SPAN, size) bytes, filled in as the upload passes
+ *               them (owned like 'data'; the last one is the CRC32C of the whole file)
+ * - received:   Upload offset: bytes received from the sender so far (size when complete)
+ * - crc:        CRC32C of the first 'received' bytes
+ * - uploader:   Connection currently allowed to send /chunk for it (CONN_ID_NONE if none)
+ * - touched:    Last upload or delivery activity (for expiry)
+ * - refs:       The table's reference plus one per user (handler, queue item, outbox)
+ * - next:       Next transfer in the same table bucket
+ * - unconfirmed: Recipients that have not confirmed the file yet
+ * - nrcpt:      Number of entries in 'rcpts'
+ * - rcpts:      The recipients (allocated together with the transfer)
+ *
+ * received, crc, uploader, touched, next and unconfirmed are guarded by the table lock; the rest
+ * never changes after transfer_start, apart from 'data' and 'allocated', which only the uploader
+ * touches before the upload is complete. Bytes of 'data' below 'received' never change; only the
+ * uploader writes above it.
+ */
+typedef struct transfer_t {
+    transfer_id_t      id;
+    char               filename[MAX_FILENAME];
+    char               sender[USERNAME_LEN];
+    char               target[TRANSFER_TARGET_LEN];
+    size_t             size;
+    char              *data;
+    size_t             allocated;
+    fc_entry_t        *blob;
+    uint32_t          *marks;
+    size_t             received;
+    uint32_t           crc;
+    conn_id_t          uploader;
+    time_t             touched;
+    _Atomic int        refs;
+    struct transfer_t *next;
+    int                unconfirmed;
+    int                nrcpt;
+    transfer_rcpt_t    rcpts[];
+} transfer_t;
+
+/**
+ * transfer_start
+ *   Begin (or resume) an upload of 'filename' ('size' bytes) from 'sender' over connection
+ *   'uploader' to the 'nrcpt' users in 'names', which the sender addressed as 'target'. An
+ *   unfinished upload with the same sender, target, name and size is resumed (with the
+ *   recipients it started with); otherwise a new transfer is created, unless the sender already
+ *   holds TRANSFER_UPLOADS_PER_SENDER unfinished uploads or the server TRANSFER_UPLOADS_MAX
+ *   (then *limited is set to 1). The file's memory is allocated as it arrives (see
+ *   transfer_reserve). Stores the offset to continue from in *offset. Returns a referenced
+ *   transfer, or NULL if memory ran out or a limit was reached.
+ */
+transfer_t *transfer_start(const char *sender, const char *target,
+                           const char (*names)[USERNAME_LEN], int nrcpt,
+                           const char *filename, size_t size, conn_id_t uploader,
+                           size_t *offset, int *limited);
+
+/**
+ * transfer_start_cached
+ *   Create a complete transfer of cached content 'blob' (filecache_lookup) named 'filename'
+ *   from 'sender' to the 'nrcpt' users in 'names', addressed as 'target': the file is already
+ *   on the server and nothing has to be uploaded. Takes over the caller's reference on 'blob'
+ *   (also on failure). Returns a referenced transfer, or NULL if memory ran out.
+ */
+transfer_t *transfer_start_cached(const char *sender, const char *target,
+                                  const char (*names)[USERNAME_LEN], int nrcpt,
+                                  const char *filename, fc_entry_t *blob);
+
+/**
+ * transfer_get
+ *   Look up transfer 'id'. Returns a referenced transfer, or NULL if there is none.
+ */
+transfer_t *transfer_get(transfer_id_t id);
+
+/**
+ * transfer_recipient
+ *   The entry of user 'name' among the recipients of 't', or NULL if the file is not for them.
+ */
+transfer_rcpt_t *transfer_recipient(transfer_t *t, const char *name);
+
+/**
+ * transfer_retain / transfer_release
+ *   Take or drop a reference. The last release frees the transfer and its data.
+ */
+void transfer_retain(transfer_t *t);
+void transfer_release(transfer_t *t);
+
+/**
+ * transfer_reserve
+ *   Make sure the first 'end' (at most 'size') bytes of the data of 't' are allocated, before the
+ *   uploader writes up to there. Uploader only. Returns the data, or NULL if memory ran out.
+ */
+char *transfer_reserve(transfer_t *t, size_t end);
+
+/**
+ * transfer_upload
+ *   Account 'n' more bytes the uploader wrote at data + received, extending the transfer's
+ *   CRC32C and checkpoints over them while they are still in cache. If 'expect' is not NULL
+ *   it is the sender's CRC32C of the file up to the end of these bytes; on a mismatch nothing
+ *   is accounted and the bytes are received again from the same offset. The last bytes hand
+ *   the file to the file cache, which may swap 'data' for an identical cached copy. Returns 1
+ *   if the upload is now complete, 0 if more is expected, -1 on a checksum mismatch.
+ */
+int transfer_upload(transfer_t *t, size_t n, const uint32_t *expect);
+
+/**
+ * transfer_upload_offset
+ *   The upload offset of 't' if 'conn' is its uploader, (size_t)-1 otherwise.
+ */
+size_t transfer_upload_offset(transfer_t *t, conn_id_t conn);
+
+/**
+ * transfer_detach
+ *   Stop 'conn' being the uploader of any transfer (it disconnected); its partial uploads stay
+ *   resumable until they expire.
+ */
+void transfer_detach(conn_id_t conn);
+
+/**
+ * transfer_delivery_begin
+ *   Mark the delivery of a fully uploaded transfer to recipient 'r' as under way. Returns 1 if
+ *   the caller should queue the delivery, 0 if one is already under way, the recipient has
+ *   confirmed the file or the upload is not complete.
+ */
+int transfer_delivery_begin(transfer_rcpt_t *r);
+
+/**
+ * transfer_delivery_end
+ *   Clear the mark set by transfer_delivery_begin (the delivery finished or failed).
+ */
+void transfer_delivery_end(transfer_rcpt_t *r);
+
+/**
+ * transfer_confirm
+ *   Recipient 'r' has the whole file. Once every recipient has it, the transfer is removed from
+ *   the table; users keep their references.
+ */
+void transfer_confirm(transfer_rcpt_t *r);
+
+/**
+ * transfer_pending_for
+ *   Store in 'out' up to 'max' recipient entries of user 'name' in transfers that are fully
+ *   uploaded and neither being delivered to them nor confirmed (left over from an earlier
+ *   connection of that user), each with a reference on its transfer. Returns how many there
+ *   are, which may be more than 'max' (only the first 'max' are stored).
+ */
+size_t transfer_pending_for(const char *name, transfer_rcpt_t **out, size_t max);
+
+/**
+ * transfer_reap
+ *   Drop transfers nobody uses that have been idle for server_config.resume_ttl seconds.
+ *   Returns how many were dropped.
+ */
+size_t transfer_reap(void);
+
+/**
+ * transfer_reaper_start / transfer_reaper_stop
+ *   Start a thread that runs transfer_reap every TRANSFER_REAP_INTERVAL seconds (returns 0, or
+ *   -1 if it could not be created), and stop it again.
+ */
+int  transfer_reaper_start(void);
+void transfer_reaper_stop(void);
+
+#endif /* TRANSFER_H */
@@ -0,0 +1,120 @@
+/* uring.h */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>             // For size_t
+#include <stdint.h>             // For uint16_t
+#include <linux/io_uring.h>     // For struct io_uring_sqe/cqe, IORING_* constants
+
+/**
+ * uring_t
+ *
+ * Minimal io_uring instance driven through the raw io_uring_setup/io_uring_enter/
+ * io_uring_register system calls (the server does not depend on liburing).
+ * A ring is owned by a single thread; nothing here is thread-safe.
+ * - fd:            Ring file descriptor
+ * - features:      IORING_FEAT_* bits reported by the kernel
+ * - sq_*:          Pointers into the mmap'ed submission ring (head, tail, mask, index array)
+ * - sqes:          The mmap'ed submission queue entries
+ * - sqe_tail:      Next local SQE slot; entries between *sq_tail and this are prepared but
+ *                  not yet published to the kernel
+ * - cq_*:          Pointers into the mmap'ed completion ring
+ * - sq_ring/cq_ring and their sizes: The mappings, for munmap (cq_ring == sq_ring when the
+ *                  kernel supports IORING_FEAT_SINGLE_MMAP)
+ */
+typedef struct {
+    int                  fd;
+    unsigned             features;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned             sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned             sqe_tail;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring;
+    size_t               sq_ring_size;
+    void                *cq_ring;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+} uring_t;
+
+/**
+ * uring_bufring_t
+ *
+ * A provided-buffer ring (IORING_REGISTER_PBUF_RING): 'count' buffers of 'buf_size' bytes that
+ * the kernel picks from when a receive is submitted with IOSQE_BUFFER_SELECT. The buffer id
+ * arrives in the completion's flags and the buffer is handed back with uring_bufring_recycle.
+ * - ring:       The shared ring of buffer descriptors
+ * - ring_size:  Size of the 'ring' mapping
+ * - data:       count * buf_size bytes of buffer space
+ * - buf_size:   Size of each buffer
+ * - count:      Number of buffers (a power of two)
+ * - group:      Buffer group id used in SQEs
+ */
+typedef struct {
+    struct io_uring_buf_ring *ring;
+    size_t                    ring_size;
+    char                     *data;
+    size_t                    buf_size;
+    unsigned                  count;
+    uint16_t                  group;
+} uring_bufring_t;
+
+/**
+ * uring_init / uring_exit
+ *   Create a ring with room for 'entries' submissions, or tear it down (outstanding requests
+ *   are cancelled by the kernel). The ring is set up for use by the creating thread only,
+ *   which lets newer kernels skip cross-thread wake-ups; older kernels get a plain ring.
+ *   uring_init returns 0 on success or a negative errno.
+ */
+int  uring_init(uring_t *ring, unsigned entries);
+void uring_exit(uring_t *ring);
+
+/**
+ * uring_get_sqe
+ *   Return a zeroed submission entry to fill in, or NULL if the submission queue is full.
+ *   Prepared entries are handed to the kernel by the next uring_submit_and_wait.
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/**
+ * uring_submit_and_wait
+ *   Submit every prepared entry and wait until at least 'wait_nr' completions are available,
+ *   in a single io_uring_enter call. 'timeout_ms' < 0 waits without a limit.
+ *   Returns 0 on success, -ETIME if the timeout expired, or another negative errno
+ *   (-EINTR when a signal arrived).
+ */
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr, int timeout_ms);
+
+/**
+ * uring_peek_cqe / uring_cqe_seen
+ *   Return the oldest unconsumed completion (NULL if there is none), and mark it consumed.
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+/**
+ * uring_bufring_init / uring_bufring_free
+ *   Allocate 'count' (power of two) buffers of 'buf_size' bytes, register them with 'ring' as
+ *   buffer group 'group' and make all of them available. Returns 0 or a negative errno.
+ *   uring_bufring_free unregisters the group and releases the memory.
+ */
+int  uring_bufring_init(uring_t *ring, uring_bufring_t *br, uint16_t group,
+                        unsigned count, size_t buf_size);
+void uring_bufring_free(uring_t *ring, uring_bufring_t *br);
+
+/**
+ * uring_bufring_buf / uring_bufring_recycle
+ *   Address of buffer 'bid', and hand buffer 'bid' back to the kernel once its data has been
+ *   consumed.
+ */
+char *uring_bufring_buf(uring_bufring_t *br, unsigned bid);
+void  uring_bufring_recycle(uring_bufring_t *br, unsigned bid);
+
+#endif /* URING_H */
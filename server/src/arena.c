@@ -0,0 +1,119 @@
+/* arena.c */
+
+#include "arena.h"
+#include <stdio.h>      // For vsnprintf
+#include <stdlib.h>     // For malloc, free
+#include <string.h>     // For memcpy, strlen
+
+// Alignment of arena_alloc results
+#define ARENA_ALIGN 8
+
+/* ----------------------------------------------------------------------------
+ * Arena
+ * ----------------------------------------------------------------------------
+ */
+
+int arena_init(arena_t *a, size_t size) {
+    a->used = 0;
+    if (a->base && a->size >= size) {
+        return 0;
+    }
+    free(a->base);
+    a->base = malloc(size);
+    a->size = a->base ? size : 0;
+    return a->base ? 0 : -1;
+}
+
+void arena_reset(arena_t *a) {
+    a->used = 0;
+}
+
+void *arena_alloc(arena_t *a, size_t n) {
+    size_t start = (a->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (start > a->size || n > a->size - start) {
+        return NULL;
+    }
+    a->used = start + n;
+    return a->base + start;
+}
+
+/* ----------------------------------------------------------------------------
+ * String builder
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * sb_start
+ *
+ * An arena without space left yields a builder over a static empty string, so callers never
+ * have to check: everything appended is dropped and sb_end returns "".
+ */
+void sb_start(strbuf_t *sb, arena_t *a) {
+    static char empty[1];
+
+    sb->arena = a;
+    sb->len   = 0;
+    if (a->base && a->used < a->size) {
+        sb->data = a->base + a->used;
+        sb->cap  = a->size - a->used;
+    } else {
+        sb->data = empty;
+        sb->cap  = 1;
+    }
+    sb->data[0] = '\0';
+}
+
+const char *sb_end(strbuf_t *sb) {
+    sb->data[sb->len] = '\0';
+    if (sb->cap > 1) {
+        sb->arena->used += sb->len + 1;
+    }
+    return sb->data;
+}
+
+void sb_put(strbuf_t *sb, const char *s, size_t n) {
+    size_t room = sb->cap - 1 - sb->len;
+    if (n > room) {
+        n = room;
+    }
+    memcpy(sb->data + sb->len, s, n);
+    sb->len += n;
+}
+
+void sb_puts(strbuf_t *sb, const char *s) {
+    sb_put(sb, s, strlen(s));
+}
+
+void sb_putc(strbuf_t *sb, char c) {
+    if (sb->len + 1 < sb->cap) {
+        sb->data[sb->len++] = c;
+    }
+}
+
+void sb_vprintf(strbuf_t *sb, const char *fmt, va_list ap) {
+    size_t room = sb->cap - sb->len;
+    int n = vsnprintf(sb->data + sb->len, room, fmt, ap);
+    if (n > 0) {
+        sb->len += (size_t)n < room ? (size_t)n : room - 1;
+    }
+}
+
+void sb_printf(strbuf_t *sb, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    sb_vprintf(sb, fmt, ap);
+    va_end(ap);
+}
+
+void sb_vcat(strbuf_t *sb, va_list ap) {
+    for (const char *s = va_arg(ap, const char *); s; s = va_arg(ap, const char *)) {
+        sb_puts(sb, s);
+    }
+}
+
+void sb_cat(strbuf_t *sb, ...) {
+    va_list ap;
+    va_start(ap, sb);
+    sb_vcat(sb, ap);
+    va_end(ap);
+}
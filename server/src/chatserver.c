@@ -12,12 +12,20 @@
 #include <unistd.h>           // For close, write, read, getpid
 #include <sys/socket.h>       // For socket, bind, listen, accept, setsockopt
 #include <sys/un.h>           // For AF_UNIX, socketpair
-#include <sys/select.h>       // For select(), fd_set macros
+#include <netinet/tcp.h>      // For TCP_NOTSENT_LOWAT
 #include <errno.h>            // For errno, EINTR
-#include <ctype.h>            // For isalnum
 #include <sys/syscall.h>      // For syscall(SYS_gettid)
 #include <signal.h>           // For sigaction, SIGINT
 #include "log.h"              // Custom logging utility (timestamps, file writes)
+#include "metrics.h"          // Counters, gauges and histograms for the admin endpoint
+#include "lockprof.h"         // Instrumented locking (make LOCKPROF=1)
+#include "pool.h"             // Slab pools for connection_t and room_t
+#include "command.h"          // Command table shared with the client
+#include "textscan.h"         // Vectorized newline/delimiter search and name/UTF-8 validation
+#include "crc32c.h"           // For crc32c_impl_name (start-up log)
+#include "lz4block.h"         // For decompressing /zchunk payloads
+#include <stdarg.h>           // For va_list (conn_log, conn_reply)
+#include <ctype.h>            // For isdigit, isxdigit (parse_number)
 
 /* ------------------------------------------------------------------------- */
 /* Global State Variables                                                     */
@@ -30,28 +38,245 @@ volatile sig_atomic_t stop = 0;
 int server_fd = -1;
 
 /**
- * Array of pointers to all active connections. Indexed 0..MAX_CONN-1.
- * If connections[i] is NULL, that slot is free; otherwise it points to an allocated connection_t.
+ * Room name index: a hash table (a power of two, at least server_config.max_rooms buckets) of
+ * open rooms, chained through room_t.name_next. Allocated in main() once the configuration is
+ * known. Only /join goes through it; everything else refers to rooms by room_id_t.
  */
-connection_t *connections[MAX_CONN] = {0};
+static room_t  **room_buckets     = NULL;
+static uint32_t  room_bucket_mask = 0;
 
 /**
- * Mutex protecting concurrent access to the global 'connections' array.
- * Must be held by any thread that reads or writes the 'connections' array, including add/remove.
+ * Mutex protecting the room name index. Held while a room is looked up by name, created, or
+ * unlinked after being retired; never together with a room's own mutex.
  */
-pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t rooms_mutex = PTHREAD_MUTEX_INITIALIZER;
+LOCKPROF_SITE(rooms_lp, "rooms_mutex");
+
+// Every room_t.mutex shares this profiling site, so the report shows the lock class as a whole.
+LOCKPROF_SITE(room_lp, "room->mutex");
+LOCKPROF_SITE(snapshot_lp, "room->snapshot_mutex");
 
 /**
- * Array of pointers to all existing chat rooms. Indexed 0..MAX_ROOMS-1.
- * If rooms[i] is NULL, that slot is free; otherwise it points to an allocated room_t.
+ * Slab pools every connection_t and room_t is taken from, created in main() once the
+ * configuration is known. Their mutexes and condition variables are initialized once per
+ * slot when the pool is created, so connection and room churn costs no malloc/free and no
+ * re-initialization. The connection pool has room for server_config.max_conn live users plus
+ * one departed connection per upload worker still delivering to it.
  */
-room_t *rooms[MAX_ROOMS] = {0};
+static pool_t *connection_pool = NULL;
+static pool_t *room_pool       = NULL;
+
+/* ------------------------------------------------------------------------- */
+/* Pooled Object Setup                                                        */
+/* ------------------------------------------------------------------------- */
 
 /**
- * Mutex protecting concurrent access to the global 'rooms' array.
- * Must be held by any thread that reads or writes the 'rooms' array, including creation or deletion.
+ * connection_ctor
+ *   Initialize (once per pool slot) the synchronization objects embedded in a connection_t:
+ *   the thread start-up handshake and the outbox.
  */
-pthread_mutex_t rooms_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void connection_ctor(void *obj) {
+    connection_t *c = obj;
+    pthread_mutex_init(&c->thread_info.init_mutex, NULL);
+    pthread_cond_init(&c->thread_info.init_cond, NULL);
+    outbox_init(&c->outbox, 0);
+}
+
+/**
+ * room_ctor
+ *   Initialize (once per pool slot) a room_t's mutexes. The member array lives right after the
+ *   struct in the same slot.
+ */
+static void room_ctor(void *obj) {
+    room_t *room = obj;
+    room->members = (conn_id_t *)(room + 1);
+    pthread_mutex_init(&room->mutex, NULL);
+    pthread_mutex_init(&room->snapshot_mutex, NULL);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Static Replies                                                             */
+/* ------------------------------------------------------------------------- */
+
+/**
+ * reply_id_t / static_replies
+ *   Every fixed reply the server sends, with its length computed at compile time, so queueing
+ *   or sending one is a single memcpy (or send) without strlen.
+ */
+typedef enum {
+    REPLY_BYE,
+    REPLY_WHISPER_USAGE,
+    REPLY_JOIN_USAGE,
+    REPLY_BAD_ROOM_NAME,
+    REPLY_ROOM_SLOTS_FULL,
+    REPLY_ROOM_FULL,
+    REPLY_BROADCAST_USAGE,
+    REPLY_JOIN_FIRST,
+    REPLY_SENDFILE_USAGE,
+    REPLY_OUT_OF_MEMORY,
+    REPLY_TOO_MANY_UPLOADS,
+    REPLY_FILE_INCOMPLETE,
+    REPLY_BAD_CHUNK,
+    REPLY_BAD_CHECKSUM,
+    REPLY_FILEACK_USAGE,
+    REPLY_UNKNOWN_COMMAND,
+    REPLY_BAD_USERNAME,
+    REPLY_USERNAME_TAKEN,
+    REPLY_SERVER_FULL,
+    REPLY_USERNAME_OK,
+    REPLY_USERNAME_OK_LZ4,
+    REPLY_SHUTDOWN,
+    REPLY_BAD_UTF8,
+    REPLY_COUNT
+} reply_id_t;
+
+typedef struct {
+    const char *text;
+    size_t      len;
+} static_reply_t;
+
+#define STATIC_REPLY(text) { text, sizeof(text) - 1 }
+
+static const static_reply_t static_replies[REPLY_COUNT] = {
+    [REPLY_BYE]             = STATIC_REPLY("[INFO] Server is shutting down your connection.\n"),
+    [REPLY_WHISPER_USAGE]   = STATIC_REPLY("[ERROR] Usage: /whisper <user> <message>\n"),
+    [REPLY_JOIN_USAGE]      = STATIC_REPLY("[ERROR] Usage: /join <room>\n"),
+    [REPLY_BAD_ROOM_NAME]   = STATIC_REPLY("[ERROR] Room name must be 1–32 alphanumeric characters.\n"),
+    [REPLY_ROOM_SLOTS_FULL] = STATIC_REPLY("[WARN] Room slots are full. Room is not created. Try again later.\n"),
+    [REPLY_ROOM_FULL]       = STATIC_REPLY("[WARN] Room is full\n"),
+    [REPLY_BROADCAST_USAGE] = STATIC_REPLY("[ERROR] Usage: /broadcast <msg>\n"),
+    [REPLY_JOIN_FIRST]      = STATIC_REPLY("[ERROR] Join a room first\n"),
+    [REPLY_SENDFILE_USAGE]  = STATIC_REPLY("[ERROR] Usage: /sendfile <filename> <user|user1,user2|#room> <size>\n"),
+    [REPLY_OUT_OF_MEMORY]   = STATIC_REPLY("[ERROR] Server out of memory. Try later.\n"),
+    [REPLY_TOO_MANY_UPLOADS] = STATIC_REPLY("[ERROR] Too many unfinished uploads. Finish one or try later.\n"),
+    [REPLY_FILE_INCOMPLETE] = STATIC_REPLY("[ERROR] Failed to receive full file data.\n"),
+    [REPLY_BAD_CHUNK]       = STATIC_REPLY("[ERROR] Invalid or unknown file chunk.\n"),
+    [REPLY_BAD_CHECKSUM]    = STATIC_REPLY("[ERROR] File chunk failed its checksum. Send the file again to resume.\n"),
+    [REPLY_FILEACK_USAGE]   = STATIC_REPLY("[ERROR] Usage: /fileack <transfer> <offset>\n"),
+    [REPLY_UNKNOWN_COMMAND] = STATIC_REPLY("[ERROR] Unknown command.\n"),
+    [REPLY_BAD_USERNAME]    = STATIC_REPLY("[ERROR] Username must be 1–16 alphanumeric characters.\n"),
+    [REPLY_USERNAME_TAKEN]  = STATIC_REPLY("[ERROR] Username already taken. Choose another.\n"),
+    [REPLY_SERVER_FULL]     = STATIC_REPLY("[ERROR] Server is full. Try again later.\n"),
+    [REPLY_USERNAME_OK]     = STATIC_REPLY("[OK] Username accepted.\n"),
+    [REPLY_USERNAME_OK_LZ4] = STATIC_REPLY("[OK] Username accepted. Compression: lz4\n"),
+    [REPLY_SHUTDOWN]        = STATIC_REPLY("[SERVER] shutting down. Goodbye.\n"),
+    [REPLY_BAD_UTF8]        = STATIC_REPLY("[ERROR] Message is not valid UTF-8.\n"),
+};
+
+/**
+ * send_static
+ *   send() a fixed reply straight to a socket (handshake and shutdown, before or after a
+ *   connection has an outbox).
+ */
+static void send_static(int fd, reply_id_t id, int flags) {
+    send(fd, static_replies[id].text, static_replies[id].len, flags);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Per-Connection Formatting                                                  */
+/* ------------------------------------------------------------------------- */
+
+/**
+ * conn_intern_prefixes
+ *   Build the connection's log and chat prefixes once its handler knows its TID, so the hot
+ *   paths only copy them (see conn_log_parts and room_broadcast).
+ */
+static void conn_intern_prefixes(connection_t *connection) {
+    int n = snprintf(connection->log_prefix, LOG_PREFIX_LEN, "[THREAD-INFO (TID: %d)] ",
+                     connection->thread_info.tid);
+    connection->tid_prefix_len = (size_t)n;
+    n += snprintf(connection->log_prefix + n, LOG_PREFIX_LEN - (size_t)n, "User '%s'",
+                  connection->username);
+    connection->user_prefix_len = (size_t)n;
+
+    n = snprintf(connection->chat_prefix, CHAT_PREFIX_LEN, "[%s] ", connection->username);
+    connection->chat_prefix_len = (size_t)n;
+}
+
+/**
+ * send_reply
+ *   Queue a fixed reply ([OK], [ERROR], [INFO], ...) for the client. It goes out together with any
+ *   relayed messages in the handler's next outbox flush instead of costing its own send().
+ */
+static void send_reply(connection_t *connection, reply_id_t id) {
+    outbox_push_reply(&connection->outbox, static_replies[id].text, static_replies[id].len);
+}
+
+/**
+ * conn_log_parts
+ *   Log line made of the first 'prefix_len' bytes of the connection's interned log prefix
+ *   (tid_prefix_len or user_prefix_len) followed by a NULL-terminated list of strings. Nothing
+ *   is formatted: the line is assembled in the arena by copying. Handler thread only.
+ */
+static void conn_log_parts(connection_t *connection, size_t prefix_len, ...)
+    __attribute__((sentinel));
+static void conn_log_parts(connection_t *connection, size_t prefix_len, ...) {
+    strbuf_t sb;
+    va_list ap;
+    sb_start(&sb, &connection->arena);
+    sb_put(&sb, connection->log_prefix, prefix_len);
+    va_start(ap, prefix_len);
+    sb_vcat(&sb, ap);
+    va_end(ap);
+    const char *line = sb_end(&sb);
+    log_write(line);
+    safe_print(line);
+}
+
+/**
+ * conn_reply_parts
+ *   Reply made of a NULL-terminated list of strings, joined in the connection's arena and
+ *   queued in its outbox. Handler thread only.
+ */
+static void conn_reply_parts(connection_t *connection, ...) __attribute__((sentinel));
+static void conn_reply_parts(connection_t *connection, ...) {
+    strbuf_t sb;
+    va_list ap;
+    sb_start(&sb, &connection->arena);
+    va_start(ap, connection);
+    sb_vcat(&sb, ap);
+    va_end(ap);
+    sb_end(&sb);
+    outbox_push_reply(&connection->outbox, sb.data, sb.len);
+}
+
+/**
+ * conn_log
+ *   printf-style log line for a connection: formatted in the connection's arena (no stack
+ *   buffer, no malloc), then written to the log file and the console.
+ *   Only the connection's own handler thread may call this (it owns the arena).
+ */
+static void conn_log(connection_t *connection, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void conn_log(connection_t *connection, const char *fmt, ...) {
+    strbuf_t sb;
+    va_list ap;
+    sb_start(&sb, &connection->arena);
+    va_start(ap, fmt);
+    sb_vprintf(&sb, fmt, ap);
+    va_end(ap);
+    const char *line = sb_end(&sb);
+    log_write(line);
+    safe_print(line);
+}
+
+/**
+ * conn_reply
+ *   printf-style reply to the client, formatted in the connection's arena and queued in its
+ *   outbox like send_reply. Handler thread only.
+ */
+static void conn_reply(connection_t *connection, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void conn_reply(connection_t *connection, const char *fmt, ...) {
+    strbuf_t sb;
+    va_list ap;
+    sb_start(&sb, &connection->arena);
+    va_start(ap, fmt);
+    sb_vprintf(&sb, fmt, ap);
+    va_end(ap);
+    sb_end(&sb);
+    outbox_push_reply(&connection->outbox, sb.data, sb.len);
+}
 
 /* ------------------------------------------------------------------------- */
 /* File Upload Queue                                                             */
@@ -65,11 +290,8 @@ pthread_mutex_t rooms_mutex = PTHREAD_MUTEX_INITIALIZER;
  */
 static file_queue_t *upload_queue = NULL;
 
-// Number of worker threads dedicated to servicing file upload tasks.
-#define NUM_UPLOAD_WORKERS 5
-
-// Array of pthread_t handles for the file-upload worker threads.
-static pthread_t upload_workers[NUM_UPLOAD_WORKERS];
+// Array of server_config.upload_workers pthread_t handles for the file-upload worker threads.
+static pthread_t *upload_workers = NULL;
 
 /* ------------------------------------------------------------------------- */
 /* Utility: Thread-Safe Console Printing                                           */
@@ -80,6 +302,7 @@ static pthread_t upload_workers[NUM_UPLOAD_WORKERS];
  *   Protects against multiple threads writing to STDOUT at the same time.
  */
 static pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+LOCKPROF_SITE(print_lp, "print_mutex");
 
 /**
  * safe_print
@@ -87,13 +310,22 @@ static pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
  *   Locks a mutex, writes the message, writes a newline, then unlocks.
  */
 void safe_print(const char *msg) {
-    pthread_mutex_lock(&print_mutex);
+    LP_LOCK(&print_mutex, &print_lp);
     write(STDOUT_FILENO, msg, strlen(msg));
     write(STDOUT_FILENO, "\n", 1);
-    pthread_mutex_unlock(&print_mutex);
+    LP_UNLOCK(&print_mutex, &print_lp);
 }
 
 
+/**
+ * print_lock_report_line
+ *   Output callback for lockprof_report: every line goes to both the log and the console.
+ */
+static void print_lock_report_line(const char *line) {
+    log_write(line);
+    safe_print(line);
+}
+
 /* ------------------------------------------------------------------------- */
 /* Signal Handler                                                               */
 /* ------------------------------------------------------------------------- */
@@ -116,46 +348,149 @@ static void handle_sigint(int sig) {
 /* ------------------------------------------------------------------------- */
 
 /**
- * room_find_free_slot_locked
- *   Internal helper (assumes rooms_mutex is already held). Returns the first index i in 0..MAX_ROOMS-1
- *   where rooms[i] is NULL, or -1 if no free slot exists.
+ * room_index_init
+ *   Allocate the room name index for server_config.max_rooms rooms. Returns 0 on success, -1 if
+ *   memory runs out.
+ */
+static int room_index_init(void) {
+    uint32_t buckets = 1;
+    while (buckets < (uint32_t)server_config.max_rooms) {
+        buckets <<= 1;
+    }
+    room_buckets = calloc(buckets, sizeof(*room_buckets));
+    if (!room_buckets) {
+        return -1;
+    }
+    room_bucket_mask = buckets - 1;
+    return 0;
+}
+
+/**
+ * room_bucket
+ *   The room_buckets chain 'name' hashes to (FNV-1a).
+ */
+static room_t **room_bucket(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return &room_buckets[h & room_bucket_mask];
+}
+
+/**
+ * room_lookup_locked
+ *   Internal helper (assumes rooms_mutex is held). The open room named 'name', or NULL. A room
+ *   that was retired but is not unlinked yet is skipped.
  */
-static int room_find_free_slot_locked(void) {
-    for (int i = 0; i < MAX_ROOMS; ++i) {
-        if (rooms[i] == NULL) {
-            return i;
+static room_t *room_lookup_locked(const char *name) {
+    for (room_t *r = *room_bucket(name); r; r = r->name_next) {
+        if (atomic_load_explicit(&r->id, memory_order_relaxed) != ROOM_ID_NONE &&
+            strcmp(r->name, name) == 0) {
+            return r;
         }
     }
-    return -1;
+    return NULL;
 }
 
 /**
- * room_find
- *   Search for an existing chat room by name. Returns a pointer to the room_t if found, NULL otherwise.
- *   Locks rooms_mutex around the iteration for thread-safety.
+ * room_get
+ *   The room with id 'id', or NULL if that room was retired. Only a member of the room (whose
+ *   presence keeps it open) may use the result without further checks; anyone else must lock
+ *   room->mutex and confirm room->id first.
  */
-room_t *room_find(const char *name) {
-    room_t *res = NULL;
-    pthread_mutex_lock(&rooms_mutex);
-    for (int i = 0; i < MAX_ROOMS; ++i) {
-        if (rooms[i] && strcmp(rooms[i]->name, name) == 0) {
-            res = rooms[i];
-            break;
+static room_t *room_get(room_id_t id) {
+    room_t *room = pool_from_id(room_pool, id);
+    return room && atomic_load_explicit(&room->id, memory_order_acquire) == id ? room : NULL;
+}
+
+/**
+ * snapshot_release
+ *   Drop one reference on a member snapshot. The last reference releases the snapshot's
+ *   references on the member connections and frees it. Accepts NULL.
+ */
+static void snapshot_release(member_snapshot_t *snap) {
+    if (snap && atomic_fetch_sub_explicit(&snap->refs, 1, memory_order_acq_rel) == 1) {
+        for (int i = 0; i < snap->count; ++i) {
+            connection_release(snap->members[i]);
+        }
+        free(snap);
+    }
+}
+
+/**
+ * room_snapshot_acquire
+ *   Take a reference on the room's current member snapshot (NULL if none was published yet).
+ *   snapshot_mutex is held only for the pointer load and the reference increment, never while
+ *   a broadcast is being delivered.
+ */
+static member_snapshot_t *room_snapshot_acquire(room_t *room) {
+    LP_LOCK(&room->snapshot_mutex, &snapshot_lp);
+    member_snapshot_t *snap = room->snapshot;
+    if (snap) {
+        atomic_fetch_add_explicit(&snap->refs, 1, memory_order_relaxed);
+    }
+    LP_UNLOCK(&room->snapshot_mutex, &snapshot_lp);
+    return snap;
+}
+
+/**
+ * room_publish_locked
+ *   Internal helper (assumes room->mutex is held). Resolve the current members[] ids into a new
+ *   snapshot of connection pointers (each with a reference taken), make it the room's current
+ *   one, and drop the room's reference on the old one. Broadcasts already iterating the old
+ *   snapshot finish on it undisturbed. If the allocation fails the previous snapshot stays
+ *   published.
+ */
+static void room_publish_locked(room_t *room) {
+    member_snapshot_t *snap = malloc(sizeof(*snap) +
+                                     (size_t)room->member_count * sizeof(connection_t *));
+    if (!snap) {
+        log_write("[THREAD-ERROR] Could not allocate a room member snapshot; keeping the old one");
+        return;
+    }
+    atomic_init(&snap->refs, 1);
+    snap->count = 0;
+    for (int i = 0; i < server_config.room_capacity && snap->count < room->member_count; ++i) {
+        if (room->members[i] != CONN_ID_NONE) {
+            connection_t *member = connection_acquire_id(room->members[i]);
+            if (member) {
+                snap->members[snap->count++] = member;
+            }
         }
     }
-    pthread_mutex_unlock(&rooms_mutex);
-    return res;
+
+    LP_LOCK(&room->snapshot_mutex, &snapshot_lp);
+    member_snapshot_t *old = room->snapshot;
+    room->snapshot = snap;
+    LP_UNLOCK(&room->snapshot_mutex, &snapshot_lp);
+
+    snapshot_release(old);
+}
+
+/**
+ * room_lookup
+ *   Map a room name to the id of the open room with that name. Locks rooms_mutex for one hash
+ *   bucket walk. Returns ROOM_ID_NONE if there is no such room.
+ */
+room_id_t room_lookup(const char *name) {
+    LP_LOCK(&rooms_mutex, &rooms_lp);
+    room_t *room = room_lookup_locked(name);
+    room_id_t id = room ? atomic_load_explicit(&room->id, memory_order_relaxed) : ROOM_ID_NONE;
+    LP_UNLOCK(&rooms_mutex, &rooms_lp);
+    return id;
 }
 
 /**
  * room_create
- *   Create a new chat room with the given name, if it does not already exist.
- *   - If a room with that name already exists, simply return it.
- *   - Otherwise, allocate a new room_t, initialize its mutex, set the name, and add it to the first free slot.
- *   - If no free slot is available, return NULL.
+ *   Find or create the chat room with the given name, under one hold of rooms_mutex (so two
+ *   users creating the same room at once end up in the same one).
+ *   - If an open room with that name exists, return its id.
+ *   - Otherwise, take a room_t (with room_capacity member slots in the same block) from room_pool,
+ *     reset it, set the name, give it its id and link it into the name index.
+ *   - If room_pool is exhausted (server_config.max_rooms rooms are open), return ROOM_ID_NONE.
  *   Logs creation events or warnings if slots are full.
  */
-room_t *room_create(const char *name, connection_t *connection) {
+room_id_t room_create(const char *name, connection_t *connection) {
     if (!connection) {
         // Defensive check: a valid connection pointer must be provided (used for logging TID).
         char msg[BUF_SIZE];
@@ -164,140 +499,126 @@ room_t *room_create(const char *name, connection_t *connection) {
                  name);
         log_write(msg);
         safe_print(msg);
-        return NULL;
+        return ROOM_ID_NONE;
     }
 
-    // If room already exists, return it immediately
-    room_t *room = room_find(name);
+    LP_LOCK(&rooms_mutex, &rooms_lp);
+    room_t *room = room_lookup_locked(name);
     if (room) {
-        return room;
+        // Room already exists
+        room_id_t id = atomic_load_explicit(&room->id, memory_order_relaxed);
+        LP_UNLOCK(&rooms_mutex, &rooms_lp);
+        return id;
     }
 
-    // Acquire global rooms lock to find a free slot and insert the new room
-    pthread_mutex_lock(&rooms_mutex);
-    int idx = room_find_free_slot_locked();
-    if (idx != -1) {
-        // Allocate and initialize a new room_t
-        room = calloc(1, sizeof(room_t));
-        pthread_mutex_init(&room->mutex, NULL);
-        strncpy(room->name, name, ROOM_NAME_LEN - 1);
-        room->name[ROOM_NAME_LEN - 1] = '\0';
-        rooms[idx] = room;
-
-        // Log event: new room created
-        char msg[BUF_SIZE];
-        snprintf(msg, sizeof msg,
-                 "[THREAD-INFO (TID: %d)] New room %s is created",
-                 connection->thread_info.tid, name);
-        log_write(msg);
-        safe_print(msg);
-    } else {
+    // Take a room_t from the pool (its mutexes are already initialized) and reset it
+    room = pool_alloc(room_pool);
+    if (!room) {
         // No free slot left for a new room
-        char msg[BUF_SIZE];
-        snprintf(msg, sizeof msg,
-                 "[THREAD-WARN (TID: %d)] There is no free room slot, room is not created",
+        LP_UNLOCK(&rooms_mutex, &rooms_lp);
+        conn_log(connection, "[THREAD-WARN (TID: %d)] There is no free room slot, room is not created",
                  connection->thread_info.tid);
-        log_write(msg);
-        safe_print(msg);
+        return ROOM_ID_NONE;
     }
-    pthread_mutex_unlock(&rooms_mutex);
-
-    // If idx was -1, we return NULL. Otherwise, the newly created room pointer is returned.
-    return room;
+    memset(room->members, 0, (size_t)server_config.room_capacity * sizeof(conn_id_t));
+    room->member_count = 0;
+    room->snapshot     = NULL;
+    strncpy(room->name, name, ROOM_NAME_LEN - 1);
+    room->name[ROOM_NAME_LEN - 1] = '\0';
+
+    room_id_t id = pool_id(room_pool, room);
+    atomic_store_explicit(&room->id, id, memory_order_release);
+    room_t **bucket = room_bucket(name);
+    room->name_next = *bucket;
+    *bucket = room;
+    metrics_gauge_add(G_ROOMS, 1);
+    LP_UNLOCK(&rooms_mutex, &rooms_lp);
+
+    // Log event: new room created
+    conn_log_parts(connection, connection->tid_prefix_len, "New room ", name, " is created", NULL);
+    return id;
 }
 
 /**
  * room_add_member
- *   Add a connection pointer to the specified room’s member list.
- *   - Locks room->mutex to protect member list.
- *   - If the room is at capacity (member_count >= ROOM_CAPACITY), issue a log and return.
- *   - Otherwise, scan the members[] array for the first NULL slot, insert connection there,
- *     increment member_count, set connection->room to this room, and log the event.
+ *   Add a connection's id to the member list of room 'id'.
+ *   - Locks room->mutex and confirms the room still has that id (it may have been retired, and
+ *     its slot even reused, since the caller looked it up); if not, returns ROOM_ADD_GONE.
+ *   - If the room is at capacity (member_count >= room_capacity), returns ROOM_ADD_FULL.
+ *   - Otherwise, stores the connection's id in the first free members[] slot, increments
+ *     member_count, republishes the snapshot, sets connection->room and logs the event.
  */
-void room_add_member(room_t *room, connection_t *connection) {
+room_add_result_t room_add_member(room_id_t id, connection_t *connection) {
+    room_t *room = pool_from_id(room_pool, id);
     if (!room) {
-        // Defensive check: If room pointer is NULL, log and return
-        char msg[BUF_SIZE];
-        snprintf(msg, sizeof msg,
-                 "[THREAD-INFO (TID: %d)] room is NULL. Threw from room_add_member",
-                 connection->thread_info.tid);
-        log_write(msg);
-        safe_print(msg);
-        return;
+        return ROOM_ADD_GONE;
     }
 
-    pthread_mutex_lock(&room->mutex);
+    LP_LOCK(&room->mutex, &room_lp);
 
-    if (room->member_count >= ROOM_CAPACITY) {
-        // Room is full; reject addition
-        pthread_mutex_unlock(&room->mutex);
-        char msg[BUF_SIZE];
-        snprintf(msg, sizeof msg,
-                 "[THREAD-INFO (TID: %d)] user %s is not added to room %s. Room is full.",
-                 connection->thread_info.tid,
-                 connection->username,
-                 room->name);
-        log_write(msg);
-        safe_print(msg);
-        return;
+    if (atomic_load_explicit(&room->id, memory_order_relaxed) != id) {
+        LP_UNLOCK(&room->mutex, &room_lp);
+        return ROOM_ADD_GONE;
     }
 
-    // Find the first available slot in members[] and insert the connection
-    for (int i = 0; i < ROOM_CAPACITY; ++i) {
-        if (room->members[i] == NULL) {
-            room->members[i] = connection;
+    if (room->member_count >= server_config.room_capacity) {
+        // Room is full; reject addition (the caller reports it)
+        LP_UNLOCK(&room->mutex, &room_lp);
+        return ROOM_ADD_FULL;
+    }
+
+    // Find the first available slot in members[] and insert the connection's id
+    conn_id_t member = atomic_load_explicit(&connection->id, memory_order_relaxed);
+    for (int i = 0; i < server_config.room_capacity; ++i) {
+        if (room->members[i] == CONN_ID_NONE) {
+            room->members[i] = member;
             room->member_count++;
+            room_publish_locked(room);
 
             // Log that the user has joined the room
-            char msg[BUF_SIZE];
-            snprintf(msg, sizeof msg,
-                     "[THREAD-INFO (TID: %d)] user %s is added to room %s",
-                     connection->thread_info.tid,
-                     connection->username,
-                     room->name);
-            log_write(msg);
-            safe_print(msg);
+            conn_log_parts(connection, connection->tid_prefix_len,
+                           "user ", connection->username, " is added to room ", room->name, NULL);
 
             break;
         }
     }
 
-    pthread_mutex_unlock(&room->mutex);
+    LP_UNLOCK(&room->mutex, &room_lp);
 
-    // Update the connection’s room pointer to reflect that it is now a member
-    connection->room = room;
+    // Record the membership in the connection
+    connection->room = id;
+    return ROOM_ADD_OK;
 }
 
 /**
  * room_remove_member
- *   Remove a connection pointer from the specified room’s member list.
- *   - Locks room->mutex to protect member list.
- *   - Finds the matching entry in members[] and sets it to NULL, decrementing member_count.
- *   - If after removal the room is empty (no non-NULL members), the room is destroyed:
- *       - Lock rooms_mutex, find and clear it from the global rooms[] array, unlock.
- *       - Destroy the room’s internal mutex, log the deletion, free the room struct.
- *   - If the connection->room matches this room, set connection->room = NULL.
- */
-void room_remove_member(room_t *room, connection_t *connection) {
+ *   Remove a connection from the member list of room 'id' (its current room).
+ *   - Locks room->mutex, clears the connection's entry in members[] and decrements member_count.
+ *   - If the room is now empty it is retired while still locked: its id is cleared, so lookups
+ *     and joiners holding the old id see that it is gone, and its last snapshot is dropped.
+ *     Otherwise the new member list is published.
+ *   - A retired room is then logged as deleted, unlinked from the name index and handed back
+ *     to room_pool under rooms_mutex.
+ *   - Sets connection->room = ROOM_ID_NONE.
+ */
+void room_remove_member(room_id_t id, connection_t *connection) {
+    room_t *room = room_get(id);
     if (!room) {
-        return;  // Nothing to remove if room pointer is NULL
+        return;  // Nothing to remove if the room is gone
     }
 
-    pthread_mutex_lock(&room->mutex);
+    conn_id_t member = atomic_load_explicit(&connection->id, memory_order_relaxed);
+    int retired = 0;
+
+    LP_LOCK(&room->mutex, &room_lp);
     // Remove the connection from the members[] array
-    for (int i = 0; i < ROOM_CAPACITY; ++i) {
-        if (room->members[i] == connection) {
-            room->members[i] = NULL;
+    for (int i = 0; i < server_config.room_capacity; ++i) {
+        if (room->members[i] == member) {
+            room->members[i] = CONN_ID_NONE;
 
             // Log that the user has been removed
-            char msg[BUF_SIZE];
-            snprintf(msg, sizeof msg,
-                     "[THREAD-INFO (TID: %d)] username %s removed from room %s",
-                     connection->thread_info.tid,
-                     connection->username,
-                     room->name);
-            log_write(msg);
-            safe_print(msg);
+            conn_log_parts(connection, connection->tid_prefix_len,
+                           "username ", connection->username, " removed from room ", room->name, NULL);
 
             if (room->member_count > 0) {
                 room->member_count--;
@@ -306,204 +627,1275 @@ void room_remove_member(room_t *room, connection_t *connection) {
         }
     }
 
-    // Check if the room has become empty after removal
-    int empty = 1;
-    for (int i = 0; i < ROOM_CAPACITY; ++i) {
-        if (room->members[i]) {
-            empty = 0;
+    if (room->member_count == 0) {
+        // Retire the room: drop the last snapshot and make the id stale
+        atomic_store_explicit(&room->id, ROOM_ID_NONE, memory_order_release);
+        LP_LOCK(&room->snapshot_mutex, &snapshot_lp);
+        member_snapshot_t *old = room->snapshot;
+        room->snapshot = NULL;
+        LP_UNLOCK(&room->snapshot_mutex, &snapshot_lp);
+        snapshot_release(old);
+        retired = 1;
+    } else {
+        room_publish_locked(room);
+    }
+    LP_UNLOCK(&room->mutex, &room_lp);
+
+    // If retired, delete the room entirely
+    if (retired) {
+        // Log that the room was deleted
+        conn_log_parts(connection, connection->tid_prefix_len,
+                       "The room ", room->name, " was deleted because there was no one left in the room", NULL);
+
+        // Unlink it from the name index and hand the room back to the pool
+        LP_LOCK(&rooms_mutex, &rooms_lp);
+        room_t **link = room_bucket(room->name);
+        while (*link && *link != room) {
+            link = &(*link)->name_next;
+        }
+        if (*link) {
+            *link = room->name_next;
+        }
+        room->name_next = NULL;
+        metrics_gauge_add(G_ROOMS, -1);
+        if (pool_free(room_pool, room) < 0) {
+            log_write("[THREAD-ERROR] Stale room pointer returned to the room pool");
+        }
+        LP_UNLOCK(&rooms_mutex, &rooms_lp);
+    }
+
+    // The connection is no longer in a room
+    if (connection->room == id) {
+        connection->room = ROOM_ID_NONE;
+    }
+}
+
+/**
+ * room_broadcast
+ *   Broadcast a text message to every member of room 'id' (the sender's current room).
+ *   - Takes a reference on the room's current member snapshot and queues the message
+ *     (formatted once, in the sender's arena, as "[from] msg\n") in each listed member’s outbox.
+ *     room->mutex is not taken, so joins, leaves and other broadcasts proceed while the fan-out
+ *     runs. Queueing never blocks, so a slow member cannot stall the room either.
+ *   - Drops the snapshot reference when finished.
+ *   - With tracing enabled, records how long the sender took to obtain the snapshot and hands
+ *     the stamp to each member's outbox entry.
+ */
+void room_broadcast(room_id_t id, connection_t *from, const char *msg, const trace_stamp_t *stamp) {
+    room_t *room = room_get(id);
+    if (!room) {
+        return;
+    }
+
+    // Build once: “[username] actual_message\n” from the sender's interned prefix
+    strbuf_t line;
+    sb_start(&line, &from->arena);
+    sb_put(&line, from->chat_prefix, from->chat_prefix_len);
+    sb_puts(&line, msg);
+    sb_putc(&line, '\n');
+    sb_end(&line);
+
+    int delivered = 0;
+    member_snapshot_t *snap = room_snapshot_acquire(room);
+    trace_record_lock_wait(stamp, stamp ? trace_now() : 0);
+    for (int i = 0; snap && i < snap->count; ++i) {
+        connection_t *member = snap->members[i];
+        if (outbox_push_chat(&member->outbox, line.data, line.len, stamp) == OUTBOX_OK) {
+            delivered++;
+        }
+    }
+    snapshot_release(snap);
+    metrics_add(M_MESSAGES_OUT, (uint64_t)delivered);
+}
+
+/**
+ * room_member_names
+ *   Read the member usernames from the room's published snapshot, like room_broadcast, so
+ *   room->mutex is not taken.
+ */
+int room_member_names(room_id_t id, char (*names)[USERNAME_LEN], int max) {
+    room_t *room = room_get(id);
+    if (!room) {
+        return -1;
+    }
+    int n = 0;
+    member_snapshot_t *snap = room_snapshot_acquire(room);
+    for (int i = 0; snap && i < snap->count && n < max; ++i) {
+        memcpy(names[n++], snap->members[i]->username, USERNAME_LEN);
+    }
+    snapshot_release(snap);
+    return n;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Connection Registry                                                              */
+/* ------------------------------------------------------------------------- */
+
+// Lock shards of the username table (a power of two)
+#define CONN_SHARDS 64
+
+/**
+ * conn_shard_t
+ *   One lock of the username table. Bucket b of name_buckets is guarded by
+ *   conn_shards[b % CONN_SHARDS], so users whose names hash to different shards never contend.
+ *   Each shard sits on its own cache line.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+} __attribute__((aligned(64))) conn_shard_t;
+
+/**
+ * Registry of connected users, created in main() once the configuration is known:
+ * - name_buckets:   Hash table (a power of two, at least server_config.max_conn buckets) of
+ *                   registered connections, chained through connection_t.name_next
+ * - registry_count: Number of registered connections, at most server_config.max_conn
+ * A registered connection also carries its conn_id_t in connection_t.id, which resolves
+ * through the pool slot it lives in and needs no lock at all (see connection_acquire_id).
+ */
+static conn_shard_t    conn_shards[CONN_SHARDS];
+static connection_t  **name_buckets     = NULL;
+static uint32_t        name_bucket_mask = 0;
+static _Atomic int     registry_count   = 0;
+LOCKPROF_SITE(shard_lp, "conn_shard.mutex");
+
+/**
+ * registry_init
+ *   Allocate the bucket array for server_config.max_conn users and initialize the shard
+ *   mutexes. Returns 0 on success, -1 if memory runs out.
+ */
+static int registry_init(void) {
+    uint32_t buckets = 1;
+    while (buckets < (uint32_t)server_config.max_conn) {
+        buckets <<= 1;
+    }
+    name_buckets = calloc(buckets, sizeof(*name_buckets));
+    if (!name_buckets) {
+        return -1;
+    }
+    name_bucket_mask = buckets - 1;
+    for (int i = 0; i < CONN_SHARDS; ++i) {
+        pthread_mutex_init(&conn_shards[i].mutex, NULL);
+    }
+    return 0;
+}
+
+/**
+ * name_bucket
+ *   The bucket 'username' hashes to (FNV-1a), and in *shard the shard guarding it.
+ */
+static connection_t **name_bucket(const char *username, conn_shard_t **shard) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)username; *p; ++p) {
+        h = (h ^ *p) * 16777619u;
+    }
+    uint32_t b = h & name_bucket_mask;
+    *shard = &conn_shards[b & (CONN_SHARDS - 1)];
+    return &name_buckets[b];
+}
+
+/**
+ * find_in_bucket_locked
+ *   The connection named 'username' in the chain at 'bucket', or NULL. The bucket's shard
+ *   must be held.
+ */
+static connection_t *find_in_bucket_locked(connection_t *bucket, const char *username) {
+    for (connection_t *c = bucket; c; c = c->name_next) {
+        if (strcmp(c->username, username) == 0) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * connection_try_retain
+ *   Take a reference on a connection that may be freed concurrently: succeeds only while at
+ *   least one other reference exists. Pooled memory is never unmapped, so reading 'refs' of a
+ *   freed or reused slot is safe; callers confirm the identity of what they got afterwards.
+ */
+static int connection_try_retain(connection_t *c) {
+    int refs = atomic_load_explicit(&c->refs, memory_order_relaxed);
+    while (refs > 0) {
+        if (atomic_compare_exchange_weak_explicit(&c->refs, &refs, refs + 1,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * registry_add
+ *
+ * The name check and the insertion happen under the same shard lock, so two registrations of
+ * one name cannot both succeed.
+ */
+registry_status_t registry_add(connection_t *c) {
+    int count = atomic_load_explicit(&registry_count, memory_order_relaxed);
+    do {
+        if (count >= server_config.max_conn) {
+            return REGISTRY_FULL;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&registry_count, &count, count + 1,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    conn_shard_t *shard;
+    connection_t **bucket = name_bucket(c->username, &shard);
+
+    LP_LOCK(&shard->mutex, &shard_lp);
+    if (find_in_bucket_locked(*bucket, c->username)) {
+        LP_UNLOCK(&shard->mutex, &shard_lp);
+        atomic_fetch_sub_explicit(&registry_count, 1, memory_order_relaxed);
+        return REGISTRY_TAKEN;
+    }
+    atomic_store_explicit(&c->id, pool_id(connection_pool, c), memory_order_release);
+    c->name_next = *bucket;
+    *bucket = c;
+    LP_UNLOCK(&shard->mutex, &shard_lp);
+    return REGISTRY_OK;
+}
+
+/**
+ * registered_connection
+ *   The connection in pool slot 'index' if it is currently registered, else NULL. Only for
+ *   the shutdown path, which walks every slot without taking references.
+ */
+static connection_t *registered_connection(uint32_t index) {
+    connection_t *c = pool_at(connection_pool, index);
+    return c && atomic_load_explicit(&c->id, memory_order_acquire) != CONN_ID_NONE ? c : NULL;
+}
+
+/**
+ * broadcast_message_via_notify
+ *   Send a private message from one user to another: format “[from] msg\n” in the sender's
+ *   arena, take a reference on the recipient (holding only its shard lock for the lookup) and
+ *   queue the line in its outbox with no registry lock held.
+ */
+int broadcast_message_via_notify(connection_t *from,
+                                 const char *to,
+                                 const char *msg,
+                                 const trace_stamp_t *stamp) {
+    connection_t *c = connection_acquire(to);
+    if (!c) {
+        return 0;
+    }
+
+    strbuf_t line;
+    sb_start(&line, &from->arena);
+    sb_put(&line, from->chat_prefix, from->chat_prefix_len);
+    sb_puts(&line, msg);
+    sb_putc(&line, '\n');
+    sb_end(&line);
+
+    if (outbox_push_chat(&c->outbox, line.data, line.len, stamp) == OUTBOX_OK) {
+        metrics_inc(M_MESSAGES_OUT);
+    }
+    connection_release(c);
+    return 1;
+}
+
+/**
+ * connection_acquire
+ *   Find a connection by username under its shard lock and take a reference on it.
+ *   Returns NULL if the user is not connected.
+ */
+connection_t *connection_acquire(const char *username) {
+    conn_shard_t *shard;
+    connection_t **bucket = name_bucket(username, &shard);
+
+    LP_LOCK(&shard->mutex, &shard_lp);
+    connection_t *c = find_in_bucket_locked(*bucket, username);
+    if (c) {
+        connection_retain(c);
+    }
+    LP_UNLOCK(&shard->mutex, &shard_lp);
+    return c;
+}
+
+/**
+ * connection_lookup_id
+ *   Map a username to the id of its connection under the name's shard lock.
+ *   Returns CONN_ID_NONE if the user is not connected.
+ */
+conn_id_t connection_lookup_id(const char *username) {
+    conn_shard_t *shard;
+    connection_t **bucket = name_bucket(username, &shard);
+
+    LP_LOCK(&shard->mutex, &shard_lp);
+    connection_t *c = find_in_bucket_locked(*bucket, username);
+    conn_id_t id = c ? atomic_load_explicit(&c->id, memory_order_relaxed) : CONN_ID_NONE;
+    LP_UNLOCK(&shard->mutex, &shard_lp);
+    return id;
+}
+
+/**
+ * connection_acquire_id
+ *
+ * Lock-free: the pool maps the id to its slot, the reference is taken only if the slot's
+ * object is still alive, and the id is compared once the reference pins the object (a slot
+ * reused meanwhile, or a connection removed meanwhile, no longer carries the id).
+ */
+connection_t *connection_acquire_id(conn_id_t id) {
+    connection_t *c = pool_from_id(connection_pool, id);
+    if (!c || !connection_try_retain(c)) {
+        return NULL;
+    }
+    if (atomic_load_explicit(&c->id, memory_order_acquire) != id) {
+        connection_release(c);
+        return NULL;
+    }
+    return c;
+}
+
+/**
+ * connection_retain
+ *   Take another reference on a connection the caller already holds one on.
+ */
+void connection_retain(connection_t *c) {
+    atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+}
+
+/**
+ * connection_release
+ *   Drop one reference. The last reference empties the outbox and returns the struct to
+ *   connection_pool.
+ */
+void connection_release(connection_t *c) {
+    if (atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) == 1) {
+        outbox_reset(&c->outbox, 0);
+        if (pool_free(connection_pool, c) < 0) {
+            log_write("[THREAD-ERROR] Stale connection pointer returned to the connection pool");
+        }
+    }
+}
+
+/**
+ * remove_connection
+ *   Unregister a connection:
+ *     - Under its shard lock, unlinks it from its name bucket and clears its id, so neither
+ *       its name nor its id resolves any more.
+ *     - If it was registered, logs that the connection is being deleted and drops the
+ *       registry's reference (the struct is freed once no upload worker still uses it).
+ *     - Otherwise logs that deletion failed.
+ */
+void remove_connection(connection_t *c) {
+    conn_shard_t *shard;
+    connection_t **link = name_bucket(c->username, &shard);
+
+    LP_LOCK(&shard->mutex, &shard_lp);
+    while (*link && *link != c) {
+        link = &(*link)->name_next;
+    }
+    int found = (*link != NULL);
+    if (found) {
+        *link = c->name_next;
+        c->name_next = NULL;
+        atomic_store_explicit(&c->id, CONN_ID_NONE, memory_order_release);
+    }
+    LP_UNLOCK(&shard->mutex, &shard_lp);
+
+    char msg[BUF_SIZE];
+    snprintf(msg, sizeof msg,
+             found ? "[THREAD-INFO (TID: %d)] Connection of %s is deleted"
+                   : "[THREAD-INFO (TID: %d)] Connection of %s could not be deleted",
+             c->thread_info.tid,
+             c->username);
+    log_write(msg);
+    safe_print(msg);
+
+    if (found) {
+        atomic_fetch_sub_explicit(&registry_count, 1, memory_order_relaxed);
+        metrics_gauge_add(G_CONNECTIONS, -1);
+        connection_release(c);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* Client Handler Thread Function                                                   */
+/* ------------------------------------------------------------------------- */
+
+/**
+ * flush_output
+ *   Send everything queued for the client (replies, room messages, whispers, files) with as few
+ *   sendmsg() calls as possible (with io_uring: hand them to the next send chain). Returns 0 to
+ *   keep going, -1 if the connection must be dropped (send error, or the slow-consumer policy
+ *   disconnected it); the reason is logged.
+ */
+static int flush_output(connection_t *connection) {
+    ssize_t sent = conn_io_flush(connection->io);
+    if (sent < 0) {
+        conn_log_parts(connection, connection->tid_prefix_len,
+                       "Connection of user '", connection->username, "' is over (send error).", NULL);
+        return -1;
+    }
+    if (sent > 0) {
+        metrics_add(M_BYTES_RELAYED, (uint64_t)sent);
+    }
+    if (outbox_overflowed(&connection->outbox)) {
+        conn_log(connection, "[THREAD-WARN (TID: %d)] User '%s' is not keeping up with its messages "
+                             "(outbound budget %zu bytes exceeded). Disconnecting.",
+                 connection->thread_info.tid,
+                 connection->username,
+                 server_config.outbox_limit);
+        return -1;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Command Handlers                                                           */
+/* ------------------------------------------------------------------------- */
+
+/**
+ * cmd_ctx_t
+ *   Everything a command handler works with.
+ *   - connection:  The client that sent the command
+ *   - io:          Its socket I/O state (for /chunk's payload and mid-command flushes)
+ *   - line:        The parsed command line; its arguments already match the command's wire spec
+ *   - extra:       Bytes that arrived after the command line in the same read, 'extra_len' long
+ *   - extra_used:  How many of those the handler consumed (a /chunk payload); the rest are
+ *                  parsed as further commands
+ *   - stamp:       Trace stamp of the command
+ */
+typedef struct {
+    connection_t  *connection;
+    conn_io_t     *io;
+    cmd_line_t     line;
+    const char    *extra;
+    size_t         extra_len;
+    size_t         extra_used;
+    trace_stamp_t *stamp;
+} cmd_ctx_t;
+
+/**
+ * command_handler_t
+ *   A command's server-side handler and the usage reply sent when its arguments do not match
+ *   the spec. run() returns 0 to keep serving the client, -1 to end the connection. 'payload'
+ *   is 1 for commands whose line is followed by data (see chunk_malformed).
+ */
+typedef struct {
+    int        (*run)(cmd_ctx_t *ctx);
+    reply_id_t   usage;
+    int          payload;
+} command_handler_t;
+
+/**
+ * text_is_utf8
+ *   Check the free text of a chat command; invalid UTF-8 is answered and logged here.
+ */
+static int text_is_utf8(cmd_ctx_t *ctx) {
+    if (ts_utf8_valid(ctx->line.text, strlen(ctx->line.text))) {
+        return 1;
+    }
+    send_reply(ctx->connection, REPLY_BAD_UTF8);
+    conn_log_parts(ctx->connection, ctx->connection->user_prefix_len,
+                   " sent a message that is not valid UTF-8.", NULL);
+    return 0;
+}
+
+/**
+ * cmd_exit
+ *   /exit: gracefully tell the client we are shutting down its connection.
+ */
+static int cmd_exit(cmd_ctx_t *ctx) {
+    send_reply(ctx->connection, REPLY_BYE);
+    flush_output(ctx->connection);
+    return -1;
+}
+
+/**
+ * cmd_whisper
+ *   /whisper <target> <message>: queue the message in the target's outbox if it is online.
+ */
+static int cmd_whisper(cmd_ctx_t *ctx) {
+    connection_t *connection = ctx->connection;
+    const char *target  = ctx->line.argv[0];
+    const char *message = ctx->line.text;
+
+    if (!text_is_utf8(ctx)) {
+        return 0;
+    }
+
+    ctx->stamp->parse_ns = trace_now();
+    trace_record_parse(ctx->stamp);
+
+    // Queue in the recipient’s outbox; this also tells whether the target is connected
+    if (!broadcast_message_via_notify(connection, target, message, ctx->stamp)) {
+        // Target not online: inform sender
+        conn_reply_parts(connection, "[ERROR] User '", target, "' not online.\n", NULL);
+
+        // Log the failed whisper attempt
+        conn_log_parts(connection, connection->user_prefix_len,
+                       " tried to whisper to offline user '", target, "'", NULL);
+        return 0;
+    }
+
+    // Target exists: log the whisper in the server console
+    strbuf_t outlog;
+    sb_start(&outlog, &connection->arena);
+    sb_cat(&outlog, ctx->line.token, " ", connection->username, " → ", target, ": ", message, "\n",
+           NULL);
+    safe_print(sb_end(&outlog));
+
+    conn_log_parts(connection, connection->user_prefix_len, " sent whisper to ", target, NULL);
+    return 0;
+}
+
+/**
+ * cmd_join
+ *   /join <room_name>: leave the current room (if any) and join or create the named one.
+ */
+static int cmd_join(cmd_ctx_t *ctx) {
+    connection_t *connection = ctx->connection;
+    const char *room_name = ctx->line.argv[0];
+
+    if (!is_valid_roomname(room_name)) {
+        // Invalid room name: must be 1–32 alphanumeric characters
+        send_reply(connection, REPLY_BAD_ROOM_NAME);
+
+        conn_log_parts(connection, connection->user_prefix_len,
+                       " sent invalid room name ", room_name, NULL);
+        return 0;
+    }
+
+    // If already in a room, remove from the old one first
+    if (connection->room != ROOM_ID_NONE) {
+        room_remove_member(connection->room, connection);
+    }
+
+    // Create or find the requested room and join it. If its last member leaves in between, the
+    // room is retired and the join sees a stale id; look the name up again (the next attempt
+    // creates a fresh room).
+    room_id_t room = ROOM_ID_NONE;
+    room_add_result_t added = ROOM_ADD_GONE;
+    while (added == ROOM_ADD_GONE) {
+        room = room_create(room_name, connection);
+        if (room == ROOM_ID_NONE) {
             break;
         }
+        added = room_add_member(room, connection);
     }
-    pthread_mutex_unlock(&room->mutex);
 
-    // If empty, delete the room entirely
-    if (empty) {
-        // Remove from global rooms[] array
-        pthread_mutex_lock(&rooms_mutex);
-        for (int i = 0; i < MAX_ROOMS; ++i) {
-            if (rooms[i] == room) {
-                rooms[i] = NULL;
-                break;
+    if (room == ROOM_ID_NONE) {
+        // Either room slots are full or creation failed
+        send_reply(connection, REPLY_ROOM_SLOTS_FULL);
+
+        conn_log_parts(connection, connection->tid_prefix_len,
+                       "Room ", room_name, " is not created. Room slots are full", NULL);
+    } else if (added == ROOM_ADD_FULL) {
+        // Room exists but is already full
+        send_reply(connection, REPLY_ROOM_FULL);
+
+        conn_log_parts(connection, connection->user_prefix_len,
+                       " could not join room ", room_name, ". Room is full.", NULL);
+    } else {
+        // Send confirmation to the client
+        conn_reply_parts(connection, "[OK] User \"", connection->username,
+                         "\" joined the room: ", room_name, "\n", NULL);
+
+        // Log the join event
+        conn_log_parts(connection, connection->user_prefix_len,
+                       " joined the room ", room_name, ".", NULL);
+    }
+    return 0;
+}
+
+/**
+ * cmd_leave
+ *   /leave: leave the current room, if any.
+ */
+static int cmd_leave(cmd_ctx_t *ctx) {
+    connection_t *connection = ctx->connection;
+
+    room_t *room = room_get(connection->room);
+    if (room) {
+        // The room may be freed by room_remove_member; keep its name for the messages
+        char room_name[ROOM_NAME_LEN];
+        memcpy(room_name, room->name, ROOM_NAME_LEN);
+
+        // Remove from the room and notify the client that they have left
+        room_remove_member(connection->room, connection);
+        conn_reply_parts(connection, "[INFO] User \"", connection->username,
+                         "\" left the room: ", room_name, "\n", NULL);
+
+        // Log the action
+        conn_log_parts(connection, connection->user_prefix_len,
+                       " left the room ", room_name, ".", NULL);
+    } else {
+        // Not in any room: send info back to client
+        conn_reply_parts(connection, "[INFO] User \"", connection->username,
+                         "\" is not in any room\n", NULL);
+
+        // Log the attempt to leave when not in a room
+        conn_log_parts(connection, connection->user_prefix_len,
+                       " tried to leave a room but was not in any room.", NULL);
+    }
+    return 0;
+}
+
+/**
+ * cmd_broadcast
+ *   /broadcast <message>: send the message to everyone in the current room.
+ */
+static int cmd_broadcast(cmd_ctx_t *ctx) {
+    connection_t *connection = ctx->connection;
+
+    if (connection->room == ROOM_ID_NONE) {
+        // Not currently in a room
+        send_reply(connection, REPLY_JOIN_FIRST);
+
+        conn_log_parts(connection, connection->user_prefix_len,
+                       " tried to broadcast but was not in any room.", NULL);
+        return 0;
+    }
+
+    if (!text_is_utf8(ctx)) {
+        return 0;
+    }
+
+    // Broadcast to everyone in the room
+    ctx->stamp->parse_ns = trace_now();
+    trace_record_parse(ctx->stamp);
+    room_broadcast(connection->room, connection, ctx->line.text, ctx->stamp);
+    return 0;
+}
+
+/**
+ * read_payload
+ *   Read the 'len' payload bytes that follow a command line into 'dest': first whatever followed
+ *   the line in the same read, then the rest from the TCP socket. With dest == NULL the bytes
+ *   are read and discarded. Returns how many bytes arrived (less than 'len' only if the
+ *   connection failed).
+ */
+static size_t read_payload(cmd_ctx_t *ctx, char *dest, size_t len) {
+    char scratch[BUF_SIZE];
+
+    size_t total = ctx->extra_len < len ? ctx->extra_len : len;
+    if (dest) {
+        memcpy(dest, ctx->extra, total);
+    }
+    ctx->extra_used = total;
+    while (total < len) {
+        size_t want = len - total;
+        char *to = dest ? dest + total : scratch;
+        if (!dest && want > sizeof scratch) {
+            want = sizeof scratch;
+        }
+        ssize_t r = conn_io_recv(ctx->io, to, want);
+        if (r <= 0) break;
+        total += (size_t)r;
+    }
+    return total;
+}
+
+/**
+ * delivery_done
+ *   Outbox release callback of a delivered transfer: the delivery to this recipient is over
+ *   either way (the recipient confirms or resumes it with /fileack), so end it and drop the
+ *   outbox's reference.
+ */
+static void delivery_done(void *arg, int sent) {
+    (void)sent;
+    transfer_rcpt_t *r = arg;
+    transfer_t *t = r->transfer;
+    transfer_delivery_end(r);
+    transfer_release(t);
+}
+
+/**
+ * queue_delivery
+ *   Queue delivery of the fully uploaded transfer of recipient 'r', from byte 'offset', to the
+ *   connection 'target_id' for the upload workers. When the queue is full the client is told
+ *   once per *warned (which is then set). Returns 1 if it was queued, 0 if a delivery to this
+ *   recipient is already under way.
+ */
+static int queue_delivery(cmd_ctx_t *ctx, transfer_rcpt_t *r, size_t offset, conn_id_t target_id,
+                          int *warned) {
+    if (!transfer_delivery_begin(r)) {
+        return 0;
+    }
+    transfer_retain(r->transfer);  // Travels with the queue item
+    file_item_t item = { .rcpt = r, .offset = offset, .target_id = target_id };
+
+    // If the queue is full, notify the client that the file will be queued anyway
+    if (!*warned && file_queue_is_full(upload_queue)) {
+        conn_reply(ctx->connection, "[INFO] Upload queue is full. File '%s' will be queued.\n",
+                   r->transfer->filename);
+        flush_output(ctx->connection);  // Tell the client before we block on the queue
+        conn_io_kick(ctx->io);
+        *warned = 1;
+    }
+
+    // Enqueue the file_item_t (blocks if the queue is at capacity)
+    file_queue_enqueue(upload_queue, &item);
+    metrics_gauge_add(G_UPLOAD_QUEUE_DEPTH, 1);
+    return 1;
+}
+
+/**
+ * deliver_all
+ *   Queue a fully uploaded transfer for every recipient, all from its single copy of the file,
+ *   and log it.
+ */
+static void deliver_all(cmd_ctx_t *ctx, transfer_t *t) {
+    int warned = 0;
+    int queued = 0;
+    for (int i = 0; i < t->nrcpt; ++i) {
+        transfer_rcpt_t *r = &t->rcpts[i];
+        queued += queue_delivery(ctx, r, 0, connection_lookup_id(r->name), &warned);
+    }
+    conn_log(ctx->connection, "[FILE-QUEUE] Upload '%s' from %s enqueued for %s (%d recipient%s).",
+             t->filename, t->sender, t->target, queued, queued == 1 ? "" : "s");
+}
+
+/**
+ * add_recipient
+ *   Append 'name' to the 'n' names in 'names' unless it is already there. Returns the new count.
+ */
+static int add_recipient(char (*names)[USERNAME_LEN], int n, const char *name) {
+    for (int i = 0; i < n; ++i) {
+        if (strcmp(names[i], name) == 0) {
+            return n;
+        }
+    }
+    memcpy(names[n], name, USERNAME_LEN);
+    return n + 1;
+}
+
+/**
+ * recipients_bound
+ *   Most names the /sendfile target list 'spec' can expand to: one per username entry and
+ *   room_capacity per "#<room>" entry, never more than max_conn.
+ */
+static int recipients_bound(const char *spec) {
+    long bound = 0;
+    for (const char *entry = spec; entry; entry = strchr(entry, ',')) {
+        if (*entry == ',') {
+            entry++;
+        }
+        bound += *entry == '#' ? server_config.room_capacity : 1;
+    }
+    return bound < server_config.max_conn ? (int)bound : server_config.max_conn;
+}
+
+/**
+ * resolve_recipients
+ *   Expand the /sendfile target list 'spec' into usernames: comma-separated entries, each a
+ *   username or "#<room>" for everyone currently in that room except the sender. Duplicates
+ *   are dropped. Stores up to 'max' names in 'names' and returns how many, or -1 after telling
+ *   the client what is wrong with the list.
+ */
+static int resolve_recipients(connection_t *connection, char *spec,
+                              char (*names)[USERNAME_LEN], int max) {
+    int n = 0;
+    char *save = NULL;
+    for (char *entry = strtok_r(spec, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+        if (entry[0] == '#') {
+            if (n == max) {
+                conn_reply(connection, "[ERROR] Too many recipients (at most %d).\n", max);
+                return -1;
+            }
+            room_id_t room = is_valid_roomname(entry + 1) ? room_lookup(entry + 1) : ROOM_ID_NONE;
+            int count = room != ROOM_ID_NONE ? room_member_names(room, names + n, max - n) : -1;
+            if (count < 0) {
+                conn_reply(connection, "[ERROR] Room '%s' not found.\n", entry + 1);
+                return -1;
+            }
+            // Members were written at the end of the list: fold them in without duplicates
+            // and without the sender
+            char member[USERNAME_LEN];
+            int listed = n;
+            for (int i = 0; i < count; ++i) {
+                memcpy(member, names[listed + i], USERNAME_LEN);
+                if (strcmp(member, connection->username) != 0) {
+                    n = add_recipient(names, n, member);
+                }
             }
+        } else if (!is_valid_username(entry)) {
+            conn_reply(connection, "[ERROR] Invalid recipient '%s'.\n", entry);
+            return -1;
+        } else if (strcmp(entry, connection->username) == 0) {
+            conn_reply(connection, "[ERROR] Cannot send a file to yourself.\n");
+            return -1;
+        } else if (n == max) {
+            conn_reply(connection, "[ERROR] Too many recipients (at most %d).\n", max);
+            return -1;
+        } else {
+            n = add_recipient(names, n, entry);
         }
-        pthread_mutex_unlock(&rooms_mutex);
+    }
+    if (n == 0) {
+        conn_reply(connection, "[ERROR] No one to send the file to.\n");
+    }
+    return n > 0 ? n : -1;
+}
 
-        // Destroy the room’s internal mutex and free memory
-        pthread_mutex_destroy(&room->mutex);
+/**
+ * parse_number
+ *   Parse a command argument that must be a number in 'base' (10 or 16) no larger than 'max':
+ *   digits only (no sign, blanks or trailing text). Returns 0 and stores the value in *out, or
+ *   -1 if the argument is anything else.
+ */
+static int parse_number(const char *arg, int base, size_t max, size_t *out) {
+    if (!*arg) {
+        return -1;
+    }
+    for (const char *p = arg; *p; ++p) {
+        if (base == 16 ? !isxdigit((unsigned char)*p) : !isdigit((unsigned char)*p)) {
+            return -1;
+        }
+    }
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, base);
+    if (errno == ERANGE || *end != '\0' || v > max) {
+        return -1;
+    }
+    *out = (size_t)v;
+    return 0;
+}
 
-        // Log that the room was deleted
-        char msg[BUF_SIZE];
-        snprintf(msg, sizeof msg,
-                 "[THREAD-INFO (TID: %d)] The room %s was deleted because there was no one left in the room",
-                 connection->thread_info.tid,
-                 room->name);
-        log_write(msg);
-        safe_print(msg);
+/**
+ * cmd_sendfile
+ *   /sendfile <filename> <targets> <size> [<digest>]: start an upload, or resume the unfinished
+ *   upload of the same file to the same targets, and answer "[XFER <transfer> <offset>]". The
+ *   client then sends the bytes from <offset> on as /chunk commands. <targets> is a username, a
+ *   comma-separated list of them, or "#<room>" for the members of a room (see
+ *   resolve_recipients); the file is uploaded and stored once for all of them.
+ *   If the client offers the file's "<xxh64>:<sha256>" <digest> and the file cache has that
+ *   content, the answer's offset is already <size>: the upload is skipped and the cached copy
+ *   is delivered.
+ */
+static int cmd_sendfile(cmd_ctx_t *ctx) {
+    connection_t *connection = ctx->connection;
+    const char *filename = ctx->line.argv[0];
+    const char *target   = ctx->line.argv[1];
+    const char *size_str = ctx->line.argv[2];
+
+    // Parse and validate file size
+    size_t filesize;
+    if (parse_number(size_str, 10, server_config.max_file_size, &filesize) < 0 || filesize == 0) {
+        conn_reply(connection, "[ERROR] File size must be between 1 byte and %zu bytes.\n",
+                   server_config.max_file_size);
+        return 0;
+    }
+    if (strlen(target) >= TRANSFER_TARGET_LEN) {
+        conn_reply(connection, "[ERROR] Recipient list is too long.\n");
+        return 0;
+    }
+    file_digest_t digest;
+    if (ctx->line.argc > 3 && fh_digest_parse(ctx->line.argv[3], &digest) < 0) {
+        conn_reply(connection, "[ERROR] Malformed file digest.\n");
+        return 0;
+    }
+
+    // Resolve the recipients (on a copy: the list is split in place)
+    char spec[TRANSFER_TARGET_LEN];
+    strcpy(spec, target);
+    int max = recipients_bound(spec);
+    char (*names)[USERNAME_LEN] = malloc((size_t)max * sizeof(*names));
+    if (!names) {
+        send_reply(connection, REPLY_OUT_OF_MEMORY);
+        return 0;
+    }
+    int nrcpt = resolve_recipients(connection, spec, names, max);
+    if (nrcpt < 0) {
+        free(names);
+        return 0;
+    }
+
+    // Transfers that expired are dropped whenever a new upload starts
+    transfer_reap();
+
+    // Content the server already has is not uploaded again
+    fc_entry_t *cached = ctx->line.argc > 3 ? filecache_lookup(&digest, filesize) : NULL;
+    if (cached) {
+        transfer_t *t = transfer_start_cached(connection->username, target,
+                                              (const char (*)[USERNAME_LEN])names, nrcpt,
+                                              filename, cached);
+        free(names);
+        if (!t) {
+            send_reply(connection, REPLY_OUT_OF_MEMORY);
+            return 0;
+        }
+        metrics_add(M_FILE_CACHE_SAVED_BYTES, filesize);
+        conn_reply(connection, "[XFER %u %zu]\n", t->id, filesize);
+        conn_log(connection, "[FILE-CACHE] '%s' from %s to %s is already on the server (transfer %u); upload skipped.",
+                 filename, connection->username, target, t->id);
+        deliver_all(ctx, t);
+        conn_reply(connection, "[OK] File '%s' queued for sending to %s. Size: %zu bytes.\n",
+                   t->filename, t->target, t->size);
+        transfer_release(t);
+        return 0;
+    }
 
-        free(room);
+    size_t offset;
+    int limited;
+    conn_id_t self = atomic_load_explicit(&connection->id, memory_order_relaxed);
+    transfer_t *t = transfer_start(connection->username, target, (const char (*)[USERNAME_LEN])names,
+                                   nrcpt, filename, filesize, self, &offset, &limited);
+    free(names);
+    if (!t) {
+        send_reply(connection, limited ? REPLY_TOO_MANY_UPLOADS : REPLY_OUT_OF_MEMORY);
+        return 0;
     }
 
-    // If the connection’s room pointer still pointed here, clear it
-    if (connection->room == room) {
-        connection->room = NULL;
+    // Tell the client where to continue from
+    conn_reply(connection, "[XFER %u %zu]\n", t->id, offset);
+    if (offset > 0) {
+        metrics_inc(M_FILE_RESUMES);
+        conn_log(connection, "[FILE-RESUME] Upload '%s' from %s to %s resumes at byte %zu of %zu.",
+                 filename, connection->username, target, offset, filesize);
+    } else {
+        conn_log(connection, "[FILE-UPLOAD] Upload '%s' from %s to %s started (transfer %u, %d recipient%s).",
+                 filename, connection->username, target, t->id, t->nrcpt, t->nrcpt == 1 ? "" : "s");
     }
+    transfer_release(t);
+    return 0;
 }
 
 /**
- * room_broadcast
- *   Broadcast a text message to every member in a given room.
- *   - Locks room->mutex, iterates over all non-NULL members[], and writes the message
- *     (formatted as "[from] msg\n") into each member’s notify_writer file descriptor.
- *   - Unlocks the mutex when finished.
+ * chunk_target
+ *   Where the payload of a chunk of transfer 'id' at 'offset' of 'len' bytes goes: into the
+ *   transfer's data if it continues this connection's upload exactly and stays within the
+ *   file, else NULL (the payload is read and discarded, and the client is told the offset to
+ *   continue from). Stores the referenced transfer (or NULL) in *tp and the upload offset
+ *   (or (size_t)-1) in *expected.
  */
-void room_broadcast(room_t *room, const char *from, const char *msg) {
-    if (!room) {
-        return;
+static char *chunk_target(connection_t *connection, transfer_id_t id, size_t offset, size_t len,
+                          transfer_t **tp, size_t *expected) {
+    conn_id_t self = atomic_load_explicit(&connection->id, memory_order_relaxed);
+    transfer_t *t = transfer_get(id);
+    *tp       = t;
+    *expected = (size_t)-1;
+    if (!t) {
+        return NULL;
     }
+    *expected = transfer_upload_offset(t, self);
+    if (*expected != offset || offset > t->size || len > t->size - offset) {
+        return NULL;
+    }
+    char *data = transfer_reserve(t, offset + len);
+    if (!data) {
+        *expected = (size_t)-1;     // Out of memory: answered like an invalid chunk
+        return NULL;
+    }
+    return data + offset;
+}
 
-    pthread_mutex_lock(&room->mutex);
-    for (int i = 0; i < ROOM_CAPACITY; ++i) {
-        connection_t *member = room->members[i];
-        if (member) {
-            // Format: “[username] actual_message\n”
-            char buf[BUF_SIZE];
-            int len = snprintf(buf, sizeof buf, "[%s] %s\n", from, msg);
-            write(member->notify_writer, buf, len);
-        }
+/**
+ * chunk_skipped
+ *   Answer a chunk whose payload was discarded (see chunk_target) and drop the transfer.
+ */
+static void chunk_skipped(connection_t *connection, transfer_id_t id, transfer_t *t,
+                          size_t expected) {
+    if (expected != (size_t)-1) {
+        conn_reply(connection, "[XFER %u %zu]\n", id, expected);
+    } else {
+        send_reply(connection, REPLY_BAD_CHUNK);
     }
-    pthread_mutex_unlock(&room->mutex);
+    transfer_release(t);
 }
 
-/* ------------------------------------------------------------------------- */
-/* Connection Lookup & Broadcasting Utilities                                       */
-/* ------------------------------------------------------------------------- */
+/**
+ * chunk_rejected
+ *   A chunk of 't' at 'offset' failed its checksum (or did not decompress): the upload stays
+ *   at 'offset'. Drops the transfer.
+ */
+static void chunk_rejected(connection_t *connection, transfer_t *t, size_t offset) {
+    send_reply(connection, REPLY_BAD_CHECKSUM);
+    metrics_inc(M_FILE_CHECKSUM_ERRORS);
+    conn_log(connection, "[FILE-UPLOAD] Chunk of '%s' from %s at byte %zu failed its checksum.",
+             t->filename, connection->username, offset);
+    transfer_release(t);
+}
 
 /**
- * find_slot_locked
- *   Internal helper that assumes conn_mutex is already held. Searches for a pointer to
- *   a connection_t * in the global connections[] array that matches 'username'. Returns
- *   &connections[i] if found, or NULL if not found.
+ * chunk_accept
+ *   Account the 'got' of 'len' bytes of a chunk that arrived at 'offset' of 't' (checked
+ *   against 'expect' if not NULL), and queue the file for the upload workers once it is
+ *   complete. Drops the transfer.
  */
-static connection_t **find_slot_locked(const char *username) {
-    for (int i = 0; i < MAX_CONN; ++i) {
-        if (connections[i] && strcmp(connections[i]->username, username) == 0) {
-            return &connections[i];
-        }
+static void chunk_accept(cmd_ctx_t *ctx, transfer_t *t, size_t offset, size_t got, size_t len,
+                         const uint32_t *expect) {
+    connection_t *connection = ctx->connection;
+    int complete = transfer_upload(t, got, got == len ? expect : NULL);
+    if (complete < 0) {
+        chunk_rejected(connection, t, offset);
+        return;
     }
-    return NULL;
+    if (got != len) {
+        // Didn’t receive the expected number of bytes: what did arrive is kept for a resume
+        send_reply(connection, REPLY_FILE_INCOMPLETE);
+        conn_log(connection, "[FILE-UPLOAD] Upload '%s' from %s interrupted at byte %zu of %zu.",
+                 t->filename, connection->username, offset + got, t->size);
+        transfer_release(t);
+        return;
+    }
+
+    if (complete) {
+        deliver_all(ctx, t);
+        conn_reply(connection, "[OK] File '%s' queued for sending to %s. Size: %zu bytes.\n",
+                   t->filename, t->target, t->size);
+    }
+    transfer_release(t);
 }
 
 /**
- * find_connection_locked
- *   Internal helper that assumes conn_mutex is already held. Returns the connection_t *
- *   for the given username, or NULL if not found.
+ * chunk_malformed
+ *   Refuse a /chunk or /zchunk whose fields are invalid. Its payload follows the line all the
+ *   same: if the payload length 'payload_len' can be read, that many bytes are drained so they
+ *   are not taken for commands; otherwise there is no telling where the next command starts
+ *   and the connection is closed. Returns the handler's result.
  */
-static connection_t *find_connection_locked(const char *username) {
-    connection_t **slot = find_slot_locked(username);
-    return slot ? *slot : NULL;
+static int chunk_malformed(cmd_ctx_t *ctx, const char *payload_len) {
+    connection_t *connection = ctx->connection;
+    size_t n;
+
+    send_reply(connection, REPLY_BAD_CHUNK);
+    if (payload_len &&
+        parse_number(payload_len, 10, LZ4_BOUND(server_config.max_file_size), &n) == 0) {
+        read_payload(ctx, NULL, n);
+        return 0;
+    }
+    conn_log(connection, "[FILE-UPLOAD] Chunk from %s has no readable length; closing the connection.",
+             connection->username);
+    flush_output(connection);
+    return -1;
 }
 
 /**
- * find_free_slot
- *   Return the first index i in 0..MAX_CONN-1 such that connections[i] is NULL.
- *   Returns -1 if no free slot is found. Locks conn_mutex while searching.
+ * cmd_chunk
+ *   /chunk <transfer> <offset> <len> [<crc>]: receive the next <len> bytes of an upload, which
+ *   follow the command line. A chunk that does not continue this connection's upload exactly
+ *   at its offset is read and discarded, and the client is told the offset to continue from.
+ *   <crc> is the sender's CRC32C (hex) of the file from byte 0 to the end of the chunk; a chunk
+ *   that does not match it is not accepted and the upload stays at <offset>. The last chunk
+ *   queues the file for the upload workers.
  */
-int find_free_slot(void) {
-    pthread_mutex_lock(&conn_mutex);
-    for (int i = 0; i < MAX_CONN; ++i) {
-        if (connections[i] == NULL) {
-            pthread_mutex_unlock(&conn_mutex);
-            return i;
-        }
+static int cmd_chunk(cmd_ctx_t *ctx) {
+    connection_t *connection = ctx->connection;
+    size_t id, offset, len, crc = 0;
+
+    if (parse_number(ctx->line.argv[0], 10, UINT32_MAX, &id) < 0 ||
+        parse_number(ctx->line.argv[1], 10, server_config.max_file_size, &offset) < 0 ||
+        parse_number(ctx->line.argv[2], 10, TRANSFER_CHUNK_SIZE, &len) < 0 || len == 0 ||
+        (ctx->line.argc > 3 && parse_number(ctx->line.argv[3], 16, UINT32_MAX, &crc) < 0)) {
+        return chunk_malformed(ctx, ctx->line.argv[2]);
     }
-    pthread_mutex_unlock(&conn_mutex);
-    return -1;
+
+    transfer_t *t;
+    size_t expected;
+    uint32_t expect = (uint32_t)crc;
+    char *dest = chunk_target(connection, (transfer_id_t)id, offset, len, &t, &expected);
+    size_t got = read_payload(ctx, dest, len);
+    if (!dest) {
+        chunk_skipped(connection, (transfer_id_t)id, t, expected);
+        return 0;
+    }
+    chunk_accept(ctx, t, offset, got, len, ctx->line.argc > 3 ? &expect : NULL);
+    return 0;
 }
 
 /**
- * find_slot
- *   Public wrapper around find_slot_locked. Locks conn_mutex, calls find_slot_locked,
- *   then unlocks conn_mutex. Returns a pointer to the slot if found, or NULL otherwise.
+ * cmd_zchunk
+ *   /zchunk <transfer> <offset> <len> <crc> <zlen>: /chunk for clients that negotiated
+ *   compression. The <zlen> bytes following the line are an LZ4 block that decodes to the
+ *   <len> bytes of the chunk; those are checked against <crc> and accepted like a /chunk. A
+ *   block that does not decode to exactly <len> bytes is rejected like a checksum mismatch.
  */
-connection_t **find_slot(const char *username) {
-    pthread_mutex_lock(&conn_mutex);
-    connection_t **res = find_slot_locked(username);
-    pthread_mutex_unlock(&conn_mutex);
-    return res;
+static int cmd_zchunk(cmd_ctx_t *ctx) {
+    connection_t *connection = ctx->connection;
+    size_t id, offset, len, crc, zlen;
+
+    // Both lengths are bounded before the block buffer is sized from them
+    char *block = NULL;
+    if (parse_number(ctx->line.argv[0], 10, UINT32_MAX, &id) == 0 &&
+        parse_number(ctx->line.argv[1], 10, server_config.max_file_size, &offset) == 0 &&
+        parse_number(ctx->line.argv[2], 10, TRANSFER_CHUNK_SIZE, &len) == 0 && len > 0 &&
+        parse_number(ctx->line.argv[3], 16, UINT32_MAX, &crc) == 0 &&
+        parse_number(ctx->line.argv[4], 10, LZ4_BOUND(len), &zlen) == 0 && zlen > 0) {
+        block = malloc(zlen);
+    }
+    if (!block) {
+        return chunk_malformed(ctx, ctx->line.argv[4]);
+    }
+
+    transfer_t *t;
+    size_t expected;
+    char *dest = chunk_target(connection, (transfer_id_t)id, offset, len, &t, &expected);
+    size_t got = read_payload(ctx, dest ? block : NULL, zlen);
+    if (!dest) {
+        free(block);
+        chunk_skipped(connection, (transfer_id_t)id, t, expected);
+        return 0;
+    }
+    if (got != zlen) {
+        free(block);
+        chunk_accept(ctx, t, offset, 0, len, NULL);
+        return 0;
+    }
+
+    // Bytes beyond the upload offset are the uploader's to write, and only become part of the
+    // file once accepted, so a block that fails to decode leaves nothing behind
+    int bad = lz4_decompress(block, zlen, dest, 0, len) < 0;
+    free(block);
+    if (bad) {
+        chunk_rejected(connection, t, offset);
+        return 0;
+    }
+    metrics_add(M_COMPRESS_IN_RAW_BYTES, len);
+    metrics_add(M_COMPRESS_IN_WIRE_BYTES, zlen);
+    uint32_t expect = (uint32_t)crc;
+    chunk_accept(ctx, t, offset, len, len, &expect);
+    return 0;
 }
 
 /**
- * find_connection
- *   Public wrapper around find_connection_locked. Locks conn_mutex, calls find_connection_locked,
- *   then unlocks conn_mutex. Returns the connection_t * if found, or NULL otherwise.
+ * cmd_fileack
+ *   /fileack <transfer> <offset>: the recipient holds the first <offset> bytes of a file sent
+ *   to it. The whole file ends the transfer for this recipient (and the transfer itself once
+ *   every recipient has it); anything less is delivered again from <offset> (unless a
+ *   delivery is already under way). Unknown transfers (expired, or already confirmed) are
+ *   ignored.
  */
-connection_t *find_connection(const char *username) {
-    connection_t *res;
-    pthread_mutex_lock(&conn_mutex);
-    res = find_connection_locked(username);
-    pthread_mutex_unlock(&conn_mutex);
-    return res;
+static int cmd_fileack(cmd_ctx_t *ctx) {
+    connection_t *connection = ctx->connection;
+    size_t id, offset;
+    if (parse_number(ctx->line.argv[0], 10, UINT32_MAX, &id) < 0 ||
+        parse_number(ctx->line.argv[1], 10, SIZE_MAX, &offset) < 0) {
+        return 0;   // Malformed: ignored like an unknown transfer
+    }
+
+    transfer_t *t = transfer_get((transfer_id_t)id);
+    transfer_rcpt_t *r = t ? transfer_recipient(t, connection->username) : NULL;
+    if (!r) {
+        transfer_release(t);
+        return 0;
+    }
+
+    if (offset >= t->size) {
+        transfer_confirm(r);
+        conn_log(connection, "[FILE-ACK] %s confirmed file '%s' from %s.",
+                 connection->username, t->filename, t->sender);
+    } else {
+        conn_id_t self = atomic_load_explicit(&connection->id, memory_order_relaxed);
+        int warned = 0;
+        if (queue_delivery(ctx, r, offset, self, &warned) && offset > 0) {
+            metrics_inc(M_FILE_RESUMES);
+            conn_log(connection, "[FILE-RESUME] Delivery of '%s' from %s to %s resumes at byte %zu of %zu.",
+                     t->filename, t->sender, connection->username, offset, t->size);
+        }
+    }
+    transfer_release(t);
+    return 0;
 }
 
 /**
- * broadcast_message_via_notify
- *   Send a private message from one user to another. Internally:
- *     - Locks conn_mutex to safely look up the recipient’s connection.
- *     - If found, format “[from] msg\n” into a buffer, then write it into the recipient’s notify_writer.
- *     - Unlock conn_mutex.
- */
-void broadcast_message_via_notify(const char *from,
-                                  const char *to,
-                                  const char *msg) {
-    pthread_mutex_lock(&conn_mutex);
-    connection_t *c = find_connection_locked(to);  // This already expects conn_mutex held
-    if (c) {
-        char buf[BUF_SIZE];
-        int len = snprintf(buf, sizeof buf, "[%s] %s\n", from, msg);
-        write(c->notify_writer, buf, len);
+ * offer_pending_files
+ *   Tell a newly connected client about files addressed to its username that an earlier
+ *   connection did not confirm: one "[FILE-RESUME <transfer> <filename> <size> <sender>]" line
+ *   each. The client answers with /fileack and the bytes it already has.
+ */
+static void offer_pending_files(connection_t *connection) {
+    transfer_rcpt_t *batch[16];
+    transfer_rcpt_t **pending = batch;
+    size_t cap = sizeof(batch) / sizeof(*batch);
+    size_t n = transfer_pending_for(connection->username, pending, cap);
+    while (n > cap) {
+        // More than fit: drop the references taken and collect them all at once
+        for (size_t i = 0; i < cap; ++i) {
+            transfer_release(pending[i]->transfer);
+        }
+        if (pending != batch) {
+            free(pending);
+        }
+        cap = n;
+        pending = malloc(cap * sizeof(*pending));
+        if (!pending) {
+            // Out of memory: offer the first batch now, the rest on a later connection
+            pending = batch;
+            cap = sizeof(batch) / sizeof(*batch);
+            n = transfer_pending_for(connection->username, pending, cap);
+            n = n < cap ? n : cap;
+            break;
+        }
+        n = transfer_pending_for(connection->username, pending, cap);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        transfer_t *t = pending[i]->transfer;
+        conn_reply(connection, "[FILE-RESUME %u %s %zu %s]\n",
+                   t->id, t->filename, t->size, t->sender);
+        arena_reset(&connection->arena);
+        transfer_release(t);
+    }
+    if (pending != batch) {
+        free(pending);
     }
-    pthread_mutex_unlock(&conn_mutex);
 }
 
 /**
- * remove_connection
- *   Remove a user from the global connections[] array by username:
- *     - Locks conn_mutex.
- *     - Locates the slot via find_slot_locked (since conn_mutex is held, safe).
- *     - If found and non-NULL, logs that the connection is being deleted, frees the connection_t struct,
- *       and sets the slot to NULL.
- *     - Otherwise logs that deletion failed.
- *     - Unlocks conn_mutex.
+ * command_handlers
+ *   Server side of the shared command table (command.h), indexed by command id. Commands the
+ *   client handles itself (/usage) have no handler and are answered as unknown.
  */
-void remove_connection(const char *user) {
-    pthread_mutex_lock(&conn_mutex);
-    connection_t **connection = find_slot_locked(user);  // conn_mutex already held
-    if (connection && *connection) {
-        char msg[BUF_SIZE];
-        snprintf(msg, sizeof msg,
-                 "[THREAD-INFO (TID: %d)] Connection of %s is deleted",
-                 (*connection)->thread_info.tid,
-                 user);
-        log_write(msg);
-        safe_print(msg);
+static const command_handler_t command_handlers[CMD_COUNT] = {
+    [CMD_EXIT]      = { cmd_exit,      REPLY_UNKNOWN_COMMAND },   // Takes any arguments
+    [CMD_WHISPER]   = { cmd_whisper,   REPLY_WHISPER_USAGE },
+    [CMD_JOIN]      = { cmd_join,      REPLY_JOIN_USAGE },
+    [CMD_LEAVE]     = { cmd_leave,     REPLY_UNKNOWN_COMMAND },   // Takes any arguments
+    [CMD_BROADCAST] = { cmd_broadcast, REPLY_BROADCAST_USAGE },
+    [CMD_SENDFILE]  = { cmd_sendfile,  REPLY_SENDFILE_USAGE },
+    [CMD_CHUNK]     = { cmd_chunk,     REPLY_BAD_CHUNK, 1 },
+    [CMD_ZCHUNK]    = { cmd_zchunk,    REPLY_BAD_CHUNK, 1 },
+    [CMD_FILEACK]   = { cmd_fileack,   REPLY_FILEACK_USAGE },
+};
 
-        free(*connection);
-        *connection = NULL;
+/**
+ * run_command
+ *   Parse one command line of 'len' bytes (in place) and run its handler with 'ctx'. Returns
+ *   the handler's result: 0 to keep going, -1 to end the connection.
+ */
+static int run_command(cmd_ctx_t *ctx, char *line, size_t len) {
+    connection_t *connection = ctx->connection;
+
+    // Everything formatted for the previous command has been sent or copied by now
+    arena_reset(&connection->arena);
+
+    uint64_t cmd_start = metrics_now_ns();
+    trace_stamp_t stamp = { trace_now(), 0 };
+    ctx->stamp = &stamp;
+    metrics_inc(M_MESSAGES_IN);
+
+    // Parse the command line in place (no strtok: other handler threads parse at the same time)
+    int args_ok = command_parse(line, len, 1, &ctx->line) == 0;
+
+    // Log which command the user just sent
+    conn_log_parts(connection, connection->user_prefix_len,
+                   " sent ", ctx->line.token ? ctx->line.token : "(null)", " command", NULL);
+
+    // One table lookup instead of a strcmp per known command
+    const command_t *cmd = ctx->line.cmd;
+    const command_handler_t *handler = cmd ? &command_handlers[cmd->id] : NULL;
+    int keep_going = 0;
+    if (!handler || !handler->run) {
+        // Unknown command (or one the client handles itself): send error and log it
+        send_reply(connection, REPLY_UNKNOWN_COMMAND);
+
+        conn_log_parts(connection, connection->user_prefix_len, " sent unknown command.", NULL);
+    } else if (!args_ok && handler->payload) {
+        // Too few fields to know how much data follows the line
+        keep_going = chunk_malformed(ctx, NULL);
+    } else if (!args_ok) {
+        // Arguments do not match the command's spec: send its usage line
+        send_reply(connection, handler->usage);
     } else {
-        char msg[BUF_SIZE];
-        snprintf(msg, sizeof msg,
-                 "[THREAD-INFO (TID: %d)] Connection of %s could not be deleted",
-                 (*connection) ? (*connection)->thread_info.tid : -1,
-                 user);
-        log_write(msg);
-        safe_print(msg);
+        keep_going = handler->run(ctx);
     }
-    pthread_mutex_unlock(&conn_mutex);
-}
 
-/* ------------------------------------------------------------------------- */
-/* Client Handler Thread Function                                                   */
-/* ------------------------------------------------------------------------- */
+    metrics_observe_ns(H_COMMAND_SECONDS, metrics_now_ns() - cmd_start);
+    return keep_going;
+}
 
 /**
  * client_handler
@@ -514,27 +1906,40 @@ void remove_connection(const char *user) {
  *
  *   Workflow:
  *     1. Record the Linux TID into connection->thread_info.tid and signal that initialization is complete.
- *     2. Create a socketpair(AF_UNIX, SOCK_STREAM) for this client so that asynchronous notifications
- *        (room broadcasts, whispers, file notifications) can be delivered via notify_writer.
- *     3. Enter a select() loop that waits on both:
+ *     2. Create a socketpair(AF_UNIX, SOCK_STREAM) for this client. Other threads queue broadcasts,
+ *        whispers and files in the connection's outbox, which writes a wake byte to notify_writer.
+ *     3. Enter a loop that waits (conn_io_wait: select() or io_uring, see io_engine.h) on:
  *          - tcp_fd (the actual client’s TCP socket) for new commands/data
- *          - notify (the read end of the socketpair) for messages from other threads (broadcasts, whispers, files)
+ *          - notify (the read end of the socketpair) for wake-ups from the outbox
+ *          - output progress while queued outbox data is waiting for socket buffer space
  *     4. When data arrives on tcp_fd:
- *          - Read a line, parse out the command (first token)
+ *          - Read, split the data into lines and parse out each command (first token)
  *          - Handle each command accordingly: /exit, /whisper, /join, /leave, /broadcast, /sendfile
- *          - Send appropriate replies back over tcp_fd (error messages, confirmations, etc.)
- *     5. When data arrives on notify_fd:
- *          - Read it and forward it directly to tcp_fd
+ *            (see command_handlers)
+ *          - Queue appropriate replies for the client (error messages, confirmations, etc.)
+ *     5. Once per loop iteration, before waiting again:
+ *          - Flush the outbox (replies plus everything other threads queued) to tcp_fd with batched,
+ *            non-blocking sendmsg() calls (or an io_uring send chain submitted with the next wait);
+ *            whatever does not fit stays queued until tcp_fd is writable
+ *          - If the slow-consumer policy marked the outbox overflowed, disconnect the client
  *     6. On any disconnection (recv() returns 0, error, or /exit command), break the loop.
  *     7. Remove the client from its room (if any), shut down sockets, log exit, and free resources.
  */
 void *client_handler(void *arg) {
     connection_t *connection = (connection_t *)arg;
 
-    // 1. Record the Linux TID into connection->thread_info.tid
-    pthread_mutex_lock(&conn_mutex);
+    // 1. Record the Linux TID into connection->thread_info.tid (the spawner reads it only after
+    //    the init handshake below)
     connection->thread_info.tid = syscall(SYS_gettid);
-    pthread_mutex_unlock(&conn_mutex);
+    conn_intern_prefixes(connection);
+
+    // Scratch arena for replies and log lines. A command can format a relayed line plus its
+    // console echo (each up to buf_size) and a few short lines; the block is allocated the
+    // first time this pooled struct serves a client and kept afterwards.
+    if (arena_init(&connection->arena, 2 * server_config.buf_size + BUF_SIZE) < 0) {
+        log_write("[THREAD-ERROR] Could not allocate a connection arena");
+        safe_print("[THREAD-ERROR] Could not allocate a connection arena");
+    }
 
     // 2. Signal to the spawner that this thread has finished its initialization
     pthread_mutex_lock(&connection->thread_info.init_mutex);
@@ -546,13 +1951,9 @@ void *client_handler(void *arg) {
     int fds[2];
     if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
         perror("socketpair");
-        char msg[BUF_SIZE];
-        snprintf(msg, sizeof msg,
-                 "[THREAD-INFO (TID: %d)] %s’s socketpair could not be created. Error in client_handler thread",
+        conn_log(connection, "[THREAD-INFO (TID: %d)] %s’s socketpair could not be created. Error in client_handler thread",
                  connection->thread_info.tid,
                  connection->username);
-        log_write(msg);
-        safe_print(msg);
 
         // If we can’t create the notify socketpair, close the client’s TCP socket and exit
         shutdown(connection->sockfd, SHUT_RDWR);
@@ -560,407 +1961,134 @@ void *client_handler(void *arg) {
         return NULL;
     } else {
         // Log success of socketpair creation
-        char msg[BUF_SIZE];
-        snprintf(msg, sizeof msg,
-                 "[THREAD-INFO (TID: %d)] %s’s socketpair is created.",
+        conn_log(connection, "[THREAD-INFO (TID: %d)] %s’s socketpair is created.",
                  connection->thread_info.tid,
                  connection->username);
-        log_write(msg);
-        safe_print(msg);
     }
 
-    // Store the two ends of the socketpair in the connection struct
-    pthread_mutex_lock(&conn_mutex);
+    // Store the two ends of the socketpair in the connection struct; only this thread uses them
+    // (other threads wake it through the outbox)
     connection->notify_fd     = fds[0];  // This end is read by the select() loop
-    connection->notify_writer = fds[1];  // Other threads write here to wake the select()
-    pthread_mutex_unlock(&conn_mutex);
+    connection->notify_writer = fds[1];  // The outbox writes wake bytes here
+    outbox_set_wake_fd(&connection->outbox, fds[1]);
+
+    // Socket I/O through the configured engine
+    conn_io_t *io = conn_io_open(connection->sockfd, connection->notify_fd, &connection->outbox);
+    if (!io) {
+        conn_log(connection, "[THREAD-ERROR (TID: %d)] Could not allocate I/O state for user %s",
+                 connection->thread_info.tid,
+                 connection->username);
+    } else if (conn_io_engine(io) != server_config.io_engine) {
+        conn_log(connection, "[THREAD-WARN (TID: %d)] io_uring ring could not be set up for user %s; using select()",
+                 connection->thread_info.tid,
+                 connection->username);
+    }
+    connection->io = io;
+
+    // Receive/relay buffer, sized by server_config.buf_size
+    size_t buf_size = server_config.buf_size;
+    char *buf = malloc(buf_size);
+    if (!buf) {
+        conn_log(connection, "[THREAD-ERROR (TID: %d)] Could not allocate I/O buffer for user %s",
+                 connection->thread_info.tid,
+                 connection->username);
+        buf_size = 0;
+    }
+
+    // Files an earlier connection of this user did not confirm
+    if (buf && io && connection->arena.base) {
+        offer_pending_files(connection);
+    }
 
-    int tcp_fd = connection->sockfd;
-    int notify = connection->notify_fd;
-    char buf[BUF_SIZE];
+    // Start of an incomplete command line kept from the previous read (at the front of buf)
+    size_t carry = 0;
 
     // Main loop: wait on either the TCP socket or the notify socket
-    while (1) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(tcp_fd, &rfds);
-        FD_SET(notify, &rfds);
-        int maxfd = (tcp_fd > notify ? tcp_fd : notify);
-
-        int ready = select(maxfd + 1, &rfds, NULL, NULL, NULL);
-        if (ready < 0) {
-            perror("select");
-            char msg[BUF_SIZE];
-            snprintf(msg, sizeof msg,
-                     "[THREAD-ERROR (TID: %d)] select() failed in thread for user %s: %s",
+    while (buf && io && connection->arena.base) {
+        // Everything formatted for the previous command has been sent or copied by now
+        arena_reset(&connection->arena);
+
+        // One batched flush per iteration: replies to the last command and everything that
+        // other threads queued since the previous flush
+        if (flush_output(connection) < 0) {
+            break;
+        }
+
+        // File streams held back too long for this client are dropped; the wait wakes up in
+        // time for the next one
+        int dropped;
+        int hold_ms = outbox_hold_expire(&connection->outbox, &dropped);
+        if (dropped > 0) {
+            conn_log(connection, "[FILE-ERROR] Dropped %d file%s held back for %d s for slow user '%s'.",
+                     dropped, dropped == 1 ? "" : "s", OUTBOX_PAUSE_TIMEOUT, connection->username);
+            metrics_add(M_FILES_DROPPED, (uint64_t)dropped);
+        }
+
+        // Outbox wake-ups are consumed inside the wait; the data goes out in the flush at the
+        // top of the loop
+        int ready = conn_io_wait(io, hold_ms);
+        if (ready == CONN_IO_SHUTDOWN) {
+            break;
+        }
+        if (ready == CONN_IO_ERROR) {
+            conn_log(connection, "[THREAD-ERROR (TID: %d)] Waiting for I/O failed in thread for user %s: %s",
                      connection->thread_info.tid,
                      connection->username,
                      strerror(errno));
-            log_write(msg);
-            safe_print(msg);
             break;
         }
 
-        // 4a. Data available on TCP socket: client sending a command
-        if (FD_ISSET(tcp_fd, &rfds)) {
-            ssize_t n = recv(tcp_fd, buf, sizeof(buf) - 1, 0);
+        // 4. Data available on TCP socket: client sending a command
+        if (ready == CONN_IO_READABLE) {
+            ssize_t n = conn_io_recv(io, buf + carry, buf_size - 1 - carry);
             if (n == 0) {
                 // Client closed the connection gracefully
-                char msg[BUF_SIZE];
-                snprintf(msg, sizeof msg,
-                         "[THREAD-INFO (TID: %d)] User '%s' closed the connection.",
-                         connection->thread_info.tid,
-                         connection->username);
-                log_write(msg);
-                safe_print(msg);
+                conn_log_parts(connection, connection->user_prefix_len, " closed the connection.", NULL);
                 break;
             } else if (n < 0) {
                 // Some error occurred on recv
-                char msg[BUF_SIZE];
-                snprintf(msg, sizeof msg,
-                         "[THREAD-INFO (TID: %d)] Connection of user '%s' is over (recv error).",
-                         connection->thread_info.tid,
-                         connection->username);
-                log_write(msg);
-                safe_print(msg);
+                conn_log_parts(connection, connection->tid_prefix_len,
+                               "Connection of user '", connection->username, "' is over (recv error).", NULL);
                 break;
             }
 
-            // Null-terminate the received bytes so we can tokenize them
-            buf[n] = '\0';
-
-            // Extract the first token (command)
-            char *cmd = strtok(buf, " \r\n");
-
-            // Log which command the user just sent
-            char msg[BUF_SIZE];
-            snprintf(msg, sizeof msg,
-                     "[THREAD-INFO (TID: %d)] User '%s' sent %s command",
-                     connection->thread_info.tid,
-                     connection->username,
-                     cmd ? cmd : "(null)");
-            log_write(msg);
-            safe_print(msg);
-
-            // Handle each supported command
-            if (cmd && strcmp(cmd, "/exit") == 0) {
-                // /exit: gracefully tell the client we are shutting down its connection
-                const char *bye = "[INFO] Server is shutting down your connection.\n";
-                send(tcp_fd, bye, strlen(bye), 0);
-                break;
-
-            } else if (cmd && strcmp(cmd, "/whisper") == 0) {
-                // /whisper <target> <message>
-                char *target = strtok(NULL, " ");
-                char *message = strtok(NULL, "\n");
-                if (!target || !message) {
-                    // Missing arguments: send usage error back to client
-                    const char *err = "[ERROR] Usage: /whisper <user> <message>\n";
-                    send(tcp_fd, err, strlen(err), 0);
-                } else {
-                    // Check if the target user is currently connected
-                    if (find_connection(target) == NULL) {
-                        // Target not online: inform sender
-                        char err[BUF_SIZE];
-                        snprintf(err, sizeof err,
-                                 "[ERROR] User '%s' not online.\n",
-                                 target);
-                        send(tcp_fd, err, strlen(err), 0);
-
-                        // Log the failed whisper attempt
-                        char log_msg[BUF_SIZE];
-                        snprintf(log_msg, sizeof log_msg,
-                                 "[THREAD-INFO (TID: %d)] User '%s' tried to whisper to offline user '%s'",
-                                 connection->thread_info.tid,
-                                 connection->username,
-                                 target);
-                        log_write(log_msg);
-                        safe_print(log_msg);
-                    } else {
-                        // Target exists: send the message via notify socket
-                        // First, log the intent in server console
-                        char outlog[BUF_SIZE];
-                        snprintf(outlog, sizeof outlog,
-                                 "%s %s → %s: %s\n",
-                                 cmd,
-                                 connection->username,
-                                 target,
-                                 message);
-                        safe_print(outlog);
-
-                        char log_msg[BUF_SIZE];
-                        snprintf(log_msg, sizeof log_msg,
-                                 "[THREAD-INFO (TID: %d)] User '%s' sent whisper to %s",
-                                 connection->thread_info.tid,
-                                 connection->username,
-                                 target);
-                        log_write(log_msg);
-                        safe_print(log_msg);
-
-                        // Deliver to the recipient’s notify_writer
-                        broadcast_message_via_notify(connection->username, target, message);
-                    }
-                }
-
-            } else if (cmd && strcmp(cmd, "/join") == 0) {
-                // /join <room_name>
-                char *room_name = strtok(NULL, " \n");
-                char *extra     = strtok(NULL, " \n");
-                if (!room_name || extra) {
-                    // Missing room name: send error
-                    char err[BUF_SIZE];
-                    snprintf(err, sizeof err,
-                             "[ERROR] Usage: /join <room>\n");
-                    send(tcp_fd, err, strlen(err), 0);
-                } else if (!is_valid_roomname(room_name)) {
-                    // Invalid room name: must be 1–32 alphanumeric characters
-                    const char *err = "[ERROR] Room name must be 1–32 alphanumeric characters.\n";
-                    send(tcp_fd, err, strlen(err), 0);
-
-                    char log_msg[BUF_SIZE];
-                    snprintf(log_msg, sizeof log_msg,
-                             "[THREAD-INFO (TID: %d)] User '%s' sent invalid room name %s",
-                             connection->thread_info.tid,
-                             connection->username,
-                             room_name);
-                    log_write(log_msg);
-                    safe_print(log_msg);
-                } else {
-                    // If already in a room, remove from the old one first
-                    if (connection->room) {
-                        room_remove_member(connection->room, connection);
-                    }
-
-                    // Create or find the requested room
-                    room_t *room = room_create(room_name, connection);
-                    if (!room) {
-                        // Either room slots are full or creation failed
-                        char err[BUF_SIZE];
-                        snprintf(err, sizeof err,
-                                 "[WARN] Room slots are full. Room is not created. Try again later.\n");
-                        send(tcp_fd, err, strlen(err), 0);
-
-                        char log_msg[BUF_SIZE];
-                        snprintf(log_msg, sizeof log_msg,
-                                 "[THREAD-INFO (TID: %d)] Room %s is not created. Room slots are full",
-                                 connection->thread_info.tid,
-                                 room_name);
-                        log_write(log_msg);
-                        safe_print(log_msg);
-                    } else if (room->member_count >= ROOM_CAPACITY) {
-                        // Room exists but is already full
-                        char warn[BUF_SIZE];
-                        snprintf(warn, sizeof warn,
-                                 "[WARN] Room is full\n");
-                        send(tcp_fd, warn, strlen(warn), 0);
-
-                        char log_msg[BUF_SIZE];
-                        snprintf(log_msg, sizeof log_msg,
-                                 "[THREAD-INFO (TID: %d)] User '%s' could not join room %s. Room is full.",
-                                 connection->thread_info.tid,
-                                 connection->username,
-                                 room_name);
-                        log_write(log_msg);
-                        safe_print(log_msg);
-                    } else {
-                        // Room is available: add the client as a member
-                        room_add_member(room, connection);
-
-                        // Send confirmation to the client
-                        char ok_msg[BUF_SIZE];
-                        snprintf(ok_msg, sizeof ok_msg,
-                                 "[OK] User \"%s\" joined the room: %s\n",
-                                 connection->username,
-                                 room->name);
-                        send(tcp_fd, ok_msg, strlen(ok_msg), 0);
-
-                        // Log the join event
-                        char log_msg[BUF_SIZE];
-                        snprintf(log_msg, sizeof log_msg,
-                                 "[THREAD-INFO (TID: %d)] User '%s' joined the room %s.",
-                                 connection->thread_info.tid,
-                                 connection->username,
-                                 room_name);
-                        log_write(log_msg);
-                        safe_print(log_msg);
-                    }
-                }
-
-            } else if (cmd && strcmp(cmd, "/leave") == 0) {
-                // /leave: leave the current room, if any
-                if (connection->room) {
-                    // Log the removal from the room
-                    char log_msg[BUF_SIZE];
-                    snprintf(log_msg, sizeof log_msg,
-                             "[THREAD-INFO (TID: %d)] User '%s' left the room %s.",
-                             connection->thread_info.tid,
-                             connection->username,
-                             connection->room->name);
-
-                    // Notify the client that they have left
-                    char info_msg[BUF_SIZE];
-                    snprintf(info_msg, sizeof info_msg,
-                             "[INFO] User \"%s\" left the room: %s\n",
-                             connection->username,
-                             connection->room->name);
-
-                    // Remove from the room and send the message
-                    room_remove_member(connection->room, connection);
-                    send(tcp_fd, info_msg, strlen(info_msg), 0);
-
-                    // Log the action
-                    log_write(log_msg);
-                    safe_print(log_msg);
-                } else {
-                    // Not in any room: send info back to client
-                    char info_msg[BUF_SIZE];
-                    snprintf(info_msg, sizeof info_msg,
-                             "[INFO] User \"%s\" is not in any room\n",
-                             connection->username);
-                    send(tcp_fd, info_msg, strlen(info_msg), 0);
-
-                    // Log the attempt to leave when not in a room
-                    char log_msg[BUF_SIZE];
-                    snprintf(log_msg, sizeof log_msg,
-                             "[THREAD-INFO (TID: %d)] User '%s' tried to leave a room but was not in any room.",
-                             connection->thread_info.tid,
-                             connection->username);
-                    log_write(log_msg);
-                    safe_print(log_msg);
-                }
-
-            } else if (cmd && strcmp(cmd, "/broadcast") == 0) {
-                // /broadcast <message>: send message to all in the current room
-                char *message = strtok(NULL, "\n");
-                if (!message) {
-                    // Missing message argument
-                    char err[BUF_SIZE];
-                    snprintf(err, sizeof err,
-                             "[ERROR] Usage: /broadcast <msg>\n");
-                    send(tcp_fd, err, strlen(err), 0);
-                } else if (!connection->room) {
-                    // Not currently in a room
-                    char err[BUF_SIZE];
-                    snprintf(err, sizeof err,
-                             "[ERROR] Join a room first\n");
-                    send(tcp_fd, err, strlen(err), 0);
-
-                    char log_msg[BUF_SIZE];
-                    snprintf(log_msg, sizeof log_msg,
-                             "[THREAD-INFO (TID: %d)] User '%s' tried to broadcast but was not in any room.",
-                             connection->thread_info.tid,
-                             connection->username);
-                    log_write(log_msg);
-                    safe_print(log_msg);
-                } else {
-                    // Broadcast to everyone in the room
-                    room_broadcast(connection->room, connection->username, message);
-                }
-
-            } else if (cmd && strcmp(cmd, "/sendfile") == 0) {
-                // /sendfile <filename> <user> <size>
-                char *filename = strtok(NULL, " \r\n");
-                char *target   = strtok(NULL, " \r\n");
-                char *size_str = strtok(NULL, " \r\n");
-
-                if (!filename || !target || !size_str) {
-                    // Missing one or more arguments
-                    const char *err = "[ERROR] Usage: /sendfile <filename> <user> <size>\n";
-                    send(tcp_fd, err, strlen(err), 0);
-                    continue;
-                }
-
-                // Parse and validate file size
-                size_t filesize = strtoul(size_str, NULL, 10);
-                if (filesize == 0 || filesize > (3 * 1024 * 1024)) {
-                    const char *err = "[ERROR] File size must be between 1 byte and 3MB.\n";
-                    send(tcp_fd, err, strlen(err), 0);
-                    continue;
-                }
-
-                // Allocate a contiguous buffer to hold the entire incoming file
-                char *filedata = malloc(filesize);
-                if (!filedata) {
-                    // Out of memory
-                    const char *err = "[ERROR] Server out of memory. Try later.\n";
-                    send(tcp_fd, err, strlen(err), 0);
-                    continue;
-                }
-
-                // Read exactly 'filesize' bytes from the TCP socket
-                size_t total = 0;
-                while (total < filesize) {
-                    ssize_t r = recv(tcp_fd, filedata + total, filesize - total, 0);
-                    if (r <= 0) break;
-                    total += (size_t)r;
+            metrics_add(M_BYTES_IN, (uint64_t)n);
+            size_t have = carry + (size_t)n;
+            carry = 0;
+
+            // Null-terminate the received bytes so that a last line without '\n' ends too
+            buf[have] = '\0';
+
+            // A read can carry several pipelined commands: run them one line at a time. Bytes a
+            // /chunk consumes as its payload are skipped.
+            size_t pos = 0;
+            int keep_going = 0;
+            while (pos < have && keep_going == 0) {
+                char  *line     = buf + pos;
+                size_t avail    = have - pos;
+                size_t line_len = ts_find_newline(line, avail);
+                if (line_len < avail) {
+                    line_len++;  // Include the '\n'
+                } else if (pos > 0 || have < buf_size - 1) {
+                    // The line continues in the next read: keep it (a line that fills the
+                    // whole buffer is run as it is)
+                    memmove(buf, line, avail);
+                    carry = avail;
+                    break;
                 }
-                if (total != filesize) {
-                    // Didn’t receive the expected number of bytes
-                    free(filedata);
-                    const char *err = "[ERROR] Failed to receive full file data.\n";
-                    send(tcp_fd, err, strlen(err), 0);
-                    continue;
-                }
-
-                // Prepare a file_item_t (defined in file_queue.h) with all metadata
-                file_item_t item;
-                memset(&item, 0, sizeof(item));
-                strncpy(item.filename, filename, MAX_FILENAME - 1);
-                item.size   = filesize;
-                item.data   = filedata;
-                snprintf(item.sender, USERNAME_LEN, "%s", connection->username);
-                snprintf(item.target, USERNAME_LEN, "%s", target);
-
-                // If the queue is full, notify the client that their file will be queued anyway
-                if (file_queue_is_full(upload_queue)) {
-                    char info_msg[BUF_SIZE];
-                    snprintf(info_msg, sizeof info_msg,
-                             "[INFO] Upload queue is full. Your file '%s' will be queued.\n",
-                             filename);
-                    send(tcp_fd, info_msg, strlen(info_msg), 0);
-                }
-
-                // Enqueue the file_item_t (blocks if the queue is at capacity)
-                file_queue_enqueue(upload_queue, &item);
-
-                // Acknowledge to the client that the file is queued
-                char ok_msg[BUF_SIZE];
-                snprintf(ok_msg, sizeof ok_msg,
-                         "[OK] File '%s' queued for sending to %s. Size: %zu bytes.\n",
-                         filename, target, filesize);
-                send(tcp_fd, ok_msg, strlen(ok_msg), 0);
-
-                // Log the enqueue event
-                char log_msg2[BUF_SIZE];
-                snprintf(log_msg2, sizeof log_msg2,
-                         "[FILE-QUEUE] Upload '%s' from %s enqueued for %s.",
-                         filename, connection->username, target);
-                log_write(log_msg2);
-                safe_print(log_msg2);
-            } else {
-                // Unknown command: send error and log it
-                const char *err = "[ERROR] Unknown command.\n";
-                send(tcp_fd, err, strlen(err), 0);
 
-                char log_msg[BUF_SIZE];
-                snprintf(log_msg, sizeof log_msg,
-                         "[THREAD-INFO (TID: %d)] User '%s' sent unknown command.",
-                         connection->thread_info.tid,
-                         connection->username);
-                log_write(log_msg);
-                safe_print(log_msg);
+                cmd_ctx_t ctx = {
+                    .connection = connection,
+                    .io         = io,
+                    .extra      = line + line_len,
+                    .extra_len  = avail - line_len,
+                };
+                keep_going = run_command(&ctx, line, line_len);
+                pos += line_len + ctx.extra_used;
             }
-        }
-
-        // 4b. Data available on notify socket: another thread wants to send us something
-        if (FD_ISSET(notify, &rfds)) {
-            ssize_t n = read(notify, buf, sizeof(buf) - 1);
-            if (n <= 0) {
-                // If read() returns 0 or negative, shut down as well
+            if (keep_going < 0) {
                 break;
             }
-            // Forward whatever bytes we got directly to the client’s TCP socket
-            send(tcp_fd, buf, n, 0);
         }
     }
 
@@ -969,10 +2097,19 @@ void *client_handler(void *arg) {
     //    - Shutdown and close both the TCP socket and the notify socketpair
     //    - Log and free the connection entry
 
-    if (connection->room) {
+    free(buf);
+
+    // Last replies get a short grace period; outstanding io_uring requests are cancelled
+    conn_io_close(io);
+    connection->io = NULL;
+
+    if (connection->room != ROOM_ID_NONE) {
         room_remove_member(connection->room, connection);
     }
 
+    // Stop accepting queued data before the wake fd goes away
+    outbox_close(&connection->outbox);
+
     shutdown(connection->sockfd, SHUT_RDWR);
     shutdown(connection->notify_fd, SHUT_RDWR);
     shutdown(connection->notify_writer, SHUT_RDWR);
@@ -981,20 +2118,16 @@ void *client_handler(void *arg) {
     close(connection->notify_fd);
     close(connection->notify_writer);
 
-    // Preserve the username for logging after we free the connection struct
-    char removed_user[USERNAME_LEN];
-    strncpy(removed_user, connection->username, USERNAME_LEN);
-    removed_user[USERNAME_LEN - 1] = '\0';
-
-    char msg[BUF_SIZE];
-    snprintf(msg, sizeof msg,
-             "[THREAD-INFO (TID: %d)] User \"%s\" has been disconnected and removed.",
+    conn_log(connection, "[THREAD-INFO (TID: %d)] User \"%s\" has been disconnected and removed.",
              connection->thread_info.tid,
-             removed_user);
-    log_write(msg);
-    safe_print(msg);
+             connection->username);
 
-    remove_connection(removed_user);
+    // Its unfinished uploads stay resumable by a later connection (for resume_ttl seconds:
+    // with resume_ttl 0 they go right away)
+    transfer_detach(atomic_load_explicit(&connection->id, memory_order_relaxed));
+    transfer_reap();
+
+    remove_connection(connection);
     return NULL;
 }
 
@@ -1012,12 +2145,7 @@ int is_valid_username(const char *s) {
     if (len == 0 || len > USERNAME_LEN - 1) {
         return 0;
     }
-    for (size_t i = 0; i < len; ++i) {
-        if (!isalnum((unsigned char)s[i])) {
-            return 0;
-        }
-    }
-    return 1;
+    return ts_span_alnum(s, len) == len;
 }
 
 /**
@@ -1030,12 +2158,7 @@ int is_valid_roomname(const char *s) {
     if (len == 0 || len > ROOM_NAME_LEN - 1) {
         return 0;
     }
-    for (size_t i = 0; i < len; ++i) {
-        if (!isalnum((unsigned char)s[i])) {
-            return 0;
-        }
-    }
-    return 1;
+    return ts_span_alnum(s, len) == len;
 }
 
 /* ------------------------------------------------------------------------- */
@@ -1044,15 +2167,18 @@ int is_valid_roomname(const char *s) {
 
 /**
  * file_upload_worker
- *   Dedicated worker thread function for servicing pending file uploads from the queue.
+ *   Dedicated worker thread function for servicing pending file deliveries from the queue.
+ *   A file sent to several users is one item per recipient, all sharing the transfer's bytes.
  *   Repeatedly dequeues a file_item_t:
  *     - If the dequeued item is marked as 'is_sentinel', break out of the loop and exit.
  *     - Otherwise, check if the target recipient is still connected:
- *         - If not, drop the file (free the buffer, log that recipient disappeared).
- *         - If yes, send a “[FILE <filename> <size> <sender>]” header over the recipient’s notify_writer,
- *           followed immediately by the raw file bytes.
- *       Log success or any errors encountered while writing the file data.
- *     - Free the allocated file buffer (item.data) once done.
+ *         - If not, end the delivery (log that the recipient disappeared); the transfer stays
+ *           in the transfer table, and the user is offered it on reconnecting.
+ *         - If yes, queue the file, from the item's offset on, in the recipient’s outbox. The
+ *           outbox borrows the transfer's bytes and sends them as a “[FILE ...]” header plus
+ *           “[FILE-DATA ...]” pieces between chat messages. If the recipient is behind on its
+ *           outbound budget the stream pauses here until it catches up.
+ *       Log success, or why the file could not be queued.
  */
 static void *file_upload_worker(void *arg) {
     (void)arg;  // unused parameter
@@ -1060,68 +2186,98 @@ static void *file_upload_worker(void *arg) {
     while (1) {
         // Dequeue a file_item_t (blocking if the queue is empty)
         file_item_t item = file_queue_dequeue(upload_queue);
+        metrics_gauge_add(G_UPLOAD_QUEUE_DEPTH, -1);
 
         if (item.is_sentinel) {
             // Sentinel indicates no more real work: exit the thread.
             break;
         }
 
-        // 2) Check if the target user is still connected
-        pthread_mutex_lock(&conn_mutex);
-        connection_t *recipient = find_connection_locked(item.target);
-        pthread_mutex_unlock(&conn_mutex);
+        uint64_t busy_start = metrics_now_ns();
+        metrics_gauge_add(G_UPLOAD_WORKERS_BUSY, 1);
+        transfer_rcpt_t *r = item.rcpt;
+        transfer_t *t = r->transfer;
+
+        // 2) Check if the target connection is still there (and keep it alive while we deliver)
+        connection_t *recipient = connection_acquire_id(item.target_id);
 
         if (!recipient) {
-            // Recipient disconnected: drop the file, log it
+            // Recipient disconnected: end this delivery, log it
             char log_msg[BUF_SIZE];
             snprintf(log_msg, sizeof log_msg,
-                     "[FILE-QUEUE] Recipient '%s' not found for file '%s' from '%s'. Dropping.",
-                     item.target, item.filename, item.sender);
+                     "[FILE-QUEUE] Recipient '%s' not found for file '%s' from '%s'. %s",
+                     r->name, t->filename, t->sender,
+                     server_config.resume_ttl > 0 ? "Kept for resume." : "Dropping.");
             log_write(log_msg);
             safe_print(log_msg);
 
-            free(item.data);
+            transfer_delivery_end(r);
+            transfer_release(t);
+            metrics_inc(M_FILES_DROPPED);
+            metrics_gauge_add(G_UPLOAD_WORKERS_BUSY, -1);
+            metrics_add(M_WORKER_BUSY_NS, metrics_now_ns() - busy_start);
             continue;
         }
 
-        // 3) Send header to recipient’s notify_writer: “[FILE <filename> <size> <sender>]\n”
+        // 3) Queue the file in the recipient’s file lane:
+        //    “[FILE <transfer> <filename> <size> <sender> <offset>]\n”, then the bytes from
+        //    <offset> on in “[FILE-DATA <transfer> <len> <crc>]\n” pieces interleaved with chat
+        //    (<crc> comes from the checkpoints made during the upload: nothing is recomputed).
+        //    A recipient whose outbox is full gets the file held back in its lane: the worker
+        //    never waits for one slow recipient
         char header[BUF_SIZE];
         int hlen = snprintf(header, sizeof header,
-                            "[FILE %s %zu %s]\n",
-                            item.filename, item.size, item.sender);
-        write(recipient->notify_writer, header, (size_t)hlen);
-
-        // 4) Send the raw file bytes
-        size_t total_sent = 0;
-        while (total_sent < item.size) {
-            ssize_t sent = write(recipient->notify_writer,
-                                 item.data + total_sent,
-                                 item.size - total_sent);
-            if (sent <= 0) {
-                // Possibly the recipient disconnected in the middle of transfer
-                char err_log[BUF_SIZE];
-                snprintf(err_log, sizeof err_log,
-                         "[FILE-ERROR] Failed sending '%s' to '%s'.",
-                         item.filename, item.target);
-                log_write(err_log);
-                safe_print(err_log);
-                break;
-            }
-            total_sent += (size_t)sent;
+                            "[FILE %u %s %zu %s %zu]\n",
+                            t->id, t->filename, t->size, t->sender, item.offset);
+        //    A recipient that negotiated compression gets the pieces that compress as
+        //    “[FILE-ZDATA ...]” LZ4 blocks, compressed once per cached file for all recipients
+        const outbox_zpiece_t *zpieces = NULL;
+        if (t->blob && outbox_compressing(&recipient->outbox)) {
+            zpieces = filecache_zpieces(t->blob);
+        }
+        outbox_payload_t payload = {
+            .data    = t->data + item.offset,
+            .len     = t->size - item.offset,
+            .origin  = item.offset,
+            .marks   = t->marks,
+            .zpieces = zpieces,
+            .release = delivery_done,   // Takes over the item's reference
+            .arg     = r,
+        };
+        transfer_retain(t);  // For the log lines below
+        int paused = 0;
+        outbox_result_t rc = outbox_push_file(&recipient->outbox, t->id, header, (size_t)hlen,
+                                              &payload, &paused);
+        connection_release(recipient);
+        if (paused) {
+            metrics_inc(M_FILE_PAUSES);
         }
 
-        // 5) If the whole file was sent, log success
-        if (total_sent == item.size) {
+        // 4) Log the outcome
+        if (rc == OUTBOX_OK) {
             char log_msg2[BUF_SIZE];
             snprintf(log_msg2, sizeof log_msg2,
-                     "[SEND FILE] '%s' sent from %s to %s (success).",
-                     item.filename, item.sender, item.target);
+                     "[SEND FILE] '%s' sent from %s to %s (%s).",
+                     t->filename, t->sender, r->name,
+                     paused ? "held until the recipient catches up" : "success");
             log_write(log_msg2);
             safe_print(log_msg2);
+            metrics_inc(M_FILES_DELIVERED);
+        } else {
+            char err_log[BUF_SIZE];
+            snprintf(err_log, sizeof err_log,
+                     "[FILE-ERROR] Failed sending '%s' to '%s' (recipient disconnected).",
+                     t->filename, r->name);
+            log_write(err_log);
+            safe_print(err_log);
+            metrics_inc(M_FILES_DROPPED);
         }
+        transfer_release(t);
 
-        // 6) Free the buffer that was allocated for this file
-        free(item.data);
+        uint64_t busy_ns = metrics_now_ns() - busy_start;
+        metrics_gauge_add(G_UPLOAD_WORKERS_BUSY, -1);
+        metrics_add(M_WORKER_BUSY_NS, busy_ns);
+        metrics_observe_ns(H_FILE_DELIVERY_SECONDS, busy_ns);
     }
 
     return NULL;
@@ -1132,15 +2288,44 @@ static void *file_upload_worker(void *arg) {
 /* ------------------------------------------------------------------------- */
 
 int main(int argc, char *argv[]) {
-    // Expect exactly one argument: the port number to listen on.
-    if (argc != 2) {
-        fprintf(stderr, "[ERROR] Usage: %s <port>\n", argv[0]);
+    // Resolve the runtime configuration: defaults, then config file, then command-line options.
+    config_set_defaults(&server_config);
+    int cfg_rc = config_parse_args(&server_config, argc, argv);
+    if (cfg_rc != 0) {
+        return cfg_rc > 0 ? 0 : 1;
+    }
+    if (config_validate(&server_config) < 0) {
+        return 1;
+    }
+    int port = server_config.port;
+
+    // Size the global tables from the configuration
+    upload_workers = calloc((size_t)server_config.upload_workers, sizeof(*upload_workers));
+    if (registry_init() < 0 || room_index_init() < 0 || !upload_workers) {
+        perror("calloc");
+        return 1;
+    }
+    connection_pool = pool_create("connections", sizeof(connection_t),
+                                  (uint32_t)(server_config.max_conn + server_config.upload_workers),
+                                  connection_ctor);
+    room_pool = pool_create("rooms",
+                            sizeof(room_t) + (size_t)server_config.room_capacity * sizeof(conn_id_t),
+                            (uint32_t)server_config.max_rooms, room_ctor);
+    if (!connection_pool || !room_pool ||
+        outbox_pool_init((uint32_t)server_config.max_conn * OUTBOX_MSG_SLOTS_PER_CONN) < 0) {
+        perror("pool_create");
         return 1;
     }
-    int port = atoi(argv[1]);
 
-    // Initialize logging subsystem (timestamped logs in LOG_DIRECTORY)
-    log_init_ts(LOG_DIRECTORY);
+    // Initialize logging subsystem (timestamped logs in the configured log directory)
+    log_init_ts(server_config.log_dir);
+
+    // Lock-profiling builds: SIGUSR1 prints the contention report. Must run before any
+    // other thread is created so that all of them inherit the blocked SIGUSR1.
+    if (lockprof_enabled()) {
+        lockprof_start_reporter(print_lock_report_line);
+        safe_print("[SERVER-INFO] Lock profiling enabled; send SIGUSR1 for a report.");
+    }
 
     // Log that the server has started
     char msg[BUF_SIZE];
@@ -1150,27 +2335,66 @@ int main(int argc, char *argv[]) {
     log_write(msg);
     safe_print(msg);
 
+    snprintf(msg, sizeof msg,
+             "[SERVER-INFO] Limits: max_conn=%d max_rooms=%d room_capacity=%d buf_size=%zu "
+             "upload_workers=%d upload_queue_size=%d max_file_size=%zu",
+             server_config.max_conn, server_config.max_rooms, server_config.room_capacity,
+             server_config.buf_size, server_config.upload_workers,
+             server_config.upload_queue_size, server_config.max_file_size);
+    log_write(msg);
+    safe_print(msg);
+
+    snprintf(msg, sizeof msg, "[SERVER-INFO] Command parsing and validation use %s kernels; file checksums use %s CRC32C; "
+             "lz4 compression %s.",
+             ts_simd_name(), crc32c_impl_name(), server_config.compression ? "offered" : "off");
+    log_write(msg);
+    safe_print(msg);
+
+    // io_uring engine: make sure the kernel supports it before any connection relies on it
+    if (server_config.io_engine == IO_ENGINE_URING) {
+        int probe = io_engine_probe();
+        if (probe < 0) {
+            snprintf(msg, sizeof msg,
+                     "[WARN] io_uring is not available (%s); falling back to the select() engine.",
+                     strerror(-probe));
+            server_config.io_engine = IO_ENGINE_SELECT;
+        } else {
+            snprintf(msg, sizeof msg, "[SERVER-INFO] I/O engine: io_uring");
+        }
+        log_write(msg);
+        safe_print(msg);
+    }
+
     // Set up SIGINT handler so we can gracefully shut down when Ctrl+C is pressed
     struct sigaction sa = {0};
     sa.sa_handler = handle_sigint;
     sigemptyset(&sa.sa_mask);
     sigaction(SIGINT, &sa, NULL);
 
+    // A client that disconnects while a reply is being sent must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
     /* ----------------------------- */
     /* 1) Initialize file upload queue */
     /* ----------------------------- */
-    upload_queue = file_queue_init(ROOM_CAPACITY);  // We mistakenly reused ROOM_CAPACITY as queue capacity
+    upload_queue = file_queue_init((size_t)server_config.upload_queue_size);
     if (!upload_queue) {
         perror("file_queue_init");
         exit(1);
     }
 
-    // Spawn NUM_UPLOAD_WORKERS threads that will process file uploads from the queue
-    for (int i = 0; i < NUM_UPLOAD_WORKERS; ++i) {
+    // Spawn upload_workers threads that will process file uploads from the queue
+    for (int i = 0; i < server_config.upload_workers; ++i) {
         pthread_create(&upload_workers[i], NULL, file_upload_worker, NULL);
         // We do not detach these worker threads because we intend to join them on shutdown
     }
 
+    // Expired transfers are dropped in the background too, not only when uploads start
+    if (transfer_reaper_start() < 0) {
+        perror("transfer_reaper_start");
+        exit(1);
+    }
+
     /* ----------------------------- */
     /* 2) Create listening socket and bind */
     /* ----------------------------- */
@@ -1229,18 +2453,39 @@ int main(int argc, char *argv[]) {
     safe_print(msg);
     log_write(msg);
 
+    // Optional metrics endpoint on the loopback interface
+    if (server_config.admin_port) {
+        if (metrics_admin_start(server_config.admin_port) == 0) {
+            snprintf(msg, sizeof msg,
+                     "[SERVER-INFO] Metrics endpoint listening on 127.0.0.1:%d",
+                     server_config.admin_port);
+        } else {
+            snprintf(msg, sizeof msg,
+                     "[WARN] Metrics endpoint could not be started on port %d: %s",
+                     server_config.admin_port, strerror(errno));
+        }
+        safe_print(msg);
+        log_write(msg);
+    }
+
     /* ----------------------------- */
     /* 3) Main accept() loop                */
     /* ----------------------------- */
+    acceptor_t *acceptor = acceptor_open(server_fd);
+    if (!acceptor) {
+        perror("acceptor_open");
+        exit(1);
+    }
+
     while (!stop) {
-        int client_fd = accept(server_fd, NULL, NULL);
+        int client_fd = acceptor_next(acceptor);
         if (client_fd < 0) {
             if (stop) {
                 // If stop==1, accept() failed because the socket was closed by SIGINT handler
                 break;
             }
             if (errno == EINTR) {
-                // Interrupted by some other signal; retry
+                // Interrupted by some other signal (or the io_uring poll timed out); retry
                 continue;
             }
 
@@ -1252,6 +2497,11 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
+        // Keep at most about one file slice unsent in the kernel, so the outbox (not the socket
+        // buffer) decides what goes out next and chat can overtake a file that is draining
+        int lowat = OUTBOX_SLICE_SIZE;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+
         // Log that a new client socket has connected
         snprintf(msg, sizeof msg,
                  "[SERVER-INFO] A client is connected to sock=%d",
@@ -1259,14 +2509,16 @@ int main(int argc, char *argv[]) {
         safe_print(msg);
         log_write(msg);
 
-        // 4) Perform username handshake
-        char username[USERNAME_LEN];
-        int idx = -1;
+        // 4) Perform username handshake: "<username>\n", or "<username> lz4\n" from a client
+        //    that wants compressed data (see outbox_set_compression)
+        char hello[USERNAME_LEN + 16];
+        char *username = hello;
+        connection_t *conn = NULL;
         int handshake_ok = 0;
 
         while (!handshake_ok) {
             // Wait to receive a username line from the client
-            ssize_t n = recv(client_fd, username, sizeof(username) - 1, 0);
+            ssize_t n = recv(client_fd, hello, sizeof(hello) - 1, 0);
             if (n <= 0) {
                 // Either client closed or error
                 if (n == 0) {
@@ -1286,16 +2538,24 @@ int main(int argc, char *argv[]) {
             }
 
             // Remove trailing newline if present
-            if (username[n - 1] == '\n') {
-                username[n - 1] = '\0';
+            if (hello[n - 1] == '\n') {
+                hello[n - 1] = '\0';
             } else {
-                username[n] = '\0';
+                hello[n] = '\0';
+            }
+
+            // Split off the compression request after the name (anything else after a space
+            // makes the name invalid, as before)
+            int want_lz4 = 0;
+            char *opt = strchr(hello, ' ');
+            if (opt && strcmp(opt + 1, "lz4") == 0) {
+                *opt     = '\0';
+                want_lz4 = 1;
             }
 
             // Validate username (must be 1–16 alphanumeric chars)
             if (!is_valid_username(username)) {
-                const char *bad = "[ERROR] Username must be 1–16 alphanumeric characters.\n";
-                send(client_fd, bad, strlen(bad), 0);
+                send_static(client_fd, REPLY_BAD_USERNAME, 0);
 
                 char log_msg[BUF_SIZE];
                 snprintf(log_msg, sizeof log_msg,
@@ -1305,71 +2565,75 @@ int main(int argc, char *argv[]) {
                 continue;  // Prompt client again
             }
 
-            // Check if the username is already taken
-            int taken = (find_connection(username) != NULL);
-            if (taken) {
-                const char *retry = "[ERROR] Username already taken. Choose another.\n";
-                send(client_fd, retry, strlen(retry), 0);
+            // Take a connection_t from the pool for the new user
+            connection_t *tmp = pool_alloc(connection_pool);
+            if (!tmp) {
+                send_static(client_fd, REPLY_OUT_OF_MEMORY, 0);
 
                 char log_msg[BUF_SIZE];
                 snprintf(log_msg, sizeof log_msg,
-                         "[SERVER-INFO] sock: %d was sent an already taken username for creation", client_fd);
+                         "[SERVER-ERROR] No free connection object while accepting user '%s' from sock=%d",
+                         username, client_fd);
                 log_write(log_msg);
                 safe_print(log_msg);
-                continue;  // Prompt client again
-            } else {
-                // Find a free slot in connections[]
-                idx = find_free_slot();
-                if (idx == -1) {
-                    const char *server_full = "[ERROR] Server is full. Try again later.\n";
-                    send(client_fd, server_full, strlen(server_full), 0);
 
-                    char log_msg[BUF_SIZE];
-                    snprintf(log_msg, sizeof log_msg,
-                             "[SERVER-INFO] A client tried to connect when server is full.");
-                    log_write(log_msg);
-                    safe_print(log_msg);
-                    continue;  // Prompt (actually will fail again)
-                }
+                close(client_fd);
+                metrics_inc(M_CONNECTIONS_REJECTED);
+                break;
+            }
 
-                // Allocate a new connection_t and insert into connections[idx]
-                connection_t *tmp = calloc(1, sizeof(connection_t));
-                if (!tmp) {
-                    const char *err = "[ERROR] Server out of memory. Try later.\n";
-                    send(client_fd, err, strlen(err), 0);
+            // Reset the recycled object; its mutexes and condition variable stay initialized
+            snprintf(tmp->username, USERNAME_LEN, "%.*s", USERNAME_LEN - 1, username);
+            tmp->sockfd                  = client_fd;
+            tmp->notify_fd               = -1;
+            tmp->notify_writer           = -1;
+            tmp->thread_info.thread      = 0;
+            tmp->thread_info.tid         = 0;
+            tmp->thread_info.initialized = 0;
+            tmp->room                    = ROOM_ID_NONE;
+            tmp->io                      = NULL;
+            tmp->name_next               = NULL;
+            tmp->refs                    = 1;
+            outbox_reset(&tmp->outbox, server_config.outbox_limit);
+            int compressed = want_lz4 && server_config.compression &&
+                             outbox_set_compression(&tmp->outbox) == 0;
+
+            // Register it: fails if the username is already taken or the server is full
+            registry_status_t status = registry_add(tmp);
+            if (status != REGISTRY_OK) {
+                pool_free(connection_pool, tmp);
 
-                    char log_msg[BUF_SIZE];
+                char log_msg[BUF_SIZE];
+                if (status == REGISTRY_TAKEN) {
+                    send_static(client_fd, REPLY_USERNAME_TAKEN, 0);
                     snprintf(log_msg, sizeof log_msg,
-                             "[SERVER-ERROR] calloc failed while accepting user '%s' from sock=%d",
-                             username, client_fd);
-                    log_write(log_msg);
-                    safe_print(log_msg);
-
-                    close(client_fd);
-                    continue;
+                             "[SERVER-INFO] sock: %d was sent an already taken username for creation", client_fd);
+                } else {
+                    send_static(client_fd, REPLY_SERVER_FULL, 0);
+                    snprintf(log_msg, sizeof log_msg,
+                             "[SERVER-INFO] A client tried to connect when server is full.");
+                    metrics_inc(M_CONNECTIONS_REJECTED);
                 }
-
-                // Critical section: actually insert the new connection pointer
-                pthread_mutex_lock(&conn_mutex);
-                connections[idx] = tmp;
-                strncpy(connections[idx]->username, username, USERNAME_LEN - 1);
-                connections[idx]->username[USERNAME_LEN - 1] = '\0';
-                connections[idx]->sockfd = client_fd;
-                pthread_mutex_unlock(&conn_mutex);
-
-                // Send “[OK] Username accepted.\n” back to the client
-                const char *ok = "[OK] Username accepted.\n";
-                send(client_fd, ok, strlen(ok), 0);
-
-                // Log acceptance
-                char log_msg[BUF_SIZE];
-                snprintf(log_msg, sizeof log_msg,
-                         "[OK] Username: %s accepted.", username);
                 log_write(log_msg);
                 safe_print(log_msg);
-
-                handshake_ok = 1;
+                continue;  // Prompt client again
             }
+            conn = tmp;
+            metrics_gauge_add(G_CONNECTIONS, 1);
+            metrics_inc(M_CONNECTIONS_ACCEPTED);
+
+            // Send “[OK] Username accepted.\n” back to the client, naming the compression if
+            // it was negotiated (the reply itself is never compressed)
+            send_static(client_fd, compressed ? REPLY_USERNAME_OK_LZ4 : REPLY_USERNAME_OK, 0);
+
+            // Log acceptance
+            char log_msg[BUF_SIZE];
+            snprintf(log_msg, sizeof log_msg,
+                     "[OK] Username: %s accepted%s.", username, compressed ? " (lz4)" : "");
+            log_write(log_msg);
+            safe_print(log_msg);
+
+            handshake_ok = 1;
         }
 
         // If handshake failed, close client_fd and skip spawning the thread
@@ -1382,33 +2646,35 @@ int main(int argc, char *argv[]) {
         pthread_attr_t attr;
         pthread_attr_init(&attr);
         pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-        pthread_create(&thread, &attr, client_handler, connections[idx]);
+
+        // The handler may finish (and unregister conn) before we are done here; the object
+        // itself cannot be reused meanwhile, since only this thread allocates connections
+        pthread_create(&thread, &attr, client_handler, conn);
         pthread_attr_destroy(&attr);
 
         // Store the thread handle in the connection’s thread_info
-        connections[idx]->thread_info.thread = thread;
-        // Initialize the init_mutex and init_cond so that we can wait for the thread to have set connection->thread_info.tid
-        pthread_mutex_init(&connections[idx]->thread_info.init_mutex, NULL);
-        pthread_cond_init(&connections[idx]->thread_info.init_cond, NULL);
+        conn->thread_info.thread = thread;
 
         // Wait until the client_handler thread signals that it has finished its initialization
-        pthread_mutex_lock(&connections[idx]->thread_info.init_mutex);
-        while (!connections[idx]->thread_info.initialized) {
-            pthread_cond_wait(&connections[idx]->thread_info.init_cond,
-                              &connections[idx]->thread_info.init_mutex);
+        // (init_mutex and init_cond were initialized once, when the pool was created)
+        pthread_mutex_lock(&conn->thread_info.init_mutex);
+        while (!conn->thread_info.initialized) {
+            pthread_cond_wait(&conn->thread_info.init_cond, &conn->thread_info.init_mutex);
         }
-        pthread_mutex_unlock(&connections[idx]->thread_info.init_mutex);
+        pthread_mutex_unlock(&conn->thread_info.init_mutex);
 
         // Log that the per-client messaging thread has been created successfully
         char log_msg[BUF_SIZE];
         snprintf(log_msg, sizeof log_msg,
                  "[SERVER-INFO] Messaging thread (TID: %d) is created for %s.",
-                 connections[idx]->thread_info.tid,
-                 connections[idx]->username);
+                 conn->thread_info.tid,
+                 conn->username);
         log_write(log_msg);
         safe_print(log_msg);
     }
 
+    acceptor_close(acceptor);
+
     /* ------------------------------------------------------------------------- */
     /* Server is shutting down:                                                 */
     /*   1) Enqueue sentinel items to tell each file_upload_worker to exit     */
@@ -1418,42 +2684,52 @@ int main(int argc, char *argv[]) {
     /*   5) Clean up logging and exit gracefully                                  */
     /* ------------------------------------------------------------------------- */
 
-    // 1) Enqueue NUM_UPLOAD_WORKERS sentinel items to shut down file upload threads
-    for (int i = 0; i < NUM_UPLOAD_WORKERS; ++i) {
+    // 1) Enqueue one sentinel item per worker to shut down file upload threads
+    for (int i = 0; i < server_config.upload_workers; ++i) {
         file_item_t sentinel = {0};
         sentinel.is_sentinel = 1;
         file_queue_enqueue(upload_queue, &sentinel);
+        metrics_gauge_add(G_UPLOAD_QUEUE_DEPTH, 1);
     }
 
     // 2) Send “[SERVER] shutting down. Goodbye.\n” to every connected client and close their sockets
-    for (int i = 0; i < MAX_CONN; ++i) {
-        if (connections[i]) {
-            const char *bye = "[SERVER] shutting down. Goodbye.\n";
-            send(connections[i]->sockfd, bye, strlen(bye), 0);
+    for (uint32_t i = 0; i < connection_pool->capacity; ++i) {
+        connection_t *c = registered_connection(i);
+        if (c) {
+            // Non-blocking: a client that stopped reading must not hold up the shutdown
+            send_static(c->sockfd, REPLY_SHUTDOWN, MSG_DONTWAIT | MSG_NOSIGNAL);
 
-            shutdown(connections[i]->sockfd, SHUT_RDWR);
-            close(connections[i]->sockfd);
+            shutdown(c->sockfd, SHUT_RDWR);
+            close(c->sockfd);
 
-            shutdown(connections[i]->notify_fd, SHUT_RDWR);
-            close(connections[i]->notify_fd);
+            shutdown(c->notify_fd, SHUT_RDWR);
+            close(c->notify_fd);
 
-            shutdown(connections[i]->notify_writer, SHUT_RDWR);
-            close(connections[i]->notify_writer);
+            shutdown(c->notify_writer, SHUT_RDWR);
+            close(c->notify_writer);
         }
     }
 
+    metrics_admin_stop();
+    transfer_reaper_stop();
+
     // 3) Join each of the file upload worker threads
-    for (int i = 0; i < NUM_UPLOAD_WORKERS; ++i) {
+    for (int i = 0; i < server_config.upload_workers; ++i) {
         pthread_join(upload_workers[i], NULL);
     }
 
     // 4) Join each client_handler thread (they should wake up on closed sockets)
-    for (int i = 0; i < MAX_CONN; ++i) {
-        if (connections[i] && connections[i]->thread_info.thread) {
-            pthread_join(connections[i]->thread_info.thread, NULL);
+    for (uint32_t i = 0; i < connection_pool->capacity; ++i) {
+        connection_t *c = registered_connection(i);
+        if (c && c->thread_info.thread) {
+            pthread_join(c->thread_info.thread, NULL);
         }
     }
 
+    // Final lock contention report (profiling builds only)
+    lockprof_stop_reporter();
+    lockprof_report(print_lock_report_line);
+
     // Optionally destroy the file queue structure (implementation-dependent)
     // file_queue_destroy(upload_queue);
     // upload_queue = NULL;
@@ -1463,5 +2739,10 @@ int main(int argc, char *argv[]) {
     safe_print("[SHUTDOWN] SIGINT received. Server exiting gracefully.");
     log_close();
 
+    free(upload_workers);
+
+    // connection_pool, room_pool and the name indexes are left to process exit: handler
+    // threads that already unregistered are not joined and may still be returning their objects
+
     return 0;
 }
@@ -0,0 +1,463 @@
+/* config.c */
+
+#include "config.h"
+#include "chatserver.h"   // For the DEFAULT_* limits
+#include "outbox.h"       // For the preallocated message slot counts
+#include <stdio.h>        // For FILE, fopen, fgets, fprintf
+#include <stdlib.h>       // For strtoull
+#include <string.h>       // For strcmp, strchr, strspn, strncpy
+#include <stddef.h>       // For offsetof
+#include <ctype.h>        // For isspace, toupper
+#include <errno.h>        // For errno, ERANGE
+#include <limits.h>       // For ULLONG_MAX
+#include <stdint.h>       // For SIZE_MAX
+#include <getopt.h>       // For getopt_long, struct option
+
+/* ----------------------------------------------------------------------------
+ * Global configuration instance
+ * ----------------------------------------------------------------------------
+ */
+
+server_config_t server_config;
+
+/* ----------------------------------------------------------------------------
+ * Option table
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * config_kind_t
+ *   How the textual value of an option is parsed:
+ *   - CFG_INT:  Plain positive integer stored in an int field
+ *   - CFG_SIZE: Byte count stored in a size_t field, with optional K/M/G suffix
+ *   - CFG_STR:  String copied into a char[256] field
+ *   - CFG_CHOICE: One of the option's 'choices', stored as its index in an int field
+ */
+typedef enum {
+    CFG_INT,
+    CFG_SIZE,
+    CFG_STR,
+    CFG_CHOICE
+} config_kind_t;
+
+/**
+ * config_option_t
+ *   One tunable, shared between the config file parser and the command line parser.
+ *   - key:       Name used in the config file (e.g. "max_conn")
+ *   - long_name: Name used on the command line (e.g. "--max-conn")
+ *   - kind:      How to parse the value
+ *   - offset:    Location of the field inside server_config_t
+ *   - help:      One-line description shown in the usage text
+ *   - choices:   NULL-terminated list of accepted words (CFG_CHOICE only)
+ */
+typedef struct {
+    const char         *key;
+    const char         *long_name;
+    config_kind_t       kind;
+    size_t              offset;
+    const char         *help;
+    const char *const  *choices;
+} config_option_t;
+
+// Accepted values of slow_policy, in slow_policy_t order
+static const char *const slow_policy_names[] = { "drop", "disconnect", "pause", NULL };
+
+// Accepted values of io_engine, in io_engine_t order
+static const char *const io_engine_names[] = { "select", "uring", NULL };
+
+static const config_option_t config_options[] = {
+    { "port",              "port",              CFG_INT,  offsetof(server_config_t, port),
+      "TCP port to listen on", NULL },
+    { "max_conn",          "max-conn",          CFG_INT,  offsetof(server_config_t, max_conn),
+      "maximum simultaneous client connections", NULL },
+    { "max_rooms",         "max-rooms",         CFG_INT,  offsetof(server_config_t, max_rooms),
+      "maximum number of rooms", NULL },
+    { "room_capacity",     "room-capacity",     CFG_INT,  offsetof(server_config_t, room_capacity),
+      "maximum members per room", NULL },
+    { "buf_size",          "buf-size",          CFG_SIZE, offsetof(server_config_t, buf_size),
+      "per-connection receive/relay buffer size (bytes)", NULL },
+    { "upload_workers",    "upload-workers",    CFG_INT,  offsetof(server_config_t, upload_workers),
+      "number of file upload worker threads", NULL },
+    { "upload_queue_size", "upload-queue-size", CFG_INT,  offsetof(server_config_t, upload_queue_size),
+      "capacity of the pending upload queue", NULL },
+    { "max_file_size",     "max-file-size",     CFG_SIZE, offsetof(server_config_t, max_file_size),
+      "largest file accepted by /sendfile (bytes)", NULL },
+    { "resume_ttl",        "resume-ttl",        CFG_INT,  offsetof(server_config_t, resume_ttl),
+      "seconds an interrupted file transfer stays resumable (0 = off)", NULL },
+    { "file_cache_size",   "file-cache-size",   CFG_SIZE, offsetof(server_config_t, file_cache_size),
+      "bytes of recent uploads kept to skip repeated uploads (0 = off)", NULL },
+    { "log_dir",           "log-dir",           CFG_STR,  offsetof(server_config_t, log_dir),
+      "directory for timestamped log files", NULL },
+    { "admin_port",        "admin-port",        CFG_INT,  offsetof(server_config_t, admin_port),
+      "loopback port for the Prometheus metrics endpoint (0 = off)", NULL },
+    { "trace",             "trace",             CFG_INT,  offsetof(server_config_t, trace),
+      "1 = record broadcast/whisper delivery stage latencies", NULL },
+    { "compression",       "compression",       CFG_INT,  offsetof(server_config_t, compression),
+      "1 = compress chat and file data for clients that ask for it (lz4)", NULL },
+    { "outbox_limit",      "outbox-limit",      CFG_SIZE, offsetof(server_config_t, outbox_limit),
+      "per-connection budget of queued outbound bytes", NULL },
+    { "slow_policy",       "slow-policy",       CFG_CHOICE, offsetof(server_config_t, slow_policy),
+      "when a client exceeds its budget: drop | disconnect | pause",
+      slow_policy_names },
+    { "io_engine",         "io-engine",         CFG_CHOICE, offsetof(server_config_t, io_engine),
+      "socket I/O engine: select | uring (falls back to select if unsupported)",
+      io_engine_names },
+};
+
+#define NUM_CONFIG_OPTIONS (sizeof(config_options) / sizeof(config_options[0]))
+
+// getopt_long value used for -c/--config; table options use their index + this base.
+#define OPT_CONFIG_FILE  'c'
+#define OPT_HELP         'h'
+#define OPT_TABLE_BASE   256
+
+/* ----------------------------------------------------------------------------
+ * Internal helpers
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * parse_number
+ *   Parse a non-negative decimal number, optionally followed by K, M or G (only when
+ *   'allow_suffix' is set). Returns 0 on success and stores the value in *out, -1 otherwise
+ *   (also when the suffix would overflow the value).
+ */
+static int parse_number(const char *text, int allow_suffix, unsigned long long *out) {
+    if (!text || !isdigit((unsigned char)*text)) {
+        return -1;
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(text, &end, 10);
+    if (errno == ERANGE) {
+        return -1;
+    }
+
+    if (allow_suffix && *end) {
+        int shift;
+        switch (toupper((unsigned char)*end)) {
+            case 'K': shift = 10; break;
+            case 'M': shift = 20; break;
+            case 'G': shift = 30; break;
+            default:  return -1;
+        }
+        if (v > (ULLONG_MAX >> shift)) {
+            return -1;
+        }
+        v <<= shift;
+        end++;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+
+    *out = v;
+    return 0;
+}
+
+/**
+ * config_apply
+ *   Parse 'value' according to 'opt' and store it in 'cfg'.
+ *   Returns 0 on success, -1 if the value is malformed.
+ */
+static int config_apply(server_config_t *cfg, const config_option_t *opt, const char *value) {
+    char *field = (char *)cfg + opt->offset;
+    unsigned long long v;
+
+    switch (opt->kind) {
+        case CFG_INT:
+            if (parse_number(value, 0, &v) < 0 || v > 0x7fffffff) {
+                return -1;
+            }
+            *(int *)field = (int)v;
+            return 0;
+
+        case CFG_SIZE:
+            if (parse_number(value, 1, &v) < 0 || v > SIZE_MAX) {
+                return -1;
+            }
+            *(size_t *)field = (size_t)v;
+            return 0;
+
+        case CFG_STR:
+            if (!*value) {
+                return -1;
+            }
+            strncpy(field, value, sizeof(cfg->log_dir) - 1);
+            field[sizeof(cfg->log_dir) - 1] = '\0';
+            return 0;
+
+        case CFG_CHOICE:
+            for (int i = 0; opt->choices[i]; ++i) {
+                if (strcmp(opt->choices[i], value) == 0) {
+                    *(int *)field = i;
+                    return 0;
+                }
+            }
+            return -1;
+    }
+    return -1;
+}
+
+/**
+ * config_find_key
+ *   Look up a config file key in the option table. Returns NULL if the key is unknown.
+ */
+static const config_option_t *config_find_key(const char *key) {
+    for (size_t i = 0; i < NUM_CONFIG_OPTIONS; ++i) {
+        if (strcmp(config_options[i].key, key) == 0) {
+            return &config_options[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * trim
+ *   Strip leading and trailing whitespace from 's' in place and return the new start.
+ */
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public functions
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * config_set_defaults
+ *
+ * Reset every field to the built-in default.
+ */
+void config_set_defaults(server_config_t *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->port              = PORT;
+    cfg->max_conn          = DEFAULT_MAX_CONN;
+    cfg->max_rooms         = DEFAULT_MAX_ROOMS;
+    cfg->room_capacity     = DEFAULT_ROOM_CAPACITY;
+    cfg->buf_size          = DEFAULT_BUF_SIZE;
+    cfg->upload_workers    = DEFAULT_UPLOAD_WORKERS;
+    cfg->upload_queue_size = DEFAULT_UPLOAD_QUEUE_SIZE;
+    cfg->max_file_size     = DEFAULT_MAX_FILE_SIZE;
+    cfg->resume_ttl        = DEFAULT_RESUME_TTL;
+    cfg->file_cache_size   = DEFAULT_FILE_CACHE_SIZE;
+    strncpy(cfg->log_dir, LOG_DIRECTORY, sizeof(cfg->log_dir) - 1);
+    cfg->admin_port        = DEFAULT_ADMIN_PORT;
+    cfg->trace             = 0;
+    cfg->compression       = 1;
+    cfg->outbox_limit      = DEFAULT_OUTBOX_LIMIT;
+    cfg->slow_policy       = SLOW_POLICY_DROP;
+    cfg->io_engine         = IO_ENGINE_SELECT;
+}
+
+/**
+ * config_load_file
+ *
+ * Parse a simple "key = value" file. Inline comments are not supported; a '#' is only
+ * treated as a comment when it starts the line. Unknown keys are reported as errors so
+ * that typos do not silently fall back to defaults.
+ */
+int config_load_file(server_config_t *cfg, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "[ERROR] Cannot open config file '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[512];
+    int  lineno = 0;
+    int  rc = 0;
+
+    while (fgets(line, sizeof line, fp)) {
+        lineno++;
+        char *p = trim(line);
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+
+        char *eq = strchr(p, '=');
+        if (!eq) {
+            fprintf(stderr, "[ERROR] %s:%d: expected 'key = value'\n", path, lineno);
+            rc = -1;
+            break;
+        }
+        *eq = '\0';
+        char *key   = trim(p);
+        char *value = trim(eq + 1);
+
+        const config_option_t *opt = config_find_key(key);
+        if (!opt) {
+            fprintf(stderr, "[ERROR] %s:%d: unknown key '%s'\n", path, lineno, key);
+            rc = -1;
+            break;
+        }
+        if (config_apply(cfg, opt, value) < 0) {
+            fprintf(stderr, "[ERROR] %s:%d: invalid value '%s' for '%s'\n", path, lineno, value, key);
+            rc = -1;
+            break;
+        }
+    }
+
+    fclose(fp);
+    return rc;
+}
+
+/**
+ * config_parse_args
+ *
+ * Two passes over argv with getopt_long:
+ *   - Pass 1 only looks for -c/--config and loads that file, so that the file acts as the base.
+ *   - Pass 2 applies every other option, overriding values from the file.
+ * The legacy invocation "chatserver <port>" keeps working through the positional argument.
+ */
+int config_parse_args(server_config_t *cfg, int argc, char *argv[]) {
+    struct option long_opts[NUM_CONFIG_OPTIONS + 3];
+    for (size_t i = 0; i < NUM_CONFIG_OPTIONS; ++i) {
+        long_opts[i].name    = config_options[i].long_name;
+        long_opts[i].has_arg = required_argument;
+        long_opts[i].flag    = NULL;
+        long_opts[i].val     = OPT_TABLE_BASE + (int)i;
+    }
+    long_opts[NUM_CONFIG_OPTIONS]     = (struct option){ "config", required_argument, NULL, OPT_CONFIG_FILE };
+    long_opts[NUM_CONFIG_OPTIONS + 1] = (struct option){ "help",   no_argument,       NULL, OPT_HELP };
+    long_opts[NUM_CONFIG_OPTIONS + 2] = (struct option){ NULL, 0, NULL, 0 };
+
+    // Pass 1: config file
+    opterr = 0;
+    optind = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "c:h", long_opts, NULL)) != -1) {
+        if (c == OPT_CONFIG_FILE && config_load_file(cfg, optarg) < 0) {
+            return -1;
+        }
+    }
+
+    // Pass 2: everything else
+    opterr = 1;
+    optind = 0;
+    while ((c = getopt_long(argc, argv, "c:h", long_opts, NULL)) != -1) {
+        if (c == OPT_CONFIG_FILE) {
+            continue;
+        }
+        if (c == OPT_HELP) {
+            config_usage(argv[0]);
+            return 1;
+        }
+        if (c < OPT_TABLE_BASE || c >= OPT_TABLE_BASE + (int)NUM_CONFIG_OPTIONS) {
+            config_usage(argv[0]);
+            return -1;
+        }
+        const config_option_t *opt = &config_options[c - OPT_TABLE_BASE];
+        if (config_apply(cfg, opt, optarg) < 0) {
+            fprintf(stderr, "[ERROR] Invalid value '%s' for --%s\n", optarg, opt->long_name);
+            return -1;
+        }
+    }
+
+    // Optional positional argument: the port
+    if (optind < argc) {
+        if (argc - optind > 1 || config_apply(cfg, config_find_key("port"), argv[optind]) < 0) {
+            config_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * config_validate
+ *
+ * Reject values that would make the server unusable or overflow the fixed-width fields
+ * derived from them.
+ */
+int config_validate(const server_config_t *cfg) {
+    if (cfg->port <= 0 || cfg->port > 65535) {
+        fprintf(stderr, "[ERROR] port must be between 1 and 65535.\n");
+        return -1;
+    }
+    if (cfg->max_conn < 1 || cfg->max_conn > 65536) {
+        fprintf(stderr, "[ERROR] max_conn must be between 1 and 65536.\n");
+        return -1;
+    }
+    if ((unsigned)cfg->max_conn > OUTBOX_MSG_SLOTS_MAX / OUTBOX_MSG_SLOTS_PER_CONN) {
+        fprintf(stderr, "[WARN] max_conn above %u: only %u outbox message slots are reserved; "
+                        "messages beyond them are malloc'd.\n",
+                OUTBOX_MSG_SLOTS_MAX / OUTBOX_MSG_SLOTS_PER_CONN, OUTBOX_MSG_SLOTS_MAX);
+    }
+    if (cfg->max_rooms < 1 || cfg->max_rooms > 65536) {
+        fprintf(stderr, "[ERROR] max_rooms must be between 1 and 65536.\n");
+        return -1;
+    }
+    if (cfg->room_capacity < 1 || cfg->room_capacity > cfg->max_conn) {
+        fprintf(stderr, "[ERROR] room_capacity must be between 1 and max_conn.\n");
+        return -1;
+    }
+    if (cfg->buf_size < 256 || cfg->buf_size > (16u << 20)) {
+        fprintf(stderr, "[ERROR] buf_size must be between 256 bytes and 16M.\n");
+        return -1;
+    }
+    if (cfg->upload_workers < 1 || cfg->upload_workers > 1024) {
+        fprintf(stderr, "[ERROR] upload_workers must be between 1 and 1024.\n");
+        return -1;
+    }
+    if (cfg->upload_queue_size < 1) {
+        fprintf(stderr, "[ERROR] upload_queue_size must be at least 1.\n");
+        return -1;
+    }
+    if (cfg->max_file_size < 1 || cfg->max_file_size > (1u << 30)) {
+        fprintf(stderr, "[ERROR] max_file_size must be between 1 byte and 1G.\n");
+        return -1;
+    }
+    if (cfg->resume_ttl < 0 || cfg->resume_ttl > 86400) {
+        fprintf(stderr, "[ERROR] resume_ttl must be between 0 and 86400 seconds.\n");
+        return -1;
+    }
+    if (cfg->file_cache_size > (1u << 30)) {
+        fprintf(stderr, "[ERROR] file_cache_size must be at most 1G.\n");
+        return -1;
+    }
+    if (cfg->admin_port < 0 || cfg->admin_port > 65535 ||
+        (cfg->admin_port != 0 && cfg->admin_port == cfg->port)) {
+        fprintf(stderr, "[ERROR] admin_port must be 0 (off) or a port other than the chat port.\n");
+        return -1;
+    }
+    if (cfg->trace != 0 && cfg->trace != 1) {
+        fprintf(stderr, "[ERROR] trace must be 0 or 1.\n");
+        return -1;
+    }
+    if (cfg->compression != 0 && cfg->compression != 1) {
+        fprintf(stderr, "[ERROR] compression must be 0 or 1.\n");
+        return -1;
+    }
+    if (cfg->outbox_limit < 4096 || cfg->outbox_limit > (1u << 30)) {
+        fprintf(stderr, "[ERROR] outbox_limit must be between 4K and 1G.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * config_usage
+ *
+ * Print the usage text, generated from the option table so it never drifts from the parser.
+ */
+void config_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] [port]\n", prog);
+    fprintf(stderr, "  -c, %-30sload settings from a 'key = value' file\n", "--config <file>");
+    for (size_t i = 0; i < NUM_CONFIG_OPTIONS; ++i) {
+        char name[64];
+        snprintf(name, sizeof name, "--%s <value>", config_options[i].long_name);
+        fprintf(stderr, "      %-30s%s\n", name, config_options[i].help);
+    }
+    fprintf(stderr, "  -h, %-30sshow this help\n", "--help");
+}
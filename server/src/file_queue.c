@@ -1,9 +1,13 @@
 /* file_queue.c */
 
 #include "file_queue.h"
+#include "lockprof.h" // For LP_LOCK / LP_UNLOCK / LP_COND_WAIT
 #include <stdlib.h>   // For malloc, calloc, free
 #include <string.h>   // For memcpy (used indirectly during shallow copy)
 
+// Profiling site shared by every file_queue_t mutex (make LOCKPROF=1)
+LOCKPROF_SITE(queue_lp, "file_queue.mutex");
+
 /**
  * file_queue_init
  *
@@ -42,7 +46,8 @@ file_queue_t *file_queue_init(size_t capacity) {
  * file_queue_destroy
  *
  * - Destroys mutex and condition variables.
- * - Iterates through the entire buffer and frees any data pointers still present.
+ * - Releases the transfers of the items still queued (slots outside head..count hold copies
+ *   of items that were already dequeued).
  * - Frees the buffer array itself.
  * - Frees the queue struct.
  * - After this call, the queue pointer should not be used again.
@@ -56,11 +61,13 @@ void file_queue_destroy(file_queue_t *q) {
     pthread_cond_destroy(&q->not_full);
     pthread_cond_destroy(&q->not_empty);
 
-    // Free any file_item_t.data still in the buffer
-    for (size_t i = 0; i < q->capacity; ++i) {
-        if (q->buffer[i].data) {
-            free(q->buffer[i].data);
-            q->buffer[i].data = NULL;
+    // Release the transfers of items that were never dequeued
+    for (size_t i = 0; i < q->count; ++i) {
+        file_item_t *item = &q->buffer[(q->head + i) % q->capacity];
+        if (item->rcpt) {
+            transfer_delivery_end(item->rcpt);
+            transfer_release(item->rcpt->transfer);
+            item->rcpt = NULL;
         }
     }
     // Free buffer array
@@ -77,9 +84,9 @@ void file_queue_destroy(file_queue_t *q) {
  */
 bool file_queue_is_full(file_queue_t *q) {
     bool full;
-    pthread_mutex_lock(&q->mutex);
+    LP_LOCK(&q->mutex, &queue_lp);
     full = (q->count == q->capacity);
-    pthread_mutex_unlock(&q->mutex);
+    LP_UNLOCK(&q->mutex, &queue_lp);
     return full;
 }
 
@@ -90,13 +97,13 @@ bool file_queue_is_full(file_queue_t *q) {
  * - If (count < capacity), copy *item into buffer[tail], update tail & count, signal not_empty, return true.
  * - Otherwise, return false immediately.
  *
- * Note: We perform a shallow copy of the entire file_item_t. The 'data' pointer
- *       is copied as-is; it is not deep-copied. The owner remains responsible
- *       for freeing item.data exactly once (after the worker thread processes it).
+ * Note: We perform a shallow copy of the entire file_item_t. The transfer reference
+ *       moves into the queue with it and is released exactly once, by the worker thread
+ *       that processes the item.
  */
 bool file_queue_try_enqueue(file_queue_t *q, const file_item_t *item) {
     bool ok = false;
-    pthread_mutex_lock(&q->mutex);
+    LP_LOCK(&q->mutex, &queue_lp);
     if (q->count < q->capacity) {
         // Copy the file_item_t structure into the queue slot
         q->buffer[q->tail] = *item;
@@ -106,7 +113,7 @@ bool file_queue_try_enqueue(file_queue_t *q, const file_item_t *item) {
         // Signal one waiting consumer that there's data available
         pthread_cond_signal(&q->not_empty);
     }
-    pthread_mutex_unlock(&q->mutex);
+    LP_UNLOCK(&q->mutex, &queue_lp);
     return ok;
 }
 
@@ -123,10 +130,10 @@ bool file_queue_try_enqueue(file_queue_t *q, const file_item_t *item) {
  * Because we wait on not_full, this call will block if the queue is full until another thread dequeues.
  */
 void file_queue_enqueue(file_queue_t *q, const file_item_t *item) {
-    pthread_mutex_lock(&q->mutex);
+    LP_LOCK(&q->mutex, &queue_lp);
     // Wait for space if queue is full
     while (q->count == q->capacity) {
-        pthread_cond_wait(&q->not_full, &q->mutex);
+        LP_COND_WAIT(&q->not_full, &q->mutex, &queue_lp);
     }
     // Copy the file_item_t structure into the queue slot
     q->buffer[q->tail] = *item;
@@ -134,7 +141,7 @@ void file_queue_enqueue(file_queue_t *q, const file_item_t *item) {
     q->count++;
     // Signal one waiting consumer that there is now at least one item
     pthread_cond_signal(&q->not_empty);
-    pthread_mutex_unlock(&q->mutex);
+    LP_UNLOCK(&q->mutex, &queue_lp);
 }
 
 /**
@@ -147,13 +154,13 @@ void file_queue_enqueue(file_queue_t *q, const file_item_t *item) {
  * - Increment head (with wrap-around), decrement count.
  * - Signal not_full in case any thread is waiting to enqueue.
  * - Unlock the mutex.
- * - Return the local file_item_t. Caller becomes responsible for freeing item.data.
+ * - Return the local file_item_t. Caller becomes responsible for releasing item.rcpt->transfer.
  */
 file_item_t file_queue_dequeue(file_queue_t *q) {
-    pthread_mutex_lock(&q->mutex);
+    LP_LOCK(&q->mutex, &queue_lp);
     // Wait for data if queue is empty
     while (q->count == 0) {
-        pthread_cond_wait(&q->not_empty, &q->mutex);
+        LP_COND_WAIT(&q->not_empty, &q->mutex, &queue_lp);
     }
     // Copy the item from the head of the queue
     file_item_t item = q->buffer[q->head];
@@ -163,6 +170,6 @@ file_item_t file_queue_dequeue(file_queue_t *q) {
     q->count--;
     // Signal one waiting producer that space is now available
     pthread_cond_signal(&q->not_full);
-    pthread_mutex_unlock(&q->mutex);
+    LP_UNLOCK(&q->mutex, &queue_lp);
     return item;
 }
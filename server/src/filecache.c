@@ -0,0 +1,305 @@
+/* filecache.c */
+
+#include "filecache.h"
+#include "config.h"     // For server_config.file_cache_size
+#include "lockprof.h"   // For LP_LOCK / LP_UNLOCK
+#include "metrics.h"    // For the cache counters
+#include "lz4block.h"   // For compressing pieces (filecache_zpieces)
+#include <stdlib.h>     // For calloc, malloc, free
+#include <string.h>     // For memcpy, memcmp
+
+// Buckets of the cache index (a power of two); entries are spread by their fast hash
+#define FILECACHE_BUCKETS 256
+
+// Profiling site of the cache lock (make LOCKPROF=1)
+LOCKPROF_SITE(filecache_lp, "filecache.mutex");
+
+// The cache: an index by fast hash plus an LRU list, newest first
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fc_entry_t     *cache_buckets[FILECACHE_BUCKETS];
+static fc_entry_t     *lru_newest;
+static fc_entry_t     *lru_oldest;
+static size_t          cache_bytes;
+
+/* ----------------------------------------------------------------------------
+ * Internal helpers
+ * ----------------------------------------------------------------------------
+ */
+
+static fc_entry_t **bucket_of(uint64_t fast) {
+    return &cache_buckets[fast & (FILECACHE_BUCKETS - 1)];
+}
+
+static void lru_unlink_locked(fc_entry_t *e) {
+    if (e->newer) {
+        e->newer->older = e->older;
+    } else {
+        lru_newest = e->older;
+    }
+    if (e->older) {
+        e->older->newer = e->newer;
+    } else {
+        lru_oldest = e->newer;
+    }
+    e->newer = e->older = NULL;
+}
+
+static void lru_push_locked(fc_entry_t *e) {
+    e->newer = NULL;
+    e->older = lru_newest;
+    if (lru_newest) {
+        lru_newest->newer = e;
+    } else {
+        lru_oldest = e;
+    }
+    lru_newest = e;
+}
+
+/**
+ * evict_locked
+ *   Take 'e' out of the index and the LRU list. The caller drops the cache's reference once
+ *   the lock is released.
+ */
+static void evict_locked(fc_entry_t *e) {
+    for (fc_entry_t **link = bucket_of(e->fast); *link; link = &(*link)->hnext) {
+        if (*link == e) {
+            *link = e->hnext;
+            break;
+        }
+    }
+    e->hnext  = NULL;
+    lru_unlink_locked(e);
+    e->cached = 0;
+    cache_bytes -= e->size;
+    metrics_gauge_add(G_FILE_CACHE_BYTES, -(int64_t)e->size);
+}
+
+/**
+ * candidate_get
+ *   The cached entry with fast hash 'fast' and 'size' bytes, referenced, or NULL. It still has
+ *   to be confirmed by SHA-256.
+ */
+static fc_entry_t *candidate_get(uint64_t fast, size_t size) {
+    LP_LOCK(&cache_mutex, &filecache_lp);
+    fc_entry_t *e = *bucket_of(fast);
+    while (e && (e->fast != fast || e->size != size)) {
+        e = e->hnext;
+    }
+    if (e) {
+        atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);
+    }
+    LP_UNLOCK(&cache_mutex, &filecache_lp);
+    return e;
+}
+
+/**
+ * entry_sha256
+ *   Store the SHA-256 of 'e' in 'out', computing it (outside the lock) the first time it is
+ *   needed.
+ */
+static void entry_sha256(fc_entry_t *e, uint8_t out[32]) {
+    LP_LOCK(&cache_mutex, &filecache_lp);
+    int ready = e->sha_ready;
+    if (ready) {
+        memcpy(out, e->sha256, 32);
+    }
+    LP_UNLOCK(&cache_mutex, &filecache_lp);
+    if (ready) {
+        return;
+    }
+
+    fh_sha256(e->data, e->size, out);
+    LP_LOCK(&cache_mutex, &filecache_lp);
+    memcpy(e->sha256, out, 32);
+    e->sha_ready = 1;
+    LP_UNLOCK(&cache_mutex, &filecache_lp);
+}
+
+/**
+ * touch
+ *   Make a cached entry the most recently used one.
+ */
+static void touch(fc_entry_t *e) {
+    LP_LOCK(&cache_mutex, &filecache_lp);
+    if (e->cached) {
+        lru_unlink_locked(e);
+        lru_push_locked(e);
+    }
+    LP_UNLOCK(&cache_mutex, &filecache_lp);
+}
+
+/**
+ * zpieces_count
+ *   Number of OUTBOX_SLICE_SIZE pieces of 'e'.
+ */
+static size_t zpieces_count(const fc_entry_t *e) {
+    return (e->size + OUTBOX_SLICE_SIZE - 1) / OUTBOX_SLICE_SIZE;
+}
+
+static void zpieces_free(outbox_zpiece_t *z, size_t count) {
+    if (!z) {
+        return;
+    }
+    for (size_t k = 0; k < count; ++k) {
+        free((char *)z[k].data);
+    }
+    free(z);
+}
+
+/**
+ * zpieces_build
+ *   Compress the pieces of 'e'. Returns them, or NULL if memory ran out.
+ */
+static outbox_zpiece_t *zpieces_build(const fc_entry_t *e) {
+    size_t count = zpieces_count(e);
+    outbox_zpiece_t *z = calloc(count, sizeof(*z));
+    uint32_t *table    = malloc(LZ4_TABLE_SIZE * sizeof(*table));
+    char *scratch      = malloc(OUTBOX_SLICE_SIZE);
+    if (!z || !table || !scratch) {
+        free(z);
+        free(table);
+        free(scratch);
+        return NULL;
+    }
+
+    for (size_t k = 0; k < count; ++k) {
+        const char *piece = e->data + k * OUTBOX_SLICE_SIZE;
+        size_t n = e->size - k * OUTBOX_SLICE_SIZE;
+        if (n > OUTBOX_SLICE_SIZE) {
+            n = OUTBOX_SLICE_SIZE;
+        }
+        if (lz4_entropy_q8(piece, n) >= LZ4_INCOMPRESSIBLE_Q8) {
+            continue;
+        }
+        memset(table, 0, LZ4_TABLE_SIZE * sizeof(*table));
+        size_t zlen = lz4_compress(piece, 0, n, scratch, n - n / 8, table);
+        char *copy  = zlen ? malloc(zlen) : NULL;
+        if (copy) {
+            memcpy(copy, scratch, zlen);
+            z[k] = (outbox_zpiece_t){ copy, zlen };
+        }
+    }
+    free(table);
+    free(scratch);
+    return z;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public functions
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * filecache_adopt
+ *
+ * Only the fast hash is computed for every upload. SHA-256 is computed when the fast hash
+ * finds a candidate, so content that is not a repeat never pays for it.
+ */
+fc_entry_t *filecache_adopt(char *data, uint32_t *marks, size_t size) {
+    uint64_t fast = fh_fast64(data, size);
+
+    fc_entry_t *e = candidate_get(fast, size);
+    if (e) {
+        uint8_t mine[32], theirs[32];
+        fh_sha256(data, size, mine);
+        entry_sha256(e, theirs);
+        if (memcmp(mine, theirs, 32) == 0) {
+            // Same content: keep one copy
+            touch(e);
+            free(data);
+            free(marks);
+            metrics_inc(M_FILE_CACHE_DEDUPS);
+            return e;
+        }
+        filecache_release(e);
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (!e) {
+        return NULL;
+    }
+    e->fast  = fast;
+    e->size  = size;
+    e->data  = data;
+    e->marks = marks;
+    atomic_init(&e->refs, 1);   // The caller's
+    atomic_init(&e->zpieces, NULL);
+
+    size_t budget = server_config.file_cache_size;
+    if (size == 0 || size > budget) {
+        return e;               // Too big to cache: it only lives as long as its transfers
+    }
+
+    fc_entry_t *victims = NULL;
+    LP_LOCK(&cache_mutex, &filecache_lp);
+    atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);   // The cache's
+    e->cached = 1;
+    fc_entry_t **bucket = bucket_of(fast);
+    e->hnext = *bucket;
+    *bucket  = e;
+    lru_push_locked(e);
+    cache_bytes += size;
+    metrics_gauge_add(G_FILE_CACHE_BYTES, (int64_t)size);
+    while (cache_bytes > budget) {
+        fc_entry_t *old = lru_oldest;
+        evict_locked(old);
+        old->hnext = victims;   // Reused as the victim list link
+        victims    = old;
+    }
+    LP_UNLOCK(&cache_mutex, &filecache_lp);
+
+    while (victims) {
+        fc_entry_t *next = victims->hnext;
+        filecache_release(victims);
+        victims = next;
+    }
+    return e;
+}
+
+fc_entry_t *filecache_lookup(const file_digest_t *d, size_t size) {
+    fc_entry_t *e = candidate_get(d->fast, size);
+    if (e) {
+        uint8_t theirs[32];
+        entry_sha256(e, theirs);
+        if (memcmp(d->sha256, theirs, 32) == 0) {
+            touch(e);
+            metrics_inc(M_FILE_CACHE_HITS);
+            return e;
+        }
+        filecache_release(e);
+    }
+    metrics_inc(M_FILE_CACHE_MISSES);
+    return NULL;
+}
+
+/**
+ * filecache_zpieces
+ *
+ * Two deliveries may compress the same entry at once; the first to finish installs its
+ * pieces and the other throws its own away.
+ */
+const outbox_zpiece_t *filecache_zpieces(fc_entry_t *e) {
+    outbox_zpiece_t *z = atomic_load_explicit(&e->zpieces, memory_order_acquire);
+    if (z || e->size == 0) {
+        return z;
+    }
+    outbox_zpiece_t *mine = zpieces_build(e);
+    if (!mine) {
+        return NULL;
+    }
+    if (!atomic_compare_exchange_strong_explicit(&e->zpieces, &z, mine, memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        zpieces_free(mine, zpieces_count(e));
+        return z;
+    }
+    return mine;
+}
+
+void filecache_release(fc_entry_t *e) {
+    if (e && atomic_fetch_sub_explicit(&e->refs, 1, memory_order_acq_rel) == 1) {
+        zpieces_free(atomic_load_explicit(&e->zpieces, memory_order_relaxed), zpieces_count(e));
+        free(e->data);
+        free(e->marks);
+        free(e);
+    }
+}
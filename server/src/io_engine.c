@@ -0,0 +1,631 @@
+/* io_engine.c */
+
+#include "io_engine.h"
+#include "uring.h"      // For the raw io_uring ring and provided buffers
+#include "config.h"     // For server_config.io_engine, server_config.buf_size
+#include "metrics.h"    // For M_SEND_CALLS, M_URING_ENTERS
+#include <stdlib.h>     // For calloc, free
+#include <string.h>     // For memcpy
+#include <errno.h>      // For errno and the E* codes carried in completions
+#include <unistd.h>     // For read, write, close
+#include <poll.h>       // For poll, struct pollfd
+#include <sys/socket.h> // For accept, recv, socketpair, shutdown, MSG_* flags
+
+/* ----------------------------------------------------------------------------
+ * State
+ * ----------------------------------------------------------------------------
+ */
+
+// user_data tags identifying which request a completion belongs to
+enum {
+    TAG_ACCEPT = 1,
+    TAG_RECV,
+    TAG_WAKE,
+    TAG_SEND,
+    TAG_CANCEL
+};
+
+// Buffer group id of the receive buffers (each connection has its own ring)
+#define RECV_GROUP 0
+
+// Accepted sockets buffered between acceptor_next calls (the ring's CQ size)
+#define ACCEPT_QUEUE 64
+
+struct acceptor {
+    int      engine;
+    int      fd;
+    uring_t  ring;
+    int      armed;
+    int      queue[ACCEPT_QUEUE];
+    unsigned head;
+    unsigned count;
+    int      error;
+};
+
+/**
+ * conn_io
+ *   - engine:                     IO_ENGINE_SELECT or IO_ENGINE_URING
+ *   - tcp_fd/notify_fd/ob:        The connection's socket, wake fd and outbox
+ *   - ring/bufs:                  io_uring instance and its provided receive buffers
+ *   - recv_armed/wake_armed:      A multishot receive / a wake read is outstanding
+ *   - ready*:                     Received buffers not yet consumed by conn_io_recv, in order;
+ *                                 'ready_off' is how much of the first one was already read
+ *   - eof/rx_err:                 The client closed the stream / the receive failed (errno)
+ *   - woke/shutdown:              A wake byte arrived / the wake socketpair was shut down
+ *   - msgs/iov:                   The send chain currently handed to the kernel
+ *   - sends:                      Links of that chain not completed yet
+ *   - prepared:                   A chain was prepared (its messages are pinned in the outbox)
+ *   - sent/tx_err:                Bytes the chain has sent so far / a send failed
+ */
+struct conn_io {
+    int              engine;
+    int              tcp_fd;
+    int              notify_fd;
+    outbox_t        *ob;
+
+    uring_t          ring;
+    uring_bufring_t  bufs;
+    int              recv_armed;
+    int              wake_armed;
+    struct {
+        uint16_t bid;
+        uint32_t len;
+    }                ready[CONN_IO_RECV_BUFS];
+    unsigned         ready_head;
+    unsigned         ready_count;
+    size_t           ready_off;
+    int              eof;
+    int              rx_err;
+    int              woke;
+    int              shutdown;
+    char             wake_buf[64];
+
+    struct msghdr    msgs[CONN_IO_SEND_LINKS];
+    struct iovec     iov[CONN_IO_SEND_LINKS * OUTBOX_IOV_MAX];
+    int              sends;
+    int              prepared;
+    size_t           sent;
+    int              tx_err;
+};
+
+/* ----------------------------------------------------------------------------
+ * io_uring helpers
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * enter
+ *   uring_submit_and_wait plus accounting of the io_uring_enter call.
+ */
+static int enter(uring_t *ring, unsigned wait_nr, int timeout_ms) {
+    metrics_inc(M_URING_ENTERS);
+    return uring_submit_and_wait(ring, wait_nr, timeout_ms);
+}
+
+/**
+ * prep_multishot_recv
+ *   Fill 'sqe' with a multishot receive on 'fd' that picks buffers from group 'group'.
+ */
+static void prep_multishot_recv(struct io_uring_sqe *sqe, int fd, uint16_t group, uint64_t tag) {
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = fd;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = tag;
+}
+
+/**
+ * prep_cancel
+ *   Queue a cancellation of the request tagged 'tag' (skipped if the submission queue is full;
+ *   the request is then cancelled when the ring is torn down).
+ */
+static void prep_cancel(uring_t *ring, uint64_t tag) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = tag;
+    sqe->user_data = TAG_CANCEL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Probe
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * io_engine_probe
+ *
+ * Opcode probing cannot tell whether multishot receive is supported, so the probe simply
+ * performs one over a socketpair and checks that it delivered data and stayed armed.
+ */
+int io_engine_probe(void) {
+    uring_t ring;
+    int rc = uring_init(&ring, 4);
+    if (rc < 0) {
+        return rc;
+    }
+    if (!(ring.features & IORING_FEAT_EXT_ARG)) {
+        uring_exit(&ring);
+        return -EOPNOTSUPP;
+    }
+
+    uring_bufring_t bufs;
+    rc = uring_bufring_init(&ring, &bufs, RECV_GROUP, 2, 64);
+    if (rc < 0) {
+        uring_exit(&ring);
+        return rc;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        rc = -errno;
+    } else {
+        prep_multishot_recv(uring_get_sqe(&ring), sv[0], RECV_GROUP, TAG_RECV);
+        rc = write(sv[1], "x", 1) == 1 ? uring_submit_and_wait(&ring, 1, 1000) : -errno;
+        struct io_uring_cqe *cqe = rc == 0 ? uring_peek_cqe(&ring) : NULL;
+        if (cqe) {
+            rc = (cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE)) ? 0
+                 : (cqe->res < 0 ? cqe->res : -EINVAL);
+            uring_cqe_seen(&ring);
+        } else if (rc == 0) {
+            rc = -ETIME;
+        }
+        close(sv[1]);
+        close(sv[0]);
+    }
+
+    uring_exit(&ring);
+    uring_bufring_free(&ring, &bufs);
+    return rc;
+}
+
+/* ----------------------------------------------------------------------------
+ * Acceptor
+ * ----------------------------------------------------------------------------
+ */
+
+acceptor_t *acceptor_open(int listen_fd) {
+    acceptor_t *acc = calloc(1, sizeof(*acc));
+    if (!acc) {
+        return NULL;
+    }
+    acc->fd     = listen_fd;
+    acc->engine = server_config.io_engine;
+    acc->ring.fd = -1;
+    if (acc->engine == IO_ENGINE_URING && uring_init(&acc->ring, ACCEPT_QUEUE / 2) < 0) {
+        acc->engine = IO_ENGINE_SELECT;
+    }
+    return acc;
+}
+
+/**
+ * acceptor_reap
+ *   Move accepted sockets from the completion queue into acc->queue. A kernel without
+ *   multishot accept rejects it with EINVAL before accepting anything; the acceptor then
+ *   switches to plain accept() for good.
+ */
+static void acceptor_reap(acceptor_t *acc) {
+    struct io_uring_cqe *cqe;
+    while (acc->count < ACCEPT_QUEUE && (cqe = uring_peek_cqe(&acc->ring))) {
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            acc->armed = 0;
+        }
+        if (cqe->res >= 0) {
+            acc->queue[(acc->head + acc->count++) % ACCEPT_QUEUE] = cqe->res;
+        } else if (cqe->res == -EINVAL) {
+            acc->engine = IO_ENGINE_SELECT;
+        } else if (cqe->res != -ECANCELED) {
+            acc->error = -cqe->res;
+        }
+        uring_cqe_seen(&acc->ring);
+    }
+}
+
+int acceptor_next(acceptor_t *acc) {
+    while (acc->engine == IO_ENGINE_URING) {
+        if (acc->count > 0) {
+            int fd = acc->queue[acc->head];
+            acc->head = (acc->head + 1) % ACCEPT_QUEUE;
+            acc->count--;
+            return fd;
+        }
+        if (acc->error) {
+            errno = acc->error;
+            acc->error = 0;
+            return -1;
+        }
+
+        if (!acc->armed) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&acc->ring);
+            sqe->opcode    = IORING_OP_ACCEPT;
+            sqe->fd        = acc->fd;
+            sqe->ioprio    = IORING_ACCEPT_MULTISHOT;
+            sqe->user_data = TAG_ACCEPT;
+            acc->armed = 1;
+        }
+
+        int rc = enter(&acc->ring, 1, ACCEPT_POLL_MS);
+        acceptor_reap(acc);
+        if (acc->count == 0 && acc->engine == IO_ENGINE_URING && !acc->error) {
+            errno = (rc == -ETIME || rc == 0) ? EINTR : -rc;
+            return -1;
+        }
+    }
+    return accept(acc->fd, NULL, NULL);
+}
+
+void acceptor_close(acceptor_t *acc) {
+    if (!acc) {
+        return;
+    }
+    if (acc->ring.fd >= 0) {
+        uring_exit(&acc->ring);
+    }
+    while (acc->count > 0) {
+        close(acc->queue[acc->head]);
+        acc->head = (acc->head + 1) % ACCEPT_QUEUE;
+        acc->count--;
+    }
+    free(acc);
+}
+
+/* ----------------------------------------------------------------------------
+ * Connection I/O: io_uring engine
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * uring_arm
+ *   Make sure a receive and a wake read are outstanding. The receive is only re-armed while a
+ *   provided buffer is free, otherwise it would fail straight away with ENOBUFS.
+ */
+static void uring_arm(conn_io_t *io) {
+    if (!io->recv_armed && !io->eof && !io->rx_err && io->ready_count < io->bufs.count) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&io->ring);
+        if (sqe) {
+            prep_multishot_recv(sqe, io->tcp_fd, io->bufs.group, TAG_RECV);
+            io->recv_armed = 1;
+        }
+    }
+    if (!io->wake_armed && !io->shutdown) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&io->ring);
+        if (sqe) {
+            sqe->opcode    = IORING_OP_READ;
+            sqe->fd        = io->notify_fd;
+            sqe->addr      = (uint64_t)(uintptr_t)io->wake_buf;
+            sqe->len       = sizeof(io->wake_buf);
+            sqe->user_data = TAG_WAKE;
+            io->wake_armed = 1;
+        }
+    }
+}
+
+/**
+ * uring_reap
+ *   Process every available completion. Returns how many there were.
+ */
+static int uring_reap(conn_io_t *io) {
+    int n = 0;
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&io->ring))) {
+        int res = cqe->res;
+        switch (cqe->user_data) {
+            case TAG_RECV:
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    io->recv_armed = 0;
+                }
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                    if (res > 0) {
+                        unsigned slot = (io->ready_head + io->ready_count++) % CONN_IO_RECV_BUFS;
+                        io->ready[slot].bid = bid;
+                        io->ready[slot].len = (uint32_t)res;
+                    } else {
+                        uring_bufring_recycle(&io->bufs, bid);
+                    }
+                }
+                if (res == 0) {
+                    io->eof = 1;
+                } else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+                    io->rx_err = -res;
+                }
+                break;
+
+            case TAG_WAKE:
+                io->wake_armed = 0;
+                if (res > 0) {
+                    io->woke = 1;
+                } else if (res != -ECANCELED && res != -EINTR) {
+                    io->shutdown = 1;
+                }
+                break;
+
+            case TAG_SEND:
+                io->sends--;
+                if (res > 0) {
+                    io->sent += (size_t)res;
+                } else if (res < 0 && res != -ECANCELED) {
+                    io->tx_err = 1;
+                }
+                break;
+
+            default:
+                break;
+        }
+        uring_cqe_seen(&io->ring);
+        n++;
+    }
+    return n;
+}
+
+/**
+ * uring_flush
+ *
+ * One chain at a time: the next one is prepared only after every link of the previous chain
+ * completed, so the outbox's single pinned batch always matches what the kernel holds.
+ * The links carry MSG_WAITALL, which turns a short send into a failure that breaks the chain;
+ * without it a later link could go out while an earlier one was incomplete.
+ */
+static ssize_t uring_flush(conn_io_t *io) {
+    if (io->sends > 0) {
+        // Still in flight: acknowledge the wake-up so that new data or an overflow wakes us again
+        outbox_wake_consumed(io->ob);
+        return 0;
+    }
+
+    ssize_t done = 0;
+    if (io->prepared) {
+        outbox_complete(io->ob, io->sent);
+        done = (ssize_t)io->sent;
+        io->sent     = 0;
+        io->prepared = 0;
+    }
+    if (io->tx_err) {
+        return -1;
+    }
+
+    size_t len;
+    int iovcnt = outbox_prepare(io->ob, io->iov, CONN_IO_SEND_LINKS * OUTBOX_IOV_MAX, &len);
+    if (iovcnt == 0) {
+        return done;
+    }
+    io->prepared = 1;
+
+    struct io_uring_sqe *prev = NULL;
+    for (int i = 0, off = 0; off < iovcnt; ++i) {
+        int cnt = iovcnt - off < OUTBOX_IOV_MAX ? iovcnt - off : OUTBOX_IOV_MAX;
+        struct io_uring_sqe *sqe = uring_get_sqe(&io->ring);
+        if (!sqe) {
+            break;  // The rest stays queued for the next chain
+        }
+        int more = off + cnt < iovcnt;
+        io->msgs[i] = (struct msghdr){ .msg_iov = &io->iov[off], .msg_iovlen = (size_t)cnt };
+        sqe->opcode    = IORING_OP_SENDMSG;
+        sqe->fd        = io->tcp_fd;
+        sqe->addr      = (uint64_t)(uintptr_t)&io->msgs[i];
+        sqe->len       = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (more ? MSG_MORE : 0);
+        sqe->user_data = TAG_SEND;
+        if (more) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        prev = sqe;
+        io->sends++;
+        off += cnt;
+        metrics_inc(M_SEND_CALLS);
+    }
+    if (prev) {
+        prev->flags &= (uint8_t)~IOSQE_IO_LINK;
+    }
+    return done;
+}
+
+static int uring_wait(conn_io_t *io, int timeout_ms) {
+    for (;;) {
+        if (io->shutdown) {
+            return CONN_IO_SHUTDOWN;
+        }
+        if (io->ready_count > 0 || io->eof || io->rx_err) {
+            return CONN_IO_READABLE;
+        }
+        if (io->woke) {
+            io->woke = 0;
+            return CONN_IO_IDLE;
+        }
+
+        uring_arm(io);
+        int rc = enter(&io->ring, 1, timeout_ms);
+        if (rc == -EOPNOTSUPP) {
+            // No timed waits on this kernel: held file streams expire at the next wake-up
+            rc = enter(&io->ring, 1, -1);
+        }
+        if (rc < 0 && rc != -EINTR && rc != -ETIME) {
+            errno = -rc;
+            return CONN_IO_ERROR;
+        }
+        if (rc == -ETIME && timeout_ms >= 0) {
+            uring_reap(io);
+            return io->ready_count > 0 || io->eof || io->rx_err ? CONN_IO_READABLE : CONN_IO_IDLE;
+        }
+        if (uring_reap(io) > 0 && io->sends == 0 && io->prepared) {
+            // The send chain finished: let the caller retire it and queue the next one
+            return io->ready_count > 0 || io->eof || io->rx_err ? CONN_IO_READABLE : CONN_IO_IDLE;
+        }
+    }
+}
+
+static ssize_t uring_recv(conn_io_t *io, void *buf, size_t len) {
+    while (io->ready_count == 0) {
+        if (io->rx_err) {
+            errno = io->rx_err;
+            return -1;
+        }
+        if (io->eof) {
+            return 0;
+        }
+        uring_arm(io);
+        int rc = enter(&io->ring, 1, -1);
+        if (rc < 0 && rc != -EINTR && rc != -ETIME) {
+            errno = -rc;
+            return -1;
+        }
+        uring_reap(io);
+    }
+
+    unsigned bid   = io->ready[io->ready_head].bid;
+    size_t   avail = io->ready[io->ready_head].len - io->ready_off;
+    size_t   n     = len < avail ? len : avail;
+    memcpy(buf, uring_bufring_buf(&io->bufs, bid) + io->ready_off, n);
+    io->ready_off += n;
+    if (io->ready_off == io->ready[io->ready_head].len) {
+        uring_bufring_recycle(&io->bufs, bid);
+        io->ready_head = (io->ready_head + 1) % CONN_IO_RECV_BUFS;
+        io->ready_count--;
+        io->ready_off = 0;
+    }
+    return (ssize_t)n;
+}
+
+/**
+ * uring_close
+ *
+ * The receive and wake read are cancelled right away; the send chain gets a grace period to
+ * deliver the final replies. If the client does not read them, shutting the socket down makes
+ * the sends fail so that nothing still references outbox memory when the ring goes away.
+ */
+static void uring_close(conn_io_t *io) {
+    uring_flush(io);
+    if (io->recv_armed) {
+        prep_cancel(&io->ring, TAG_RECV);
+    }
+    if (io->wake_armed) {
+        prep_cancel(&io->ring, TAG_WAKE);
+    }
+
+    int cut = 0;
+    while (io->recv_armed || io->wake_armed || io->sends > 0) {
+        int rc = enter(&io->ring, 1, CONN_IO_CLOSE_TIMEOUT_MS);
+        uring_reap(io);
+        if (rc == -ETIME || (rc < 0 && rc != -EINTR)) {
+            if (cut) {
+                break;  // Nothing more will complete; the kernel cancels the rest on exit
+            }
+            shutdown(io->tcp_fd, SHUT_RDWR);
+            cut = 1;
+        }
+    }
+    if (io->prepared) {
+        outbox_complete(io->ob, io->sent);
+    }
+
+    // Unconsumed received data is discarded along with the buffers
+    uring_bufring_free(&io->ring, &io->bufs);
+    uring_exit(&io->ring);
+}
+
+/* ----------------------------------------------------------------------------
+ * Connection I/O: select engine
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * select_wait
+ *   The "select" engine waits with poll(): select() cannot watch descriptors at or above
+ *   FD_SETSIZE, which a server with a few hundred connections (3 fds each) reaches.
+ */
+static int select_wait(conn_io_t *io, int timeout_ms) {
+    struct pollfd fds[2] = {
+        { .fd = io->tcp_fd,    .events = POLLIN },
+        { .fd = io->notify_fd, .events = POLLIN },
+    };
+    if (outbox_pending(io->ob)) {
+        // Queued data is waiting for room in the socket buffer
+        fds[0].events |= POLLOUT;
+    }
+
+    if (poll(fds, 2, timeout_ms) < 0) {
+        return CONN_IO_ERROR;
+    }
+
+    // Outbox wake-up: consume the wake bytes; the data goes out with the next flush
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (read(io->notify_fd, io->wake_buf, sizeof(io->wake_buf)) <= 0) {
+            return CONN_IO_SHUTDOWN;
+        }
+    }
+    // Hang-ups and errors are readable too: the next recv reports them
+    return fds[0].revents & (POLLIN | POLLHUP | POLLERR) ? CONN_IO_READABLE : CONN_IO_IDLE;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public connection functions
+ * ----------------------------------------------------------------------------
+ */
+
+conn_io_t *conn_io_open(int tcp_fd, int notify_fd, outbox_t *ob) {
+    conn_io_t *io = calloc(1, sizeof(*io));
+    if (!io) {
+        return NULL;
+    }
+    io->engine    = IO_ENGINE_SELECT;
+    io->tcp_fd    = tcp_fd;
+    io->notify_fd = notify_fd;
+    io->ob        = ob;
+    io->ring.fd   = -1;
+
+    if (server_config.io_engine == IO_ENGINE_URING &&
+        uring_init(&io->ring, CONN_IO_RING_ENTRIES) == 0) {
+        if (uring_bufring_init(&io->ring, &io->bufs, RECV_GROUP, CONN_IO_RECV_BUFS,
+                               server_config.buf_size) == 0) {
+            io->engine = IO_ENGINE_URING;
+        } else {
+            uring_exit(&io->ring);
+        }
+    }
+    return io;
+}
+
+int conn_io_engine(const conn_io_t *io) {
+    return io->engine;
+}
+
+ssize_t conn_io_flush(conn_io_t *io) {
+    if (io->engine == IO_ENGINE_URING) {
+        return uring_flush(io);
+    }
+    return outbox_flush(io->ob, io->tcp_fd);
+}
+
+void conn_io_kick(conn_io_t *io) {
+    if (io->engine == IO_ENGINE_URING) {
+        enter(&io->ring, 0, -1);
+    }
+}
+
+int conn_io_wait(conn_io_t *io, int timeout_ms) {
+    if (io->engine == IO_ENGINE_URING) {
+        return uring_wait(io, timeout_ms);
+    }
+    return select_wait(io, timeout_ms);
+}
+
+ssize_t conn_io_recv(conn_io_t *io, void *buf, size_t len) {
+    if (io->engine == IO_ENGINE_URING) {
+        return uring_recv(io, buf, len);
+    }
+    return recv(io->tcp_fd, buf, len, 0);
+}
+
+void conn_io_close(conn_io_t *io) {
+    if (!io) {
+        return;
+    }
+    if (io->engine == IO_ENGINE_URING) {
+        uring_close(io);
+    }
+    free(io);
+}
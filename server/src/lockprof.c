@@ -0,0 +1,286 @@
+/* lockprof.c */
+
+#include "lockprof.h"
+#include "metrics.h"    // For metrics_now_ns
+#include <stdio.h>      // For snprintf
+#include <stdlib.h>     // For qsort
+#include <signal.h>     // For sigset_t, sigwait, pthread_sigmask, pthread_kill
+
+#ifdef CHAT_LOCK_PROFILE
+
+/* ----------------------------------------------------------------------------
+ * Internal state
+ * ----------------------------------------------------------------------------
+ */
+
+// Every site that has been used at least once. Sites are never unregistered.
+static lockprof_t      *site_list = NULL;
+static pthread_mutex_t  site_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Maximum number of profiled locks one thread can hold at the same time.
+#define LOCKPROF_MAX_HELD 16
+
+/**
+ * held_t
+ *   Per-thread record of a lock currently held, so the unlock can compute the hold time.
+ *   Several rooms share one site, so the mutex address (not the site) identifies the entry.
+ */
+typedef struct {
+    pthread_mutex_t *mutex;
+    uint64_t         since_ns;
+} held_t;
+
+static __thread held_t held[LOCKPROF_MAX_HELD];
+static __thread int    held_count = 0;
+
+/**
+ * update_max
+ *   Raise *slot to 'v' if 'v' is larger, tolerating concurrent updates.
+ */
+static void update_max(_Atomic uint64_t *slot, uint64_t v) {
+    uint64_t cur = atomic_load_explicit(slot, memory_order_relaxed);
+    while (v > cur &&
+           !atomic_compare_exchange_weak_explicit(slot, &cur, v,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/**
+ * site_register
+ *   Link 'lp' into the report list the first time it is used.
+ */
+static void site_register(lockprof_t *lp) {
+    if (atomic_load_explicit(&lp->registered, memory_order_acquire)) {
+        return;
+    }
+    pthread_mutex_lock(&site_mutex);
+    if (!atomic_load_explicit(&lp->registered, memory_order_relaxed)) {
+        lp->next  = site_list;
+        site_list = lp;
+        atomic_store_explicit(&lp->registered, 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&site_mutex);
+}
+
+/**
+ * hold_begin / hold_end
+ *   Push or pop the per-thread "held since" record and account the hold time.
+ */
+static void hold_begin(pthread_mutex_t *m) {
+    if (held_count < LOCKPROF_MAX_HELD) {
+        held[held_count].mutex    = m;
+        held[held_count].since_ns = metrics_now_ns();
+        held_count++;
+    }
+}
+
+static void hold_end(pthread_mutex_t *m, lockprof_t *lp) {
+    for (int i = held_count - 1; i >= 0; --i) {
+        if (held[i].mutex == m) {
+            uint64_t dt = metrics_now_ns() - held[i].since_ns;
+            atomic_fetch_add_explicit(&lp->hold_ns, dt, memory_order_relaxed);
+            update_max(&lp->max_hold_ns, dt);
+            held[i] = held[--held_count];
+            return;
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Instrumented primitives
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * lockprof_lock
+ *
+ * Try the lock first; only when it is already held do we timestamp and block, so the
+ * uncontended path costs one trylock plus the hold-time bookkeeping.
+ */
+int lockprof_lock(pthread_mutex_t *m, lockprof_t *lp) {
+    site_register(lp);
+
+    int rc = pthread_mutex_trylock(m);
+    if (rc != 0) {
+        uint64_t t0 = metrics_now_ns();
+        rc = pthread_mutex_lock(m);
+        if (rc != 0) {
+            return rc;
+        }
+        uint64_t dt = metrics_now_ns() - t0;
+        atomic_fetch_add_explicit(&lp->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&lp->wait_ns, dt, memory_order_relaxed);
+        update_max(&lp->max_wait_ns, dt);
+    }
+
+    atomic_fetch_add_explicit(&lp->acquisitions, 1, memory_order_relaxed);
+    hold_begin(m);
+    return 0;
+}
+
+int lockprof_unlock(pthread_mutex_t *m, lockprof_t *lp) {
+    hold_end(m, lp);
+    return pthread_mutex_unlock(m);
+}
+
+/**
+ * lockprof_cond_wait
+ *
+ * The mutex is released while waiting on the condition, so the current hold ends before the
+ * wait and a new hold starts after it. Time spent sleeping on the condition is not counted
+ * as lock wait: it reflects an empty/full queue, not contention.
+ */
+int lockprof_cond_wait(pthread_cond_t *c, pthread_mutex_t *m, lockprof_t *lp) {
+    hold_end(m, lp);
+    int rc = pthread_cond_wait(c, m);
+    hold_begin(m);
+    return rc;
+}
+
+int lockprof_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m,
+                            const struct timespec *abstime, lockprof_t *lp) {
+    hold_end(m, lp);
+    int rc = pthread_cond_timedwait(c, m, abstime);
+    hold_begin(m);
+    return rc;
+}
+
+int lockprof_enabled(void) {
+    return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Report
+ * ----------------------------------------------------------------------------
+ */
+
+static int compare_wait_desc(const void *a, const void *b) {
+    uint64_t wa = atomic_load_explicit(&(*(lockprof_t *const *)a)->wait_ns, memory_order_relaxed);
+    uint64_t wb = atomic_load_explicit(&(*(lockprof_t *const *)b)->wait_ns, memory_order_relaxed);
+    return (wa < wb) - (wa > wb);
+}
+
+void lockprof_report(void (*emit)(const char *line)) {
+    lockprof_t *sites[64];
+    size_t n = 0;
+
+    pthread_mutex_lock(&site_mutex);
+    for (lockprof_t *lp = site_list; lp && n < sizeof(sites) / sizeof(sites[0]); lp = lp->next) {
+        sites[n++] = lp;
+    }
+    pthread_mutex_unlock(&site_mutex);
+
+    qsort(sites, n, sizeof(sites[0]), compare_wait_desc);
+
+    char line[256];
+    emit("[LOCK-PROFILE] lock                      acquires  contended  wait_ms(total/max)  hold_ms(total/max)");
+    for (size_t i = 0; i < n; ++i) {
+        lockprof_t *lp = sites[i];
+        uint64_t acq = atomic_load_explicit(&lp->acquisitions, memory_order_relaxed);
+        uint64_t con = atomic_load_explicit(&lp->contended, memory_order_relaxed);
+        snprintf(line, sizeof line,
+                 "[LOCK-PROFILE] %-24s %9llu  %9llu  %9.3f/%-8.3f  %9.3f/%-8.3f",
+                 lp->name,
+                 (unsigned long long)acq,
+                 (unsigned long long)con,
+                 atomic_load_explicit(&lp->wait_ns, memory_order_relaxed) / 1e6,
+                 atomic_load_explicit(&lp->max_wait_ns, memory_order_relaxed) / 1e6,
+                 atomic_load_explicit(&lp->hold_ns, memory_order_relaxed) / 1e6,
+                 atomic_load_explicit(&lp->max_hold_ns, memory_order_relaxed) / 1e6);
+        emit(line);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * SIGUSR1 reporter thread
+ * ----------------------------------------------------------------------------
+ */
+
+static pthread_t      reporter_thread;
+static int            reporter_running = 0;
+static volatile int   reporter_stop = 0;
+static void         (*reporter_emit)(const char *line) = NULL;
+
+/**
+ * reporter_loop
+ *   Wait synchronously for SIGUSR1 (blocked in every thread) and print a report each time.
+ *   Using sigwait instead of a signal handler keeps the report out of async-signal context
+ *   and means no client thread ever sees EINTR because of a report request.
+ */
+static void *reporter_loop(void *arg) {
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    while (1) {
+        int sig;
+        if (sigwait(&set, &sig) != 0 || reporter_stop) {
+            break;
+        }
+        lockprof_report(reporter_emit);
+    }
+    return NULL;
+}
+
+void lockprof_start_reporter(void (*emit)(const char *line)) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    reporter_emit = emit;
+    if (pthread_create(&reporter_thread, NULL, reporter_loop, NULL) == 0) {
+        reporter_running = 1;
+    }
+}
+
+void lockprof_stop_reporter(void) {
+    if (!reporter_running) {
+        return;
+    }
+    reporter_stop = 1;
+    pthread_kill(reporter_thread, SIGUSR1);
+    pthread_join(reporter_thread, NULL);
+    reporter_running = 0;
+}
+
+#else /* !CHAT_LOCK_PROFILE */
+
+int lockprof_lock(pthread_mutex_t *m, lockprof_t *lp) {
+    (void)lp;
+    return pthread_mutex_lock(m);
+}
+
+int lockprof_unlock(pthread_mutex_t *m, lockprof_t *lp) {
+    (void)lp;
+    return pthread_mutex_unlock(m);
+}
+
+int lockprof_cond_wait(pthread_cond_t *c, pthread_mutex_t *m, lockprof_t *lp) {
+    (void)lp;
+    return pthread_cond_wait(c, m);
+}
+
+int lockprof_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m,
+                            const struct timespec *abstime, lockprof_t *lp) {
+    (void)lp;
+    return pthread_cond_timedwait(c, m, abstime);
+}
+
+int lockprof_enabled(void) {
+    return 0;
+}
+
+void lockprof_report(void (*emit)(const char *line)) {
+    (void)emit;
+}
+
+void lockprof_start_reporter(void (*emit)(const char *line)) {
+    (void)emit;
+}
+
+void lockprof_stop_reporter(void) {
+}
+
+#endif /* CHAT_LOCK_PROFILE */
@@ -1,6 +1,8 @@
 /* log.c */
 
 #include "log.h"
+#include "metrics.h"    // For the log backlog gauge
+#include "lockprof.h"   // For LP_LOCK / LP_UNLOCK
 #include <pthread.h>    // For pthread_mutex_t, pthread_mutex_lock/unlock
 #include <time.h>       // For time_t, struct tm, time(), localtime_r(), strftime()
 #include <stdio.h>      // For FILE, fopen, fprintf, fclose, perror, snprintf
@@ -25,6 +27,7 @@ static FILE *log_fp = NULL;
  *   Protects both log_fp checks and the fprintf/flushing sequence.
  */
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+LOCKPROF_SITE(log_lp, "log_mutex");
 
 /**
  * make_timestamp
@@ -123,8 +126,10 @@ void log_write(const char *msg) {
     char ts[20];
     make_timestamp(ts);  // Generate "YYYY-MM-DD HH:MM:SS"
 
-    // Acquire the mutex so no two threads write concurrently
-    pthread_mutex_lock(&log_mutex);
+    // Acquire the mutex so no two threads write concurrently. The backlog gauge counts
+    // threads queued on (or holding) the lock, which shows when logging becomes a bottleneck.
+    metrics_gauge_add(G_LOG_BACKLOG, 1);
+    LP_LOCK(&log_mutex, &log_lp);
 
     if (log_fp) {
         // Write: timestamp, space-dash-space, message, newline
@@ -132,7 +137,8 @@ void log_write(const char *msg) {
         fflush(log_fp);  // Ensure data is on disk immediately
     }
 
-    pthread_mutex_unlock(&log_mutex);
+    LP_UNLOCK(&log_mutex, &log_lp);
+    metrics_gauge_add(G_LOG_BACKLOG, -1);
 }
 
 /**
@@ -142,10 +148,10 @@ void log_write(const char *msg) {
  * Holds log_mutex to ensure no other thread is writing as we close.
  */
 void log_close(void) {
-    pthread_mutex_lock(&log_mutex);
+    LP_LOCK(&log_mutex, &log_lp);
     if (log_fp) {
         fclose(log_fp);
         log_fp = NULL;
     }
-    pthread_mutex_unlock(&log_mutex);
+    LP_UNLOCK(&log_mutex, &log_lp);
 }
@@ -0,0 +1,495 @@
+/* metrics.c */
+
+#include "metrics.h"
+#include <pthread.h>      // For pthread_key_t, pthread_once, pthread_mutex_t
+#include <stdatomic.h>    // For atomic counters and gauges
+#include <stdio.h>        // For snprintf
+#include <stdlib.h>       // For calloc, malloc, realloc, free
+#include <stdarg.h>       // For va_list in the render buffer
+#include <time.h>         // For clock_gettime, CLOCK_MONOTONIC
+#include <unistd.h>       // For close, write
+#include <errno.h>        // For errno, EINTR
+#include <arpa/inet.h>    // For sockaddr_in, htons, htonl
+#include <sys/socket.h>   // For socket, bind, listen, accept, shutdown
+#include <sys/time.h>     // For struct timeval (SO_RCVTIMEO)
+
+/* ----------------------------------------------------------------------------
+ * Metric descriptors
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * metric_desc_t
+ *   Static description of one exported metric.
+ *   - name:   Prometheus metric name
+ *   - help:   Text for the "# HELP" line
+ *   - scale:  Divisor applied to the raw value on export (e.g. 1e9 for nanoseconds → seconds)
+ */
+typedef struct {
+    const char *name;
+    const char *help;
+    double      scale;
+} metric_desc_t;
+
+static const metric_desc_t counter_desc[M_COUNTER_COUNT] = {
+    [M_CONNECTIONS_ACCEPTED] = { "chat_connections_accepted_total", "Client handshakes completed.", 1 },
+    [M_CONNECTIONS_REJECTED] = { "chat_connections_rejected_total", "Client handshakes refused.", 1 },
+    [M_MESSAGES_IN]          = { "chat_messages_in_total", "Commands received from clients.", 1 },
+    [M_MESSAGES_OUT]         = { "chat_messages_out_total", "Chat messages handed to recipients.", 1 },
+    [M_BYTES_IN]             = { "chat_bytes_in_total", "Bytes read from client sockets.", 1 },
+    [M_BYTES_RELAYED]        = { "chat_bytes_relayed_total", "Bytes written to client sockets.", 1 },
+    [M_FILES_DELIVERED]      = { "chat_files_delivered_total", "Files handed to their recipient.", 1 },
+    [M_FILES_DROPPED]        = { "chat_files_dropped_total", "Files dropped before delivery.", 1 },
+    [M_WORKER_BUSY_NS]       = { "chat_upload_worker_busy_seconds_total", "Time upload workers spent processing files.", 1e9 },
+    [M_OUTBOX_DROPPED]       = { "chat_outbox_dropped_messages_total", "Chat messages dropped for slow consumers.", 1 },
+    [M_SLOW_DISCONNECTS]     = { "chat_slow_consumer_disconnects_total", "Clients disconnected for exceeding their outbound budget.", 1 },
+    [M_FILE_PAUSES]          = { "chat_file_stream_pauses_total", "File streams that waited for a slow recipient.", 1 },
+    [M_FILE_RESUMES]         = { "chat_file_resumes_total", "Uploads or deliveries resumed from a non-zero offset.", 1 },
+    [M_SEND_CALLS]           = { "chat_send_calls_total", "sendmsg calls made to flush client output.", 1 },
+    [M_URING_ENTERS]         = { "chat_uring_enter_calls_total", "io_uring_enter calls made by the io_uring engine.", 1 },
+    [M_FILE_CACHE_HITS]      = { "chat_file_cache_hits_total", "File offers answered from the file cache.", 1 },
+    [M_FILE_CACHE_MISSES]    = { "chat_file_cache_misses_total", "File offers the file cache did not have.", 1 },
+    [M_FILE_CACHE_DEDUPS]    = { "chat_file_cache_dedups_total", "Uploads whose content was already in the file cache.", 1 },
+    [M_FILE_CACHE_SAVED_BYTES] = { "chat_file_cache_saved_bytes_total", "Upload bytes skipped thanks to the file cache.", 1 },
+    [M_FILE_CHECKSUM_ERRORS] = { "chat_file_checksum_errors_total", "Upload chunks rejected for a CRC32C mismatch.", 1 },
+    [M_COMPRESS_OUT_RAW_BYTES]  = { "chat_compression_out_raw_bytes_total", "Bytes sent compressed to clients, before compression.", 1 },
+    [M_COMPRESS_OUT_WIRE_BYTES] = { "chat_compression_out_wire_bytes_total", "Bytes sent compressed to clients, as sent.", 1 },
+    [M_COMPRESS_IN_RAW_BYTES]   = { "chat_compression_in_raw_bytes_total", "Bytes received compressed from clients, decompressed.", 1 },
+    [M_COMPRESS_IN_WIRE_BYTES]  = { "chat_compression_in_wire_bytes_total", "Bytes received compressed from clients, as received.", 1 },
+};
+
+static const metric_desc_t gauge_desc[G_GAUGE_COUNT] = {
+    [G_CONNECTIONS]         = { "chat_connections", "Currently connected clients.", 1 },
+    [G_ROOMS]               = { "chat_rooms", "Currently existing rooms.", 1 },
+    [G_UPLOAD_QUEUE_DEPTH]  = { "chat_upload_queue_depth", "Files waiting in the upload queue.", 1 },
+    [G_UPLOAD_WORKERS_BUSY] = { "chat_upload_workers_busy", "Upload workers currently processing a file.", 1 },
+    [G_LOG_BACKLOG]         = { "chat_log_backlog", "Threads waiting for or holding the log lock.", 1 },
+    [G_OUTBOX_BYTES]        = { "chat_outbox_bytes", "Outbound bytes queued across all connections.", 1 },
+    [G_FILE_CACHE_BYTES]    = { "chat_file_cache_bytes", "File bytes held by the file cache.", 1 },
+};
+
+static const metric_desc_t hist_desc[H_HIST_COUNT] = {
+    [H_COMMAND_SECONDS]       = { "chat_command_duration_seconds", "Time to handle one client command.", 1e9 },
+    [H_FILE_DELIVERY_SECONDS] = { "chat_file_delivery_duration_seconds", "Time to hand one file to its recipient.", 1e9 },
+    [H_TRACE_PARSE_SECONDS]     = { "chat_trace_parse_seconds", "Traced messages: recv to command parsed.", 1e9 },
+    [H_TRACE_LOCK_WAIT_SECONDS] = { "chat_trace_lock_wait_seconds", "Traced broadcasts: parsed to room member snapshot acquired.", 1e9 },
+    [H_TRACE_ENQUEUE_SECONDS]   = { "chat_trace_enqueue_seconds", "Traced messages: parsed to queued in the recipient's outbox.", 1e9 },
+    [H_TRACE_DELIVERY_SECONDS]  = { "chat_trace_delivery_seconds", "Traced messages: recipient's outbox to TCP send.", 1e9 },
+    [H_TRACE_TOTAL_SECONDS]     = { "chat_trace_total_seconds", "Traced messages: parsed to recipient's TCP send.", 1e9 },
+};
+
+/**
+ * hist_bounds_ns
+ *   Upper bounds (inclusive, in nanoseconds) of the histogram buckets. Samples larger than
+ *   the last bound land in the implicit +Inf bucket.
+ */
+static const uint64_t hist_bounds_ns[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000,
+    1000000000, 2500000000ULL, 5000000000ULL, 10000000000ULL
+};
+
+#define HIST_BUCKETS (sizeof(hist_bounds_ns) / sizeof(hist_bounds_ns[0]))
+
+/* ----------------------------------------------------------------------------
+ * Per-thread storage
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * metrics_shard_t
+ *   Private counter/histogram storage for one thread. Only the owning thread writes to it;
+ *   the scraper reads it with relaxed loads, so no lock or locked instruction is needed on
+ *   the hot path.
+ *   - counters:    One slot per metric_counter_id_t
+ *   - buckets:     Per-histogram bucket counts (non-cumulative), last slot is +Inf
+ *   - sum_ns:      Per-histogram sum of all samples
+ *   - next:        Link in the global shard list
+ */
+typedef struct metrics_shard {
+    _Atomic uint64_t      counters[M_COUNTER_COUNT];
+    _Atomic uint64_t      buckets[H_HIST_COUNT][HIST_BUCKETS + 1];
+    _Atomic uint64_t      sum_ns[H_HIST_COUNT];
+    struct metrics_shard *next;
+} metrics_shard_t;
+
+// All live shards, plus the folded totals of threads that have exited.
+static metrics_shard_t *shard_list = NULL;
+static metrics_shard_t  retired;
+static pthread_mutex_t  shard_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t    shard_key;
+static pthread_once_t   shard_key_once = PTHREAD_ONCE_INIT;
+static __thread metrics_shard_t *tls_shard = NULL;
+
+// Gauges are shared; they change rarely compared to counters.
+static _Atomic int64_t  gauges[G_GAUGE_COUNT];
+
+/**
+ * shard_add
+ *   Single-writer increment: the owner is the only thread that stores to 'slot', so a plain
+ *   load + store (both relaxed) is enough and avoids a locked read-modify-write.
+ */
+static inline void shard_add(_Atomic uint64_t *slot, uint64_t v) {
+    atomic_store_explicit(slot, atomic_load_explicit(slot, memory_order_relaxed) + v,
+                          memory_order_relaxed);
+}
+
+/**
+ * shard_fold
+ *   Add every value of 'src' into 'dst'. Caller holds shard_mutex.
+ */
+static void shard_fold(metrics_shard_t *dst, metrics_shard_t *src) {
+    for (int i = 0; i < M_COUNTER_COUNT; ++i) {
+        atomic_fetch_add_explicit(&dst->counters[i],
+                                  atomic_load_explicit(&src->counters[i], memory_order_relaxed),
+                                  memory_order_relaxed);
+    }
+    for (int h = 0; h < H_HIST_COUNT; ++h) {
+        for (size_t b = 0; b <= HIST_BUCKETS; ++b) {
+            atomic_fetch_add_explicit(&dst->buckets[h][b],
+                                      atomic_load_explicit(&src->buckets[h][b], memory_order_relaxed),
+                                      memory_order_relaxed);
+        }
+        atomic_fetch_add_explicit(&dst->sum_ns[h],
+                                  atomic_load_explicit(&src->sum_ns[h], memory_order_relaxed),
+                                  memory_order_relaxed);
+    }
+}
+
+/**
+ * shard_release
+ *   Thread-exit destructor: fold the exiting thread's values into 'retired' and unlink it.
+ */
+static void shard_release(void *arg) {
+    metrics_shard_t *shard = arg;
+
+    pthread_mutex_lock(&shard_mutex);
+    shard_fold(&retired, shard);
+    for (metrics_shard_t **pp = &shard_list; *pp; pp = &(*pp)->next) {
+        if (*pp == shard) {
+            *pp = shard->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard_mutex);
+
+    free(shard);
+}
+
+static void shard_key_init(void) {
+    pthread_key_create(&shard_key, shard_release);
+}
+
+/**
+ * metrics_shard
+ *   Return the calling thread's shard, registering a new one on first use.
+ *   Returns &retired if allocation fails, so samples are still counted (just shared).
+ */
+static metrics_shard_t *metrics_shard(void) {
+    if (tls_shard) {
+        return tls_shard;
+    }
+
+    pthread_once(&shard_key_once, shard_key_init);
+    metrics_shard_t *shard = calloc(1, sizeof(*shard));
+    if (!shard) {
+        return &retired;
+    }
+
+    pthread_mutex_lock(&shard_mutex);
+    shard->next = shard_list;
+    shard_list  = shard;
+    pthread_mutex_unlock(&shard_mutex);
+
+    pthread_setspecific(shard_key, shard);
+    tls_shard = shard;
+    return shard;
+}
+
+/* ----------------------------------------------------------------------------
+ * Recording API
+ * ----------------------------------------------------------------------------
+ */
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_add(metric_counter_id_t id, uint64_t v) {
+    metrics_shard_t *shard = metrics_shard();
+    if (shard == &retired) {
+        atomic_fetch_add_explicit(&retired.counters[id], v, memory_order_relaxed);
+        return;
+    }
+    shard_add(&shard->counters[id], v);
+}
+
+void metrics_gauge_add(metric_gauge_id_t id, int64_t delta) {
+    atomic_fetch_add_explicit(&gauges[id], delta, memory_order_relaxed);
+}
+
+void metrics_gauge_set(metric_gauge_id_t id, int64_t value) {
+    atomic_store_explicit(&gauges[id], value, memory_order_relaxed);
+}
+
+void metrics_observe_ns(metric_hist_id_t id, uint64_t ns) {
+    size_t b = 0;
+    while (b < HIST_BUCKETS && ns > hist_bounds_ns[b]) {
+        b++;
+    }
+
+    metrics_shard_t *shard = metrics_shard();
+    if (shard == &retired) {
+        atomic_fetch_add_explicit(&retired.buckets[id][b], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&retired.sum_ns[id], ns, memory_order_relaxed);
+        return;
+    }
+    shard_add(&shard->buckets[id][b], 1);
+    shard_add(&shard->sum_ns[id], ns);
+}
+
+/* ----------------------------------------------------------------------------
+ * Prometheus text rendering
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * render_buf_t
+ *   Growable output buffer used while rendering. 'failed' is set on allocation failure and
+ *   makes every later append a no-op.
+ */
+typedef struct {
+    char   *data;
+    size_t  len;
+    size_t  cap;
+    int     failed;
+} render_buf_t;
+
+static void rb_printf(render_buf_t *rb, const char *fmt, ...) {
+    if (rb->failed) {
+        return;
+    }
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(rb->data + rb->len, rb->cap - rb->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            rb->failed = 1;
+            return;
+        }
+        if ((size_t)n < rb->cap - rb->len) {
+            rb->len += (size_t)n;
+            return;
+        }
+        size_t ncap = rb->cap * 2 + (size_t)n;
+        char *p = realloc(rb->data, ncap);
+        if (!p) {
+            rb->failed = 1;
+            return;
+        }
+        rb->data = p;
+        rb->cap  = ncap;
+    }
+}
+
+/**
+ * rb_header
+ *   Emit the "# HELP" and "# TYPE" lines for one metric.
+ */
+static void rb_header(render_buf_t *rb, const metric_desc_t *d, const char *type) {
+    rb_printf(rb, "# HELP %s %s\n# TYPE %s %s\n", d->name, d->help, d->name, type);
+}
+
+char *metrics_render(size_t *len) {
+    render_buf_t rb = { malloc(8192), 0, 8192, 0 };
+    if (!rb.data) {
+        return NULL;
+    }
+
+    // Merge all shards into one snapshot while holding the registry lock
+    metrics_shard_t *total = calloc(1, sizeof(*total));
+    if (!total) {
+        free(rb.data);
+        return NULL;
+    }
+    pthread_mutex_lock(&shard_mutex);
+    shard_fold(total, &retired);
+    for (metrics_shard_t *s = shard_list; s; s = s->next) {
+        shard_fold(total, s);
+    }
+    pthread_mutex_unlock(&shard_mutex);
+
+    for (int i = 0; i < M_COUNTER_COUNT; ++i) {
+        const metric_desc_t *d = &counter_desc[i];
+        uint64_t v = atomic_load_explicit(&total->counters[i], memory_order_relaxed);
+        rb_header(&rb, d, "counter");
+        if (d->scale == 1) {
+            rb_printf(&rb, "%s %llu\n", d->name, (unsigned long long)v);
+        } else {
+            rb_printf(&rb, "%s %.9f\n", d->name, (double)v / d->scale);
+        }
+    }
+
+    for (int i = 0; i < G_GAUGE_COUNT; ++i) {
+        const metric_desc_t *d = &gauge_desc[i];
+        rb_header(&rb, d, "gauge");
+        rb_printf(&rb, "%s %lld\n", d->name,
+                  (long long)atomic_load_explicit(&gauges[i], memory_order_relaxed));
+    }
+
+    for (int h = 0; h < H_HIST_COUNT; ++h) {
+        const metric_desc_t *d = &hist_desc[h];
+        rb_header(&rb, d, "histogram");
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+            cumulative += atomic_load_explicit(&total->buckets[h][b], memory_order_relaxed);
+            rb_printf(&rb, "%s_bucket{le=\"%g\"} %llu\n", d->name,
+                      (double)hist_bounds_ns[b] / d->scale, (unsigned long long)cumulative);
+        }
+        cumulative += atomic_load_explicit(&total->buckets[h][HIST_BUCKETS], memory_order_relaxed);
+        rb_printf(&rb, "%s_bucket{le=\"+Inf\"} %llu\n", d->name, (unsigned long long)cumulative);
+        rb_printf(&rb, "%s_sum %.9f\n", d->name,
+                  (double)atomic_load_explicit(&total->sum_ns[h], memory_order_relaxed) / d->scale);
+        rb_printf(&rb, "%s_count %llu\n", d->name, (unsigned long long)cumulative);
+    }
+
+    free(total);
+
+    if (rb.failed) {
+        free(rb.data);
+        return NULL;
+    }
+    if (len) {
+        *len = rb.len;
+    }
+    return rb.data;
+}
+
+/* ----------------------------------------------------------------------------
+ * Admin endpoint
+ * ----------------------------------------------------------------------------
+ */
+
+static int            admin_fd = -1;
+static pthread_t      admin_thread;
+static volatile int   admin_running = 0;
+
+/**
+ * write_all
+ *   Write the whole buffer to 'fd', retrying on short writes and EINTR.
+ *   Returns 0 on success, -1 on error.
+ */
+static int write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p   += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+/**
+ * admin_loop
+ *   Accept one connection at a time, consume the request, answer with the metrics page and
+ *   close. Scrapes are rare and cheap, so a single thread is enough.
+ */
+static void *admin_loop(void *arg) {
+    (void)arg;
+
+    while (admin_running) {
+        int fd = accept(admin_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;  // Listening socket shut down by metrics_admin_stop()
+        }
+
+        // Do not let a silent client stall the endpoint
+        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+        char req[2048];
+        recv(fd, req, sizeof req, 0);
+
+        size_t body_len = 0;
+        char *body = metrics_render(&body_len);
+        char header[256];
+        int hlen;
+        if (body) {
+            hlen = snprintf(header, sizeof header,
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n",
+                            body_len);
+        } else {
+            hlen = snprintf(header, sizeof header,
+                            "HTTP/1.0 500 Internal Server Error\r\n"
+                            "Content-Length: 0\r\n"
+                            "Connection: close\r\n\r\n");
+        }
+        if (write_all(fd, header, (size_t)hlen) == 0 && body) {
+            write_all(fd, body, body_len);
+        }
+        free(body);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int metrics_admin_start(int port) {
+    admin_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (admin_fd < 0) {
+        return -1;
+    }
+
+    int yes = 1;
+    setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+
+    // Only reachable from the local machine
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons((uint16_t)port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    if (bind(admin_fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(admin_fd, 4) < 0) {
+        int saved = errno;
+        close(admin_fd);
+        admin_fd = -1;
+        errno = saved;
+        return -1;
+    }
+
+    admin_running = 1;
+    if (pthread_create(&admin_thread, NULL, admin_loop, NULL) != 0) {
+        admin_running = 0;
+        close(admin_fd);
+        admin_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_admin_stop(void) {
+    if (!admin_running) {
+        return;
+    }
+    admin_running = 0;
+    shutdown(admin_fd, SHUT_RDWR);  // Wakes the blocked accept()
+    pthread_join(admin_thread, NULL);
+    close(admin_fd);
+    admin_fd = -1;
+}
@@ -0,0 +1,855 @@
+/* outbox.c */
+
+#include "outbox.h"
+#include "config.h"     // For server_config.slow_policy
+#include "metrics.h"    // For drop/disconnect/pause counters and the queued-bytes gauge
+#include "lockprof.h"   // For LP_LOCK / LP_UNLOCK
+#include "lz4block.h"   // For the compressed chat stream
+#include "pool.h"       // For the preallocated message slots
+#include <stdlib.h>     // For malloc, free
+#include <stdio.h>      // For snprintf
+#include <string.h>     // For memcpy
+#include <errno.h>      // For errno, EAGAIN, EINTR
+#include <fcntl.h>      // For fcntl, O_NONBLOCK
+#include <time.h>       // For clock_gettime, struct timespec
+#include <unistd.h>     // For write
+#include <sys/socket.h> // For sendmsg, MSG_DONTWAIT, MSG_NOSIGNAL, MSG_MORE
+
+// Profiling site shared by every connection's outbox mutex (make LOCKPROF=1)
+LOCKPROF_SITE(outbox_lp, "outbox.mutex");
+
+// Message slots shared by every outbox (NULL until outbox_pool_init)
+static pool_t *msg_pool = NULL;
+
+/* ----------------------------------------------------------------------------
+ * Internal helpers (caller holds ob->mutex)
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * msg_alloc
+ *   A message with room for 'len' bytes: a pool slot if it fits one and one is free (no lock
+ *   beyond the thread's own cache in the common case), else malloc'd. Returns NULL if memory
+ *   runs out.
+ */
+static outbox_msg_t *msg_alloc(size_t len) {
+    outbox_msg_t *m = NULL;
+    if (msg_pool && sizeof(*m) + len <= OUTBOX_MSG_SLOT) {
+        m = pool_alloc(msg_pool);
+    }
+    return m ? m : malloc(sizeof(*m) + len);
+}
+
+/**
+ * msg_free
+ *   Release a message to the pool, or free() it if it was malloc'd.
+ */
+static void msg_free(outbox_msg_t *m) {
+    if (!msg_pool || pool_free(msg_pool, m) < 0) {
+        free(m);
+    }
+}
+
+/**
+ * file_free
+ *   Free a file stream and hand its payload back to the owner.
+ */
+static void file_free(outbox_file_t *f, int sent) {
+    f->payload.release(f->payload.arg, sent);
+    free(f);
+}
+
+/**
+ * append_locked
+ *   Add 'm' at the tail and account its bytes.
+ */
+static void append_locked(outbox_t *ob, outbox_msg_t *m) {
+    m->next = NULL;
+    if (ob->tail) {
+        ob->tail->next = m;
+    } else {
+        ob->head = m;
+    }
+    ob->tail   = m;
+    ob->bytes += m->len;
+    if (m->kind == OUTBOX_CHAT) {
+        ob->chat_bytes += m->len;
+    }
+    metrics_gauge_add(G_OUTBOX_BYTES, (int64_t)m->len);
+}
+
+/**
+ * wake_locked
+ *   Write one byte to the wake fd unless a wake-up is already pending. The fd is non-blocking
+ *   and at most one byte is ever outstanding, so this never blocks the caller.
+ */
+static void wake_locked(outbox_t *ob) {
+    if (ob->wake_pending || ob->wake_fd < 0) {
+        return;
+    }
+    char b = 1;
+    if (write(ob->wake_fd, &b, 1) == 1 || errno == EAGAIN) {
+        ob->wake_pending = 1;
+    }
+}
+
+/**
+ * chat_bytes_locked
+ *   Unsent chat bytes, the quantity the chat budget applies to.
+ */
+static size_t chat_bytes_locked(const outbox_t *ob) {
+    return ob->chat_bytes;
+}
+
+/**
+ * has_data_locked
+ *   1 if either lane has unsent data.
+ */
+static int has_data_locked(const outbox_t *ob) {
+    return ob->head != NULL || (ob->file_head != NULL && !ob->file_head->held);
+}
+
+/**
+ * evict_chat_locked
+ *   Drop the oldest queued chat messages (never one that is partially sent or pinned by an
+ *   asynchronous send or a compressed frame) until 'need' more bytes fit in the budget.
+ *   Returns 1 if they now fit, 0 otherwise.
+ */
+static int evict_chat_locked(outbox_t *ob, size_t need) {
+    outbox_msg_t **link = &ob->head;
+    outbox_msg_t  *prev = NULL;
+    int pinned = ob->inflight > ob->ztext.count ? ob->inflight : ob->ztext.count;
+    int pos = 0;
+
+    while (*link && chat_bytes_locked(ob) + need > ob->limit) {
+        outbox_msg_t *m = *link;
+        if (m->kind != OUTBOX_CHAT || m->off > 0 || pos++ < pinned) {
+            prev = m;
+            link = &m->next;
+            continue;
+        }
+        *link = m->next;
+        if (ob->tail == m) {
+            ob->tail = prev;
+        }
+        ob->bytes      -= m->len;
+        ob->chat_bytes -= m->len;
+        metrics_gauge_add(G_OUTBOX_BYTES, -(int64_t)m->len);
+        metrics_inc(M_OUTBOX_DROPPED);
+        msg_free(m);
+    }
+    return chat_bytes_locked(ob) + need <= ob->limit;
+}
+
+/**
+ * overflow_locked
+ *   Apply the disconnect outcome: refuse further data and wake the handler so it notices.
+ */
+static outbox_result_t overflow_locked(outbox_t *ob) {
+    if (!ob->overflowed) {
+        ob->overflowed = 1;
+        metrics_inc(M_SLOW_DISCONNECTS);
+    }
+    wake_locked(ob);
+    return OUTBOX_OVERFLOW;
+}
+
+/**
+ * admit_locked
+ *   Release held file streams, in lane order, while they fit in the budget (or the queue is
+ *   empty, so a file larger than the whole budget still goes through).
+ */
+static void admit_locked(outbox_t *ob) {
+    outbox_file_t *f = ob->file_held;
+    while (f && (ob->bytes == 0 || ob->bytes + f->payload.len <= ob->limit)) {
+        f->held    = 0;
+        ob->bytes += f->payload.len;
+        metrics_gauge_add(G_OUTBOX_BYTES, (int64_t)f->payload.len);
+        f = f->next;
+    }
+    ob->file_held = f;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public functions
+ * ----------------------------------------------------------------------------
+ */
+
+int outbox_pool_init(uint32_t slots) {
+    if (slots > OUTBOX_MSG_SLOTS_MAX) {
+        slots = OUTBOX_MSG_SLOTS_MAX;
+    }
+    msg_pool = pool_create("outbox messages", OUTBOX_MSG_SLOT, slots, NULL);
+    return msg_pool ? 0 : -1;
+}
+
+void outbox_init(outbox_t *ob, size_t limit) {
+    pthread_mutex_init(&ob->mutex, NULL);
+
+    ob->head      = NULL;
+    ob->tail      = NULL;
+    ob->file_head = NULL;
+    ob->bytes     = 0;
+    ob->z         = (lz4_stream_t){ 0 };
+    ob->ztext.buf = NULL;
+    outbox_reset(ob, limit);
+}
+
+void outbox_reset(outbox_t *ob, size_t limit) {
+    outbox_msg_t *m = ob->head;
+    while (m) {
+        outbox_msg_t *next = m->next;
+        msg_free(m);
+        m = next;
+    }
+    outbox_file_t *f = ob->file_head;
+    while (f) {
+        outbox_file_t *next = f->next;
+        file_free(f, 0);
+        f = next;
+    }
+    metrics_gauge_add(G_OUTBOX_BYTES, -(int64_t)ob->bytes);
+    lz4_stream_free(&ob->z);
+    free(ob->ztext.buf);
+
+    ob->ztext        = (outbox_ztext_t){ 0 };
+    ob->head         = NULL;
+    ob->tail         = NULL;
+    ob->file_head    = NULL;
+    ob->file_tail    = NULL;
+    ob->file_held    = NULL;
+    ob->slice.file   = NULL;
+    ob->batch_chat   = 0;
+    ob->batch_ztext  = 0;
+    ob->batch_slice  = 0;
+    ob->batch_out    = 0;
+    ob->bytes        = 0;
+    ob->chat_bytes   = 0;
+    ob->limit        = limit;
+    ob->wake_fd      = -1;
+    ob->wake_pending = 0;
+    ob->inflight     = 0;
+    ob->closed       = 0;
+    ob->overflowed   = 0;
+}
+
+int outbox_set_compression(outbox_t *ob) {
+    lz4_stream_t z;
+    char *buf = malloc(OUTBOX_FRAME_MAX + LZ4_BOUND(LZ4_BLOCK_MAX));
+    if (!buf || lz4_stream_init(&z, 1) < 0) {
+        free(buf);
+        return -1;
+    }
+
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    lz4_stream_free(&ob->z);
+    free(ob->ztext.buf);
+    ob->z     = z;
+    ob->ztext = (outbox_ztext_t){ .buf = buf };
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+    return 0;
+}
+
+int outbox_compressing(outbox_t *ob) {
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    int on = ob->z.buf != NULL;
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+    return on;
+}
+
+void outbox_set_wake_fd(outbox_t *ob, int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    ob->wake_fd = fd;
+    if (has_data_locked(ob)) {
+        wake_locked(ob);
+    }
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+}
+
+/**
+ * outbox_push_chat
+ *
+ * The message is allocated before taking the lock, so the critical section is a handful of
+ * pointer updates plus (rarely) one non-blocking write of the wake byte.
+ */
+outbox_result_t outbox_push_chat(outbox_t *ob, const char *data, size_t len,
+                                 const trace_stamp_t *stamp) {
+    outbox_msg_t *m = msg_alloc(len);
+    if (!m) {
+        metrics_inc(M_OUTBOX_DROPPED);
+        return OUTBOX_DROPPED;
+    }
+    memcpy(m->inline_data, data, len);
+    m->kind     = OUTBOX_CHAT;
+    m->data     = m->inline_data;
+    m->len      = len;
+    m->off      = 0;
+    m->parse_ns = stamp ? stamp->parse_ns : 0;
+    m->enq_ns   = m->parse_ns ? metrics_now_ns() : 0;
+
+    outbox_result_t rc = OUTBOX_OK;
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    if (ob->closed || ob->overflowed) {
+        rc = OUTBOX_CLOSED;
+    } else if (chat_bytes_locked(ob) + len > ob->limit) {
+        switch (server_config.slow_policy) {
+            case SLOW_POLICY_DROP:
+                if (!evict_chat_locked(ob, len)) {
+                    metrics_inc(M_OUTBOX_DROPPED);
+                    rc = OUTBOX_DROPPED;
+                }
+                break;
+            case SLOW_POLICY_PAUSE:
+                if (chat_bytes_locked(ob) + len > 2 * ob->limit) {
+                    rc = overflow_locked(ob);
+                }
+                break;
+            default:
+                rc = overflow_locked(ob);
+                break;
+        }
+    }
+    if (rc == OUTBOX_OK) {
+        append_locked(ob, m);
+        wake_locked(ob);
+        m = NULL;
+    }
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+
+    if (m) {
+        msg_free(m);
+    }
+    return rc;
+}
+
+void outbox_push_reply(outbox_t *ob, const char *data, size_t len) {
+    outbox_msg_t *m = msg_alloc(len);
+    if (!m) {
+        return;
+    }
+    *m = (outbox_msg_t){ .kind = OUTBOX_REPLY, .data = m->inline_data, .len = len };
+    memcpy(m->inline_data, data, len);
+
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    if (ob->closed) {
+        LP_UNLOCK(&ob->mutex, &outbox_lp);
+        msg_free(m);
+        return;
+    }
+    append_locked(ob, m);
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+}
+
+/**
+ * outbox_push_file
+ *
+ * A file is admitted when it fits in the remaining budget, or when the outbox is empty (so a
+ * file larger than the whole budget still goes through, just never on top of other data).
+ * Otherwise it is queued held and admitted as sent bytes leave the queue (see sent_locked), so
+ * the upload worker that pushes it moves on to other recipients right away.
+ */
+outbox_result_t outbox_push_file(outbox_t *ob, uint32_t xfer, const char *header, size_t header_len,
+                                 const outbox_payload_t *payload, int *paused) {
+    outbox_file_t *f = malloc(sizeof(*f) + header_len);
+    if (!f) {
+        payload->release(payload->arg, 0);
+        return OUTBOX_CLOSED;
+    }
+    *f = (outbox_file_t){ .xfer = xfer, .payload = *payload, .header_len = header_len, .held = 1 };
+    memcpy(f->header, header, header_len);
+    clock_gettime(CLOCK_MONOTONIC, &f->deadline);
+    f->deadline.tv_sec += OUTBOX_PAUSE_TIMEOUT;
+
+    outbox_result_t rc = OUTBOX_OK;
+    *paused = 0;
+
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    if (ob->closed || ob->overflowed) {
+        rc = OUTBOX_CLOSED;
+    } else {
+        if (ob->file_tail) {
+            ob->file_tail->next = f;
+        } else {
+            ob->file_head = f;
+        }
+        ob->file_tail = f;
+        if (!ob->file_held) {
+            ob->file_held = f;
+        }
+        admit_locked(ob);
+        *paused = f->held;
+        // Also when held: the handler then waits with the stream's deadline in view
+        wake_locked(ob);
+        f = NULL;
+    }
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+
+    if (f) {
+        file_free(f, 0);
+    }
+    return rc;
+}
+
+/**
+ * slice_cut_locked
+ *   Cut the next piece of the head file stream into ob->slice, unless one is already cut.
+ *   Returns 1 if a piece is ready to send, 0 if the file lane is empty.
+ */
+static int slice_cut_locked(outbox_t *ob) {
+    outbox_slice_t *sl = &ob->slice;
+    outbox_file_t *f = ob->file_head;
+    if (sl->file) {
+        return 1;
+    }
+    if (!f || f->held) {
+        return 0;
+    }
+
+    // Pieces end on the file's OUTBOX_SLICE_SIZE boundaries (only the first piece of a
+    // resumed delivery is shorter), which is where its checkpoints are
+    size_t at = f->payload.origin + f->framed;
+    size_t n  = OUTBOX_SLICE_SIZE - at % OUTBOX_SLICE_SIZE;
+    if (n > f->payload.len - f->framed) {
+        n = f->payload.len - f->framed;
+    }
+    // A whole piece that compressed goes out as its LZ4 block
+    const outbox_zpiece_t *zp = NULL;
+    if (f->payload.zpieces && f->payload.marks && at % OUTBOX_SLICE_SIZE == 0 &&
+        f->payload.zpieces[at / OUTBOX_SLICE_SIZE].len > 0) {
+        zp = &f->payload.zpieces[at / OUTBOX_SLICE_SIZE];
+    }
+    unsigned crc = f->payload.marks ? f->payload.marks[(at + n - 1) / OUTBOX_SLICE_SIZE] : 0;
+    int frame_len;
+    if (zp) {
+        frame_len = snprintf(sl->frame, sizeof sl->frame, "[FILE-ZDATA %u %zu %08x %zu]\n",
+                             f->xfer, n, crc, zp->len);
+        metrics_add(M_COMPRESS_OUT_RAW_BYTES, n);
+        metrics_add(M_COMPRESS_OUT_WIRE_BYTES, zp->len);
+    } else if (f->payload.marks) {
+        frame_len = snprintf(sl->frame, sizeof sl->frame, "[FILE-DATA %u %zu %08x]\n",
+                             f->xfer, n, crc);
+    } else {
+        frame_len = snprintf(sl->frame, sizeof sl->frame, "[FILE-DATA %u %zu]\n", f->xfer, n);
+    }
+
+    sl->nseg = 0;
+    if (f->framed == 0) {
+        sl->seg[sl->nseg++] = (struct iovec){ f->header, f->header_len };
+    }
+    sl->seg[sl->nseg++] = (struct iovec){ sl->frame, (size_t)frame_len };
+    sl->seg[sl->nseg++] = zp ? (struct iovec){ (char *)zp->data, zp->len }
+                             : (struct iovec){ (char *)f->payload.data + f->framed, n };
+    sl->total = 0;
+    for (int i = 0; i < sl->nseg; ++i) {
+        sl->total += sl->seg[i].iov_len;
+    }
+    sl->sent   = 0;
+    sl->raw    = n;
+    sl->packed = zp != NULL;
+    sl->file   = f;
+    f->framed += n;
+    return 1;
+}
+
+/**
+ * slice_iov_locked
+ *   Describe the unsent part of the cut piece in 'iov' (at most three entries). Adds its length
+ *   to *want and returns the number of iovecs.
+ */
+static int slice_iov_locked(const outbox_slice_t *sl, struct iovec *iov, size_t *want) {
+    int iovcnt = 0;
+    size_t skip = sl->sent;
+    for (int i = 0; i < sl->nseg; ++i) {
+        if (skip >= sl->seg[i].iov_len) {
+            skip -= sl->seg[i].iov_len;
+            continue;
+        }
+        iov[iovcnt].iov_base = (char *)sl->seg[i].iov_base + skip;
+        iov[iovcnt].iov_len  = sl->seg[i].iov_len - skip;
+        *want += iov[iovcnt].iov_len;
+        iovcnt++;
+        skip = 0;
+    }
+    return iovcnt;
+}
+
+/**
+ * slice_consume_locked
+ *   Account up to 'n' sent bytes to the cut piece. A finished piece is dropped, and so is its
+ *   stream once every payload byte is out. Returns the bytes taken; *payload receives how
+ *   many of them were file payload (the part counted in ob->bytes).
+ */
+static size_t slice_consume_locked(outbox_t *ob, size_t n, size_t *payload) {
+    outbox_slice_t *sl = &ob->slice;
+    size_t take = sl->total - sl->sent;
+    if (take > n) {
+        take = n;
+    }
+
+    // The payload is the last segment: bytes beyond the header and frame belong to it (all
+    // at once for a compressed piece, whose bytes are not the file's)
+    size_t data_start = sl->total - sl->seg[sl->nseg - 1].iov_len;
+    size_t from = sl->sent > data_start ? sl->sent : data_start;
+    size_t to   = sl->sent + take;
+    if (sl->packed) {
+        *payload = to == sl->total ? sl->raw : 0;
+    } else {
+        *payload = to > from ? to - from : 0;
+    }
+
+    sl->sent += take;
+    if (sl->sent == sl->total) {
+        outbox_file_t *f = sl->file;
+        sl->file = NULL;
+        if (f->framed == f->payload.len) {
+            ob->file_head = f->next;
+            if (!ob->file_head) {
+                ob->file_tail = NULL;
+            }
+            file_free(f, 1);
+        }
+    }
+    return take;
+}
+
+/**
+ * chat_consume_locked
+ *   Account up to 'n' sent bytes to the first 'count' chat lane messages and retire every
+ *   message that is now fully on the wire. Returns the bytes taken.
+ */
+static size_t chat_consume_locked(outbox_t *ob, size_t n, int count) {
+    size_t used = 0;
+    while (used < n && count-- > 0) {
+        outbox_msg_t *m = ob->head;
+        size_t take = m->len - m->off;
+        if (take > n - used) {
+            take = n - used;
+        }
+        m->off += take;
+        used   += take;
+        if (m->kind == OUTBOX_CHAT) {
+            ob->chat_bytes -= take;
+        }
+        if (m->off < m->len) {
+            break;
+        }
+        ob->head = m->next;
+        if (!ob->head) {
+            ob->tail = NULL;
+        }
+        trace_record_delivery(m->parse_ns, m->enq_ns);
+        msg_free(m);
+    }
+    return used;
+}
+
+/**
+ * ztext_build_locked
+ *   Compress the unsent chat lane messages at the head (as many as make up LZ4_BLOCK_MAX bytes)
+ *   into ob->ztext. Returns 1 if the frame is built, 0 if there is nothing to compress or the
+ *   frame would not be smaller than the messages (they then go out as they are, and the
+ *   stream is left as if they had never been offered).
+ */
+static int ztext_build_locked(outbox_t *ob) {
+    outbox_ztext_t *zt = &ob->ztext;
+    size_t raw = 0;
+    int count = 0;
+    for (outbox_msg_t *m = ob->head; m && m->off == 0 && raw + m->len <= LZ4_BLOCK_MAX;
+         m = m->next) {
+        raw += m->len;
+        count++;
+    }
+
+    // The frame must come out shorter than the messages, header included
+    char hdr[OUTBOX_FRAME_MAX];
+    size_t hmax = (size_t)snprintf(hdr, sizeof hdr, "[ZTEXT %zu %zu]\n", raw, raw);
+    if (count == 0 || raw <= hmax + 1) {
+        return 0;
+    }
+
+    char *in = lz4_stream_reserve(&ob->z, raw);
+    outbox_msg_t *m = ob->head;
+    for (int i = 0; i < count; ++i, m = m->next) {
+        memcpy(in, m->data, m->len);
+        in += m->len;
+    }
+    char *body  = zt->buf + OUTBOX_FRAME_MAX;
+    size_t zlen = lz4_stream_compress(&ob->z, raw, body, raw - hmax - 1);
+    if (zlen == 0) {
+        return 0;
+    }
+
+    size_t hlen = (size_t)snprintf(hdr, sizeof hdr, "[ZTEXT %zu %zu]\n", raw, zlen);
+    memcpy(body - hlen, hdr, hlen);
+    zt->data  = body - hlen;
+    zt->total = hlen + zlen;
+    zt->sent  = 0;
+    zt->raw   = raw;
+    zt->count = count;
+    metrics_add(M_COMPRESS_OUT_RAW_BYTES, raw);
+    metrics_add(M_COMPRESS_OUT_WIRE_BYTES, zt->total);
+    return 1;
+}
+
+/**
+ * ztext_consume_locked
+ *   Account up to 'n' sent bytes to the compressed frame. Once all of it is sent, the messages
+ *   it carries are retired. Returns the bytes taken; *chat receives the bytes of the retired
+ *   messages (the part counted in ob->bytes).
+ */
+static size_t ztext_consume_locked(outbox_t *ob, size_t n, size_t *chat) {
+    outbox_ztext_t *zt = &ob->ztext;
+    size_t take = zt->total - zt->sent;
+    if (take > n) {
+        take = n;
+    }
+    zt->sent += take;
+    *chat = 0;
+    if (zt->sent == zt->total) {
+        *chat = chat_consume_locked(ob, zt->raw, zt->count);
+        zt->count = 0;
+    }
+    return take;
+}
+
+/**
+ * gather_locked
+ *   Describe the next batch in 'iov' (at most 'max' entries, at least 4): a file piece that is
+ *   already partly sent, then as many chat lane messages as fit (or, on a compressing outbox,
+ *   the compressed frame of the messages at the head), then, if no piece came first and every
+ *   chat message was included, the next file piece. Records the layout in ob->batch_chat,
+ *   ob->batch_ztext and ob->batch_slice, stores the total length in *want and whether more data is queued behind
+ *   the batch in *more. Returns the number of iovecs.
+ */
+static int gather_locked(outbox_t *ob, struct iovec *iov, int max, size_t *want, int *more) {
+    int iovcnt = 0;
+    *want = 0;
+    ob->batch_chat  = 0;
+    ob->batch_ztext = 0;
+    ob->batch_slice = 0;
+
+    if (ob->slice.file && ob->slice.sent > 0) {
+        iovcnt += slice_iov_locked(&ob->slice, iov, want);
+        ob->batch_slice = 1;
+    }
+
+    outbox_msg_t *m = ob->head;
+    if (ob->z.buf && (ob->ztext.count > 0 || ztext_build_locked(ob))) {
+        const outbox_ztext_t *zt = &ob->ztext;
+        iov[iovcnt].iov_base = (char *)zt->data + zt->sent;
+        iov[iovcnt].iov_len  = zt->total - zt->sent;
+        *want += iov[iovcnt].iov_len;
+        iovcnt++;
+        ob->batch_ztext = 1;
+        for (int i = 0; i < zt->count; ++i) {
+            m = m->next;
+        }
+    }
+    for (; m && !ob->batch_ztext && iovcnt < max - 3; m = m->next) {
+        iov[iovcnt].iov_base = (char *)m->data + m->off;
+        iov[iovcnt].iov_len  = m->len - m->off;
+        *want += iov[iovcnt].iov_len;
+        iovcnt++;
+        ob->batch_chat++;
+    }
+
+    if (!ob->batch_slice && !m && slice_cut_locked(ob)) {
+        iovcnt += slice_iov_locked(&ob->slice, iov + iovcnt, want);
+        ob->batch_slice = 2;
+    }
+
+    const outbox_file_t *f = ob->file_head;
+    *more = m != NULL || (f && (f->framed < f->payload.len || (f->next && !f->next->held) ||
+                                ob->batch_slice != 2));
+    return iovcnt;
+}
+
+/**
+ * sent_locked
+ *   Retire 'n' sent bytes of the batch laid out by the last gather_locked, in the same order,
+ *   and admit held file streams that now fit.
+ */
+static void sent_locked(outbox_t *ob, size_t n) {
+    size_t accounted = 0, payload;
+
+    if (ob->batch_slice == 1 && n > 0) {
+        n -= slice_consume_locked(ob, n, &payload);
+        accounted += payload;
+    }
+    if (ob->batch_ztext) {
+        size_t chat;
+        n         -= ztext_consume_locked(ob, n, &chat);
+        accounted += chat;
+    } else {
+        size_t chat = chat_consume_locked(ob, n, ob->batch_chat);
+        n         -= chat;
+        accounted += chat;
+    }
+    if (ob->batch_slice == 2 && n > 0) {
+        n -= slice_consume_locked(ob, n, &payload);
+        accounted += payload;
+    }
+
+    if (accounted > 0) {
+        ob->bytes -= accounted;
+        metrics_gauge_add(G_OUTBOX_BYTES, -(int64_t)accounted);
+        admit_locked(ob);
+    }
+}
+
+/**
+ * outbox_flush
+ *
+ * Sends happen under the outbox lock, but they are non-blocking, so a pusher waits at most
+ * for one copy into the socket buffer. Whatever the socket does not take stays queued and the
+ * handler retries once the socket is writable again.
+ */
+ssize_t outbox_flush(outbox_t *ob, int fd) {
+    ssize_t total = 0;
+    int failed = 0;
+
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    ob->wake_pending = 0;
+
+    while (has_data_locked(ob)) {
+        struct iovec iov[OUTBOX_IOV_MAX];
+        size_t want;
+        int more;
+        int iovcnt = gather_locked(ob, iov, OUTBOX_IOV_MAX, &want, &more);
+
+        // More data beyond this batch: let the kernel hold back a partial segment
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)iovcnt };
+        int flags = MSG_DONTWAIT | MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+        ssize_t n = sendmsg(fd, &msg, flags);
+        metrics_inc(M_SEND_CALLS);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                failed = 1;
+            }
+            break;
+        }
+
+        sent_locked(ob, (size_t)n);
+        total += n;
+        if ((size_t)n < want) {
+            break;  // Socket buffer is full
+        }
+    }
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+
+    return failed ? -1 : total;
+}
+
+/**
+ * outbox_prepare
+ *
+ * The iovecs point straight into the queued messages; pinning them (ob->inflight) keeps the
+ * drop policy from freeing memory the kernel is still reading.
+ */
+int outbox_prepare(outbox_t *ob, struct iovec *iov, int max, size_t *len) {
+    int iovcnt = 0;
+    *len = 0;
+
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    ob->wake_pending = 0;
+    if (!ob->batch_out && has_data_locked(ob)) {
+        int more;
+        iovcnt = gather_locked(ob, iov, max, len, &more);
+        ob->inflight  = ob->batch_chat;
+        ob->batch_out = 1;
+    }
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+    return iovcnt;
+}
+
+void outbox_complete(outbox_t *ob, size_t sent) {
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    sent_locked(ob, sent);
+    ob->inflight  = 0;
+    ob->batch_out = 0;
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+}
+
+void outbox_wake_consumed(outbox_t *ob) {
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    ob->wake_pending = 0;
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+}
+
+int outbox_pending(outbox_t *ob) {
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    int pending = has_data_locked(ob);
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+    return pending;
+}
+
+int outbox_overflowed(outbox_t *ob) {
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    int overflowed = ob->overflowed;
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+    return overflowed;
+}
+
+int outbox_hold_expire(outbox_t *ob, int *dropped) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    outbox_file_t *expired = NULL;
+    int wait_ms = -1;
+    *dropped = 0;
+
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    while (ob->file_held && !ob->overflowed) {
+        outbox_file_t *f = ob->file_held;
+        long left = (long)(f->deadline.tv_sec - now.tv_sec) * 1000 +
+                    (f->deadline.tv_nsec - now.tv_nsec) / 1000000;
+        if (left > 0) {
+            wait_ms = (int)left;
+            break;
+        }
+        if (server_config.slow_policy == SLOW_POLICY_DISCONNECT) {
+            overflow_locked(ob);
+            break;
+        }
+
+        // Unlink it: streams ahead of the first held one are all admitted
+        outbox_file_t *prev = NULL;
+        for (outbox_file_t *p = ob->file_head; p != f; p = p->next) {
+            prev = p;
+        }
+        if (prev) {
+            prev->next = f->next;
+        } else {
+            ob->file_head = f->next;
+        }
+        if (ob->file_tail == f) {
+            ob->file_tail = prev;
+        }
+        ob->file_held = f->next;
+        f->next = expired;
+        expired = f;
+        (*dropped)++;
+    }
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+
+    while (expired) {
+        outbox_file_t *next = expired->next;
+        file_free(expired, 0);
+        expired = next;
+    }
+    return wait_ms;
+}
+
+void outbox_close(outbox_t *ob) {
+    LP_LOCK(&ob->mutex, &outbox_lp);
+    ob->closed  = 1;
+    ob->wake_fd = -1;
+    LP_UNLOCK(&ob->mutex, &outbox_lp);
+}
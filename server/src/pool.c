@@ -0,0 +1,274 @@
+/* pool.c */
+
+#include "pool.h"
+#include "lockprof.h"   // For LP_LOCK / LP_UNLOCK
+#include <stdlib.h>     // For calloc, free
+#include <sys/mman.h>   // For mmap, munmap
+
+// Profiling sites shared by every pool's shared-list mutex and per-thread cache mutexes
+LOCKPROF_SITE(pool_lp, "pool.mutex");
+LOCKPROF_SITE(pool_cache_lp, "pool.cache");
+
+// Stored in a thread's key slot when all caches were taken, so it stops looking for one
+static char no_cache;
+
+/* ----------------------------------------------------------------------------
+ * Internal helpers
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * slot_of
+ *   Index of the slot 'obj' points at, or -1 if it is not the start of a slot in this pool.
+ */
+static long slot_of(const pool_t *pool, const void *obj) {
+    const char *p = obj;
+    if (p < pool->slab || p >= pool->slab + (size_t)pool->capacity * pool->slot_size) {
+        return -1;
+    }
+    size_t off = (size_t)(p - pool->slab);
+    if (off % pool->slot_size != 0) {
+        return -1;
+    }
+    return (long)(off / pool->slot_size);
+}
+
+/**
+ * cache_release
+ *   Thread-exit destructor of pool->key: hand the thread's cached slots back to the shared
+ *   list and make the cache available to another thread.
+ */
+static void cache_release(void *arg) {
+    if (arg == &no_cache) {
+        return;
+    }
+    pool_cache_t *cache = arg;
+    pool_t *pool = cache->pool;
+
+    LP_LOCK(&pool->mutex, &pool_lp);
+    LP_LOCK(&cache->mutex, &pool_cache_lp);
+    while (cache->count > 0) {
+        pool->free_slots[pool->free_count++] = cache->slots[--cache->count];
+    }
+    cache->claimed = 0;
+    LP_UNLOCK(&cache->mutex, &pool_cache_lp);
+    LP_UNLOCK(&pool->mutex, &pool_lp);
+}
+
+/**
+ * cache_get
+ *   The calling thread's cache, claiming a free one on first use. Returns NULL if every cache
+ *   is owned by another thread.
+ */
+static pool_cache_t *cache_get(pool_t *pool) {
+    void *cur = pthread_getspecific(pool->key);
+    if (cur) {
+        return cur == &no_cache ? NULL : cur;
+    }
+
+    pool_cache_t *cache = NULL;
+    LP_LOCK(&pool->mutex, &pool_lp);
+    for (int i = 0; i < POOL_MAX_CACHES; ++i) {
+        if (!pool->caches[i].claimed) {
+            cache = &pool->caches[i];
+            cache->claimed = 1;
+            break;
+        }
+    }
+    LP_UNLOCK(&pool->mutex, &pool_lp);
+
+    pthread_setspecific(pool->key, cache ? (void *)cache : (void *)&no_cache);
+    return cache;
+}
+
+/**
+ * steal_locked
+ *   The shared list is empty: take a slot from any thread's cache. Caller holds pool->mutex.
+ *   Returns the slot index, or -1 if the pool is exhausted.
+ */
+static long steal_locked(pool_t *pool) {
+    for (int i = 0; i < POOL_MAX_CACHES; ++i) {
+        pool_cache_t *cache = &pool->caches[i];
+        long slot = -1;
+        LP_LOCK(&cache->mutex, &pool_cache_lp);
+        if (cache->count > 0) {
+            slot = cache->slots[--cache->count];
+        }
+        LP_UNLOCK(&cache->mutex, &pool_cache_lp);
+        if (slot >= 0) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public functions
+ * ----------------------------------------------------------------------------
+ */
+
+pool_t *pool_create(const char *name, size_t obj_size, uint32_t capacity,
+                    void (*ctor)(void *obj)) {
+    if (capacity > (1u << POOL_ID_INDEX_BITS)) {
+        return NULL;
+    }
+    pool_t *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->name      = name;
+    pool->slot_size = (obj_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pool->capacity  = capacity;
+
+    // Anonymous pages are zero and only committed once touched: a pool sized for the worst case
+    // costs memory in proportion to the slots actually used (page-aligned, so POOL_ALIGN holds)
+    size_t slab_size = (size_t)capacity * pool->slot_size;
+    void *slab = capacity ? mmap(NULL, slab_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+    if (slab == MAP_FAILED) {
+        free(pool);
+        return NULL;
+    }
+    pool->slab       = slab;
+    pool->gens       = calloc(capacity, sizeof(*pool->gens));
+    pool->free_slots = calloc(capacity, sizeof(*pool->free_slots));
+    if (!pool->gens || !pool->free_slots || pthread_key_create(&pool->key, cache_release) != 0) {
+        free(pool->free_slots);
+        free((void *)pool->gens);
+        munmap(pool->slab, slab_size);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    for (int i = 0; i < POOL_MAX_CACHES; ++i) {
+        pool->caches[i].pool = pool;
+        pthread_mutex_init(&pool->caches[i].mutex, NULL);
+    }
+
+    // Lowest slots on top of the stack, so a lightly loaded server touches few cache lines
+    for (uint32_t i = 0; i < capacity; ++i) {
+        pool->free_slots[i] = capacity - 1 - i;
+        if (ctor) {
+            ctor(pool->slab + (size_t)i * pool->slot_size);
+        }
+    }
+    pool->free_count = capacity;
+    return pool;
+}
+
+/**
+ * pool_alloc
+ *
+ * A thread whose cache ran dry refills half of it from the shared list while it holds the
+ * lock anyway, so a burst of allocations takes pool->mutex once per POOL_CACHE_SIZE / 2.
+ */
+void *pool_alloc(pool_t *pool) {
+    pool_cache_t *cache = cache_get(pool);
+    long slot = -1;
+
+    if (cache) {
+        LP_LOCK(&cache->mutex, &pool_cache_lp);
+        if (cache->count > 0) {
+            slot = cache->slots[--cache->count];
+        }
+        LP_UNLOCK(&cache->mutex, &pool_cache_lp);
+    }
+
+    if (slot < 0) {
+        LP_LOCK(&pool->mutex, &pool_lp);
+        if (pool->free_count > 0) {
+            slot = pool->free_slots[--pool->free_count];
+            if (cache) {
+                LP_LOCK(&cache->mutex, &pool_cache_lp);
+                while (cache->count < POOL_CACHE_SIZE / 2 && pool->free_count > 0) {
+                    cache->slots[cache->count++] = pool->free_slots[--pool->free_count];
+                }
+                LP_UNLOCK(&cache->mutex, &pool_cache_lp);
+            }
+        } else {
+            slot = steal_locked(pool);
+        }
+        LP_UNLOCK(&pool->mutex, &pool_lp);
+    }
+
+    if (slot < 0) {
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&pool->gens[slot], 1, memory_order_acq_rel);  // Now odd: live
+    return pool->slab + (size_t)slot * pool->slot_size;
+}
+
+/**
+ * pool_free
+ *
+ * The generation is bumped (to even) with a compare-and-swap, so of two threads freeing the
+ * same object only one succeeds. A full cache keeps half of its slots and spills the rest.
+ */
+int pool_free(pool_t *pool, void *obj) {
+    long slot = slot_of(pool, obj);
+    if (slot < 0) {
+        return -1;
+    }
+    uint32_t gen = atomic_load_explicit(&pool->gens[slot], memory_order_acquire);
+    if (!(gen & 1) ||
+        !atomic_compare_exchange_strong_explicit(&pool->gens[slot], &gen, gen + 1,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        return -1;
+    }
+
+    uint32_t spill[POOL_CACHE_SIZE / 2 + 1];
+    unsigned n = 0;
+    pool_cache_t *cache = cache_get(pool);
+    if (cache) {
+        LP_LOCK(&cache->mutex, &pool_cache_lp);
+        if (cache->count < POOL_CACHE_SIZE) {
+            cache->slots[cache->count++] = (uint32_t)slot;
+            LP_UNLOCK(&cache->mutex, &pool_cache_lp);
+            return 0;
+        }
+        while (cache->count > POOL_CACHE_SIZE / 2) {
+            spill[n++] = cache->slots[--cache->count];
+        }
+        LP_UNLOCK(&cache->mutex, &pool_cache_lp);
+    }
+    spill[n++] = (uint32_t)slot;
+
+    LP_LOCK(&pool->mutex, &pool_lp);
+    while (n > 0) {
+        pool->free_slots[pool->free_count++] = spill[--n];
+    }
+    LP_UNLOCK(&pool->mutex, &pool_lp);
+    return 0;
+}
+
+void *pool_at(pool_t *pool, uint32_t index) {
+    return index < pool->capacity ? pool->slab + (size_t)index * pool->slot_size : NULL;
+}
+
+// Generation bits that fit in an id next to the slot index
+#define POOL_ID_GEN_MASK ((1u << (32 - POOL_ID_INDEX_BITS)) - 1)
+
+pool_id_t pool_id(pool_t *pool, const void *obj) {
+    long slot = slot_of(pool, obj);
+    if (slot < 0) {
+        return POOL_ID_NONE;
+    }
+    uint32_t gen = atomic_load_explicit(&pool->gens[slot], memory_order_acquire);
+    if (!(gen & 1)) {
+        return POOL_ID_NONE;
+    }
+    return ((gen & POOL_ID_GEN_MASK) << POOL_ID_INDEX_BITS) | (uint32_t)slot;
+}
+
+void *pool_from_id(pool_t *pool, pool_id_t id) {
+    uint32_t slot = id & ((1u << POOL_ID_INDEX_BITS) - 1);
+    if (id == POOL_ID_NONE || slot >= pool->capacity) {
+        return NULL;
+    }
+    uint32_t gen = atomic_load_explicit(&pool->gens[slot], memory_order_acquire);
+    if (!(gen & 1) || (gen & POOL_ID_GEN_MASK) != id >> POOL_ID_INDEX_BITS) {
+        return NULL;
+    }
+    return pool->slab + (size_t)slot * pool->slot_size;
+}
@@ -0,0 +1,44 @@
+/* trace.c */
+
+#include "trace.h"
+#include "config.h"     // For server_config.trace
+#include "metrics.h"    // For metrics_now_ns, metrics_observe_ns
+
+/* ----------------------------------------------------------------------------
+ * Public functions
+ * ----------------------------------------------------------------------------
+ */
+
+uint64_t trace_now(void) {
+    return server_config.trace ? metrics_now_ns() : 0;
+}
+
+/**
+ * trace_record_delivery
+ *
+ * Stages recorded per message:
+ *   - enqueue:  parse → queued in the recipient's outbox
+ *   - delivery: outbox → last byte handed to the recipient's TCP send()
+ *   - total:    parse → send()
+ */
+void trace_record_delivery(uint64_t parse_ns, uint64_t enq_ns) {
+    if (!parse_ns || !enq_ns) {
+        return;
+    }
+    uint64_t now = metrics_now_ns();
+    metrics_observe_ns(H_TRACE_ENQUEUE_SECONDS, enq_ns - parse_ns);
+    metrics_observe_ns(H_TRACE_DELIVERY_SECONDS, now - enq_ns);
+    metrics_observe_ns(H_TRACE_TOTAL_SECONDS, now - parse_ns);
+}
+
+void trace_record_parse(const trace_stamp_t *stamp) {
+    if (stamp && stamp->parse_ns && stamp->recv_ns) {
+        metrics_observe_ns(H_TRACE_PARSE_SECONDS, stamp->parse_ns - stamp->recv_ns);
+    }
+}
+
+void trace_record_lock_wait(const trace_stamp_t *stamp, uint64_t locked_ns) {
+    if (stamp && stamp->parse_ns && locked_ns) {
+        metrics_observe_ns(H_TRACE_LOCK_WAIT_SECONDS, locked_ns - stamp->parse_ns);
+    }
+}
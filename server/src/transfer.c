@@ -0,0 +1,496 @@
+/* transfer.c */
+
+#include "transfer.h"
+#include "lockprof.h"   // For LP_LOCK / LP_UNLOCK
+#include "crc32c.h"     // For crc32c_update
+#include <stdlib.h>     // For malloc, realloc, free
+#include <string.h>     // For strcmp, strncpy
+#include <errno.h>      // For ETIMEDOUT
+
+// Buckets of the transfer table (a power of two); transfers are spread by id
+#define TRANSFER_BUCKETS 256
+
+// Profiling site of the table lock (make LOCKPROF=1)
+LOCKPROF_SITE(transfers_lp, "transfers.mutex");
+
+// The transfer table: every transfer that can still be resumed or acknowledged
+static pthread_mutex_t transfers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static transfer_t     *transfer_buckets[TRANSFER_BUCKETS];
+
+// Next transfer id to hand out (guarded by transfers_mutex)
+static transfer_id_t next_id = 1;
+
+// Reaper thread (transfer_reaper_start): 'reaper_stop' and 'reaper_cond' are guarded by
+// reaper_mutex
+static pthread_t       reaper_thread;
+static int             reaper_running = 0;
+static int             reaper_stop    = 0;
+static pthread_mutex_t reaper_mutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  reaper_cond;
+
+/* ----------------------------------------------------------------------------
+ * Internal helpers
+ * ----------------------------------------------------------------------------
+ */
+
+static transfer_t **bucket_of(transfer_id_t id) {
+    return &transfer_buckets[id & (TRANSFER_BUCKETS - 1)];
+}
+
+/**
+ * unlink_locked
+ *   Remove 't' from its bucket if it is still there. Returns 1 if it was (the caller then owns
+ *   the table's reference), 0 otherwise.
+ */
+static int unlink_locked(transfer_t *t) {
+    for (transfer_t **link = bucket_of(t->id); *link; link = &(*link)->next) {
+        if (*link == t) {
+            *link = t->next;
+            t->next = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * find_upload_locked
+ *   The unfinished upload from 'sender' to 'target' of 'filename' with 'size' bytes, if any.
+ */
+static transfer_t *find_upload_locked(const char *sender, const char *target,
+                                      const char *filename, size_t size) {
+    for (size_t b = 0; b < TRANSFER_BUCKETS; ++b) {
+        for (transfer_t *t = transfer_buckets[b]; t; t = t->next) {
+            if (t->size == size && t->received < size &&
+                strcmp(t->sender, sender) == 0 && strcmp(t->target, target) == 0 &&
+                strcmp(t->filename, filename) == 0) {
+                return t;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * count_uploads_locked
+ *   Number of unfinished uploads in the table; stores how many of them are from 'sender' in
+ *   *mine.
+ */
+static int count_uploads_locked(const char *sender, int *mine) {
+    int total = 0;
+    *mine = 0;
+    for (size_t b = 0; b < TRANSFER_BUCKETS; ++b) {
+        for (transfer_t *t = transfer_buckets[b]; t; t = t->next) {
+            if (t->received < t->size) {
+                total++;
+                *mine += strcmp(t->sender, sender) == 0;
+            }
+        }
+    }
+    return total;
+}
+
+/**
+ * transfer_new
+ *   Allocate a transfer with its recipient list (not yet in the table, no data attached).
+ */
+static transfer_t *transfer_new(const char *sender, const char *target,
+                                const char (*names)[USERNAME_LEN], int nrcpt,
+                                const char *filename, size_t size) {
+    transfer_t *t = calloc(1, sizeof(*t) + (size_t)nrcpt * sizeof(t->rcpts[0]));
+    if (!t) {
+        return NULL;
+    }
+    strncpy(t->filename, filename, MAX_FILENAME - 1);
+    strncpy(t->sender, sender, USERNAME_LEN - 1);
+    strncpy(t->target, target, TRANSFER_TARGET_LEN - 1);
+    t->size        = size;
+    t->touched     = time(NULL);
+    t->nrcpt       = nrcpt;
+    t->unconfirmed = nrcpt;
+    for (int i = 0; i < nrcpt; ++i) {
+        t->rcpts[i].transfer = t;
+        strncpy(t->rcpts[i].name, names[i], USERNAME_LEN - 1);
+    }
+    atomic_init(&t->refs, 2);   // The table's and the caller's
+    return t;
+}
+
+/**
+ * crc_extend
+ *   Extend 'crc', the CRC32C of the first 'at' bytes of 't', over the next 'n' bytes, storing
+ *   the checkpoints they pass. Returns the new CRC.
+ */
+static uint32_t crc_extend(transfer_t *t, size_t at, size_t n, uint32_t crc) {
+    size_t end = at + n;
+    while (at < end) {
+        size_t next = (at / TRANSFER_MARK_SPAN + 1) * TRANSFER_MARK_SPAN;
+        if (next > end) {
+            next = end;
+        }
+        crc = crc32c_update(crc, t->data + at, next - at);
+        at  = next;
+        if (at % TRANSFER_MARK_SPAN == 0 || at == t->size) {
+            t->marks[(at - 1) / TRANSFER_MARK_SPAN] = crc;
+        }
+    }
+    return crc;
+}
+
+/**
+ * insert_locked
+ *   Give 't' the next id and add it to the table.
+ */
+static void insert_locked(transfer_t *t) {
+    t->id = next_id++;
+    if (next_id == 0) {
+        next_id = 1;
+    }
+    transfer_t **bucket = bucket_of(t->id);
+    t->next = *bucket;
+    *bucket = t;
+}
+
+/**
+ * reaper_loop
+ *   Run transfer_reap every TRANSFER_REAP_INTERVAL seconds until transfer_reaper_stop.
+ */
+static void *reaper_loop(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&reaper_mutex);
+    while (!reaper_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += TRANSFER_REAP_INTERVAL;
+        int rc = 0;
+        while (!reaper_stop && rc != ETIMEDOUT) {
+            rc = pthread_cond_timedwait(&reaper_cond, &reaper_mutex, &deadline);
+        }
+        if (!reaper_stop) {
+            pthread_mutex_unlock(&reaper_mutex);
+            transfer_reap();
+            pthread_mutex_lock(&reaper_mutex);
+        }
+    }
+    pthread_mutex_unlock(&reaper_mutex);
+    return NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Public functions
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * transfer_start
+ *
+ * The new transfer is allocated before taking the lock (its data is not: see
+ * transfer_reserve), so that looking for an upload to resume, checking the limits and inserting
+ * happen in one critical section.
+ */
+transfer_t *transfer_start(const char *sender, const char *target,
+                           const char (*names)[USERNAME_LEN], int nrcpt,
+                           const char *filename, size_t size, conn_id_t uploader,
+                           size_t *offset, int *limited) {
+    transfer_t *fresh = transfer_new(sender, target, names, nrcpt, filename, size);
+    uint32_t *marks = malloc(TRANSFER_MARKS(size) * sizeof(*marks));
+    *limited = 0;
+
+    LP_LOCK(&transfers_mutex, &transfers_lp);
+    transfer_t *t = find_upload_locked(sender, target, filename, size);
+    if (t) {
+        t->uploader = uploader;
+        t->touched  = time(NULL);
+        *offset     = t->received;
+        atomic_fetch_add_explicit(&t->refs, 1, memory_order_relaxed);
+    } else if (fresh && marks) {
+        int mine;
+        int total = count_uploads_locked(sender, &mine);
+        if (mine >= TRANSFER_UPLOADS_PER_SENDER || total >= TRANSFER_UPLOADS_MAX) {
+            *limited = 1;
+        } else {
+            t = fresh;
+            t->marks    = marks;
+            t->uploader = uploader;
+            *offset     = 0;
+            insert_locked(t);
+        }
+    }
+    LP_UNLOCK(&transfers_mutex, &transfers_lp);
+
+    if (t != fresh) {
+        free(fresh);
+        free(marks);
+    }
+    return t;
+}
+
+transfer_t *transfer_start_cached(const char *sender, const char *target,
+                                  const char (*names)[USERNAME_LEN], int nrcpt,
+                                  const char *filename, fc_entry_t *blob) {
+    transfer_t *t = transfer_new(sender, target, names, nrcpt, filename, blob->size);
+    if (!t) {
+        filecache_release(blob);
+        return NULL;
+    }
+    t->blob     = blob;
+    t->data     = blob->data;
+    t->marks    = blob->marks;
+    t->received = blob->size;
+    t->crc      = blob->marks[TRANSFER_MARKS(blob->size) - 1];
+    t->uploader = CONN_ID_NONE;
+    LP_LOCK(&transfers_mutex, &transfers_lp);
+    insert_locked(t);
+    LP_UNLOCK(&transfers_mutex, &transfers_lp);
+    return t;
+}
+
+transfer_t *transfer_get(transfer_id_t id) {
+    LP_LOCK(&transfers_mutex, &transfers_lp);
+    transfer_t *t = *bucket_of(id);
+    while (t && t->id != id) {
+        t = t->next;
+    }
+    if (t) {
+        atomic_fetch_add_explicit(&t->refs, 1, memory_order_relaxed);
+    }
+    LP_UNLOCK(&transfers_mutex, &transfers_lp);
+    return t;
+}
+
+transfer_rcpt_t *transfer_recipient(transfer_t *t, const char *name) {
+    for (int i = 0; i < t->nrcpt; ++i) {
+        if (strcmp(t->rcpts[i].name, name) == 0) {
+            return &t->rcpts[i];
+        }
+    }
+    return NULL;
+}
+
+void transfer_retain(transfer_t *t) {
+    atomic_fetch_add_explicit(&t->refs, 1, memory_order_relaxed);
+}
+
+void transfer_release(transfer_t *t) {
+    if (t && atomic_fetch_sub_explicit(&t->refs, 1, memory_order_acq_rel) == 1) {
+        if (t->blob) {
+            filecache_release(t->blob);
+        } else {
+            free(t->data);
+            free(t->marks);
+        }
+        free(t);
+    }
+}
+
+/**
+ * transfer_reserve
+ *
+ * The allocation doubles (from TRANSFER_ALLOC_MIN, up to the file size), so a file costs a
+ * logarithmic number of reallocs and a sender is only charged memory for what it sent.
+ */
+char *transfer_reserve(transfer_t *t, size_t end) {
+    if (end <= t->allocated) {
+        return t->data;
+    }
+    size_t cap = t->allocated ? t->allocated : TRANSFER_ALLOC_MIN;
+    while (cap < end) {
+        cap *= 2;
+    }
+    if (cap > t->size) {
+        cap = t->size;
+    }
+    char *data = realloc(t->data, cap);
+    if (!data) {
+        return NULL;
+    }
+    t->data      = data;
+    t->allocated = cap;
+    return data;
+}
+
+/**
+ * transfer_upload
+ *
+ * Nobody reads 'data' or 'marks' before the upload is complete, so the checksum is computed,
+ * and the last chunk hands the file to the cache (and takes back a shared copy), outside the
+ * lock, before 'received' reaches 'size'.
+ */
+int transfer_upload(transfer_t *t, size_t n, const uint32_t *expect) {
+    LP_LOCK(&transfers_mutex, &transfers_lp);
+    size_t   at  = t->received;
+    uint32_t crc = t->crc;
+    LP_UNLOCK(&transfers_mutex, &transfers_lp);
+
+    crc = crc_extend(t, at, n, crc);
+    if (expect && *expect != crc) {
+        return -1;
+    }
+
+    int complete = n > 0 && at + n == t->size;
+    if (!complete) {
+        LP_LOCK(&transfers_mutex, &transfers_lp);
+        t->received += n;
+        t->crc       = crc;
+        t->touched   = time(NULL);
+        LP_UNLOCK(&transfers_mutex, &transfers_lp);
+        return 0;
+    }
+
+    fc_entry_t *blob = filecache_adopt(t->data, t->marks, t->size);
+
+    LP_LOCK(&transfers_mutex, &transfers_lp);
+    if (blob) {
+        t->blob  = blob;
+        t->data  = blob->data;
+        t->marks = blob->marks;
+    }
+    t->received += n;
+    t->crc       = crc;
+    t->touched   = time(NULL);
+    t->uploader  = CONN_ID_NONE;
+    LP_UNLOCK(&transfers_mutex, &transfers_lp);
+    return 1;
+}
+
+size_t transfer_upload_offset(transfer_t *t, conn_id_t conn) {
+    LP_LOCK(&transfers_mutex, &transfers_lp);
+    size_t offset = t->uploader == conn && conn != CONN_ID_NONE ? t->received : (size_t)-1;
+    LP_UNLOCK(&transfers_mutex, &transfers_lp);
+    return offset;
+}
+
+void transfer_detach(conn_id_t conn) {
+    LP_LOCK(&transfers_mutex, &transfers_lp);
+    for (size_t b = 0; b < TRANSFER_BUCKETS; ++b) {
+        for (transfer_t *t = transfer_buckets[b]; t; t = t->next) {
+            if (t->uploader == conn) {
+                t->uploader = CONN_ID_NONE;
+                t->touched  = time(NULL);
+            }
+        }
+    }
+    LP_UNLOCK(&transfers_mutex, &transfers_lp);
+}
+
+int transfer_delivery_begin(transfer_rcpt_t *r) {
+    transfer_t *t = r->transfer;
+    LP_LOCK(&transfers_mutex, &transfers_lp);
+    int ok = !r->sending && !r->confirmed && t->received == t->size;
+    if (ok) {
+        r->sending = 1;
+        t->touched = time(NULL);
+    }
+    LP_UNLOCK(&transfers_mutex, &transfers_lp);
+    return ok;
+}
+
+void transfer_delivery_end(transfer_rcpt_t *r) {
+    LP_LOCK(&transfers_mutex, &transfers_lp);
+    r->sending = 0;
+    r->transfer->touched = time(NULL);
+    LP_UNLOCK(&transfers_mutex, &transfers_lp);
+}
+
+void transfer_confirm(transfer_rcpt_t *r) {
+    transfer_t *t = r->transfer;
+    LP_LOCK(&transfers_mutex, &transfers_lp);
+    if (!r->confirmed) {
+        r->confirmed = 1;
+        t->unconfirmed--;
+    }
+    int was_listed = t->unconfirmed == 0 && unlink_locked(t);
+    LP_UNLOCK(&transfers_mutex, &transfers_lp);
+    if (was_listed) {
+        transfer_release(t);
+    }
+}
+
+size_t transfer_pending_for(const char *name, transfer_rcpt_t **out, size_t max) {
+    size_t n = 0;
+    LP_LOCK(&transfers_mutex, &transfers_lp);
+    for (size_t b = 0; b < TRANSFER_BUCKETS; ++b) {
+        for (transfer_t *t = transfer_buckets[b]; t; t = t->next) {
+            if (t->received != t->size) {
+                continue;
+            }
+            transfer_rcpt_t *r = transfer_recipient(t, name);
+            if (r && !r->sending && !r->confirmed) {
+                if (n < max) {
+                    atomic_fetch_add_explicit(&t->refs, 1, memory_order_relaxed);
+                    out[n] = r;
+                }
+                n++;
+            }
+        }
+    }
+    LP_UNLOCK(&transfers_mutex, &transfers_lp);
+    return n;
+}
+
+/**
+ * transfer_reap
+ *
+ * A transfer is idle when only the table references it and nobody is uploading it. Every
+ * delivery holds a reference, so none is under way then either. The scan is cheap next to a
+ * file upload, so besides the reaper thread callers run it whenever a new upload starts and
+ * whenever an uploader disconnects.
+ */
+size_t transfer_reap(void) {
+    transfer_t *dead = NULL;
+    size_t count = 0;
+    time_t now = time(NULL);
+
+    LP_LOCK(&transfers_mutex, &transfers_lp);
+    for (size_t b = 0; b < TRANSFER_BUCKETS; ++b) {
+        transfer_t **link = &transfer_buckets[b];
+        while (*link) {
+            transfer_t *t = *link;
+            if (atomic_load_explicit(&t->refs, memory_order_relaxed) == 1 &&
+                t->uploader == CONN_ID_NONE &&
+                now - t->touched >= server_config.resume_ttl) {
+                *link   = t->next;
+                t->next = dead;
+                dead    = t;
+                count++;
+            } else {
+                link = &t->next;
+            }
+        }
+    }
+    LP_UNLOCK(&transfers_mutex, &transfers_lp);
+
+    while (dead) {
+        transfer_t *next = dead->next;
+        transfer_release(dead);
+        dead = next;
+    }
+    return count;
+}
+
+int transfer_reaper_start(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reaper_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    reaper_stop = 0;
+    if (pthread_create(&reaper_thread, NULL, reaper_loop, NULL) != 0) {
+        return -1;
+    }
+    reaper_running = 1;
+    return 0;
+}
+
+void transfer_reaper_stop(void) {
+    if (!reaper_running) {
+        return;
+    }
+    pthread_mutex_lock(&reaper_mutex);
+    reaper_stop = 1;
+    pthread_cond_signal(&reaper_cond);
+    pthread_mutex_unlock(&reaper_mutex);
+    pthread_join(reaper_thread, NULL);
+    reaper_running = 0;
+}
@@ -0,0 +1,286 @@
+/* uring.c */
+
+#include "uring.h"
+#include <errno.h>          // For errno, ENOMEM, EINVAL
+#include <string.h>         // For memset
+#include <unistd.h>         // For syscall, close, sysconf
+#include <sys/mman.h>       // For mmap, munmap
+#include <sys/syscall.h>    // For __NR_io_uring_setup, __NR_io_uring_enter, __NR_io_uring_register
+
+/* ----------------------------------------------------------------------------
+ * System call wrappers
+ * ----------------------------------------------------------------------------
+ */
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, const void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* ----------------------------------------------------------------------------
+ * Ring setup
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * setup_ring
+ *   io_uring_setup with the single-thread flags newest kernels understand, retrying with fewer
+ *   flags on EINVAL: DEFER_TASKRUN (6.1) runs completion work only when the owner waits,
+ *   SINGLE_ISSUER (6.0) and COOP_TASKRUN (5.19) avoid interrupting the owner with IPIs.
+ */
+static int setup_ring(unsigned entries, struct io_uring_params *p) {
+    static const unsigned flag_sets[] = {
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+        0
+    };
+
+    for (size_t i = 0; i < sizeof(flag_sets) / sizeof(flag_sets[0]); ++i) {
+        memset(p, 0, sizeof(*p));
+        p->flags = flag_sets[i];
+        int fd = sys_io_uring_setup(entries, p);
+        if (fd >= 0 || errno != EINVAL) {
+            return fd >= 0 ? fd : -errno;
+        }
+    }
+    return -EINVAL;
+}
+
+int uring_init(uring_t *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(ring, 0, sizeof(*ring));
+
+    int fd = setup_ring(entries, &p);
+    if (fd < 0) {
+        ring->fd = -1;
+        return fd;
+    }
+    ring->fd       = fd;
+    ring->features = p.features;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head    = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask    = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array   = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail   = *ring->sq_tail;
+    ring->cq_head    = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail    = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask    = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // SQ slots map 1:1 to SQEs, so the index array is filled once
+    for (unsigned i = 0; i < p.sq_entries; ++i) {
+        ring->sq_array[i] = i;
+    }
+    return 0;
+
+fail:
+    {
+        int err = -errno;
+        uring_exit(ring);
+        return err;
+    }
+}
+
+void uring_exit(uring_t *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Submission and completion
+ * ----------------------------------------------------------------------------
+ */
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr, int timeout_ms) {
+    unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    const void *argp = NULL;
+    size_t argsz = 0;
+
+    if (timeout_ms >= 0) {
+        if (!(ring->features & IORING_FEAT_EXT_ARG)) {
+            return -EOPNOTSUPP;
+        }
+        ts.tv_sec  = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp   = &arg;
+        argsz  = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    // Nothing to wait for if completions are already there; still submit
+    if (uring_peek_cqe(ring)) {
+        wait_nr = 0;
+    }
+
+    int rc = sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags, argp, argsz);
+    return rc < 0 ? -errno : 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* ----------------------------------------------------------------------------
+ * Provided buffers
+ * ----------------------------------------------------------------------------
+ */
+
+int uring_bufring_init(uring_t *ring, uring_bufring_t *br, uint16_t group,
+                       unsigned count, size_t buf_size) {
+    memset(br, 0, sizeof(*br));
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    br->ring_size = (count * sizeof(struct io_uring_buf) + page - 1) & ~(page - 1);
+    br->ring = mmap(NULL, br->ring_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br->ring == MAP_FAILED) {
+        br->ring = NULL;
+        return -ENOMEM;
+    }
+    br->data = mmap(NULL, count * buf_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br->data == MAP_FAILED) {
+        br->data = NULL;
+        munmap(br->ring, br->ring_size);
+        br->ring = NULL;
+        return -ENOMEM;
+    }
+    br->buf_size = buf_size;
+    br->count    = count;
+    br->group    = group;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)br->ring;
+    reg.ring_entries = count;
+    reg.bgid         = group;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = -errno;
+        munmap(br->data, count * buf_size);
+        munmap(br->ring, br->ring_size);
+        memset(br, 0, sizeof(*br));
+        return err;
+    }
+
+    for (unsigned bid = 0; bid < count; ++bid) {
+        uring_bufring_recycle(br, bid);
+    }
+    return 0;
+}
+
+void uring_bufring_free(uring_t *ring, uring_bufring_t *br) {
+    if (!br->ring) {
+        return;
+    }
+    if (ring->fd >= 0) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = br->group;
+        sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    munmap(br->data, br->count * br->buf_size);
+    munmap(br->ring, br->ring_size);
+    memset(br, 0, sizeof(*br));
+}
+
+char *uring_bufring_buf(uring_bufring_t *br, unsigned bid) {
+    return br->data + (size_t)bid * br->buf_size;
+}
+
+/**
+ * uring_bufring_recycle
+ *
+ * Only this thread writes the tail, so a plain read of it is current. Entry 0 shares its
+ * 'resv' field with the tail, which is why only addr/len/bid are written.
+ */
+void uring_bufring_recycle(uring_bufring_t *br, unsigned bid) {
+    uint16_t tail = br->ring->tail;
+    struct io_uring_buf *buf = &br->ring->bufs[tail & (br->count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_bufring_buf(br, bid);
+    buf->len  = (uint32_t)br->buf_size;
+    buf->bid  = (uint16_t)bid;
+    __atomic_store_n(&br->ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}